@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Minimal timing harness shared by the benchmark programs. Each result is
+// printed as one JSON object per line so runs can be diffed between releases.
+
+namespace bench {
+
+struct Timing {
+    double medianNs = 0;
+    double minNs = 0;
+    int iterations = 0;
+};
+
+// Runs fn repeatedly for roughly budgetMs and reports per-call times.
+template <typename F>
+Timing measure(F&& fn, int budgetMs = 300) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    std::vector<double> samples;
+    auto end = clock::now() + std::chrono::milliseconds(budgetMs);
+    do {
+        auto t0 = clock::now();
+        fn();
+        auto t1 = clock::now();
+        samples.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+    } while (clock::now() < end || samples.size() < 5);
+    std::sort(samples.begin(), samples.end());
+    Timing t;
+    t.medianNs = samples[samples.size() / 2];
+    t.minNs = samples.front();
+    t.iterations = static_cast<int>(samples.size());
+    return t;
+}
+
+inline void report(const char* suite, const std::string& name, const char* unit, double value, const Timing& t) {
+    printf("{\"suite\":\"%s\",\"case\":\"%s\",\"%s\":%.3f,\"median_ns\":%.0f,\"min_ns\":%.0f,\"iterations\":%d}\n",
+           suite, name.c_str(), unit, value, t.medianNs, t.minNs, t.iterations);
+    fflush(stdout);
+}
+
+// For results that are not per-call timings (rates, counts, skews).
+inline void report(const char* suite, const std::string& name, const char* unit, double value) {
+    printf("{\"suite\":\"%s\",\"case\":\"%s\",\"%s\":%.3f}\n", suite, name.c_str(), unit, value);
+    fflush(stdout);
+}
+
+} // namespace bench
@@ -0,0 +1,105 @@
+#include "bench.h"
+#include "../common/hal/devices.h"
+#include "../common/protocol.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+// The device_list message usb.cpp's ListDevices sends after every arrival
+// and removal: building it from the enumeration, and sending it through
+// Output in each wire mode. Checks the message reads back with every device,
+// and that ids match as the lock and eject commands match them.
+
+namespace {
+
+std::vector<hal::Device> makeDevices(int n) {
+    std::vector<hal::Device> devices;
+    for (int i = 0; i < n; ++i) {
+        hal::Device d;
+        bool disk = i % 3 == 0;
+        d.id = (disk ? "USBSTOR\\DISK&VEN_SANDISK&PROD_CRUZER_BLADE&REV_1.00\\4C530001" : "HID\\VID_046D&PID_C077\\7&2A") +
+               std::to_string(1000 + i);
+        d.name = disk ? "SanDisk Cruzer Blade USB Device" : "USB Optical Mouse";
+        d.type = disk ? "DISK" : "MOUSE";
+        if (disk) d.path = std::string(1, (char)('E' + i % 20)) + ":";
+        devices.push_back(d);
+    }
+    return devices;
+}
+
+// As ListDevices builds it.
+void encodeList(const std::vector<hal::Device>& present, const std::map<std::string, void*>& locked, protocol::Encoder& list) {
+    list.clear();
+    list.beginMap();
+    list.field("type", "device_list");
+    list.key("devices");
+    list.beginArray();
+    for (const hal::Device& dev : present) {
+        list.beginMap();
+        list.field("id", dev.id);
+        list.field("name", dev.name);
+        list.field("type", dev.type);
+        list.field("path", dev.path);
+        list.field("isLocked", locked.find(dev.id) != locked.end());
+        list.endMap();
+    }
+    list.endArray();
+    list.endMap();
+}
+
+} // namespace
+
+int main() {
+    bool ok = true;
+    if (!hal::idsEqual("USBSTOR\\Disk&Ven_SanDisk\\4C53", "usbstor\\DISK&VEN_SANDISK\\4c53") ||
+        hal::idsEqual("USBSTOR\\DISK\\4C53", "USBSTOR\\DISK\\4C54") || hal::idsEqual("USBSTOR", "USBSTOR\\")) {
+        fprintf(stderr, "idsEqual: wrong answer\n");
+        ok = false;
+    }
+    protocol::Encoder list;
+    std::string json;
+
+    for (int n : { 4, 32, 256 }) {
+        std::vector<hal::Device> devices = makeDevices(n);
+        std::map<std::string, void*> locked;
+        locked[devices[0].id] = nullptr;
+
+        encodeList(devices, locked, list);
+        json.clear();
+        if (!protocol::toJson((const uint8_t*)list.bytes().data(), list.bytes().size(), json) ||
+            json.find(devices.back().id.substr(devices.back().id.size() - 4)) == std::string::npos ||
+            json.find("\"isLocked\":true") == std::string::npos) {
+            fprintf(stderr, "device_list for %d devices does not read back\n", n);
+            ok = false;
+        }
+
+        std::string suffix = "/" + std::to_string(n);
+        bench::Timing built = bench::measure([&] { encodeList(devices, locked, list); });
+        bench::report("devices", "list_build" + suffix, "us", built.medianNs / 1e3, built);
+
+        for (protocol::Mode mode : { protocol::Mode::JsonLines, protocol::Mode::Binary }) {
+            FILE* sink = tmpfile();
+            if (!sink) continue;
+            {
+                protocol::Output out(mode, sink, 1 << 16);
+                bench::Timing sent = bench::measure([&] {
+                    encodeList(devices, locked, list);
+                    out.send(protocol::MessageType::DeviceList, list);
+                });
+                out.flush();
+                protocol::OutputStats stats = out.stats();
+                if (stats.queued != stats.written + stats.coalesced) {
+                    fprintf(stderr, "device_list messages lost\n");
+                    ok = false;
+                }
+                const char* name = mode == protocol::Mode::Binary ? "list_send_binary" : "list_send_json";
+                bench::report("devices", name + suffix, "us", sent.medianNs / 1e3, sent);
+            }
+            fclose(sink);
+        }
+    }
+    return ok ? 0 : 1;
+}
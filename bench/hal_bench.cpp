@@ -0,0 +1,463 @@
+#include "bench.h"
+#include "../common/hal/devices.h"
+#include "../common/hal/pci.h"
+#include "../common/hal/power.h"
+#include "../ui/src/lab4/capture.h"
+#include "../ui/src/lab4/frametrace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records synthetic hardware of each kind through the HAL recorders, then
+// replays the traces: at max speed every answer must come back as recorded,
+// at original speed also when it was recorded. Reports what recording costs
+// and how compact the traces are, and runs a capture session on replayed
+// frames the way the webcam helper does on a machine without the camera.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t sinceNs(Clock::time_point t0) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+}
+
+// ---- power ----
+
+class FakePower : public hal::Power {
+public:
+    bool read(hal::PowerStatus& status) override {
+        ++n;
+        status.acLine = (uint8_t)(n / 10 % 2);
+        status.batteryPercent = (uint8_t)(100 - n % 100);
+        status.lifeTime = n % 7 ? 3600 - n * 10 : 0xffffffff;
+        status.fullLifeTime = 7200;
+        status.chemistry = n % 3 ? "LION" : "";
+        return n % 13 != 0;
+    }
+    bool suspend(bool hibernate) override { return !hibernate; }
+
+private:
+    uint32_t n = 0;
+};
+
+bool samePower(const hal::PowerStatus& a, const hal::PowerStatus& b) {
+    return a.acLine == b.acLine && a.batteryPercent == b.batteryPercent && a.lifeTime == b.lifeTime &&
+           a.fullLifeTime == b.fullLifeTime && a.chemistry == b.chemistry;
+}
+
+bool verifyPower(const std::string& path) {
+    const int readings = 40;
+    const int periodMs = 5;
+    std::vector<hal::PowerStatus> expect(readings);
+    std::vector<bool> expectOk(readings);
+    std::vector<int64_t> recordedAt(readings);
+    {
+        auto trace = std::make_shared<hal::TraceWriter>();
+        if (!trace->open(path)) return false;
+        std::unique_ptr<hal::Power> power = hal::recordPower(std::unique_ptr<hal::Power>(new FakePower()), trace);
+        Clock::time_point t0 = Clock::now();
+        for (int i = 0; i < readings; ++i) {
+            expectOk[i] = power->read(expect[i]);
+            recordedAt[i] = sinceNs(t0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(periodMs));
+        }
+        power->suspend(false);
+        power->suspend(true);
+        bench::report("hal", "power_trace_bytes", "per_record", (double)trace->bytes() / trace->records());
+    }
+
+    bool ok = true;
+    for (hal::Speed speed : { hal::Speed::Max, hal::Speed::Original }) {
+        std::unique_ptr<hal::Power> replay = hal::replayPower(path, speed);
+        if (!replay) return false;
+        double worstMs = 0;
+        Clock::time_point t0 = Clock::now();
+        int64_t firstAt = 0;
+        for (int i = 0; i < readings; ++i) {
+            hal::PowerStatus got;
+            bool gotOk = replay->read(got);
+            int64_t at = sinceNs(t0);
+            if (i == 0) firstAt = at;
+            if (gotOk != expectOk[i] || !samePower(got, expect[i])) {
+                fprintf(stderr, "power reading %d differs on replay\n", i);
+                ok = false;
+            }
+            double skewMs = std::fabs((double)((at - firstAt) - (recordedAt[i] - recordedAt[0]))) / 1e6;
+            if (skewMs > worstMs) worstMs = skewMs;
+        }
+        hal::PowerStatus extra;
+        if (replay->read(extra) || !replay->ended()) {
+            fprintf(stderr, "power replay does not end with the trace\n");
+            ok = false;
+        }
+        if (!replay->suspend(false) || replay->suspend(true)) {
+            fprintf(stderr, "suspend answers differ on replay\n");
+            ok = false;
+        }
+        if (speed == hal::Speed::Original) {
+            bench::report("hal", "power_replay_original_max_skew", "ms", worstMs);
+            // Sleep granularity on a loaded CI machine, not drift: the error
+            // does not accumulate because every wait is against the origin.
+            if (worstMs > 50) {
+                fprintf(stderr, "power replay off by %.1f ms\n", worstMs);
+                ok = false;
+            }
+        } else {
+            bench::report("hal", "power_replay_max_total", "ms", sinceNs(t0) / 1e6);
+        }
+    }
+    return ok;
+}
+
+// ---- PCI ----
+
+// A few buses of single- and multi-function devices.
+class FakePci : public hal::PciConfig {
+public:
+    uint32_t read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) override {
+        if (bus > 3 || (device * 7 + bus) % 5 != 0) return 0xffffffff;
+        bool multi = device % 3 == 0;
+        if (function && (!multi || function > 3)) return 0xffffffff;
+        if (offset == 0x0C) return multi ? 0x00800000 : 0;
+        return (uint32_t)(0x1000 + bus * 256 + device * 8 + function) << 16 | 0x8086;
+    }
+};
+
+bool samePci(const std::vector<hal::PciFunction>& a, const std::vector<hal::PciFunction>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].bus != b[i].bus || a[i].device != b[i].device || a[i].function != b[i].function ||
+            a[i].vendorId != b[i].vendorId || a[i].deviceId != b[i].deviceId) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool verifyPci(const std::string& path) {
+    FakePci machine;
+    std::vector<hal::PciFunction> expect = hal::enumeratePci(machine);
+    bench::Timing direct = bench::measure([&] { hal::enumeratePci(machine); });
+    bench::report("hal", "pci_scan_direct", "us", direct.medianNs / 1e3, direct);
+
+    {
+        auto trace = std::make_shared<hal::TraceWriter>();
+        if (!trace->open(path)) return false;
+        std::unique_ptr<hal::PciConfig> pci = hal::recordPci(std::unique_ptr<hal::PciConfig>(new FakePci()), trace);
+        Clock::time_point t0 = Clock::now();
+        hal::enumeratePci(*pci);
+        bench::report("hal", "pci_scan_recorded", "us", sinceNs(t0) / 1e3);
+        bench::report("hal", "pci_trace_bytes", "per_record", (double)trace->bytes() / trace->records());
+    }
+
+    std::unique_ptr<hal::PciConfig> replay = hal::replayPci(path, hal::Speed::Max);
+    if (!replay) return false;
+    if (!samePci(hal::enumeratePci(*replay), expect)) {
+        fprintf(stderr, "PCI scan differs on replay\n");
+        return false;
+    }
+    bench::Timing replayed = bench::measure([&] { hal::enumeratePci(*replay); });
+    bench::report("hal", "pci_scan_replay", "us", replayed.medianNs / 1e3, replayed);
+    return true;
+}
+
+// ---- devices ----
+
+// Plugs a disk in, asks to remove it and removes it, with Windows' habit of
+// repeating a notification.
+class FakeDevices : public hal::Devices {
+public:
+    std::vector<hal::Device> list() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<hal::Device> devices;
+        devices.push_back({ "HID\\VID_046D&PID_C077\\7&1", "USB Optical Mouse", "MOUSE", "" });
+        if (plugged) devices.push_back({ "USBSTOR\\DISK&VEN_SANDISK\\4C53", "SanDisk Cruzer", "DISK", "E:" });
+        return devices;
+    }
+
+    hal::EjectResult eject(const std::string& id) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return plugged && id.find("USBSTOR") == 0 ? hal::EjectResult::Ejected : hal::EjectResult::NotFound;
+    }
+
+    void watch(const std::function<void(hal::DeviceEvent, int64_t)>& onEvent) override {
+        const struct {
+            int delayMs;
+            hal::DeviceEvent event;
+        } script[] = {
+            { 10, hal::DeviceEvent::Arrival },
+            { 1, hal::DeviceEvent::Arrival },
+            { 30, hal::DeviceEvent::QueryRemove },
+            { 15, hal::DeviceEvent::QueryRemoveFailed },
+            { 20, hal::DeviceEvent::QueryRemove },
+            { 25, hal::DeviceEvent::RemoveComplete },
+        };
+        for (const auto& step : script) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(step.delayMs));
+            if (stopped) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (step.event == hal::DeviceEvent::Arrival) plugged = true;
+                if (step.event == hal::DeviceEvent::RemoveComplete) plugged = false;
+            }
+            onEvent(step.event, nowNs());
+        }
+    }
+
+    void stop() override { stopped = true; }
+
+    int64_t nowNs() override {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+private:
+    std::mutex mutex;
+    bool plugged = false;
+    std::atomic<bool> stopped{ false };
+};
+
+struct Observed {
+    std::vector<hal::DeviceEvent> events;
+    std::vector<int64_t> gaps; // ns since the previous event
+    std::vector<size_t> listSizes;
+};
+
+// What usb.cpp does with a backend: lists on every arrival and removal.
+Observed drive(hal::Devices& devices) {
+    Observed seen;
+    seen.listSizes.push_back(devices.list().size());
+    int64_t last = 0;
+    devices.watch([&](hal::DeviceEvent event, int64_t timeNs) {
+        seen.events.push_back(event);
+        seen.gaps.push_back(seen.events.size() > 1 ? timeNs - last : 0);
+        last = timeNs;
+        if (event == hal::DeviceEvent::Arrival || event == hal::DeviceEvent::RemoveComplete) {
+            seen.listSizes.push_back(devices.list().size());
+        }
+    });
+    seen.listSizes.push_back(devices.eject("USBSTOR\\DISK&VEN_SANDISK\\4C53") == hal::EjectResult::Ejected);
+    return seen;
+}
+
+bool verifyDevices(const std::string& path) {
+    Observed expect;
+    {
+        auto trace = std::make_shared<hal::TraceWriter>();
+        if (!trace->open(path)) return false;
+        std::unique_ptr<hal::Devices> devices = hal::recordDevices(std::unique_ptr<hal::Devices>(new FakeDevices()), trace);
+        expect = drive(*devices);
+        bench::report("hal", "devices_trace_bytes", "per_record", (double)trace->bytes() / trace->records());
+    }
+
+    bool ok = true;
+    for (hal::Speed speed : { hal::Speed::Max, hal::Speed::Original }) {
+        std::unique_ptr<hal::Devices> replay = hal::replayDevices(path, speed);
+        if (!replay) return false;
+        Clock::time_point t0 = Clock::now();
+        Observed got = drive(*replay);
+        if (got.events != expect.events || got.listSizes != expect.listSizes) {
+            fprintf(stderr, "device events or lists differ on replay\n");
+            ok = false;
+            continue;
+        }
+        // The gaps decide debouncing and safe removal, so they must survive
+        // at either speed.
+        double worstMs = 0;
+        for (size_t i = 0; i < got.gaps.size(); ++i) {
+            double skewMs = std::fabs((double)(got.gaps[i] - expect.gaps[i])) / 1e6;
+            if (skewMs > worstMs) worstMs = skewMs;
+        }
+        if (worstMs > 1) {
+            fprintf(stderr, "device event gaps off by %.3f ms\n", worstMs);
+            ok = false;
+        }
+        bench::report("hal", speed == hal::Speed::Max ? "devices_replay_max_total" : "devices_replay_original_total", "ms",
+                      sinceNs(t0) / 1e6);
+    }
+
+    // A module closing mid-replay: stop() ends the watch in the middle of a
+    // wait for the next event instead of after the trace.
+    std::unique_ptr<hal::Devices> replay = hal::replayDevices(path, hal::Speed::Original);
+    if (!replay) return false;
+    std::thread watcher([&] { replay->watch([](hal::DeviceEvent, int64_t) {}); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    Clock::time_point t0 = Clock::now();
+    replay->stop();
+    watcher.join();
+    double stopMs = sinceNs(t0) / 1e6;
+    bench::report("hal", "devices_replay_stop", "ms", stopMs);
+    if (stopMs > 5) {
+        fprintf(stderr, "stopping a replayed watch took %.3f ms\n", stopMs);
+        ok = false;
+    }
+    return ok;
+}
+
+// ---- frames ----
+
+class PatternSource : public capture::FrameSource {
+public:
+    PatternSource(int w, int h, double fps, int count) : width(w), height(h), period((int64_t)(1e9 / fps)), frames(count) {}
+
+    bool open(capture::StreamFormat& format) override {
+        format.width = width;
+        format.height = height;
+        format.fps = 1e9 / period;
+        start = Clock::now();
+        return true;
+    }
+
+    bool read(const pixelconv::Image& dst, int64_t& deviceNs) override {
+        if (tick >= frames) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            return false;
+        }
+        ++tick;
+        if (period) std::this_thread::sleep_until(start + std::chrono::nanoseconds(tick * period));
+        for (int y = 0; y < height; ++y) {
+            uint8_t* row = dst.planes[0].data + (size_t)y * dst.planes[0].stride;
+            for (int x = 0; x < width; ++x) row[x] = (uint8_t)(x + y * 3 + tick * 7);
+        }
+        for (int y = 0; y < height / 2; ++y) memset(dst.planes[1].data + (size_t)y * dst.planes[1].stride, (int)(tick & 0xff), (size_t)width);
+        deviceNs = 5000000000LL + tick * 33333333;
+        return true;
+    }
+
+    void close() override {}
+
+private:
+    int width, height;
+    int64_t period;
+    int frames;
+    int64_t tick = 0;
+    Clock::time_point start;
+};
+
+uint64_t checksum(const pixelconv::Image& image, int64_t deviceNs) {
+    uint64_t h = 1469598103934665603ull ^ (uint64_t)deviceNs;
+    for (int p = 0; p < 2; ++p) {
+        int rows = p ? image.height / 2 : image.height;
+        for (int y = 0; y < rows; ++y) {
+            const uint8_t* row = image.planes[p].data + (size_t)y * image.planes[p].stride;
+            for (int x = 0; x < image.width; ++x) h = (h ^ row[x]) * 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+class CountingSink : public capture::FrameSink {
+public:
+    bool onFrame(const capture::Frame&) override {
+        ++frames;
+        return true;
+    }
+    std::atomic<int> frames{ 0 };
+};
+
+bool verifyFrames(const std::string& path) {
+    const int w = 320, h = 240, count = 60;
+    const double fps = 60;
+    std::vector<uint8_t> buffer(pixelconv::imageSize(pixelconv::PixelFormat::NV12, w, h));
+    pixelconv::Image image = pixelconv::wrap(pixelconv::PixelFormat::NV12, w, h, buffer.data());
+
+    // Recording cost: the same source read directly and through the recorder,
+    // without frame pacing.
+    {
+        auto trace = std::make_shared<hal::TraceWriter>();
+        if (!trace->open(path)) return false;
+        PatternSource direct(w, h, 0, 1 << 30);
+        capture::StreamFormat format;
+        direct.open(format);
+        int64_t deviceNs;
+        bench::Timing plain = bench::measure([&] { direct.read(image, deviceNs); }, 100);
+        std::unique_ptr<capture::FrameSource> recorded =
+            frametrace::record(std::unique_ptr<capture::FrameSource>(new PatternSource(w, h, 0, 1 << 30)), "bench", trace);
+        recorded->open(format);
+        bench::Timing withTrace = bench::measure([&] { recorded->read(image, deviceNs); }, 100);
+        bench::report("hal", "frame_read_direct", "us", plain.medianNs / 1e3, plain);
+        bench::report("hal", "frame_read_recorded", "us", withTrace.medianNs / 1e3, withTrace);
+    }
+
+    std::vector<uint64_t> expect;
+    {
+        auto trace = std::make_shared<hal::TraceWriter>();
+        if (!trace->open(path)) return false;
+        std::unique_ptr<capture::FrameSource> source =
+            frametrace::record(std::unique_ptr<capture::FrameSource>(new PatternSource(w, h, fps, count)), "cam0", trace);
+        capture::StreamFormat format;
+        source->open(format);
+        int64_t deviceNs;
+        while (source->read(image, deviceNs)) expect.push_back(checksum(image, deviceNs));
+        source->close();
+        bench::report("hal", "frame_trace_overhead", "bytes_per_frame", (double)trace->bytes() / count - buffer.size());
+    }
+
+    bool ok = true;
+    if (frametrace::cameras(path) != std::vector<std::string>{ "cam0" }) {
+        fprintf(stderr, "trace does not list its camera\n");
+        ok = false;
+    }
+
+    // Max speed: same frames, same device timestamps.
+    {
+        std::unique_ptr<capture::FrameSource> replay = frametrace::replay(path, "cam0", hal::Speed::Max);
+        capture::StreamFormat format;
+        if (!replay || !replay->open(format) || format.width != w || format.height != h || std::fabs(format.fps - fps) > 0.01) {
+            fprintf(stderr, "frame replay does not open with the recorded format\n");
+            return false;
+        }
+        std::vector<uint64_t> got;
+        int64_t deviceNs;
+        Clock::time_point t0 = Clock::now();
+        while (replay->read(image, deviceNs)) got.push_back(checksum(image, deviceNs));
+        double seconds = sinceNs(t0) / 1e9;
+        if (got != expect) {
+            fprintf(stderr, "replayed frames differ (%zu of %zu)\n", got.size(), expect.size());
+            ok = false;
+        }
+        bench::report("hal", "frame_replay_max", "fps", got.size() / seconds);
+    }
+
+    // Original speed through a capture session, as webcam --replay runs it.
+    {
+        capture::Session session("cam0", frametrace::replay(path, "cam0", hal::Speed::Original));
+        auto sink = std::make_shared<CountingSink>();
+        session.addSink(sink);
+        if (!session.start()) {
+            fprintf(stderr, "session does not start on a replay\n");
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds((int)(count / fps * 1000) + 300));
+        capture::SessionStats stats = session.stats();
+        session.stop();
+        if ((int)stats.captured != count || sink->frames != count) {
+            fprintf(stderr, "session captured %d of %d replayed frames\n", (int)stats.captured, count);
+            ok = false;
+        }
+        bench::report("hal", "frame_replay_session", "frames", (double)stats.captured);
+    }
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    const std::string path = "hal_bench.trace";
+    bool ok = true;
+    ok = verifyPower(path) && ok;
+    ok = verifyPci(path) && ok;
+    ok = verifyDevices(path) && ok;
+    ok = verifyFrames(path) && ok;
+    remove(path.c_str());
+    return ok ? 0 : 1;
+}
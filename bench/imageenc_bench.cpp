@@ -0,0 +1,476 @@
+#include "bench.h"
+#include "../ui/src/lab4/imageenc.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Every encoder's output decodes back to the pixels it was given: BMP and QOI
+// by their specs, PNG through a strict inflater of its own that checks the
+// chunk CRCs, the zlib header and the Adler-32. Odd sizes, flat and noisy
+// content, every PNG level and banded (threaded) PNGs included. Then the time
+// and size of each at 1080p.
+
+namespace {
+
+enum class Content { Camera, Flat, Noise };
+
+// Camera-like content: smooth gradients with a little sensor noise, which is
+// what photos from the helper look like to an encoder. Flat gives long runs
+// and matches, noise gives none.
+std::vector<uint8_t> syntheticFrame(int w, int h, Content content = Content::Camera) {
+    std::vector<uint8_t> px((size_t)w * h * 4);
+    std::mt19937 rng(7);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            uint8_t* p = &px[((size_t)y * w + x) * 4];
+            if (content == Content::Flat) {
+                p[0] = 40;
+                p[1] = (uint8_t)(y < h / 2 ? 90 : 91);
+                p[2] = 200;
+            } else if (content == Content::Noise) {
+                uint32_t r = rng();
+                p[0] = (uint8_t)r;
+                p[1] = (uint8_t)(r >> 8);
+                p[2] = (uint8_t)(r >> 16);
+            } else {
+                int n = (int)(rng() % 5) - 2;
+                p[0] = (uint8_t)std::min(255, std::max(0, (x * 255 / w + n)));
+                p[1] = (uint8_t)std::min(255, std::max(0, (y * 255 / h + n)));
+                p[2] = (uint8_t)std::min(255, std::max(0, ((x + y) * 127 / (w + h) + 64 + n)));
+            }
+            p[3] = 255;
+        }
+    }
+    return px;
+}
+
+uint32_t be32(const uint8_t* p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+uint32_t le32(const uint8_t* p) { return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0]; }
+
+// ---- decoders, written from the specs rather than from the encoders ----
+
+// Decoded images are packed RGB, three bytes a pixel.
+bool decodeBmp(const std::vector<uint8_t>& f, int& w, int& h, std::vector<uint8_t>& rgb) {
+    if (f.size() < 54 || f[0] != 'B' || f[1] != 'M' || le32(&f[2]) != f.size()) return false;
+    uint32_t offBits = le32(&f[10]);
+    w = (int)le32(&f[18]);
+    int32_t height = (int32_t)le32(&f[22]);
+    if (le32(&f[14]) != 40 || (f[28] | f[29] << 8) != 24 || le32(&f[30]) != 0 || w <= 0 || height == 0) return false;
+    h = height < 0 ? -height : height;
+    size_t stride = ((size_t)w * 3 + 3) & ~(size_t)3;
+    if (offBits + stride * h > f.size()) return false;
+    rgb.resize((size_t)w * h * 3);
+    for (int y = 0; y < h; ++y) {
+        const uint8_t* src = &f[offBits + stride * (height < 0 ? y : h - 1 - y)];
+        for (int x = 0; x < w; ++x) {
+            uint8_t* d = &rgb[((size_t)y * w + x) * 3];
+            d[0] = src[x * 3 + 2];
+            d[1] = src[x * 3 + 1];
+            d[2] = src[x * 3 + 0];
+        }
+    }
+    return true;
+}
+
+bool decodeQoi(const std::vector<uint8_t>& f, int& w, int& h, std::vector<uint8_t>& rgb) {
+    static const uint8_t kEnd[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    if (f.size() < 22 || memcmp(f.data(), "qoif", 4) != 0 || f[12] < 3 || f[12] > 4 || f[13] > 1) return false;
+    if (memcmp(&f[f.size() - 8], kEnd, 8) != 0) return false;
+    w = (int)be32(&f[4]);
+    h = (int)be32(&f[8]);
+    size_t total = (size_t)w * h;
+    rgb.resize(total * 3);
+    uint8_t index[64][4] = {};
+    uint8_t px[4] = { 0, 0, 0, 255 };
+    size_t pos = 14, end = f.size() - 8, n = 0;
+    int run = 0;
+    while (n < total) {
+        if (run > 0) {
+            --run;
+        } else {
+            if (pos >= end) return false;
+            uint8_t b = f[pos++];
+            if (b == 0xFE || b == 0xFF) {
+                size_t bytes = b == 0xFE ? 3 : 4;
+                if (pos + bytes > end) return false;
+                memcpy(px, &f[pos], bytes);
+                pos += bytes;
+            } else if ((b >> 6) == 0) {
+                memcpy(px, index[b], 4);
+            } else if ((b >> 6) == 1) {
+                px[0] = (uint8_t)(px[0] + ((b >> 4) & 3) - 2);
+                px[1] = (uint8_t)(px[1] + ((b >> 2) & 3) - 2);
+                px[2] = (uint8_t)(px[2] + (b & 3) - 2);
+            } else if ((b >> 6) == 2) {
+                if (pos >= end) return false;
+                uint8_t b2 = f[pos++];
+                int vg = (b & 0x3F) - 32;
+                px[0] = (uint8_t)(px[0] + vg - 8 + (b2 >> 4));
+                px[1] = (uint8_t)(px[1] + vg);
+                px[2] = (uint8_t)(px[2] + vg - 8 + (b2 & 15));
+            } else {
+                run = b & 0x3F;
+            }
+            memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        }
+        memcpy(&rgb[n++ * 3], px, 3);
+    }
+    return run == 0 && pos == end;
+}
+
+// RFC 1951, strictly: a code may be incomplete only if it is a single code
+// of one bit (or empty, for distances), as zlib allows.
+class Inflater {
+public:
+    Inflater(const uint8_t* data, size_t size) : in(data), n(size) {}
+
+    bool run(std::vector<uint8_t>& out) {
+        bool last = false;
+        while (!last) {
+            last = bits(1) == 1;
+            int type = (int)bits(2);
+            bool ok = type == 0 ? stored(out) : type == 1 ? fixed(out) : type == 2 ? dynamic(out) : false;
+            if (!ok || bad) return false;
+        }
+        return true;
+    }
+
+    // Bytes consumed, once run() has returned; the rest of the last byte is
+    // padding.
+    size_t used() const { return pos; }
+
+private:
+    struct Huffman {
+        short count[16];
+        short symbol[288];
+    };
+
+    uint32_t bits(int need) {
+        uint32_t v = buffer;
+        while (count < need) {
+            if (pos >= n) {
+                bad = true;
+                return 0;
+            }
+            v |= (uint32_t)in[pos++] << count;
+            count += 8;
+        }
+        buffer = v >> need;
+        count -= need;
+        return v & ((1u << need) - 1);
+    }
+
+    // 0 for a complete code, > 0 incomplete, < 0 oversubscribed.
+    static int build(Huffman& h, const uint8_t* lengths, int symbols) {
+        memset(h.count, 0, sizeof(h.count));
+        for (int s = 0; s < symbols; ++s) h.count[lengths[s]]++;
+        if (h.count[0] == symbols) return 1;
+        int left = 1;
+        for (int len = 1; len < 16; ++len) {
+            left = left * 2 - h.count[len];
+            if (left < 0) return left;
+        }
+        short offs[16];
+        offs[1] = 0;
+        for (int len = 1; len < 15; ++len) offs[len + 1] = (short)(offs[len] + h.count[len]);
+        for (int s = 0; s < symbols; ++s) {
+            if (lengths[s]) h.symbol[offs[lengths[s]]++] = (short)s;
+        }
+        return left;
+    }
+
+    static bool acceptable(int left, const Huffman& h, int symbols) {
+        return left == 0 || (left > 0 && h.count[0] + h.count[1] == symbols);
+    }
+
+    int decode(const Huffman& h) {
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; ++len) {
+            code |= (int)bits(1);
+            int c = h.count[len];
+            if (code - c < first) return h.symbol[index + (code - first)];
+            index += c;
+            first = (first + c) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    bool stored(std::vector<uint8_t>& out) {
+        buffer = 0;
+        count = 0;
+        if (pos + 4 > n) return false;
+        uint32_t len = in[pos] | in[pos + 1] << 8;
+        uint32_t nlen = in[pos + 2] | in[pos + 3] << 8;
+        pos += 4;
+        if (len != (~nlen & 0xFFFF) || pos + len > n) return false;
+        out.insert(out.end(), in + pos, in + pos + len);
+        pos += len;
+        return true;
+    }
+
+    bool fixed(std::vector<uint8_t>& out) {
+        uint8_t lengths[288 + 30];
+        for (int s = 0; s < 288; ++s) lengths[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+        for (int s = 0; s < 30; ++s) lengths[288 + s] = 5;
+        Huffman lit, dist;
+        build(lit, lengths, 288);
+        build(dist, lengths + 288, 30);
+        return codes(out, lit, dist);
+    }
+
+    bool dynamic(std::vector<uint8_t>& out) {
+        static const uint8_t kOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+        int nlen = (int)bits(5) + 257, ndist = (int)bits(5) + 1, ncode = (int)bits(4) + 4;
+        if (nlen > 286 || ndist > 30) return false;
+        uint8_t lengths[320] = {};
+        for (int i = 0; i < ncode; ++i) lengths[kOrder[i]] = (uint8_t)bits(3);
+        Huffman lencode, lit, dist;
+        if (build(lencode, lengths, 19) != 0) return false;
+        int index = 0;
+        while (index < nlen + ndist) {
+            int sym = decode(lencode);
+            if (sym < 0 || bad) return false;
+            if (sym < 16) {
+                lengths[index++] = (uint8_t)sym;
+                continue;
+            }
+            uint8_t len = 0;
+            int repeat;
+            if (sym == 16) {
+                if (index == 0) return false;
+                len = lengths[index - 1];
+                repeat = 3 + (int)bits(2);
+            } else if (sym == 17) {
+                repeat = 3 + (int)bits(3);
+            } else {
+                repeat = 11 + (int)bits(7);
+            }
+            if (index + repeat > nlen + ndist) return false;
+            while (repeat--) lengths[index++] = len;
+        }
+        if (lengths[256] == 0) return false;
+        int err = build(lit, lengths, nlen);
+        if (!acceptable(err, lit, nlen)) return false;
+        err = build(dist, lengths + nlen, ndist);
+        if (!acceptable(err, dist, ndist)) return false;
+        return codes(out, lit, dist);
+    }
+
+    bool codes(std::vector<uint8_t>& out, const Huffman& lit, const Huffman& dist) {
+        static const short kLenBase[29] = { 3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                            31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const short kLenExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const short kDistBase[30] = { 1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                             193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static const short kDistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+        for (;;) {
+            int sym = decode(lit);
+            if (sym < 0 || bad) return false;
+            if (sym < 256) {
+                out.push_back((uint8_t)sym);
+            } else if (sym == 256) {
+                return true;
+            } else {
+                sym -= 257;
+                if (sym >= 29) return false;
+                size_t len = kLenBase[sym] + bits(kLenExtra[sym]);
+                int d = decode(dist);
+                if (d < 0 || d >= 30) return false;
+                size_t distance = (size_t)(unsigned short)kDistBase[d] + bits(kDistExtra[d]);
+                if (distance > out.size() || bad) return false;
+                size_t from = out.size() - distance;
+                for (size_t i = 0; i < len; ++i) out.push_back(out[from + i]);
+            }
+        }
+    }
+
+    const uint8_t* in;
+    size_t n;
+    size_t pos = 0;
+    uint32_t buffer = 0;
+    int count = 0;
+    bool bad = false;
+};
+
+uint32_t crc32(const uint8_t* p, size_t n, uint32_t crc = 0) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+uint32_t adler32(const std::vector<uint8_t>& v) {
+    uint32_t a = 1, b = 0;
+    for (uint8_t c : v) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    return b << 16 | a;
+}
+
+bool decodePng(const std::vector<uint8_t>& f, int& w, int& h, std::vector<uint8_t>& rgb) {
+    static const uint8_t kSig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (f.size() < 8 || memcmp(f.data(), kSig, 8) != 0) return false;
+    std::vector<uint8_t> idat;
+    bool header = false, end = false;
+    size_t pos = 8;
+    while (!end) {
+        if (pos + 12 > f.size()) return false;
+        uint32_t len = be32(&f[pos]);
+        if (pos + 12 + len > f.size()) return false;
+        const uint8_t* type = &f[pos + 4];
+        const uint8_t* data = type + 4;
+        if (crc32(type, 4 + len) != be32(data + len)) return false;
+        if (memcmp(type, "IHDR", 4) == 0) {
+            // 8-bit truecolour, deflate, adaptive filters, not interlaced.
+            if (len != 13 || data[8] != 8 || data[9] != 2 || data[10] || data[11] || data[12]) return false;
+            w = (int)be32(data);
+            h = (int)be32(data + 4);
+            header = true;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            idat.insert(idat.end(), data, data + len);
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            end = true;
+        }
+        pos += 12 + len;
+    }
+    if (!header || pos != f.size() || idat.size() < 6) return false;
+    if ((idat[0] & 15) != 8 || (idat[0] >> 4) > 7 || (idat[0] << 8 | idat[1]) % 31 || (idat[1] & 0x20)) return false;
+
+    std::vector<uint8_t> raw;
+    Inflater inflater(idat.data() + 2, idat.size() - 2);
+    if (!inflater.run(raw)) return false;
+    size_t tail = 2 + inflater.used();
+    if (tail + 4 != idat.size() || be32(&idat[tail]) != adler32(raw)) return false;
+
+    size_t stride = (size_t)w * 3;
+    if (raw.size() != (stride + 1) * h) return false;
+    rgb.assign(stride * h, 0);
+    for (int y = 0; y < h; ++y) {
+        uint8_t filter = raw[y * (stride + 1)];
+        const uint8_t* src = &raw[y * (stride + 1) + 1];
+        uint8_t* cur = &rgb[y * stride];
+        const uint8_t* up = y ? cur - stride : nullptr;
+        for (size_t i = 0; i < stride; ++i) {
+            int a = i >= 3 ? cur[i - 3] : 0, b = up ? up[i] : 0, c = up && i >= 3 ? up[i - 3] : 0;
+            int pred;
+            switch (filter) {
+            case 0: pred = 0; break;
+            case 1: pred = a; break;
+            case 2: pred = b; break;
+            case 3: pred = (a + b) / 2; break;
+            case 4: {
+                int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                pred = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default: return false;
+            }
+            cur[i] = (uint8_t)(src[i] + pred);
+        }
+    }
+    return true;
+}
+
+bool decode(imageenc::Format format, const std::vector<uint8_t>& f, int& w, int& h, std::vector<uint8_t>& rgb) {
+    switch (format) {
+    case imageenc::Format::Qoi: return decodeQoi(f, w, h, rgb);
+    case imageenc::Format::Png: return decodePng(f, w, h, rgb);
+    default: return decodeBmp(f, w, h, rgb);
+    }
+}
+
+// The encoded file decodes to the source pixels, alpha aside.
+bool roundTrips(imageenc::Format format, const std::vector<uint8_t>& encoded, const std::vector<uint8_t>& bgra,
+                int w, int h, const std::string& what) {
+    int dw = 0, dh = 0;
+    std::vector<uint8_t> rgb;
+    if (!decode(format, encoded, dw, dh, rgb)) {
+        fprintf(stderr, "%s: does not decode\n", what.c_str());
+        return false;
+    }
+    if (dw != w || dh != h) {
+        fprintf(stderr, "%s: decodes as %dx%d\n", what.c_str(), dw, dh);
+        return false;
+    }
+    for (size_t i = 0; i < (size_t)w * h; ++i) {
+        const uint8_t* s = &bgra[i * 4];
+        const uint8_t* d = &rgb[i * 3];
+        if (d[0] != s[2] || d[1] != s[1] || d[2] != s[0]) {
+            fprintf(stderr, "%s: pixel %zu,%zu differs\n", what.c_str(), i % w, i / w);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool verifyRoundTrips() {
+    const struct {
+        int w, h;
+    } sizes[] = { { 1, 1 }, { 3, 200 }, { 333, 97 }, { 640, 480 } };
+    const char* contentNames[] = { "camera", "flat", "noise" };
+    bool ok = true;
+    std::vector<uint8_t> out;
+    for (const auto& size : sizes) {
+        for (Content content : { Content::Camera, Content::Flat, Content::Noise }) {
+            std::vector<uint8_t> px = syntheticFrame(size.w, size.h, content);
+            pixelconv::Image img = pixelconv::wrap(pixelconv::PixelFormat::BGRA, size.w, size.h, px.data());
+            std::string what = std::to_string(size.w) + "x" + std::to_string(size.h) + " " + contentNames[(int)content];
+            ok = (imageenc::encodeBmp(img, out) && roundTrips(imageenc::Format::Bmp, out, px, size.w, size.h, what + " bmp")) && ok;
+            ok = (imageenc::encodeQoi(img, out) && roundTrips(imageenc::Format::Qoi, out, px, size.w, size.h, what + " qoi")) && ok;
+            for (int level = 0; level <= 9; ++level) {
+                for (int threads : { 1, 2, 3, 8 }) {
+                    std::string png = what + " png l" + std::to_string(level) + " t" + std::to_string(threads);
+                    ok = (imageenc::encodePng(img, level, out, threads) &&
+                          roundTrips(imageenc::Format::Png, out, px, size.w, size.h, png)) && ok;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+// Times one encoder at 1080p, then checks what it produced.
+bool run(const std::string& name, imageenc::Format format, const std::vector<uint8_t>& px, int w, int h,
+         std::vector<uint8_t>& out, const std::function<void()>& fn) {
+    bench::Timing t = bench::measure(fn, 500);
+    bench::report("imageenc", name, "bytes", (double)out.size(), t);
+    return roundTrips(format, out, px, w, h, name);
+}
+
+} // namespace
+
+int main() {
+    bool ok = verifyRoundTrips();
+
+    const int w = 1920, h = 1080;
+    std::vector<uint8_t> px = syntheticFrame(w, h);
+    pixelconv::Image img = pixelconv::wrap(pixelconv::PixelFormat::BGRA, w, h, px.data());
+    std::vector<uint8_t> out;
+
+    bench::Timing raw = bench::measure([&] { out.assign(px.begin(), px.end()); });
+    bench::report("imageenc", "bmp32_raw_copy", "bytes", (double)(px.size() + 54), raw);
+
+    ok = run("bmp24", imageenc::Format::Bmp, px, w, h, out, [&] { imageenc::encodeBmp(img, out); }) && ok;
+    ok = run("qoi", imageenc::Format::Qoi, px, w, h, out, [&] { imageenc::encodeQoi(img, out); }) && ok;
+
+    std::vector<int> threadCounts = { 1 };
+    if (std::thread::hardware_concurrency() > 1) threadCounts.push_back((int)std::thread::hardware_concurrency());
+    for (int level : { 0, 1, 6, 9 }) {
+        for (int threads : threadCounts) {
+            std::string name = "png_l" + std::to_string(level) + "_t" + std::to_string(threads);
+            ok = run(name, imageenc::Format::Png, px, w, h, out, [&] { imageenc::encodePng(img, level, out, threads); }) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,279 @@
+#include "bench.h"
+#include "../common/json.h"
+#include "../common/protocol.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// json::Writer against the three ways the helpers built JSON before it: the
+// same messages, the bytes per second each produces and the heap
+// allocations each makes per message. Also checks that every escape comes
+// out right and that the SIMD scan finds what the scalar one finds.
+
+namespace {
+
+std::atomic<uint64_t> allocations{ 0 };
+
+} // namespace
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+namespace {
+
+// ---- the builders json::Writer replaced, as they were ----
+
+namespace legacy {
+
+// usb.cpp
+std::string escapeJson(const std::string& s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '\\') res += "\\\\";
+        else if (c == '"') res += "\\\"";
+        else res += c;
+    }
+    return res;
+}
+
+// webcam.cpp
+std::string escapeJSON(const std::string& s) {
+    std::ostringstream o;
+    for (char c : s) {
+        switch (c) {
+        case '\"': o << "\\\""; break;
+        case '\\': o << "\\\\"; break;
+        case '\b': o << "\\b"; break;
+        case '\f': o << "\\f"; break;
+        case '\n': o << "\\n"; break;
+        case '\r': o << "\\r"; break;
+        case '\t': o << "\\t"; break;
+        default:   o << c; break;
+        }
+    }
+    return o.str();
+}
+
+} // namespace legacy
+
+struct Segment {
+    std::string camera = "\\\\?\\usb#vid_046d&pid_0825&mi_00#7&1b2c3d4e&0&0000#{e5323777-f976-4f5b-9b55-b94699c46e44}";
+    std::string path = "C:\\Users\\lab\\Videos\\captures\\segment_3_20241019_101500.mp4";
+    int64_t startNs = 1729332900123456789;
+    int64_t endNs = 1729332960123456789;
+    uint64_t frames = 1800;
+    uint64_t bytes = 73400320;
+};
+
+void legacyWebcam(const Segment& s, std::string& out) {
+    std::ostringstream json;
+    json << "{\"type\":\"segment_closed\",\"camera\":\"" << legacy::escapeJSON(s.camera)
+         << "\",\"filename\":\"" << legacy::escapeJSON(s.path) << "\",\"start_ns\":" << s.startNs
+         << ",\"end_ns\":" << s.endNs << ",\"frames\":" << s.frames << ",\"bytes\":" << s.bytes << "}";
+    out = json.str();
+}
+
+void legacyUsb(const Segment& s, std::string& out) {
+    std::ostringstream json;
+    json << "{ \"type\": \"log\", \"message\": \"" << legacy::escapeJson(s.path) << "\", \"level\": \""
+         << legacy::escapeJson(s.camera) << "\" }";
+    out = json.str();
+}
+
+void legacyPci(const std::vector<uint32_t>& ids, std::string& out) {
+    std::ostringstream json;
+    json << "{\"devices\":[";
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (i) json << ",";
+        json << "{\"DeviceID\":\"0x" << std::hex << std::setfill('0') << std::setw(4) << (ids[i] >> 16) << "\",";
+        json << "\"VendorID\":\"0x" << std::hex << std::setfill('0') << std::setw(4) << (ids[i] & 0xffff) << "\"}";
+    }
+    json << "]}";
+    out = json.str();
+}
+
+void writerWebcam(const Segment& s, json::Writer& msg) {
+    msg.clear();
+    msg.beginObject();
+    msg.field("type", "segment_closed");
+    msg.field("camera", s.camera);
+    msg.field("filename", s.path);
+    msg.field("start_ns", s.startNs);
+    msg.field("end_ns", s.endNs);
+    msg.field("frames", s.frames);
+    msg.field("bytes", s.bytes);
+    msg.endObject();
+}
+
+void writerUsb(const Segment& s, json::Writer& msg) {
+    msg.clear();
+    msg.beginObject();
+    msg.field("type", "log");
+    msg.field("message", s.path);
+    msg.field("level", s.camera);
+    msg.endObject();
+}
+
+void writerPci(const std::vector<uint32_t>& ids, json::Writer& msg) {
+    msg.clear();
+    msg.beginObject();
+    msg.key("devices").beginArray();
+    for (uint32_t id : ids) {
+        msg.beginObject();
+        msg.key("DeviceID").beginString().text("0x").hex(id >> 16, 4).endString();
+        msg.key("VendorID").beginString().text("0x").hex(id & 0xffff, 4).endString();
+        msg.endObject();
+    }
+    msg.endArray();
+    msg.endObject();
+}
+
+bool verifyEscapes() {
+    bool ok = true;
+    std::string all;
+    for (int c = 0; c < 0x80; ++c) all.push_back((char)c);
+    all += "\xc3\xa9\xe2\x82\xac"; // UTF-8 passes through
+
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("s", all);
+    msg.key("list").beginArray().value(-1).value(true).null().value(0.1);
+    msg.value(std::numeric_limits<double>::infinity()).endArray();
+    msg.key("hex").beginString().hex(0x80070005u).text("/").hex(0xa, 4).endString();
+    msg.endObject();
+
+    // Every byte below 0x20 must be escaped, and the result must parse back
+    // to the same string.
+    for (char c : msg.view()) {
+        if ((unsigned char)c < 0x20) {
+            fprintf(stderr, "raw control character 0x%02x in output\n", (unsigned char)c);
+            ok = false;
+        }
+    }
+    std::string packed, back;
+    if (!protocol::fromJson(msg.view(), packed) ||
+        !protocol::toJson((const uint8_t*)packed.data(), packed.size(), back) || back != msg.view()) {
+        fprintf(stderr, "does not round trip:\n  %.*s\n  %s\n", (int)msg.size(), msg.view().data(), back.c_str());
+        ok = false;
+    }
+    std::string_view text = msg.view();
+    if (text.find("\\u0001\\u0002") == std::string_view::npos || text.find("\\b\\t\\n\\u000b\\f\\r") == std::string_view::npos ||
+        text.find("\"list\":[-1,true,null,0.1,null]") == std::string_view::npos ||
+        text.find("\"hex\":\"80070005/000a\"") == std::string_view::npos) {
+        fprintf(stderr, "unexpected output: %.*s\n", (int)text.size(), text.data());
+        ok = false;
+    }
+
+    // The vector scan against a byte loop, at every alignment and length.
+    std::mt19937 rng(35);
+    for (int i = 0; i < 200000 && ok; ++i) {
+        std::string s(rng() % 70, 'a');
+        for (char& c : s) c = (char)(rng() % 4 ? 'a' + rng() % 26 : rng() % 256);
+        size_t from = s.empty() ? 0 : rng() % (s.size() + 1);
+        const char* end = s.data() + s.size();
+        const char* expect = s.data() + from;
+        while (expect < end && !json::detail::needsEscape((unsigned char)*expect)) ++expect;
+        if (json::findEscape(s.data() + from, end) != expect) {
+            fprintf(stderr, "scan mismatch at length %zu offset %zu\n", s.size(), from);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+template <typename F>
+void run(const char* name, F&& fn) {
+    size_t bytes = 0;
+    fn(bytes);
+    uint64_t before = allocations.load();
+    const int calls = 1000;
+    for (int i = 0; i < calls; ++i) fn(bytes);
+    double perMessage = (double)(allocations.load() - before) / calls;
+    bench::Timing t = bench::measure([&] { fn(bytes); });
+    bench::report("json", std::string(name) + "_throughput", "mb_per_s", bytes / (t.medianNs / 1e9) / 1e6, t);
+    bench::report("json", std::string(name) + "_allocations", "per_msg", perMessage);
+}
+
+} // namespace
+
+int main() {
+    bool ok = verifyEscapes();
+
+    Segment seg;
+    std::vector<uint32_t> pci;
+    for (uint32_t i = 0; i < 40; ++i) pci.push_back(((0x1000 + i * 37) << 16) | (0x8086 + i));
+    std::string legacyOut;
+    json::Writer msg;
+
+    run("legacy_webcam", [&](size_t& n) { legacyWebcam(seg, legacyOut); n = legacyOut.size(); });
+    run("writer_webcam", [&](size_t& n) { writerWebcam(seg, msg); n = msg.size(); });
+    run("legacy_usb", [&](size_t& n) { legacyUsb(seg, legacyOut); n = legacyOut.size(); });
+    run("writer_usb", [&](size_t& n) { writerUsb(seg, msg); n = msg.size(); });
+    run("legacy_pci", [&](size_t& n) { legacyPci(pci, legacyOut); n = legacyOut.size(); });
+    run("writer_pci", [&](size_t& n) { writerPci(pci, msg); n = msg.size(); });
+
+    // Same bytes out of both, so the rates compare like for like.
+    legacyWebcam(seg, legacyOut);
+    writerWebcam(seg, msg);
+    if (legacyOut != msg.view()) {
+        fprintf(stderr, "webcam message differs:\n  %s\n  %.*s\n", legacyOut.c_str(), (int)msg.size(), msg.view().data());
+        ok = false;
+    }
+    legacyPci(pci, legacyOut);
+    writerPci(pci, msg);
+    if (legacyOut != msg.view()) {
+        fprintf(stderr, "pci list differs\n");
+        ok = false;
+    }
+
+    // Through Output as the helpers send it: one write per message.
+    FILE* sink = tmpfile();
+    if (sink) {
+        protocol::Output out(protocol::Mode::JsonLines, sink);
+        // Two full queues, held back and then written, grow both the queue's
+        // buffer and the writer's to the largest backlog there can be.
+        for (int round = 0; round < 2; ++round) {
+            {
+                protocol::Output::Batch batch(out);
+                for (size_t i = 0; i < protocol::Output::kDefaultCapacity; ++i) {
+                    writerWebcam(seg, msg);
+                    out.sendJson(msg.view());
+                }
+            }
+            out.flush();
+        }
+        uint64_t before = allocations.load();
+        for (int i = 0; i < 1000; ++i) {
+            writerWebcam(seg, msg);
+            out.sendJson(msg.view());
+        }
+        double sentAllocations = (allocations.load() - before) / 1000.0;
+        bench::report("json", "writer_webcam_sent_allocations", "per_msg", sentAllocations);
+        if (sentAllocations > 0) {
+            fprintf(stderr, "sending through Output allocated %.3f times per message\n", sentAllocations);
+            ok = false;
+        }
+        bench::Timing t = bench::measure([&] {
+            writerWebcam(seg, msg);
+            out.sendJson(msg.view());
+        });
+        bench::report("json", "writer_webcam_sent", "us", t.medianNs / 1e3, t);
+    }
+    if (sink) fclose(sink);
+    return ok ? 0 : 1;
+}
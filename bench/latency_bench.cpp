@@ -0,0 +1,129 @@
+#include "bench.h"
+#include "../ui/src/lab4/latency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cost of recording a stage and accuracy of the reported percentiles against
+// exact ones computed from the raw samples; the running totals survive a
+// reset, and the macros honour WEBCAM_LATENCY_STATS.
+
+namespace {
+
+// Every value must fall inside its bucket, and buckets must be no wider than
+// 1/32 of their lower bound.
+bool verifyBuckets() {
+    std::mt19937_64 rng(5);
+    for (int i = 0; i < 1000000; ++i) {
+        uint64_t v = rng() >> (rng() % 64);
+        if (v >= (1ull << 37)) continue;
+        int b = latency::Histogram::bucketFor(v);
+        uint64_t lo = latency::Histogram::bucketLow(b), hi = latency::Histogram::bucketHigh(b);
+        if (v < lo || v > hi || (hi - lo) * 32 > std::max<uint64_t>(lo, 32)) {
+            fprintf(stderr, "value %llu in bucket %d [%llu, %llu]\n", (unsigned long long)v, b,
+                    (unsigned long long)lo, (unsigned long long)hi);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Log-normal stage times around 2 ms, like a convert or encode step.
+bool verifyPercentiles() {
+    std::mt19937 rng(11);
+    std::lognormal_distribution<double> dist(14.5, 0.6);
+    std::vector<uint64_t> samples(200000);
+    for (auto& s : samples) {
+        s = (uint64_t)dist(rng);
+        latency::record(latency::Stage::PhotoEncode, (int64_t)s);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    bool ok = true;
+    for (const latency::Summary& s : latency::collect(true)) {
+        if (s.stage != latency::Stage::PhotoEncode) continue;
+        const double qs[] = { 0.5, 0.9, 0.99 };
+        const double got[] = { s.p50Us, s.p90Us, s.p99Us };
+        for (int i = 0; i < 3; ++i) {
+            double exact = samples[(size_t)(qs[i] * samples.size()) - 1] / 1e3;
+            double err = std::abs(got[i] - exact) / exact;
+            bench::report("latency", "p" + std::to_string((int)(qs[i] * 100)) + "_relative_error", "ratio", err);
+            if (err > 1.0 / 32) ok = false;
+        }
+    }
+    if (!latency::collect(false).empty()) {
+        fprintf(stderr, "reset left samples behind\n");
+        ok = false;
+    }
+    // The running totals the metrics endpoint reads ignore the reset.
+    uint64_t sumNs = 0, want = 0;
+    for (uint64_t v : samples) want += v;
+    latency::Histogram total = latency::total(latency::Stage::PhotoEncode, sumNs);
+    if (total.count() != samples.size() || sumNs != want) {
+        fprintf(stderr, "totals after reset: %llu samples, %llu ns\n", (unsigned long long)total.count(),
+                (unsigned long long)sumNs);
+        ok = false;
+    }
+    return ok;
+}
+
+// The LATENCY_* macros record a lap and a mark, or nothing at all when the
+// build has WEBCAM_LATENCY_STATS off.
+bool verifyMacros() {
+    latency::collect(true);
+    LATENCY_STOPWATCH(sw);
+    LATENCY_LAP(sw, PreviewPublish);
+    LATENCY_RESTART(sw);
+    LATENCY_MARK(sw, PreviewPublish);
+    uint64_t want = WEBCAM_LATENCY_STATS ? 2 : 0, got = 0;
+    for (const latency::Summary& s : latency::collect(true))
+        if (s.stage == latency::Stage::PreviewPublish) got = s.count;
+    if (got != want) {
+        fprintf(stderr, "macros recorded %llu samples, expected %llu\n", (unsigned long long)got,
+                (unsigned long long)want);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main() {
+    bool ok = verifyBuckets() && verifyPercentiles() && verifyMacros();
+
+    bench::Timing t = bench::measure([] {
+        for (int i = 0; i < 1000; ++i) latency::record(latency::Stage::VideoWriteSample, 1000 + i * 37);
+    });
+    bench::report("latency", "record_1thread", "ns_per_record", t.medianNs / 1000, t);
+
+    bench::Timing lap = bench::measure([] {
+        latency::Stopwatch sw;
+        for (int i = 0; i < 1000; ++i) sw.lap(latency::Stage::VideoReadSample);
+    });
+    bench::report("latency", "stopwatch_lap", "ns_per_lap", lap.medianNs / 1000, lap);
+
+    // Recording threads share nothing, so the per-record cost should not grow
+    // with the thread count.
+    int threads = (int)std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+    bench::Timing mt = bench::measure([threads] {
+        std::vector<std::thread> pool;
+        for (int n = 0; n < threads; ++n) {
+            pool.emplace_back([] {
+                for (int i = 0; i < 100000; ++i) latency::record(latency::Stage::VideoConvert, 500 + i);
+            });
+        }
+        for (auto& th : pool) th.join();
+    });
+    bench::report("latency", "record_" + std::to_string(threads) + "threads", "ns_per_record",
+                  mt.medianNs / 100000, mt);
+
+    bench::Timing report = bench::measure([] { latency::collect(false); });
+    bench::report("latency", "collect", "us", report.medianNs / 1e3, report);
+    return ok ? 0 : 1;
+}
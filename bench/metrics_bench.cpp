@@ -0,0 +1,210 @@
+#include "bench.h"
+#include "../common/metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// The metrics registry the helpers report into: updates from many threads
+// add up exactly, the exposition parses as Prometheus text with cumulative
+// buckets, and a scrape over the loopback server returns it. Reports what an
+// update costs on the hot paths, alone and contended, and what a scrape costs.
+
+namespace {
+
+const int kThreads = 4;
+const int kPerThread = 250000;
+
+bool verifyConcurrentUpdates() {
+    metrics::Registry r;
+    metrics::Counter& counter = r.counter("bench_updates_total", "Updates.");
+    metrics::Gauge& gauge = r.gauge("bench_level", "Level.");
+    metrics::Histogram& histogram = r.histogram("bench_seconds", "Durations.");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < kPerThread; ++i) {
+                counter.add();
+                gauge.add(1);
+                histogram.observe((i % 100) * 1e-4 * (t + 1));
+            }
+        });
+    }
+    for (std::thread& t : threads) t.join();
+
+    uint64_t want = (uint64_t)kThreads * kPerThread;
+    uint64_t buckets = 0;
+    for (size_t i = 0; i <= histogram.bounds().size(); ++i) buckets += histogram.bucket(i);
+    if (counter.value() != want || gauge.value() != (double)want || histogram.count() != want || buckets != want) {
+        fprintf(stderr, "lost updates: counter %llu, gauge %.0f, histogram %llu (%llu in buckets) of %llu\n",
+                (unsigned long long)counter.value(), gauge.value(), (unsigned long long)histogram.count(),
+                (unsigned long long)buckets, (unsigned long long)want);
+        return false;
+    }
+    return true;
+}
+
+// Every line is a comment or "name{labels} value"; a histogram's buckets
+// never decrease and end in +Inf equal to _count; label values are escaped.
+bool verifyExposition() {
+    metrics::Registry r;
+    r.counter("bench_events_total", "Events.", metrics::label("camera", "\\\\?\\usb#\"cam\"\nx")).add(3);
+    r.counter("bench_events_total", "Events.", metrics::label("camera", "plain")).add(1);
+    metrics::Histogram& h = r.histogram("bench_seconds", "Durations.\nSecond line.");
+    for (double v : { 0.00005, 0.002, 0.002, 0.3, 42.0 }) h.observe(v);
+    r.addCollector([](metrics::Exposition& out) {
+        out.family("bench_collected", "From a collector.", "gauge");
+        out.sample("bench_collected", {}, 1.5);
+    });
+
+    std::string text;
+    r.render(text);
+    bool ok = true;
+    uint64_t last = 0, inf = UINT64_MAX, count = 0;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) {
+            ok = false;
+            break;
+        }
+        std::string line = text.substr(start, end - start);
+        start = end + 1;
+        if (line.rfind("# HELP ", 0) == 0 || line.rfind("# TYPE ", 0) == 0) continue;
+        size_t space = line.rfind(' ');
+        size_t brace = line.find('{');
+        if (space == std::string::npos || line.find('\n') != std::string::npos ||
+            (brace != std::string::npos && line[space - 1] != '}')) {
+            ok = false;
+            continue;
+        }
+        uint64_t value = strtoull(line.c_str() + space + 1, nullptr, 10);
+        if (line.rfind("bench_seconds_bucket", 0) == 0) {
+            if (value < last) ok = false;
+            last = value;
+            if (line.find("le=\"+Inf\"") != std::string::npos) inf = value;
+        } else if (line.rfind("bench_seconds_count", 0) == 0) {
+            count = value;
+        }
+    }
+    if (inf != 5 || count != 5) ok = false;
+    if (text.find("camera=\"\\\\\\\\?\\\\usb#\\\"cam\\\"\\nx\"} 3") == std::string::npos ||
+        text.find("Durations.\\nSecond line.") == std::string::npos || text.find("bench_collected 1.5") == std::string::npos) {
+        ok = false;
+    }
+    if (!ok) fprintf(stderr, "exposition does not parse:\n%s", text.c_str());
+    return ok;
+}
+
+#if defined(_WIN32)
+using Socket = SOCKET;
+void closeSocket(Socket s) { closesocket(s); }
+#else
+using Socket = int;
+void closeSocket(Socket s) { close(s); }
+#endif
+
+// One GET as a scraper sends it; the whole response, or empty on failure.
+std::string scrape(uint16_t port, const char* path) {
+    Socket s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    std::string response;
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: localhost\r\nAccept: text/plain\r\n\r\n";
+        send(s, request.data(), (int)request.size(), 0);
+        char buf[16384];
+        int n;
+        while ((n = (int)recv(s, buf, (int)sizeof(buf), 0)) > 0) response.append(buf, (size_t)n);
+    }
+    closeSocket(s);
+    return response;
+}
+
+} // namespace
+
+int main() {
+    bool ok = verifyConcurrentUpdates();
+    ok = verifyExposition() && ok;
+
+    metrics::Counter& counter = metrics::registry().counter("bench_counter_total", "Bench counter.");
+    metrics::Histogram& histogram = metrics::registry().histogram("bench_histogram_seconds", "Bench histogram.");
+    const int batch = 1000;
+    bench::Timing add = bench::measure([&] {
+        for (int i = 0; i < batch; ++i) counter.add();
+    });
+    bench::report("metrics", "counter_add", "ns", add.medianNs / batch, add);
+    bench::Timing observe = bench::measure([&] {
+        for (int i = 0; i < batch; ++i) histogram.observe(i * 1e-5);
+    });
+    bench::report("metrics", "histogram_observe", "ns", observe.medianNs / batch, observe);
+
+    // The same counter from every thread at once, as the output writer and
+    // the module threads do.
+    {
+        std::atomic<bool> go{ false };
+        std::vector<std::thread> threads;
+        for (int t = 0; t < kThreads; ++t) {
+            threads.emplace_back([&] {
+                while (!go) std::this_thread::yield();
+                for (int i = 0; i < kPerThread; ++i) counter.add();
+            });
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        go = true;
+        for (std::thread& t : threads) t.join();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        bench::report("metrics", "counter_add_contended_4t", "ns", s * 1e9 / kPerThread);
+    }
+
+    // A registry about the size of helperd's with every module running.
+    for (int i = 0; i < 40; ++i) {
+        metrics::registry().counter("bench_family_" + std::to_string(i % 10) + "_total", "Family.",
+                                    metrics::label("series", std::to_string(i))).add(i);
+    }
+    for (int i = 0; i < 8; ++i) metrics::registry().histogram("bench_latency_" + std::to_string(i) + "_seconds", "Latency.").observe(0.01);
+    std::string text;
+    bench::Timing render = bench::measure([&] {
+        text.clear();
+        metrics::registry().render(text);
+    });
+    bench::report("metrics", "render", "us", render.medianNs / 1e3, render);
+    bench::report("metrics", "render_bytes", "bytes", (double)text.size());
+
+    std::unique_ptr<metrics::Server> server = metrics::Server::listen(0);
+    if (!server) {
+        fprintf(stderr, "cannot listen on loopback\n");
+        return 1;
+    }
+    std::string response = scrape(server->port(), "/metrics");
+    if (response.rfind("HTTP/1.1 200 OK\r\n", 0) != 0 || response.find("bench_counter_total ") == std::string::npos ||
+        response.find("text/plain; version=0.0.4") == std::string::npos) {
+        fprintf(stderr, "scrape failed:\n%s\n", response.substr(0, 400).c_str());
+        ok = false;
+    }
+    if (scrape(server->port(), "/other").rfind("HTTP/1.1 404", 0) != 0) {
+        fprintf(stderr, "unknown path was served\n");
+        ok = false;
+    }
+    bench::Timing scraped = bench::measure([&] { response = scrape(server->port(), "/metrics"); });
+    bench::report("metrics", "scrape_loopback", "us", scraped.medianNs / 1e3, scraped);
+    return ok ? 0 : 1;
+}
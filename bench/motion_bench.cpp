@@ -0,0 +1,163 @@
+#include "bench.h"
+#include "../ui/src/lab4/motion.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Cost of the motion detector per frame and its behaviour on a synthetic
+// scene: sensor noise alone must never start an event, a moving object must
+// start exactly one and end it after the quiet time, and masking the object's
+// path must hide it.
+
+using pixelconv::Isa;
+
+namespace {
+
+// SIMD tables against the scalar reference; the width leaves a ragged tail
+// for every vector loop.
+bool verify(const motion::Kernels& k) {
+    const int w = 1300, h = 40, stride = 1312;
+    const int cellsX = w / motion::kCell, cellsY = h / motion::kCell, count = cellsX * cellsY;
+    std::mt19937 rng(77);
+    std::vector<uint8_t> luma((size_t)stride * h);
+    for (auto& v : luma) v = (uint8_t)rng();
+
+    const motion::Kernels& ref = motion::kernelsFor(Isa::Scalar);
+    std::vector<uint8_t> a(count), b(count);
+    ref.cellMeans(luma.data(), stride, cellsX, cellsY, a.data());
+    k.cellMeans(luma.data(), stride, cellsX, cellsY, b.data());
+    if (a != b) {
+        fprintf(stderr, "cell_means/%s: differs from scalar\n", pixelconv::isaName(k.isa));
+        return false;
+    }
+
+    std::vector<uint8_t> cur(count), mask(count), refA(count), refB(count);
+    for (int i = 0; i < count; ++i) {
+        cur[i] = (uint8_t)rng();
+        refA[i] = refB[i] = (uint8_t)rng();
+        mask[i] = rng() % 3 ? 0xFF : 0;
+    }
+    for (int threshold : { -7, 0, 10, 128, 255, 300 }) {
+        uint32_t na = ref.changedCells(cur.data(), refA.data(), mask.data(), count, threshold);
+        uint32_t nb = k.changedCells(cur.data(), refB.data(), mask.data(), count, threshold);
+        if (na != nb || refA != refB) {
+            fprintf(stderr, "changed_cells/%s: differs from scalar at threshold %d\n", pixelconv::isaName(k.isa), threshold);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Luma of a static, evenly lit bench with per-pixel sensor noise of +-3, and
+// optionally a bright 96x96 object.
+void renderScene(std::vector<uint8_t>& luma, int w, int h, std::mt19937& rng, int objX, int objY) {
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            int base = 60 + (x + y) / 16 % 80;
+            luma[(size_t)y * w + x] = (uint8_t)(base + (int)(rng() % 7) - 3);
+        }
+    }
+    if (objX < 0) return;
+    for (int y = objY; y < objY + 96 && y < h; ++y) {
+        for (int x = objX; x < objX + 96 && x < w; ++x) luma[(size_t)y * w + x] = 220;
+    }
+}
+
+struct Events {
+    std::vector<int> started;
+    std::vector<int> stopped;
+};
+
+// 300 frames at 30 fps; the object crosses the frame during frames 60-149.
+Events runScene(const std::vector<motion::Rect>& regions) {
+    const int w = 1280, h = 720;
+    const int64_t period = 1000000000LL / 30;
+    std::vector<uint8_t> luma((size_t)w * h);
+    std::mt19937 rng(3);
+
+    motion::Config cfg;
+    cfg.stopAfterNs = 1000000000;
+    motion::Detector detector(cfg);
+    detector.setMask(regions);
+
+    Events ev;
+    for (int f = 0; f < 300; ++f) {
+        bool moving = f >= 60 && f < 150;
+        renderScene(luma, w, h, rng, moving ? 40 + (f - 60) * 12 : -1, 300);
+        pixelconv::Image img = pixelconv::wrap(pixelconv::PixelFormat::GRAY8, w, h, luma.data());
+        motion::Result r = detector.process(img, f * period);
+        if (r.transition == motion::Transition::Started) ev.started.push_back(f);
+        if (r.transition == motion::Transition::Stopped) ev.stopped.push_back(f);
+    }
+    return ev;
+}
+
+bool checkScenes() {
+    bool ok = true;
+    Events all = runScene({});
+    bench::report("motion", "scene/events", "count", (double)all.started.size());
+    if (all.started.size() != 1 || all.stopped.size() != 1) {
+        fprintf(stderr, "scene: %zu starts, %zu stops, expected one each\n", all.started.size(), all.stopped.size());
+        ok = false;
+    } else {
+        bench::report("motion", "scene/start_delay", "frames", all.started[0] - 60);
+        bench::report("motion", "scene/stop_delay", "frames", all.stopped[0] - 149);
+        // The object leaving is itself a change, and the reference needs a few
+        // frames to settle after it, so the quiet second starts a little after
+        // frame 149.
+        if (all.started[0] < 60 || all.started[0] > 66 || all.stopped[0] < 179 || all.stopped[0] > 188) {
+            fprintf(stderr, "scene: started at %d, stopped at %d\n", all.started[0], all.stopped[0]);
+            ok = false;
+        }
+    }
+
+    // Watch only the top of the frame; the object moves along y = 300..395.
+    Events masked = runScene({ { 0, 0, 1280, 200 } });
+    if (!masked.started.empty()) {
+        fprintf(stderr, "scene: masked-out motion started %zu events\n", masked.started.size());
+        ok = false;
+    }
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    bool ok = true;
+    for (Isa isa : { Isa::SSE41, Isa::AVX2 }) {
+        const motion::Kernels& k = motion::kernelsFor(isa);
+        if (k.isa == isa) ok = verify(k) && ok;
+    }
+    ok = checkScenes() && ok;
+
+    // One 1080p NV12 frame per call: the detector only touches the luma plane.
+    const int w = 1920, h = 1080;
+    std::vector<uint8_t> frame(pixelconv::imageSize(pixelconv::PixelFormat::NV12, w, h));
+    std::mt19937 rng(9);
+    for (auto& v : frame) v = (uint8_t)rng();
+    pixelconv::Image img = pixelconv::wrap(pixelconv::PixelFormat::NV12, w, h, frame.data());
+
+    const int cellsX = w / motion::kCell, cellsY = h / motion::kCell, count = cellsX * cellsY;
+    std::vector<uint8_t> cells(count), ref(count, 128), mask(count, 0xFF);
+    for (Isa isa : { Isa::Scalar, Isa::SSE41, Isa::AVX2 }) {
+        const motion::Kernels& k = motion::kernelsFor(isa);
+        if (k.isa != isa) continue;
+        bench::Timing t = bench::measure([&] {
+            k.cellMeans(img.planes[0].data, img.planes[0].stride, cellsX, cellsY, cells.data());
+            k.changedCells(cells.data(), ref.data(), mask.data(), count, 10);
+        });
+        std::string name = std::string("1080p_frame/") + pixelconv::isaName(isa);
+        bench::report("motion", name, "us", t.medianNs / 1e3, t);
+        bench::report("motion", name + "/core_percent_at_30fps", "percent", t.medianNs * 30 / 1e7);
+    }
+
+    motion::Detector detector;
+    int64_t ts = 0;
+    bench::Timing t = bench::measure([&] { detector.process(img, ts += 33333333); });
+    bench::report("motion", "1080p_detector", "us", t.medianNs / 1e3, t);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,268 @@
+#include "bench.h"
+#include "../ui/src/lab4/capture.h"
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs several capture sessions against synthetic cameras and checks the
+// properties the helper relies on with real ones: every session keeps its
+// frame rate, frames arrive intact, a stalled device or a slow sink only costs
+// its own session frames, and timestamps from different cameras line up.
+// Stopping a session whose device hangs in read() returns promptly, and a
+// read that ignores the cancel does not hold stop() past its timeout.
+
+namespace {
+
+// Frames are due on a grid shared by all sources, like cameras started
+// together. Each source reports them on its own device clock with an arbitrary
+// base, which ClockSync has to remove. A stalled source skips the frames it
+// missed, as a camera does.
+class SyntheticSource : public capture::FrameSource {
+public:
+    SyntheticSource(int w, int h, double fps, int64_t epochNs, int64_t deviceBaseNs, int64_t stallAtNs = 0)
+        : width(w), height(h), period((int64_t)(1e9 / fps)), epoch(epochNs), deviceBase(deviceBaseNs), stallAt(stallAtNs) {}
+
+    bool open(capture::StreamFormat& format) override {
+        format.width = width;
+        format.height = height;
+        format.fps = 1e9 / period;
+        return true;
+    }
+
+    bool read(const pixelconv::Image& dst, int64_t& deviceNs) override {
+        if (stallAt && capture::clockNs() >= stallAt) {
+            stallAt = 0;
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        int64_t tick = (capture::clockNs() - epoch) / period + 1;
+        if (tick <= lastTick) tick = lastTick + 1;
+        lastTick = tick;
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(epoch + tick * period)));
+
+        // Luma gets the tick number in its first 8 bytes and a pattern derived
+        // from it everywhere else, so sinks can check the frame is whole.
+        uint8_t fill = (uint8_t)(tick * 37);
+        for (int y = 0; y < height; ++y) memset(dst.planes[0].data + (size_t)y * dst.planes[0].stride, fill, (size_t)width);
+        memcpy(dst.planes[0].data, &tick, sizeof(tick));
+        deviceNs = deviceBase + tick * period;
+        return true;
+    }
+
+    void close() override {}
+
+private:
+    int width, height;
+    int64_t period, epoch, deviceBase, stallAt;
+    int64_t lastTick = 0;
+};
+
+// Verifies each frame and records tick -> timestamp for the alignment check.
+class CheckingSink : public capture::FrameSink {
+public:
+    explicit CheckingSink(int delayMs = 0) : delay(delayMs) {}
+
+    bool onFrame(const capture::Frame& frame) override {
+        int64_t tick;
+        memcpy(&tick, frame.image.planes[0].data, sizeof(tick));
+        const uint8_t* lastRow = frame.image.planes[0].data + (size_t)(frame.image.height - 1) * frame.image.planes[0].stride;
+        if (lastRow[frame.image.width - 1] != (uint8_t)(tick * 37)) ++corrupt;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stamps.emplace_back(tick, frame.timestampNs);
+        }
+        if (delay) std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+        return true;
+    }
+
+    std::vector<std::pair<int64_t, int64_t>> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stamps;
+    }
+
+    uint64_t corrupt = 0;
+
+private:
+    int delay;
+    std::mutex mutex;
+    std::vector<std::pair<int64_t, int64_t>> stamps;
+};
+
+struct Scenario {
+    const char* name;
+    int sessions;
+    int width, height;
+    double fps;
+    int slowSink;      // session index whose sink takes longer than a frame, or -1
+    int stalledSource; // session index whose device stalls for a second, or -1
+};
+
+// Largest difference between the timestamps different sessions gave the
+// same tick, in microseconds.
+double alignmentUs(std::vector<std::shared_ptr<CheckingSink>>& sinks) {
+    std::vector<std::vector<std::pair<int64_t, int64_t>>> all;
+    for (auto& s : sinks) all.push_back(s->snapshot());
+    double worst = 0;
+    for (const auto& ref : all[0]) {
+        for (size_t i = 1; i < all.size(); ++i) {
+            for (const auto& other : all[i]) {
+                if (other.first == ref.first) {
+                    worst = std::max(worst, std::abs((double)(other.second - ref.second)) / 1e3);
+                    break;
+                }
+            }
+        }
+    }
+    return worst;
+}
+
+bool run(const Scenario& sc, double seconds) {
+    int64_t epoch = capture::clockNs();
+    std::vector<std::unique_ptr<capture::Session>> sessions;
+    std::vector<std::shared_ptr<CheckingSink>> sinks;
+    for (int i = 0; i < sc.sessions; ++i) {
+        int64_t deviceBase = (int64_t)(i + 1) * 7777777777LL;
+        int64_t stallAt = i == sc.stalledSource ? epoch + (int64_t)(seconds * 0.3e9) : 0;
+        std::unique_ptr<capture::FrameSource> src(new SyntheticSource(sc.width, sc.height, sc.fps, epoch, deviceBase, stallAt));
+        sessions.emplace_back(new capture::Session("synthetic" + std::to_string(i), std::move(src)));
+        sinks.push_back(std::make_shared<CheckingSink>(i == sc.slowSink ? (int)(3e3 / sc.fps) : 0));
+        sessions.back()->addSink(sinks.back());
+    }
+    for (auto& s : sessions) {
+        if (!s->start()) {
+            fprintf(stderr, "%s: session failed to start\n", sc.name);
+            return false;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds((int)(seconds * 1e3)));
+
+    std::vector<capture::SessionStats> stats;
+    for (auto& s : sessions) stats.push_back(s->stats());
+    for (auto& s : sessions) s->stop();
+
+    bool ok = true;
+    for (int i = 0; i < sc.sessions; ++i) {
+        const capture::SessionStats& st = stats[i];
+        std::string name = std::string(sc.name) + "/" + sessions[i]->id();
+        bench::report("multicam", name + "/deliver_fps", "fps", st.deliverFps);
+        bench::report("multicam", name + "/dropped", "frames", (double)st.dropped);
+        if (sinks[i]->corrupt) {
+            fprintf(stderr, "%s: %llu corrupt frames\n", name.c_str(), (unsigned long long)sinks[i]->corrupt);
+            ok = false;
+        }
+        // Sessions that were neither stalled nor slow must be unaffected.
+        if (i != sc.slowSink && i != sc.stalledSource && (st.dropped > 0 || st.deliverFps < sc.fps * 0.9)) {
+            fprintf(stderr, "%s: affected by another session (%.1f fps, %llu dropped)\n", name.c_str(),
+                    st.deliverFps, (unsigned long long)st.dropped);
+            ok = false;
+        }
+    }
+    if (sc.slowSink >= 0 && stats[sc.slowSink].dropped == 0) {
+        fprintf(stderr, "%s: slow sink dropped nothing\n", sc.name);
+        ok = false;
+    }
+
+    double skewUs = alignmentUs(sinks);
+    bench::report("multicam", std::string(sc.name) + "/timestamp_skew", "us", skewUs);
+    if (skewUs > 5000) {
+        fprintf(stderr, "%s: timestamps across sessions differ by %.0f us\n", sc.name, skewUs);
+        ok = false;
+    }
+    return ok;
+}
+
+// A device that delivers nothing: read() blocks until cancel(), or, with
+// honourCancel false, until release().
+class HungSource : public capture::FrameSource {
+public:
+    explicit HungSource(bool honour) : honourCancel(honour) {}
+
+    bool open(capture::StreamFormat& format) override {
+        format.width = 64;
+        format.height = 48;
+        format.fps = 30;
+        return true;
+    }
+
+    bool read(const pixelconv::Image&, int64_t&) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] { return released || (cancelled && honourCancel); });
+        return false;
+    }
+
+    void close() override {}
+
+    void cancel() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        wake.notify_all();
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        released = true;
+        wake.notify_all();
+    }
+
+private:
+    bool honourCancel;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool cancelled = false;
+    bool released = false;
+};
+
+bool verifyHungStop() {
+    bool ok = true;
+
+    capture::Session cancellable("hung", std::unique_ptr<capture::FrameSource>(new HungSource(true)));
+    cancellable.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    int64_t t0 = capture::clockNs();
+    bool stopped = cancellable.stop(1000);
+    double ms = (capture::clockNs() - t0) / 1e6;
+    bench::report("multicam", "hung_read_stop", "ms", ms);
+    if (!stopped || ms > 100) {
+        fprintf(stderr, "hung_read_stop: cancelled read not joined (%.1f ms)\n", ms);
+        ok = false;
+    }
+
+    HungSource* stuck = new HungSource(false);
+    capture::Session deaf("deaf", std::unique_ptr<capture::FrameSource>(stuck));
+    deaf.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    t0 = capture::clockNs();
+    stopped = deaf.stop(50);
+    ms = (capture::clockNs() - t0) / 1e6;
+    if (stopped || ms > 200) {
+        fprintf(stderr, "deaf_read_stop: stop %s after %.1f ms\n", stopped ? "joined" : "gave up", ms);
+        ok = false;
+    }
+    stuck->release();
+    if (!deaf.stop(1000)) {
+        fprintf(stderr, "deaf_read_stop: released read not joined\n");
+        ok = false;
+    }
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    const Scenario scenarios[] = {
+        {"4x720p30", 4, 1280, 720, 30, -1, -1},
+        {"8x480p30", 8, 640, 480, 30, -1, -1},
+        {"4x1080p30_isolation", 4, 1920, 1080, 30, 1, 2},
+    };
+    bool ok = verifyHungStop();
+    for (const Scenario& sc : scenarios) ok = run(sc, 3.0) && ok;
+    return ok ? 0 : 1;
+}
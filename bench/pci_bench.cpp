@@ -0,0 +1,87 @@
+#include "bench.h"
+#include "../lab2/pci_scan.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// lab2's scan (hal::enumeratePci) over a synthetic configuration space image
+// laid out like a laptop's: a root complex on bus 0 with a handful of
+// multi-function devices and a few bridges to single-device buses behind it.
+// Reports the scan, and the scan plus the JSON file lab2 writes.
+
+namespace {
+
+// The first 64 bytes of every function's configuration space, 0xff where no
+// function answers, as the hardware reads.
+class ConfigImage : public hal::PciConfig {
+public:
+    static constexpr int kDwords = 16;
+
+    ConfigImage() : space((size_t)256 * 32 * 8 * kDwords, 0xffffffff) {}
+
+    uint32_t read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) override {
+        if (offset >= kDwords * 4) return 0xffffffff;
+        return space[index(bus, device, function) + offset / 4];
+    }
+
+    void add(int bus, int device, int function, uint16_t vendor, uint16_t id, bool multi) {
+        uint32_t* cfg = &space[index(bus, device, function)];
+        cfg[0] = (uint32_t)id << 16 | vendor;
+        cfg[3] = multi ? 0x00800000 : 0;
+        ++functions;
+    }
+
+    int functions = 0;
+
+private:
+    static size_t index(int bus, int device, int function) {
+        return (((size_t)bus * 32 + device) * 8 + function) * kDwords;
+    }
+
+    std::vector<uint32_t> space;
+};
+
+void populate(ConfigImage& image) {
+    // Host bridge, graphics, USB/audio/SMBus controllers with several functions.
+    image.add(0, 0, 0, 0x8086, 0x9a14, false);
+    image.add(0, 2, 0, 0x8086, 0x9a49, false);
+    for (int f = 0; f < 4; ++f) image.add(0, 0x14, f, 0x8086, (uint16_t)(0xa0ed + f), true);
+    for (int f = 0; f < 2; ++f) image.add(0, 0x15, f, 0x8086, (uint16_t)(0xa0e8 + f), true);
+    image.add(0, 0x16, 0, 0x8086, 0xa0e0, true);
+    image.add(0, 0x17, 0, 0x8086, 0xa0d3, false);
+    for (int f = 0; f < 8; ++f) image.add(0, 0x1f, f, 0x8086, (uint16_t)(0xa082 + f), true);
+    // Root ports and the devices behind them.
+    for (int port = 0; port < 4; ++port) {
+        image.add(0, 0x1c, port, 0x8086, (uint16_t)(0xa0b8 + port), true);
+        image.add(1 + port, 0, 0, port % 2 ? 0x10ec : 0x144d, (uint16_t)(0x8168 + port), false);
+    }
+}
+
+} // namespace
+
+int main() {
+    ConfigImage image;
+    populate(image);
+    bool ok = true;
+
+    std::vector<hal::PciFunction> found = hal::enumeratePci(image);
+    if ((int)found.size() != image.functions) {
+        fprintf(stderr, "scan found %zu of %d functions\n", found.size(), image.functions);
+        ok = false;
+    }
+
+    bench::Timing scan = bench::measure([&] { found = hal::enumeratePci(image); });
+    bench::report("pci", "scan", "us", scan.medianNs / 1e3, scan);
+
+    json::Writer out;
+    bench::Timing listed = bench::measure([&] {
+        found = hal::enumeratePci(image);
+        out.clear();
+        writePciList(found, out);
+    });
+    bench::report("pci", "scan_and_write", "us", listed.medianNs / 1e3, listed);
+    bench::report("pci", "list_bytes", "bytes", (double)out.size());
+    return ok ? 0 : 1;
+}
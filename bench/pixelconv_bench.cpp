@@ -0,0 +1,123 @@
+#include "bench.h"
+#include "../ui/src/lab4/pixelconv.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace pixelconv;
+
+namespace {
+
+struct Buffer {
+    std::vector<uint8_t> bytes;
+    Image img;
+    Buffer(PixelFormat f, int w, int h) : bytes(imageSize(f, w, h) + 64) { img = wrap(f, w, h, bytes.data()); }
+};
+
+void fillRandom(Buffer& b, uint32_t seed) {
+    std::mt19937 rng(seed);
+    for (auto& v : b.bytes) v = static_cast<uint8_t>(rng());
+}
+
+struct Case {
+    const char* name;
+    PixelFormat src;
+    PixelFormat dst;
+    int factor; // 0 = convert, otherwise downscale
+};
+
+const Case kCases[] = {
+    {"yuy2_to_bgra", PixelFormat::YUY2, PixelFormat::BGRA, 0},
+    {"nv12_to_bgra", PixelFormat::NV12, PixelFormat::BGRA, 0},
+    {"i420_to_bgra", PixelFormat::I420, PixelFormat::BGRA, 0},
+    {"nv12_to_rgb24", PixelFormat::NV12, PixelFormat::RGB24, 0},
+    {"bgra_to_rgb24", PixelFormat::BGRA, PixelFormat::RGB24, 0},
+    {"yuy2_to_nv12", PixelFormat::YUY2, PixelFormat::NV12, 0},
+    {"i420_to_nv12", PixelFormat::I420, PixelFormat::NV12, 0},
+    {"bgra_down2x", PixelFormat::BGRA, PixelFormat::BGRA, 2},
+    {"bgra_down4x", PixelFormat::BGRA, PixelFormat::BGRA, 4},
+    {"gray_down2x", PixelFormat::GRAY8, PixelFormat::GRAY8, 2},
+    {"gray_down4x", PixelFormat::GRAY8, PixelFormat::GRAY8, 4},
+};
+
+bool run(const Case& c, const Kernels& k, const Image& src, const Image& dst) {
+    return c.factor ? downscale(src, dst, c.factor, k) : convert(src, dst, k);
+}
+
+// Compares a SIMD table against the scalar reference; the width leaves a
+// ragged tail for every vector loop.
+bool verify(const Case& c, const Kernels& k) {
+    const int w = 1300, h = 36;
+    int ow = c.factor ? w / c.factor : w, oh = c.factor ? h / c.factor : h;
+    Buffer src(c.src, w, h);
+    fillRandom(src, 1234);
+    Buffer ref(c.dst, ow, oh), out(c.dst, ow, oh);
+    if (!run(c, kernelsFor(Isa::Scalar), src.img, ref.img) || !run(c, k, src.img, out.img)) {
+        fprintf(stderr, "%s/%s: conversion rejected\n", c.name, isaName(k.isa));
+        return false;
+    }
+    size_t n = imageSize(c.dst, ow, oh);
+    for (size_t i = 0; i < n; ++i) {
+        if (ref.bytes[i] != out.bytes[i]) {
+            fprintf(stderr, "%s/%s: mismatch at byte %zu (%d vs %d)\n", c.name, isaName(k.isa), i,
+                    ref.bytes[i], out.bytes[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main() {
+    const int w = 1920, h = 1080;
+    const Isa isas[] = {Isa::Scalar, Isa::SSE41, Isa::AVX2};
+    bool ok = true;
+
+    for (const Case& c : kCases) {
+        int ow = c.factor ? w / c.factor : w, oh = c.factor ? h / c.factor : h;
+        Buffer src(c.src, w, h);
+        Buffer dst(c.dst, ow, oh);
+        fillRandom(src, 42);
+
+        for (Isa isa : isas) {
+            const Kernels& k = kernelsFor(isa);
+            if (k.isa != isa) continue;
+            if (isa != Isa::Scalar && !verify(c, k)) {
+                ok = false;
+                continue;
+            }
+            bench::Timing t = bench::measure([&] { run(c, k, src.img, dst.img); });
+            double mpix = (double)w * h / t.medianNs * 1e3;
+            bench::report("pixelconv", std::string(c.name) + "/" + isaName(isa), "mpix_per_s", mpix, t);
+        }
+    }
+    // Preview path: fused YUV -> BGRA + downscale against the two-pass version
+    // it replaces, which must produce the same pixels.
+    for (int factor : {2, 4}) {
+        Buffer src(PixelFormat::NV12, w, h), full(PixelFormat::BGRA, w, h);
+        Buffer ref(PixelFormat::BGRA, w / factor, h / factor), out(PixelFormat::BGRA, w / factor, h / factor);
+        fillRandom(src, 42);
+        convert(src.img, full.img);
+        downscale(full.img, ref.img, factor);
+        convertScaled(src.img, out.img, factor);
+        if (memcmp(ref.bytes.data(), out.bytes.data(), imageSize(PixelFormat::BGRA, w / factor, h / factor)) != 0) {
+            fprintf(stderr, "nv12_preview_down%dx: fused output differs from two-pass\n", factor);
+            ok = false;
+            continue;
+        }
+        std::string suffix = "_down" + std::to_string(factor) + "x/" + isaName(kernels().isa);
+        bench::Timing twoPass = bench::measure([&] {
+            convert(src.img, full.img);
+            downscale(full.img, ref.img, factor);
+        });
+        bench::report("pixelconv", "nv12_preview_two_pass" + suffix, "mpix_per_s", (double)w * h / twoPass.medianNs * 1e3, twoPass);
+        bench::Timing fused = bench::measure([&] { convertScaled(src.img, out.img, factor); });
+        bench::report("pixelconv", "nv12_preview_fused" + suffix, "mpix_per_s", (double)w * h / fused.medianNs * 1e3, fused);
+    }
+    return ok ? 0 : 1;
+}
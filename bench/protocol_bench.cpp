@@ -0,0 +1,489 @@
+#include "bench.h"
+#include "../common/protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Both wire modes end to end: JSON survives the MessagePack round trip, the
+// decoders give the same messages however the stream is chunked, helperd's
+// channels tag and filter as subscribed, queued snapshots are replaced in
+// place, a slow host neither stalls the senders nor reorders or tears
+// messages, and the cost per message of writing and of splitting the stream
+// on the host side.
+
+namespace {
+
+const char* kSamples[] = {
+    "{\"type\":\"preview_frame\",\"frame\":123456,\"slot\":2}",
+    "{\"type\":\"segment_closed\",\"camera\":\"\\\\\\\\?\\\\usb#vid_046d\",\"filename\":\"captures/segment_3_000012.mp4\","
+    "\"start_ns\":1700000000123456789,\"end_ns\":1700000060123456789,\"frames\":1800,\"bytes\":7340032}",
+    "{\"type\":\"status\",\"message\":\"Error in capture (Code: 80070005)\\n\\\"quoted\\\"\",\"error\":true}",
+    "{\"type\":\"stats\",\"enabled\":true,\"stages\":[{\"stage\":\"convert\",\"p50_ms\":0.25,\"p99_ms\":1.5,"
+    "\"count\":-3}],\"empty\":{},\"none\":null,\"list\":[]}",
+    "{\"powerSource\":\"Online\",\"batteryType\":\"LION\",\"batteryLevel\":87,\"batteryLifeTime\":4294967295}",
+};
+
+bool verifyRoundTrip() {
+    bool ok = true;
+    for (const char* json : kSamples) {
+        std::string packed, back;
+        protocol::MessageType type;
+        if (!protocol::fromJson(json, packed, &type) ||
+            !protocol::toJson((const uint8_t*)packed.data(), packed.size(), back) || back != json) {
+            fprintf(stderr, "round trip:\n  %s\n  %s\n", json, back.c_str());
+            ok = false;
+        }
+    }
+    protocol::MessageType type;
+    std::string packed;
+    if (!protocol::fromJson(kSamples[1], packed, &type) || type != protocol::MessageType::SegmentClosed) {
+        fprintf(stderr, "segment_closed did not map to its message type\n");
+        ok = false;
+    }
+    if (protocol::fromJson("{\"type\":\"log\",", packed)) {
+        fprintf(stderr, "truncated JSON accepted\n");
+        ok = false;
+    }
+
+    // A surrogate pair becomes one 4-byte UTF-8 sequence; a lone or
+    // mismatched half has no UTF-8 form and is refused.
+    std::string back;
+    packed.clear();
+    if (!protocol::fromJson("{\"m\":\"\\ud83d\\ude00\"}", packed) ||
+        !protocol::toJson((const uint8_t*)packed.data(), packed.size(), back) || back.find("\xF0\x9F\x98\x80") == std::string::npos) {
+        fprintf(stderr, "surrogate pair: %s\n", back.c_str());
+        ok = false;
+    }
+    for (const char* bad : { "{\"m\":\"\\ud83d\\u0041\"}", "{\"m\":\"\\ud83d\\ud83d\"}", "{\"m\":\"\\ud83d\"}",
+                             "{\"m\":\"\\ud83dx\"}", "{\"m\":\"\\ude00\"}" }) {
+        if (protocol::fromJson(bad, packed)) {
+            fprintf(stderr, "invalid surrogate accepted: %s\n", bad);
+            ok = false;
+        }
+    }
+
+    // Numbers at the edges of the integer types, out of double range, and
+    // malformed.
+    const char* numbers[][2] = {
+        { "{\"n\":18446744073709551615}", "{\"n\":18446744073709551615}" },
+        { "{\"n\":-9223372036854775808}", "{\"n\":-9223372036854775808}" },
+        { "{\"n\":1e-400}", "{\"n\":0}" },
+        { "{\"n\":-0.5}", "{\"n\":-0.5}" },
+    };
+    for (const auto& n : numbers) {
+        packed.clear();
+        back.clear();
+        if (!protocol::fromJson(n[0], packed) || !protocol::toJson((const uint8_t*)packed.data(), packed.size(), back) ||
+            back != n[1]) {
+            fprintf(stderr, "number %s came back as %s\n", n[0], back.c_str());
+            ok = false;
+        }
+    }
+    for (const char* bad : { "{\"n\":-}", "{\"n\":1e}", "{\"n\":1.2.3}", "{\"n\":--1}" }) {
+        if (protocol::fromJson(bad, packed)) {
+            fprintf(stderr, "malformed number accepted: %s\n", bad);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// The same messages written in either mode and fed back in random-sized
+// chunks, down to single bytes.
+bool verifyChunkedDecode() {
+    std::mt19937 rng(34);
+    std::vector<std::string> messages;
+    for (int i = 0; i < 2000; ++i) messages.push_back(kSamples[rng() % 5]);
+
+    std::string lines, frames(protocol::kPreamble, sizeof(protocol::kPreamble));
+    for (const std::string& json : messages) {
+        lines += json + ((rng() & 1) ? "\r\n" : "\n");
+        std::string packed;
+        protocol::MessageType type;
+        protocol::fromJson(json, packed, &type);
+        protocol::appendFrame(frames, type, packed);
+    }
+
+    bool ok = true;
+    for (int maxChunk : { 1, 7, 4096 }) {
+        protocol::LineDecoder lineDecoder;
+        protocol::FrameDecoder frameDecoder;
+        size_t lineCount = 0, frameCount = 0;
+        for (size_t pos = 0; pos < lines.size();) {
+            size_t n = std::min<size_t>(1 + rng() % maxChunk, lines.size() - pos);
+            lineDecoder.feed(lines.data() + pos, n);
+            pos += n;
+            std::string_view line;
+            while (lineDecoder.next(line)) {
+                if (lineCount >= messages.size() || line != messages[lineCount]) ok = false;
+                ++lineCount;
+            }
+        }
+        for (size_t pos = 0; pos < frames.size();) {
+            size_t n = std::min<size_t>(1 + rng() % maxChunk, frames.size() - pos);
+            frameDecoder.feed(frames.data() + pos, n);
+            pos += n;
+            protocol::Frame frame;
+            while (frameDecoder.next(frame)) {
+                std::string json;
+                if (frameCount >= messages.size() || !protocol::toJson(frame.payload, frame.size, json) ||
+                    json != messages[frameCount])
+                    ok = false;
+                ++frameCount;
+            }
+        }
+        if (!ok || lineCount != messages.size() || frameCount != messages.size() || frameDecoder.failed()) {
+            fprintf(stderr, "chunks of up to %d bytes: %zu lines, %zu frames of %zu\n", maxChunk, lineCount,
+                    frameCount, messages.size());
+            ok = false;
+        }
+    }
+
+    protocol::FrameDecoder garbage;
+    garbage.feed(kSamples[0], 16);
+    protocol::Frame frame;
+    if (garbage.next(frame) || !garbage.failed()) {
+        fprintf(stderr, "JSON accepted as a frame stream\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// The webcam helper's most frequent message, encoded the way it is sent.
+void encodePreviewFrame(protocol::Encoder& msg, uint64_t frame) {
+    msg.clear();
+    msg.beginMap();
+    msg.field("type", "preview_frame");
+    msg.field("frame", frame);
+    msg.field("slot", (int)(frame % 3));
+    msg.endMap();
+}
+
+std::string readAll(FILE* f) {
+    std::string data;
+    fseek(f, 0, SEEK_END);
+    data.resize((size_t)ftell(f));
+    fseek(f, 0, SEEK_SET);
+    data.resize(fread(&data[0], 1, data.size(), f));
+    return data;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// A multiplexed Output with only the battery subscribed: battery and None
+// messages come out tagged with their channel, usb ones are filtered, and an
+// unsubscribed channel stops mid-stream.
+bool verifyChannels() {
+    bool ok = true;
+    for (protocol::Mode mode : { protocol::Mode::JsonLines, protocol::Mode::Binary }) {
+        FILE* f = tmpfile();
+        if (!f) continue;
+        protocol::OutputStats st;
+        {
+            protocol::Output out(mode, f, 64, true);
+            out.subscribe(protocol::Channel::Battery, true);
+            out.sendJson(kSamples[4], protocol::MessageType::PowerStatus, protocol::Channel::Battery);
+            out.sendJson("{\"type\":\"device_list\",\"devices\":[]}", protocol::MessageType::DeviceList, protocol::Channel::Usb);
+            out.sendJson("{}", protocol::MessageType::Generic, protocol::Channel::Battery);
+            out.sendJson("{\"type\":\"modules\"}");
+            out.subscribe(protocol::Channel::Battery, false);
+            out.sendJson(kSamples[4], protocol::MessageType::PowerStatus, protocol::Channel::Battery);
+            out.flush();
+            st = out.stats();
+        }
+        std::string data = readAll(f);
+        fclose(f);
+
+        std::vector<std::string> got;
+        if (mode == protocol::Mode::Binary) {
+            protocol::FrameDecoder decoder;
+            decoder.feed(data.data(), data.size());
+            protocol::Frame frame;
+            while (decoder.next(frame)) {
+                std::string json = protocol::channelName(frame.channel);
+                json += ' ';
+                protocol::toJson(frame.payload, frame.size, json);
+                got.push_back(json);
+            }
+            if (data.compare(0, 4, protocol::kChannelPreamble, 4) != 0 || decoder.failed()) ok = false;
+        } else {
+            protocol::LineDecoder decoder;
+            decoder.feed(data.data(), data.size());
+            std::string_view line;
+            while (decoder.next(line)) got.push_back(std::string(line));
+        }
+        std::vector<std::string> want;
+        if (mode == protocol::Mode::Binary) {
+            want = { std::string("battery ") + kSamples[4], "battery {}", " {\"type\":\"modules\"}" };
+        } else {
+            want = { std::string("{\"channel\":\"battery\",") + (kSamples[4] + 1), "{\"channel\":\"battery\"}",
+                     "{\"type\":\"modules\"}" };
+        }
+        if (got != want || st.filtered != 2 || st.written != 3) {
+            fprintf(stderr, "%s channels: %zu messages, %llu filtered\n",
+                    mode == protocol::Mode::Binary ? "binary" : "json", got.size(), (unsigned long long)st.filtered);
+            for (const std::string& g : got) fprintf(stderr, "  %s\n", g.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// A host that is not reading while snapshots churn: each snapshot of a type
+// and channel keeps one place in the queue however often it is replaced, the
+// same type on another channel keeps its own, and the messages sent in
+// between are neither pushed out nor reordered.
+bool verifySnapshots() {
+    FILE* f = tmpfile();
+    if (!f) return true;
+    protocol::OutputStats st;
+    char json[96];
+    {
+        protocol::Output out(protocol::Mode::JsonLines, f, 5, true);
+        for (protocol::Channel c : { protocol::Channel::Webcam, protocol::Channel::Usb, protocol::Channel::Battery })
+            out.subscribe(c, true);
+        protocol::Output::Batch batch(out);
+        for (int i = 0; i <= 1000; ++i) {
+            snprintf(json, sizeof(json), "{\"type\":\"preview_frame\",\"frame\":%d}", i);
+            out.sendJson(json, protocol::MessageType::PreviewFrame, protocol::Channel::Webcam);
+            snprintf(json, sizeof(json), "{\"type\":\"device_list\",\"version\":%d}", i);
+            out.sendJson(json, protocol::MessageType::DeviceList, protocol::Channel::Usb);
+            snprintf(json, sizeof(json), "{\"type\":\"device_list\",\"version\":%d}", i * 7);
+            out.sendJson(json, protocol::MessageType::DeviceList, protocol::Channel::Battery);
+            if (i == 10 || i == 500) {
+                snprintf(json, sizeof(json), "{\"type\":\"file_saved\",\"n\":%d}", i);
+                out.sendJson(json, protocol::MessageType::FileSaved, protocol::Channel::Webcam);
+            }
+        }
+        out.sendJson("{\"type\":\"status\"}", protocol::MessageType::Status, protocol::Channel::Webcam);
+        st = out.stats();
+    }
+    std::string data = readAll(f);
+    fclose(f);
+
+    std::vector<std::string> want = {
+        "{\"channel\":\"webcam\",\"type\":\"preview_frame\",\"frame\":1000}",
+        "{\"channel\":\"usb\",\"type\":\"device_list\",\"version\":1000}",
+        "{\"channel\":\"battery\",\"type\":\"device_list\",\"version\":7000}",
+        "{\"channel\":\"webcam\",\"type\":\"file_saved\",\"n\":10}",
+        "{\"channel\":\"webcam\",\"type\":\"file_saved\",\"n\":500}",
+    };
+    std::vector<std::string> got;
+    protocol::LineDecoder decoder;
+    decoder.feed(data.data(), data.size());
+    std::string_view line;
+    while (decoder.next(line)) got.push_back(std::string(line));
+    if (got != want || st.dropped != 1 || st.maxDepth != 5) {
+        fprintf(stderr, "snapshots: %llu dropped, max depth %zu\n", (unsigned long long)st.dropped, st.maxDepth);
+        for (const std::string& g : got) fprintf(stderr, "  %s\n", g.c_str());
+        return false;
+    }
+    return true;
+}
+
+void benchMode(protocol::Mode mode, const char* name) {
+    const int count = 200000;
+    FILE* f = tmpfile();
+    if (!f) return;
+    std::string prefix = name;
+    protocol::Encoder msg;
+
+    // Writer: encode, queue and write until everything is out. Sent as
+    // Generic so that none of them are coalesced away; the queue is sized so
+    // none are dropped.
+    {
+        protocol::Output out(mode, f, count);
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i) {
+            encodePreviewFrame(msg, i);
+            out.send(protocol::MessageType::Generic, msg);
+        }
+        out.flush();
+        bench::report("protocol", prefix + "_send", "msgs_per_s", count / secondsSince(t0));
+
+        // The same messages batched, as segment_closed and its evictions are.
+        t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i += 64) {
+            protocol::Output::Batch batch(out);
+            for (int j = 0; j < 64; ++j) {
+                encodePreviewFrame(msg, i + j);
+                out.send(protocol::MessageType::Generic, msg);
+            }
+        }
+        out.flush();
+        bench::report("protocol", prefix + "_send_batched", "msgs_per_s", count / secondsSince(t0));
+        protocol::OutputStats st = out.stats();
+        bench::report("protocol", prefix + "_msgs_per_write", "count", (double)st.written / st.writes);
+    }
+
+    // Reader: split the stream back into messages in 64 KB pipe-sized reads.
+    std::string data = readAll(f);
+    fclose(f);
+    const size_t chunk = 64 * 1024;
+    size_t messages = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    if (mode == protocol::Mode::Binary) {
+        protocol::FrameDecoder decoder;
+        protocol::Frame frame;
+        for (size_t pos = 0; pos < data.size(); pos += chunk) {
+            decoder.feed(data.data() + pos, std::min(chunk, data.size() - pos));
+            while (decoder.next(frame)) ++messages;
+        }
+    } else {
+        protocol::LineDecoder decoder;
+        std::string_view line;
+        for (size_t pos = 0; pos < data.size(); pos += chunk) {
+            decoder.feed(data.data() + pos, std::min(chunk, data.size() - pos));
+            while (decoder.next(line)) ++messages;
+        }
+    }
+    double s = secondsSince(t0);
+    bench::report("protocol", prefix + "_decode", "msgs_per_s", messages / s);
+    bench::report("protocol", prefix + "_decode", "mb_per_s", data.size() / s / 1e6);
+    bench::report("protocol", prefix + "_bytes_per_msg", "bytes", messages ? (double)data.size() / messages : 0);
+}
+
+// Four threads send into a pipe whose reader takes a millisecond per 4 KB.
+// Producers must not wait for it; what reaches the reader must be whole
+// messages in each producer's order; the newest device_list must arrive.
+bool verifySlowConsumer() {
+    int fds[2];
+#if defined(_WIN32)
+    if (_pipe(fds, 1 << 16, _O_BINARY) != 0) return true;
+    FILE* w = _fdopen(fds[1], "wb");
+#else
+    if (pipe(fds) != 0) return true;
+    FILE* w = fdopen(fds[1], "wb");
+#endif
+    if (!w) return true;
+
+    std::string received;
+    std::thread reader([&] {
+        char buf[4096];
+        for (;;) {
+#if defined(_WIN32)
+            int n = _read(fds[0], buf, sizeof(buf));
+#else
+            ssize_t n = read(fds[0], buf, sizeof(buf));
+#endif
+            if (n <= 0) break;
+            received.append(buf, (size_t)n);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    const int producers = 4, perProducer = 5000, snapshots = 500;
+    std::vector<std::vector<double>> latencies(producers);
+    protocol::OutputStats st;
+    {
+        protocol::Output out(protocol::Mode::JsonLines, w, 256);
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back([&, p] {
+                char json[128];
+                for (int i = 0; i < perProducer; ++i) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    snprintf(json, sizeof(json), "{\"type\":\"log\",\"producer\":%d,\"seq\":%d}", p, i);
+                    out.sendJson(json);
+                    if (p == 0 && i % (perProducer / snapshots) == 0) {
+                        snprintf(json, sizeof(json), "{\"type\":\"device_list\",\"version\":%d}",
+                                 i / (perProducer / snapshots));
+                        out.sendJson(json, protocol::MessageType::DeviceList);
+                    }
+                    latencies[p].push_back(
+                        std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+                }
+            });
+        }
+        for (std::thread& t : threads) t.join();
+        out.flush();
+        st = out.stats();
+    }
+    fclose(w);
+    reader.join();
+#if defined(_WIN32)
+    _close(fds[0]);
+#else
+    close(fds[0]);
+#endif
+
+    bool ok = true;
+    std::vector<int> lastSeq(producers, -1);
+    int lastVersion = -1;
+    size_t lines = 0;
+    protocol::LineDecoder decoder;
+    decoder.feed(received.data(), received.size());
+    std::string_view line;
+    while (decoder.next(line)) {
+        ++lines;
+        int p, seq, version;
+        std::string text(line);
+        if (sscanf(text.c_str(), "{\"type\":\"log\",\"producer\":%d,\"seq\":%d}", &p, &seq) == 2 && p >= 0 &&
+            p < producers) {
+            if (seq <= lastSeq[p]) ok = false;
+            lastSeq[p] = seq;
+        } else if (sscanf(text.c_str(), "{\"type\":\"device_list\",\"version\":%d}", &version) == 1) {
+            if (version <= lastVersion) ok = false;
+            lastVersion = version;
+        } else {
+            fprintf(stderr, "torn message: %s\n", text.c_str());
+            ok = false;
+        }
+    }
+    if (!ok) fprintf(stderr, "messages out of order\n");
+    if (lastVersion != snapshots - 1) {
+        fprintf(stderr, "last device_list was version %d of %d\n", lastVersion, snapshots - 1);
+        ok = false;
+    }
+    if (lines != st.written || st.written + st.coalesced != st.queued) {
+        fprintf(stderr, "%zu lines; queued %llu, written %llu, coalesced %llu\n", lines,
+                (unsigned long long)st.queued, (unsigned long long)st.written, (unsigned long long)st.coalesced);
+        ok = false;
+    }
+
+    std::vector<double> all;
+    for (const std::vector<double>& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    bench::report("protocol", "slow_consumer_send_p99", "us", all[all.size() * 99 / 100]);
+    bench::report("protocol", "slow_consumer_send_max", "us", all.back());
+    bench::report("protocol", "slow_consumer_dropped", "count", (double)st.dropped);
+    bench::report("protocol", "slow_consumer_coalesced", "count", (double)st.coalesced);
+    bench::report("protocol", "slow_consumer_max_depth", "count", (double)st.maxDepth);
+    bench::report("protocol", "slow_consumer_msgs_per_write", "count", (double)st.written / st.writes);
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    bool ok = verifyRoundTrip();
+    ok = verifyChunkedDecode() && ok;
+    ok = verifyChannels() && ok;
+    ok = verifySnapshots() && ok;
+    ok = verifySlowConsumer() && ok;
+
+    benchMode(protocol::Mode::JsonLines, "json_lines");
+    benchMode(protocol::Mode::Binary, "binary");
+
+    // Existing call sites that still build JSON text and convert it.
+    std::string packed;
+    bench::Timing transcode = bench::measure([&] { protocol::fromJson(kSamples[1], packed); });
+    bench::report("protocol", "transcode_segment_closed", "us", transcode.medianNs / 1e3, transcode);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,24 @@
+# Runs the benchmark programs and writes their results to OUTPUT, one JSON
+# object per line. Invoked by the bench target; BENCHES is '|'-separated.
+
+string(REPLACE "|" ";" BENCHES "${BENCHES}")
+string(TIMESTAMP started "%Y-%m-%dT%H:%M:%SZ" UTC)
+file(WRITE "${OUTPUT}"
+    "{\"suite\":\"meta\",\"case\":\"build\",\"version\":\"${VERSION}\",\"compiler\":\"${COMPILER}\","
+    "\"build_type\":\"${BUILD_TYPE}\",\"system\":\"${SYSTEM}\",\"started\":\"${started}\"}\n")
+
+set(failed)
+foreach(program ${BENCHES})
+    get_filename_component(name "${program}" NAME_WE)
+    message(STATUS "Running ${name}")
+    execute_process(COMMAND "${program}" OUTPUT_VARIABLE results RESULT_VARIABLE rc)
+    file(APPEND "${OUTPUT}" "${results}")
+    if(NOT rc EQUAL 0)
+        list(APPEND failed "${name}")
+    endif()
+endforeach()
+
+if(failed)
+    message(FATAL_ERROR "Failed checks in: ${failed} (results so far in ${OUTPUT})")
+endif()
+message(STATUS "Results in ${OUTPUT}")
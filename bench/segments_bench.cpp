@@ -0,0 +1,137 @@
+#include "bench.h"
+#include "../ui/src/lab4/segments.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+// Simulates a days-long continuous recording against a small quota: the
+// files on disk must stay under the quota (plus the newest segment), the
+// store must not grow with the number of segments, and a restart must pick
+// up the segments already on disk, oldest first. Recordings on several
+// cameras share the quota: a later one cannot change or clear it.
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string writeSegment(const fs::path& dir, int n, size_t bytes) {
+    char name[64];
+    snprintf(name, sizeof(name), "segment_%06d.mp4", n);
+    std::string path = (dir / name).string();
+    FILE* f = fopen(path.c_str(), "wb");
+    std::vector<char> data(bytes, 'x');
+    if (f) {
+        fwrite(data.data(), 1, data.size(), f);
+        fclose(f);
+    }
+    return path;
+}
+
+uint64_t bytesOnDisk(const fs::path& dir) {
+    uint64_t total = 0;
+    for (const auto& e : fs::directory_iterator(dir)) total += e.file_size();
+    return total;
+}
+
+bool verifySharedQuota() {
+    bool ok = true;
+    bool adopt = false;
+    segments::Store store;
+    if (!store.attach(1000, adopt) || !adopt || store.quota() != 1000) {
+        fprintf(stderr, "shared quota: first recording did not set the quota\n");
+        ok = false;
+    }
+    store.add({ "no/such/segment_a.mp4", 400 });
+    if (!store.attach(0, adopt) || adopt || store.quota() != 1000) {
+        fprintf(stderr, "shared quota: a recording without one changed the quota\n");
+        ok = false;
+    }
+    if (store.attach(2000, adopt)) {
+        fprintf(stderr, "shared quota: a conflicting quota was accepted\n");
+        ok = false;
+        store.detach();
+    }
+    store.setQuota(0);
+    if (store.quota() != 1000 || store.totalBytes() != 400) {
+        fprintf(stderr, "shared quota: cleared while recordings run\n");
+        ok = false;
+    }
+    store.detach();
+    store.detach();
+    if (store.recordings() != 0 || !store.attach(0, adopt) || adopt || store.quota() != 0 || store.count() != 0) {
+        fprintf(stderr, "shared quota: not reset once every recording stopped\n");
+        ok = false;
+    }
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    fs::path dir = fs::temp_directory_path() / "segments_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    // A day of one-minute segments, scaled down to a few KB each.
+    const uint64_t quota = 256 * 1024;
+    const size_t maxSegment = 6144;
+    const int segmentsPerDay = 1440;
+    std::mt19937 rng(21);
+    segments::Store store(quota);
+    bool ok = verifySharedQuota();
+    int n = 0;
+    size_t maxEntries = 0;
+    uint64_t deleted = 0;
+    std::string newest;
+
+    auto closeSegment = [&] {
+        segments::Segment s;
+        s.path = newest = writeSegment(dir, n++, 2048 + rng() % (maxSegment - 2048));
+        s.bytes = segments::fileSize(s.path);
+        deleted += store.add(s).size();
+        maxEntries = std::max(maxEntries, store.count());
+    };
+
+    for (int day = 0; day < 3; ++day) {
+        for (int i = 0; i < segmentsPerDay; ++i) closeSegment();
+        uint64_t disk = bytesOnDisk(dir);
+        if (disk > quota + maxSegment || disk != store.totalBytes()) {
+            fprintf(stderr, "day %d: %llu bytes on disk, store counts %llu, quota %llu\n", day,
+                    (unsigned long long)disk, (unsigned long long)store.totalBytes(), (unsigned long long)quota);
+            ok = false;
+        }
+    }
+    // Steady state: every close writes a file and deletes one or two.
+    bench::Timing add = bench::measure(closeSegment);
+    bench::report("segments", "close_with_eviction", "us", add.medianNs / 1e3, add);
+    bench::report("segments", "max_tracked_segments", "count", (double)maxEntries);
+    bench::report("segments", "deleted_segments", "count", (double)deleted);
+    if (maxEntries > quota / 2048 + 1) {
+        fprintf(stderr, "store grew to %zu entries\n", maxEntries);
+        ok = false;
+    }
+
+    // Restart: a fresh store with half the quota adopts what is on disk and
+    // trims it from the oldest end.
+    segments::Store restarted(quota / 2);
+    restarted.scan(dir.string(), "segment_", ".mp4");
+    uint64_t disk = bytesOnDisk(dir);
+    bench::report("segments", "restart_adopted", "count", (double)restarted.count());
+    if (disk > quota / 2 + maxSegment || disk != restarted.totalBytes()) {
+        fprintf(stderr, "restart: %llu bytes on disk, store counts %llu\n", (unsigned long long)disk,
+                (unsigned long long)restarted.totalBytes());
+        ok = false;
+    }
+    if (!fs::exists(newest)) {
+        fprintf(stderr, "restart: deleted the newest segment\n");
+        ok = false;
+    }
+
+    fs::remove_all(dir);
+    return ok ? 0 : 1;
+}
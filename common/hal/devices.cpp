@@ -0,0 +1,154 @@
+#include "devices.h"
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+namespace hal {
+
+bool idsEqual(const std::string& a, const std::string& b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char c1, char c2) {
+        return tolower((unsigned char)c1) == tolower((unsigned char)c2);
+    });
+}
+
+namespace {
+
+enum Kind : uint8_t {
+    kList = 1,  // uvar count, then per device str id, str name, str type, str path
+    kEvent = 2, // u8 DeviceEvent, svar event time on the backend's clock
+    kEject = 3, // str id, u8 EjectResult
+};
+
+class RecordingDevices : public Devices {
+public:
+    RecordingDevices(std::unique_ptr<Devices> machine, std::shared_ptr<TraceWriter> writer)
+        : inner(std::move(machine)), trace(std::move(writer)) {}
+
+    std::vector<Device> list() override {
+        std::vector<Device> devices = inner->list();
+        Packer payload;
+        payload.uvar(devices.size());
+        for (const Device& d : devices) payload.str(d.id).str(d.name).str(d.type).str(d.path);
+        trace->write(Channel::Devices, kList, payload);
+        return devices;
+    }
+
+    EjectResult eject(const std::string& id) override {
+        EjectResult result = inner->eject(id);
+        Packer payload;
+        payload.str(id).u8((uint8_t)result);
+        trace->write(Channel::Devices, kEject, payload);
+        return result;
+    }
+
+    void watch(const std::function<void(DeviceEvent, int64_t)>& onEvent) override {
+        Packer payload;
+        inner->watch([&](DeviceEvent event, int64_t timeNs) {
+            payload.clear();
+            payload.u8((uint8_t)event).svar(timeNs);
+            trace->write(Channel::Devices, kEvent, payload);
+            onEvent(event, timeNs);
+        });
+    }
+
+    void stop() override { inner->stop(); }
+
+    int64_t nowNs() override { return inner->nowNs(); }
+
+private:
+    std::unique_ptr<Devices> inner;
+    std::shared_ptr<TraceWriter> trace;
+};
+
+// Lists, ejects and events each have their own reader, so the threads that
+// ask for them do not depend on one another's progress. Event times are
+// replaced by the replay clock's, which keeps the gaps between them.
+class ReplayDevices : public Devices {
+public:
+    explicit ReplayDevices(Speed speed) : clock(speed) {}
+
+    bool open(const std::string& path) { return lists.open(path) && ejects.open(path) && events.open(path); }
+
+    std::vector<Device> list() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        Record rec;
+        while (lists.next(Channel::Devices, rec)) {
+            if (rec.kind != kList) continue;
+            Unpacker in(rec.payload);
+            std::vector<Device> devices((size_t)in.uvar());
+            for (Device& d : devices) {
+                d.id = in.str();
+                d.name = in.str();
+                d.type = in.str();
+                d.path = in.str();
+            }
+            if (in.ok()) last = std::move(devices);
+            break;
+        }
+        return last;
+    }
+
+    EjectResult eject(const std::string&) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        Record rec;
+        while (ejects.next(Channel::Devices, rec)) {
+            if (rec.kind != kEject) continue;
+            Unpacker in(rec.payload);
+            in.str();
+            EjectResult result = (EjectResult)in.u8();
+            return in.ok() ? result : EjectResult::NotFound;
+        }
+        return EjectResult::NotFound;
+    }
+
+    void watch(const std::function<void(DeviceEvent, int64_t)>& onEvent) override {
+        Record rec;
+        while (events.next(Channel::Devices, rec)) {
+            if (rec.kind != kEvent) continue;
+            Unpacker in(rec.payload);
+            DeviceEvent event = (DeviceEvent)in.u8();
+            if (!in.ok()) continue;
+            if (!clock.waitUntil(rec.timeNs)) return;
+            onEvent(event, rec.timeNs);
+        }
+    }
+
+    void stop() override { clock.cancel(); }
+
+    int64_t nowNs() override { return clock.nowNs(); }
+
+private:
+    ReplayClock clock;
+    std::mutex mutex;
+    TraceReader lists;
+    TraceReader ejects;
+    TraceReader events;
+    std::vector<Device> last;
+};
+
+} // namespace
+
+#if !defined(_WIN32)
+std::unique_ptr<Devices> systemDevices() {
+    return nullptr;
+}
+#endif
+
+std::unique_ptr<Devices> recordDevices(std::unique_ptr<Devices> inner, std::shared_ptr<TraceWriter> trace) {
+    if (!inner || !trace) return inner;
+    return std::unique_ptr<Devices>(new RecordingDevices(std::move(inner), std::move(trace)));
+}
+
+std::unique_ptr<Devices> replayDevices(const std::string& path, Speed speed) {
+    std::unique_ptr<ReplayDevices> devices(new ReplayDevices(speed));
+    if (!devices->open(path)) return nullptr;
+    return std::unique_ptr<Devices>(devices.release());
+}
+
+std::unique_ptr<Devices> openDevices(const TraceOptions& options) {
+    if (options.replaying()) return replayDevices(options.replay, options.speed);
+    return recordDevices(systemDevices(), options.recorder);
+}
+
+} // namespace hal
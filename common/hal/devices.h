@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+// Removable devices and their arrival and removal (lab5).
+
+namespace hal {
+
+struct Device {
+    std::string id;   // PnP instance id
+    std::string name;
+    std::string type; // "DISK" or "MOUSE"
+    std::string path; // drive letter of a volume on this disk, "E:"; empty otherwise
+};
+
+// PnP instance ids name the same device whatever their case.
+bool idsEqual(const std::string& a, const std::string& b);
+
+enum class DeviceEvent : uint8_t {
+    Arrival = 1,
+    QueryRemove,       // the system asks whether a device may go
+    QueryRemoveFailed, // and something refused
+    RemoveComplete,
+};
+
+enum class EjectResult : uint8_t {
+    Ejected = 1,
+    Busy,
+    NotFound,
+};
+
+class Devices {
+public:
+    virtual ~Devices() = default;
+    // USB disks and pointing devices present now. Thread-safe.
+    virtual std::vector<Device> list() = 0;
+    // Asks the system to eject a disk (or the hub it hangs off). Thread-safe.
+    virtual EjectResult eject(const std::string& id) = 0;
+    // Calls onEvent for each change, on the calling thread, until the backend
+    // has no more (never for the machine, at the end of the trace for a
+    // replay) or stop() is called. Call at most once.
+    virtual void watch(const std::function<void(DeviceEvent event, int64_t timeNs)>& onEvent) = 0;
+    // Makes watch() return soon, or at once if it starts later. Thread-safe.
+    virtual void stop() = 0;
+    // Now on the clock event times are on.
+    virtual int64_t nowNs() = 0;
+};
+
+// Setup API enumeration and device notifications, or null where there is no
+// backend.
+std::unique_ptr<Devices> systemDevices();
+std::unique_ptr<Devices> recordDevices(std::unique_ptr<Devices> inner, std::shared_ptr<TraceWriter> trace);
+// Events come back at their recorded times; the n-th list() or eject() gets
+// the n-th recorded answer (a list past the last one repeats it). Null if the
+// trace cannot be read.
+std::unique_ptr<Devices> replayDevices(const std::string& path, Speed speed);
+
+std::unique_ptr<Devices> openDevices(const TraceOptions& options);
+
+} // namespace hal
@@ -0,0 +1,243 @@
+#if defined(_WIN32)
+
+#include "devices.h"
+
+#include <windows.h>
+#include <winioctl.h>
+#include <dbt.h>
+#include <setupapi.h>
+#include <cfgmgr32.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+namespace hal {
+
+namespace {
+
+const GUID GUID_DEVINTERFACE_DISK = { 0x53f56307, 0xb6bf, 0x11d0, { 0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b } };
+const GUID GUID_DEVINTERFACE_MOUSE = { 0x378de44c, 0x56ef, 0x11d1, { 0xbc, 0x8c, 0x00, 0xa0, 0xc9, 0x14, 0x05, 0xdd } };
+
+std::string GetProperty(DEVINST devInst, ULONG property) {
+    char buffer[1024];
+    ULONG len = sizeof(buffer);
+    if (CM_Get_DevNode_Registry_PropertyA(devInst, property, NULL, (PBYTE)buffer, &len, 0) == CR_SUCCESS) {
+        return std::string(buffer);
+    }
+    return "";
+}
+
+std::string GetDetailedName(DEVINST devInst) {
+    std::string name = GetProperty(devInst, CM_DRP_FRIENDLYNAME);
+    if (!name.empty()) return name;
+    name = GetProperty(devInst, CM_DRP_DEVICEDESC);
+
+    if (name == "USB Input Device" || name.find("HID") != std::string::npos || name == "Disk drive" || name == "USB Mass Storage Device") {
+        DEVINST parentInst;
+        if (CM_Get_Parent(&parentInst, devInst, 0) == CR_SUCCESS) {
+            std::string parentName = GetProperty(parentInst, CM_DRP_FRIENDLYNAME);
+            if (!parentName.empty() && parentName != "USB Composite Device") return parentName;
+        }
+    }
+    return name.empty() ? "Unknown Device" : name;
+}
+
+// The storage device number of a disk or of the disk a volume is on, or -1.
+// Opened without access rights: the ioctl needs none, and a locked or busy
+// volume still answers.
+long DiskNumber(const char* path) {
+    HANDLE h = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) return -1;
+    STORAGE_DEVICE_NUMBER number = {};
+    DWORD bytes = 0;
+    BOOL ok = DeviceIoControl(h, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &number, sizeof(number), &bytes, NULL);
+    CloseHandle(h);
+    return ok && number.DeviceType == FILE_DEVICE_DISK ? (long)number.DeviceNumber : -1;
+}
+
+// The first drive letter of each disk that has one, by disk number. A volume
+// spanning disks answers for none of them.
+std::map<long, std::string> DriveLetters() {
+    std::map<long, std::string> letters;
+    DWORD drives = GetLogicalDrives();
+    for (int i = 0; i < 26; i++) {
+        if (!(drives & (1 << i))) continue;
+        std::string drive = std::string(1, (char)('A' + i)) + ":";
+        UINT kind = GetDriveTypeA((drive + "\\").c_str());
+        if (kind != DRIVE_REMOVABLE && kind != DRIVE_FIXED) continue;
+        long disk = DiskNumber(("\\\\.\\" + drive).c_str());
+        if (disk >= 0 && !letters.count(disk)) letters[disk] = drive;
+    }
+    return letters;
+}
+
+// The drive letter of a disk interface's volume, or empty.
+std::string GetDriveLetter(HDEVINFO hDevInfo, SP_DEVINFO_DATA& devInfo, const GUID& guid,
+                           const std::map<long, std::string>& letters) {
+    SP_DEVICE_INTERFACE_DATA iface = {};
+    iface.cbSize = sizeof(iface);
+    if (!SetupDiEnumDeviceInterfaces(hDevInfo, &devInfo, &guid, 0, &iface)) return "";
+    DWORD size = 0;
+    SetupDiGetDeviceInterfaceDetailA(hDevInfo, &iface, NULL, 0, &size, NULL);
+    if (size < sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A)) return "";
+    std::vector<char> buffer(size);
+    SP_DEVICE_INTERFACE_DETAIL_DATA_A* detail = (SP_DEVICE_INTERFACE_DETAIL_DATA_A*)buffer.data();
+    detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+    if (!SetupDiGetDeviceInterfaceDetailA(hDevInfo, &iface, detail, size, NULL, NULL)) return "";
+    auto it = letters.find(DiskNumber(detail->DevicePath));
+    return it == letters.end() ? "" : it->second;
+}
+
+// Adds the present USB devices of one interface class; pointing devices may
+// also be HID ones. A disk gets the drive letter of its own volume.
+void Enumerate(const GUID& guid, const char* type, bool disk, std::vector<Device>& devices) {
+    HDEVINFO hDevInfo = SetupDiGetClassDevs(&guid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (hDevInfo == INVALID_HANDLE_VALUE) return;
+    std::map<long, std::string> letters;
+    if (disk) letters = DriveLetters();
+    SP_DEVINFO_DATA spDevInfoData;
+    spDevInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+    for (int i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &spDevInfoData); i++) {
+        char buf[1024];
+        if (CM_Get_Device_IDA(spDevInfoData.DevInst, buf, 1024, 0) == CR_SUCCESS) {
+            std::string devId = buf;
+            bool usb = devId.find("USB") != std::string::npos;
+            if (usb || (!disk && devId.find("HID") != std::string::npos)) {
+                Device dev;
+                dev.id = devId;
+                dev.name = GetDetailedName(spDevInfoData.DevInst);
+                dev.type = type;
+                if (disk) dev.path = GetDriveLetter(hDevInfo, spDevInfoData, guid, letters);
+                devices.push_back(dev);
+            }
+        }
+    }
+    SetupDiDestroyDeviceInfoList(hDevInfo);
+}
+
+bool AttemptEject(DEVINST devInst) {
+    PNP_VETO_TYPE vetoType = PNP_VetoTypeUnknown;
+    char vetoName[MAX_PATH];
+
+    CONFIGRET res = CM_Request_Device_EjectA(devInst, &vetoType, vetoName, MAX_PATH, 0);
+    if (res == CR_SUCCESS) return true;
+
+    DEVINST parentInst;
+    if (CM_Get_Parent(&parentInst, devInst, 0) == CR_SUCCESS) {
+        return AttemptEject(parentInst);
+    }
+    return false;
+}
+
+int64_t SteadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The window procedure has no context argument; there is one watcher per
+// process.
+const std::function<void(DeviceEvent, int64_t)>* watcher = nullptr;
+
+LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    if (msg == WM_DEVICECHANGE && watcher) {
+        int64_t now = SteadyNs();
+        switch (wParam) {
+            case DBT_DEVICEARRIVAL: (*watcher)(DeviceEvent::Arrival, now); break;
+            case DBT_DEVICEQUERYREMOVE: (*watcher)(DeviceEvent::QueryRemove, now); break;
+            case DBT_DEVICEQUERYREMOVEFAILED: (*watcher)(DeviceEvent::QueryRemoveFailed, now); break;
+            case DBT_DEVICEREMOVECOMPLETE: (*watcher)(DeviceEvent::RemoveComplete, now); break;
+        }
+    } else if (msg == WM_DESTROY) {
+        // stop() closed the window; the message loop in watch() ends.
+        PostQuitMessage(0);
+    }
+    return DefWindowProc(hwnd, msg, wParam, lParam);
+}
+
+class SystemDevices : public Devices {
+public:
+    std::vector<Device> list() override {
+        std::vector<Device> devices;
+        Enumerate(GUID_DEVINTERFACE_DISK, "DISK", true, devices);
+        Enumerate(GUID_DEVINTERFACE_MOUSE, "MOUSE", false, devices);
+        return devices;
+    }
+
+    EjectResult eject(const std::string& id) override {
+        HDEVINFO hDevInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_DISK, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+        if (hDevInfo == INVALID_HANDLE_VALUE) return EjectResult::NotFound;
+
+        SP_DEVINFO_DATA spDevInfoData;
+        spDevInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+        EjectResult result = EjectResult::NotFound;
+
+        for (int i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &spDevInfoData); i++) {
+            char buf[1024];
+            if (CM_Get_Device_IDA(spDevInfoData.DevInst, buf, 1024, 0) == CR_SUCCESS && idsEqual(id, std::string(buf))) {
+                result = AttemptEject(spDevInfoData.DevInst) ? EjectResult::Ejected : EjectResult::Busy;
+                break;
+            }
+        }
+        SetupDiDestroyDeviceInfoList(hDevInfo);
+        return result;
+    }
+
+    void watch(const std::function<void(DeviceEvent, int64_t)>& onEvent) override {
+        WNDCLASSEX wx = {};
+        wx.cbSize = sizeof(WNDCLASSEX);
+        wx.lpfnWndProc = WndProc;
+        wx.lpszClassName = "USBMonitorClass";
+        RegisterClassEx(&wx);
+        HWND hwnd = CreateWindowEx(0, "USBMonitorClass", "USB Monitor", 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!hwnd || stopping) {
+                if (hwnd) DestroyWindow(hwnd);
+                return;
+            }
+            window = hwnd;
+        }
+        watcher = &onEvent;
+
+        DEV_BROADCAST_DEVICEINTERFACE notificationFilter = {};
+        notificationFilter.dbcc_size = sizeof(DEV_BROADCAST_DEVICEINTERFACE);
+        notificationFilter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+
+        notificationFilter.dbcc_classguid = GUID_DEVINTERFACE_MOUSE;
+        HDEVNOTIFY mice = RegisterDeviceNotification(hwnd, &notificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE);
+
+        notificationFilter.dbcc_classguid = GUID_DEVINTERFACE_DISK;
+        HDEVNOTIFY disks = RegisterDeviceNotification(hwnd, &notificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE);
+
+        MSG msg;
+        while (GetMessage(&msg, NULL, 0, 0) > 0) { TranslateMessage(&msg); DispatchMessage(&msg); }
+        watcher = nullptr;
+        if (mice) UnregisterDeviceNotification(mice);
+        if (disks) UnregisterDeviceNotification(disks);
+        if (IsWindow(hwnd)) DestroyWindow(hwnd);
+        std::lock_guard<std::mutex> lock(mutex);
+        window = NULL;
+    }
+
+    void stop() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        if (window) PostMessage(window, WM_CLOSE, 0, 0);
+    }
+
+    int64_t nowNs() override { return SteadyNs(); }
+
+private:
+    std::mutex mutex;
+    HWND window = NULL; // while watch() runs
+    bool stopping = false;
+};
+
+} // namespace
+
+std::unique_ptr<Devices> systemDevices() {
+    return std::unique_ptr<Devices>(new SystemDevices());
+}
+
+} // namespace hal
+
+#endif
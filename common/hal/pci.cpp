@@ -0,0 +1,146 @@
+#include "pci.h"
+#include "../metrics.h"
+
+#include <chrono>
+#include <unordered_map>
+
+namespace hal {
+
+namespace {
+
+enum Kind : uint8_t {
+    kRead = 1, // u8 bus, u8 device, u8 function, u8 offset, uvar value
+};
+
+uint32_t addressKey(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    return (uint32_t)bus << 24 | (uint32_t)device << 16 | (uint32_t)function << 8 | offset;
+}
+
+class RecordingPci : public PciConfig {
+public:
+    RecordingPci(std::unique_ptr<PciConfig> machine, std::shared_ptr<TraceWriter> writer)
+        : inner(std::move(machine)), trace(std::move(writer)) {}
+
+    uint32_t read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) override {
+        uint32_t value = inner->read32(bus, device, function, offset);
+        payload.clear();
+        payload.u8(bus).u8(device).u8(function).u8(offset).uvar(value);
+        trace->write(Channel::Pci, kRead, payload);
+        return value;
+    }
+
+private:
+    std::unique_ptr<PciConfig> inner;
+    std::shared_ptr<TraceWriter> trace;
+    Packer payload;
+};
+
+// Reads are looked up by address, so a scan in a different order still gets
+// the recorded values; at Original speed each is answered no sooner than it
+// was recorded.
+class ReplayPci : public PciConfig {
+public:
+    explicit ReplayPci(Speed speed) : clock(speed) {}
+
+    bool open(const std::string& path) {
+        TraceReader reader;
+        if (!reader.open(path)) return false;
+        Record rec;
+        while (reader.next(Channel::Pci, rec)) {
+            if (rec.kind != kRead) continue;
+            Unpacker in(rec.payload);
+            uint8_t bus = in.u8(), device = in.u8(), function = in.u8(), offset = in.u8();
+            uint32_t value = (uint32_t)in.uvar();
+            if (in.ok()) reads.emplace(addressKey(bus, device, function, offset), Answer{ value, rec.timeNs });
+        }
+        return true;
+    }
+
+    uint32_t read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) override {
+        auto it = reads.find(addressKey(bus, device, function, offset));
+        if (it == reads.end()) return 0xffffffff;
+        clock.waitUntil(it->second.timeNs);
+        return it->second.value;
+    }
+
+private:
+    struct Answer {
+        uint32_t value;
+        int64_t timeNs;
+    };
+    ReplayClock clock;
+    std::unordered_map<uint32_t, Answer> reads;
+};
+
+} // namespace
+
+std::vector<PciFunction> enumeratePci(PciConfig& config) {
+    static metrics::Counter& scans = metrics::registry().counter("helper_pci_scans_total", "PCI bus scans.");
+    static metrics::Gauge& functions =
+        metrics::registry().gauge("helper_pci_functions", "PCI functions found by the last scan.");
+    static metrics::Histogram& took = metrics::registry().histogram("helper_pci_scan_seconds", "Time one PCI bus scan took.");
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<PciFunction> found;
+    for (int bus = 0; bus < 256; ++bus) {
+        for (int device = 0; device < 32; ++device) {
+            bool isMultiFunctionDevice = false;
+
+            for (int function = 0; function < 8; ++function) {
+                uint32_t value = config.read32((uint8_t)bus, (uint8_t)device, (uint8_t)function, 0x00);
+
+                if (value != 0xFFFFFFFF && value != 0x00000000) {
+                    if (function == 0) {
+                        uint32_t headerValue = config.read32((uint8_t)bus, (uint8_t)device, 0, 0x0C);
+                        if ((headerValue & 0x00800000) != 0) {
+                            isMultiFunctionDevice = true;
+                        }
+                    }
+
+                    PciFunction f;
+                    f.bus = (uint8_t)bus;
+                    f.device = (uint8_t)device;
+                    f.function = (uint8_t)function;
+                    f.vendorId = (uint16_t)(value & 0xFFFF);
+                    f.deviceId = (uint16_t)(value >> 16);
+                    found.push_back(f);
+
+                    if (!isMultiFunctionDevice) {
+                        break;
+                    }
+
+                } else if (function == 0) {
+                    break;
+                }
+            }
+        }
+    }
+    took.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    scans.add();
+    functions.set((double)found.size());
+    return found;
+}
+
+#if !defined(_WIN32)
+std::unique_ptr<PciConfig> systemPci() {
+    return nullptr;
+}
+#endif
+
+std::unique_ptr<PciConfig> recordPci(std::unique_ptr<PciConfig> inner, std::shared_ptr<TraceWriter> trace) {
+    if (!inner || !trace) return inner;
+    return std::unique_ptr<PciConfig>(new RecordingPci(std::move(inner), std::move(trace)));
+}
+
+std::unique_ptr<PciConfig> replayPci(const std::string& path, Speed speed) {
+    std::unique_ptr<ReplayPci> pci(new ReplayPci(speed));
+    if (!pci->open(path)) return nullptr;
+    return std::unique_ptr<PciConfig>(pci.release());
+}
+
+std::unique_ptr<PciConfig> openPci(const TraceOptions& options) {
+    if (options.replaying()) return replayPci(options.replay, options.speed);
+    return recordPci(systemPci(), options.recorder);
+}
+
+} // namespace hal
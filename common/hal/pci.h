@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+// PCI configuration space (lab2).
+
+namespace hal {
+
+class PciConfig {
+public:
+    virtual ~PciConfig() = default;
+    // The dword at offset (a multiple of 4) in a function's configuration
+    // space; 0xffffffff where nothing answers.
+    virtual uint32_t read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) = 0;
+};
+
+struct PciFunction {
+    uint8_t bus = 0;
+    uint8_t device = 0;
+    uint8_t function = 0;
+    uint16_t vendorId = 0;
+    uint16_t deviceId = 0;
+};
+
+// Every function present, by bus, device and function. Functions above 0 are
+// only probed on multi-function devices.
+std::vector<PciFunction> enumeratePci(PciConfig& config);
+
+// Port I/O on CF8/CFC through the giveio driver, or null if the driver is
+// not running or there is no backend.
+std::unique_ptr<PciConfig> systemPci();
+std::unique_ptr<PciConfig> recordPci(std::unique_ptr<PciConfig> inner, std::shared_ptr<TraceWriter> trace);
+// Answers every recorded read, and 0xffffffff to any other. Null if the
+// trace cannot be read.
+std::unique_ptr<PciConfig> replayPci(const std::string& path, Speed speed);
+
+std::unique_ptr<PciConfig> openPci(const TraceOptions& options);
+
+} // namespace hal
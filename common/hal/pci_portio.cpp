@@ -0,0 +1,64 @@
+#if defined(_WIN32)
+
+#include "pci.h"
+
+#include <windows.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace hal {
+
+namespace {
+
+#if defined(_MSC_VER)
+static inline void outpd(unsigned short port, unsigned int value) {
+    __outdword(port, value);
+}
+
+static inline unsigned int inpd(unsigned short port) {
+    return __indword(port);
+}
+#else
+static inline void outpd(unsigned short port, unsigned int value) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline unsigned int inpd(unsigned short port) {
+    unsigned int value;
+    __asm__ __volatile__("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+#endif
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration mechanism #1. The giveio handle is what grants this process
+// the I/O ports, so it stays open for as long as the backend lives.
+class PortIoPci : public PciConfig {
+public:
+    explicit PortIoPci(HANDLE giveIo) : handle(giveIo) {}
+    ~PortIoPci() override { CloseHandle(handle); }
+
+    uint32_t read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) override {
+        DWORD address = 0x80000000 | ((DWORD)bus << 16) | ((DWORD)device << 11) | ((DWORD)function << 8) | (offset & 0xFC);
+        outpd(PCI_CONFIG_ADDRESS, address);
+        return inpd(PCI_CONFIG_DATA);
+    }
+
+private:
+    HANDLE handle;
+};
+
+} // namespace
+
+std::unique_ptr<PciConfig> systemPci() {
+    HANDLE hGiveIo = CreateFile("\\\\.\\giveio", GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hGiveIo == INVALID_HANDLE_VALUE) return nullptr;
+    return std::unique_ptr<PciConfig>(new PortIoPci(hGiveIo));
+}
+
+} // namespace hal
+
+#endif
@@ -0,0 +1,110 @@
+#include "power.h"
+
+namespace hal {
+
+namespace {
+
+enum Kind : uint8_t {
+    kRead = 1,    // u8 ok, u8 acLine, u8 percent, uvar lifeTime, uvar fullLifeTime, str chemistry
+    kSuspend = 2, // u8 hibernate, u8 ok
+};
+
+class RecordingPower : public Power {
+public:
+    RecordingPower(std::unique_ptr<Power> machine, std::shared_ptr<TraceWriter> writer)
+        : inner(std::move(machine)), trace(std::move(writer)) {}
+
+    bool read(PowerStatus& status) override {
+        bool ok = inner->read(status);
+        payload.clear();
+        payload.u8(ok).u8(status.acLine).u8(status.batteryPercent);
+        payload.uvar(status.lifeTime).uvar(status.fullLifeTime).str(status.chemistry);
+        trace->write(Channel::Power, kRead, payload);
+        return ok;
+    }
+
+    bool suspend(bool hibernate) override {
+        bool ok = inner->suspend(hibernate);
+        payload.clear();
+        payload.u8(hibernate).u8(ok);
+        trace->write(Channel::Power, kSuspend, payload);
+        return ok;
+    }
+
+private:
+    std::unique_ptr<Power> inner;
+    std::shared_ptr<TraceWriter> trace;
+    Packer payload;
+};
+
+// Readings come back in order, each when it was taken. Suspend requests are
+// not replayed against the machine; they answer as the recorded ones did.
+class ReplayPower : public Power {
+public:
+    explicit ReplayPower(Speed speed) : clock(speed) {}
+
+    bool open(const std::string& path) { return reads.open(path) && suspends.open(path); }
+
+    bool read(PowerStatus& status) override {
+        Record rec;
+        while (reads.next(Channel::Power, rec)) {
+            if (rec.kind != kRead) continue;
+            clock.waitUntil(rec.timeNs);
+            Unpacker in(rec.payload);
+            bool ok = in.u8() != 0;
+            status.acLine = in.u8();
+            status.batteryPercent = in.u8();
+            status.lifeTime = (uint32_t)in.uvar();
+            status.fullLifeTime = (uint32_t)in.uvar();
+            status.chemistry = in.str();
+            return ok && in.ok();
+        }
+        done = true;
+        return false;
+    }
+
+    bool suspend(bool) override {
+        Record rec;
+        while (suspends.next(Channel::Power, rec)) {
+            if (rec.kind != kSuspend) continue;
+            Unpacker in(rec.payload);
+            in.u8();
+            return in.u8() != 0;
+        }
+        return false;
+    }
+
+    bool ended() const override { return done; }
+
+private:
+    ReplayClock clock;
+    TraceReader reads;
+    TraceReader suspends;
+    bool done = false;
+};
+
+} // namespace
+
+#if !defined(_WIN32)
+std::unique_ptr<Power> systemPower() {
+    return nullptr;
+}
+#endif
+
+std::unique_ptr<Power> recordPower(std::unique_ptr<Power> inner, std::shared_ptr<TraceWriter> trace) {
+    if (!inner || !trace) return inner;
+    return std::unique_ptr<Power>(new RecordingPower(std::move(inner), std::move(trace)));
+}
+
+std::unique_ptr<Power> replayPower(const std::string& path, Speed speed) {
+    std::unique_ptr<ReplayPower> power(new ReplayPower(speed));
+    if (!power->open(path)) return nullptr;
+    return std::unique_ptr<Power>(power.release());
+}
+
+std::unique_ptr<Power> openPower(const TraceOptions& options) {
+    if (options.replaying()) return replayPower(options.replay, options.speed);
+    return recordPower(systemPower(), options.recorder);
+}
+
+} // namespace hal
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "trace.h"
+
+// Power supply and battery (lab1).
+
+namespace hal {
+
+// As GetSystemPowerStatus reports it: 255 and 0xffffffff mean unknown.
+struct PowerStatus {
+    uint8_t acLine = 255;         // 0 offline, 1 online
+    uint8_t batteryPercent = 255;
+    uint32_t lifeTime = 0xffffffff;     // seconds left
+    uint32_t fullLifeTime = 0xffffffff; // seconds on a full charge
+    std::string chemistry;        // "LION", "PbAc", ...; empty if unknown
+};
+
+class Power {
+public:
+    virtual ~Power() = default;
+    virtual bool read(PowerStatus& status) = 0;
+    // Sleep, or hibernate. Replay only plays back whether it worked.
+    virtual bool suspend(bool hibernate) = 0;
+    // A replay has run out of readings; the machine never does.
+    virtual bool ended() const { return false; }
+};
+
+// This machine's supply, or null where there is no backend.
+std::unique_ptr<Power> systemPower();
+std::unique_ptr<Power> recordPower(std::unique_ptr<Power> inner, std::shared_ptr<TraceWriter> trace);
+// Null if the trace cannot be read.
+std::unique_ptr<Power> replayPower(const std::string& path, Speed speed);
+
+// The backend the options ask for.
+std::unique_ptr<Power> openPower(const TraceOptions& options);
+
+} // namespace hal
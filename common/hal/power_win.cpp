@@ -0,0 +1,122 @@
+#if defined(_WIN32)
+
+#include "power.h"
+
+#include <cstring>
+#include <windows.h>
+#include <powrprof.h>
+#include <Setupapi.h>
+#include <initguid.h>
+#include <Devguid.h>
+#include <winioctl.h>
+
+#pragma comment(lib, "powrprof.lib")
+#pragma comment(lib, "setupapi.lib")
+
+#define IOCTL_BATTERY_QUERY_TAG CTL_CODE(FILE_DEVICE_BATTERY, 0x10, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_BATTERY_QUERY_INFORMATION CTL_CODE(FILE_DEVICE_BATTERY, 0x11, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+namespace hal {
+
+namespace {
+
+typedef enum _BATTERY_QUERY_INFORMATION_LEVEL {
+    BatteryInformation
+} BATTERY_QUERY_INFORMATION_LEVEL;
+
+typedef struct _BATTERY_QUERY_INFORMATION {
+    ULONG BatteryTag;
+    BATTERY_QUERY_INFORMATION_LEVEL InformationLevel;
+    ULONG AtRate;
+} BATTERY_QUERY_INFORMATION, *PBATTERY_QUERY_INFORMATION;
+
+typedef struct _BATTERY_INFORMATION {
+    ULONG Capabilities;
+    UCHAR Technology;
+    UCHAR Reserved[3];
+    UCHAR Chemistry[4];
+    ULONG DesignedCapacity;
+    ULONG FullChargedCapacity;
+    ULONG DefaultAlert1;
+    ULONG DefaultAlert2;
+    ULONG CriticalBias;
+    ULONG CycleCount;
+} BATTERY_INFORMATION, *PBATTERY_INFORMATION;
+
+// The first battery's chemistry, or empty.
+std::string batteryChemistry() {
+    HDEVINFO hdev = SetupDiGetClassDevs(&GUID_DEVCLASS_BATTERY, 0, 0, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (hdev == INVALID_HANDLE_VALUE) return "";
+
+    SP_DEVICE_INTERFACE_DATA did = {0};
+    did.cbSize = sizeof(did);
+
+    if (SetupDiEnumDeviceInterfaces(hdev, 0, &GUID_DEVCLASS_BATTERY, 0, &did)) {
+        DWORD cbRequired = 0;
+        SetupDiGetDeviceInterfaceDetail(hdev, &did, NULL, 0, &cbRequired, NULL);
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            SetupDiDestroyDeviceInfoList(hdev); return "";
+        }
+
+        PSP_DEVICE_INTERFACE_DETAIL_DATA pdidd = (PSP_DEVICE_INTERFACE_DETAIL_DATA)LocalAlloc(LPTR, cbRequired);
+        if (!pdidd) {
+            SetupDiDestroyDeviceInfoList(hdev); return "";
+        }
+        pdidd->cbSize = sizeof(*pdidd);
+
+        if (SetupDiGetDeviceInterfaceDetail(hdev, &did, pdidd, cbRequired, NULL, NULL)) {
+            HANDLE hBattery = CreateFile(pdidd->DevicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (hBattery != INVALID_HANDLE_VALUE) {
+                BATTERY_QUERY_INFORMATION bqi = {0};
+                DWORD dwOut;
+
+                DeviceIoControl(hBattery, IOCTL_BATTERY_QUERY_TAG, NULL, 0, &bqi.BatteryTag, sizeof(bqi.BatteryTag), &dwOut, NULL);
+
+                if (bqi.BatteryTag) {
+                    BATTERY_INFORMATION bi = {0};
+                    bqi.InformationLevel = BatteryInformation;
+                    if (DeviceIoControl(hBattery, IOCTL_BATTERY_QUERY_INFORMATION, &bqi, sizeof(bqi), &bi, sizeof(bi), &dwOut, NULL)) {
+                        char name[5] = {0};
+                        memcpy(name, bi.Chemistry, 4);
+                        CloseHandle(hBattery);
+                        LocalFree(pdidd);
+                        SetupDiDestroyDeviceInfoList(hdev);
+                        return std::string(name);
+                    }
+                }
+                CloseHandle(hBattery);
+            }
+        }
+        LocalFree(pdidd);
+    }
+    SetupDiDestroyDeviceInfoList(hdev);
+    return "";
+}
+
+class SystemPower : public Power {
+public:
+    bool read(PowerStatus& status) override {
+        SYSTEM_POWER_STATUS sps;
+        if (!GetSystemPowerStatus(&sps)) return false;
+        status.acLine = sps.ACLineStatus;
+        status.batteryPercent = sps.BatteryLifePercent;
+        status.lifeTime = sps.BatteryLifeTime;
+        status.fullLifeTime = sps.BatteryFullLifeTime;
+        status.chemistry = batteryChemistry();
+        return true;
+    }
+
+    bool suspend(bool hibernate) override {
+        return SetSuspendState(hibernate ? TRUE : FALSE, TRUE, TRUE) != FALSE;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<Power> systemPower() {
+    return std::unique_ptr<Power>(new SystemPower());
+}
+
+} // namespace hal
+
+#endif
@@ -0,0 +1,225 @@
+#include "trace.h"
+
+#include <cstring>
+
+namespace hal {
+
+namespace {
+
+// Records are buffered by stdio; a recorder that is killed loses at most
+// this much of its tail.
+constexpr int64_t kFlushIntervalNs = 1000000000;
+constexpr size_t kWriteBuffer = 1 << 20;
+
+size_t putVarint(uint8_t* out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+const char* optionValue(const char* arg, const char* name) {
+    size_t n = strlen(name);
+    return strncmp(arg, name, n) == 0 ? arg + n : nullptr;
+}
+
+} // namespace
+
+// ---- Packer / Unpacker ----
+
+Packer& Packer::f64(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    for (int i = 0; i < 8; ++i) buf.push_back((char)(bits >> (8 * i)));
+    return *this;
+}
+
+double Unpacker::f64() {
+    const uint8_t* s = raw(8);
+    uint64_t bits = 0;
+    if (s) {
+        for (int i = 0; i < 8; ++i) bits |= (uint64_t)s[i] << (8 * i);
+    }
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// ---- TraceWriter ----
+
+bool TraceWriter::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file) return false;
+    file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    setvbuf(file, nullptr, _IOFBF, kWriteBuffer);
+    fwrite(kTraceMagic, 1, sizeof(kTraceMagic), file);
+    start = std::chrono::steady_clock::now();
+    lastNs = 0;
+    lastFlushNs = 0;
+    recordCount = 0;
+    byteCount = sizeof(kTraceMagic);
+    return true;
+}
+
+void TraceWriter::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!file) return;
+    fclose(file);
+    file = nullptr;
+}
+
+void TraceWriter::write(Channel channel, uint8_t kind, const void* payload, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!file) return;
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (now < lastNs) now = lastNs;
+
+    uint8_t head[2 + 10 + 10];
+    head[0] = (uint8_t)channel;
+    head[1] = kind;
+    size_t n = 2;
+    n += putVarint(head + n, (uint64_t)(now - lastNs));
+    n += putVarint(head + n, size);
+    fwrite(head, 1, n, file);
+    if (size) fwrite(payload, 1, size, file);
+    lastNs = now;
+    ++recordCount;
+    byteCount += n + size;
+
+    if (now - lastFlushNs >= kFlushIntervalNs) {
+        fflush(file);
+        lastFlushNs = now;
+    }
+}
+
+uint64_t TraceWriter::records() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return recordCount;
+}
+
+uint64_t TraceWriter::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return byteCount;
+}
+
+// ---- TraceReader ----
+
+bool TraceReader::open(const std::string& path) {
+    close();
+    file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    char magic[sizeof(kTraceMagic)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, kTraceMagic, sizeof(magic)) != 0) {
+        close();
+        return false;
+    }
+    timeNs = 0;
+    return true;
+}
+
+void TraceReader::close() {
+    if (file) fclose(file);
+    file = nullptr;
+}
+
+bool TraceReader::readVarint(uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF) return false;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+bool TraceReader::header(Record& record, uint64_t& size) {
+    if (!file) return false;
+    int channel = fgetc(file);
+    int kind = fgetc(file);
+    uint64_t delta;
+    if (channel == EOF || kind == EOF || !readVarint(delta) || !readVarint(size)) return false;
+    timeNs += (int64_t)delta;
+    record.channel = (Channel)channel;
+    record.kind = (uint8_t)kind;
+    record.timeNs = timeNs;
+    return true;
+}
+
+bool TraceReader::next(Record& record) {
+    uint64_t size;
+    if (!header(record, size)) return false;
+    record.payload.resize((size_t)size);
+    return !size || fread(record.payload.data(), 1, (size_t)size, file) == size;
+}
+
+bool TraceReader::next(Channel channel, Record& record) {
+    uint64_t size;
+    while (header(record, size)) {
+        if (record.channel == channel) {
+            record.payload.resize((size_t)size);
+            return !size || fread(record.payload.data(), 1, (size_t)size, file) == size;
+        }
+        if (fseek(file, (long)size, SEEK_CUR) != 0) return false;
+    }
+    return false;
+}
+
+// ---- ReplayClock ----
+
+bool ReplayClock::waitUntil(int64_t traceNs) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!anchored) {
+        anchored = true;
+        realStart = std::chrono::steady_clock::now();
+        traceStart = traceNs;
+    }
+    if (traceNs > released) released = traceNs;
+    if (pace == Speed::Max) return !stopped;
+    std::chrono::steady_clock::time_point due = realStart + std::chrono::nanoseconds(traceNs - traceStart);
+    return !cancelled.wait_until(lock, due, [this] { return stopped; });
+}
+
+void ReplayClock::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+    }
+    cancelled.notify_all();
+}
+
+int64_t ReplayClock::nowNs() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pace == Speed::Max || !anchored) return released;
+    return traceStart + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - realStart).count();
+}
+
+// ---- options ----
+
+TraceOptions traceOptionsFromArgs(int argc, char** argv) {
+    TraceOptions options;
+    std::string record;
+    for (int i = 1; i < argc; ++i) {
+        if (const char* v = optionValue(argv[i], "--record=")) record = v;
+        else if (const char* v = optionValue(argv[i], "--replay=")) options.replay = v;
+        else if (const char* v = optionValue(argv[i], "--replay-speed=")) {
+            options.speed = strcmp(v, "max") == 0 ? Speed::Max : Speed::Original;
+        }
+    }
+    if (!record.empty() && options.replaying()) {
+        fprintf(stderr, "--record ignored: replaying %s\n", options.replay.c_str());
+    } else if (!record.empty()) {
+        options.recorder = std::make_shared<TraceWriter>();
+        if (!options.recorder->open(record)) {
+            fprintf(stderr, "Cannot create trace file %s\n", record.c_str());
+            options.recorder.reset();
+        }
+    }
+    return options;
+}
+
+} // namespace hal
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Record and replay of hardware traffic.
+//
+// Every subsystem the helpers touch (power, PCI config space, device
+// enumeration, cameras) sits behind a small interface with three backends:
+// the machine, a recorder wrapped around it, and a replay of a recorded
+// trace. A helper started with --record=<file> writes what the hardware
+// answered, and when; one started with --replay=<file> gets the same answers
+// back on any machine, at the recorded pace or, with --replay-speed=max, as
+// fast as it asks for them.
+//
+// A trace is the magic "HTR1" followed by records of
+//     u8      channel (Channel)
+//     u8      kind, defined by the channel
+//     varint  nanoseconds since the previous record
+//     varint  payload size
+//     ...     payload, written with Packer
+// Varints are LEB128. All subsystems of a process share one file, so a trace
+// keeps how their events interleaved.
+
+namespace hal {
+
+enum class Channel : uint8_t {
+    Power = 1,
+    Pci = 2,
+    Devices = 3,
+    Frames = 4,
+};
+
+constexpr char kTraceMagic[4] = { 'H', 'T', 'R', '1' };
+
+// A record payload. Integers are varints, signed ones zigzag encoded.
+class Packer {
+public:
+    void clear() { buf.clear(); }
+    const std::string& data() const { return buf; }
+
+    Packer& u8(uint8_t v) {
+        buf.push_back((char)v);
+        return *this;
+    }
+    Packer& uvar(uint64_t v) {
+        while (v >= 0x80) {
+            buf.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((char)v);
+        return *this;
+    }
+    Packer& svar(int64_t v) { return uvar(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+    Packer& f64(double v);
+    Packer& str(std::string_view s) {
+        uvar(s.size());
+        buf.append(s.data(), s.size());
+        return *this;
+    }
+    Packer& raw(const void* data, size_t size) {
+        buf.append((const char*)data, size);
+        return *this;
+    }
+
+private:
+    std::string buf;
+};
+
+// Reads a payload written by Packer. Reading past the end yields zeros and
+// clears ok().
+class Unpacker {
+public:
+    Unpacker(const uint8_t* data, size_t size) : p(data), end(data + size) {}
+    explicit Unpacker(const std::vector<uint8_t>& payload) : Unpacker(payload.data(), payload.size()) {}
+
+    bool ok() const { return good; }
+    size_t remaining() const { return (size_t)(end - p); }
+
+    uint8_t u8() {
+        if (p == end) return fail();
+        return *p++;
+    }
+    uint64_t uvar() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p == end) return fail();
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        return fail();
+    }
+    int64_t svar() {
+        uint64_t v = uvar();
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+    double f64();
+    std::string str() {
+        const uint8_t* s = raw((size_t)uvar());
+        return s ? std::string((const char*)s, (const char*)p) : std::string();
+    }
+    // The next size bytes in place, or null if the payload is shorter.
+    const uint8_t* raw(size_t size) {
+        if (!good || remaining() < size) {
+            fail();
+            return nullptr;
+        }
+        const uint8_t* s = p;
+        p += size;
+        return s;
+    }
+
+private:
+    uint8_t fail() {
+        good = false;
+        p = end;
+        return 0;
+    }
+
+    const uint8_t* p;
+    const uint8_t* end;
+    bool good = true;
+};
+
+// Appends records to a trace file. Thread-safe; records are stamped with the
+// time they are written, relative to open().
+class TraceWriter {
+public:
+    TraceWriter() = default;
+    ~TraceWriter() { close(); }
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    void write(Channel channel, uint8_t kind, const void* payload, size_t size);
+    void write(Channel channel, uint8_t kind, const Packer& payload) {
+        write(channel, kind, payload.data().data(), payload.data().size());
+    }
+
+    uint64_t records() const;
+    uint64_t bytes() const;
+
+private:
+    mutable std::mutex mutex;
+    FILE* file = nullptr;
+    std::chrono::steady_clock::time_point start;
+    int64_t lastNs = 0;
+    int64_t lastFlushNs = 0;
+    uint64_t recordCount = 0;
+    uint64_t byteCount = 0;
+};
+
+struct Record {
+    Channel channel = Channel::Power;
+    uint8_t kind = 0;
+    int64_t timeNs = 0; // since the trace was opened
+    std::vector<uint8_t> payload;
+};
+
+// Reads a trace front to back. Not thread-safe; each replay backend keeps its
+// own reader.
+class TraceReader {
+public:
+    TraceReader() = default;
+    ~TraceReader() { close(); }
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    // The next record, or false at the end of the trace. A truncated last
+    // record (a recorder that was killed) ends the trace too.
+    bool next(Record& record);
+    // The next record on one channel; the others' payloads are skipped
+    // without being read.
+    bool next(Channel channel, Record& record);
+
+private:
+    bool header(Record& record, uint64_t& size);
+    bool readVarint(uint64_t& v);
+
+    FILE* file = nullptr;
+    int64_t timeNs = 0;
+};
+
+enum class Speed { Original, Max };
+
+// Paces a replay. At Original speed the first record sets the origin and
+// every later one is released when as much time has passed as had passed in
+// the recording; at Max speed nothing waits. Thread-safe.
+class ReplayClock {
+public:
+    explicit ReplayClock(Speed speed = Speed::Original) : pace(speed) {}
+
+    Speed speed() const { return pace; }
+    // False if cancel() was called before or during the wait.
+    bool waitUntil(int64_t traceNs);
+    // Ends every wait now and from here on, for a replay that is shutting down.
+    void cancel();
+    // The trace time now: where the wall clock has got to at Original speed,
+    // the last record released at Max speed.
+    int64_t nowNs() const;
+
+private:
+    Speed pace;
+    mutable std::mutex mutex;
+    std::condition_variable cancelled;
+    bool stopped = false;
+    bool anchored = false;
+    std::chrono::steady_clock::time_point realStart;
+    int64_t traceStart = 0;
+    int64_t released = 0;
+};
+
+// What a helper was asked for on its command line:
+//     --record=<file>               record the hardware into a trace
+//     --replay=<file>               use a recorded trace instead of the hardware
+//     --replay-speed=original|max   pace of the replay (original)
+struct TraceOptions {
+    std::string replay;
+    Speed speed = Speed::Original;
+    std::shared_ptr<TraceWriter> recorder; // open, or null when not recording
+
+    bool replaying() const { return !replay.empty(); }
+};
+
+// Parses the options and opens the recording. Problems are reported on
+// stderr, which the host logs, and the helper carries on without recording.
+TraceOptions traceOptionsFromArgs(int argc, char** argv);
+
+} // namespace hal
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#else
+#define JSON_SSE2 0
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+// Streaming JSON writer shared by the helpers.
+//
+// A message is built in place, in a buffer that lives inside the Writer: up
+// to kInline bytes need no heap allocation at all, and a Writer that is
+// cleared and reused keeps whatever it grew to. Strings are scanned 16 bytes
+// at a time for the characters that need escaping (SSE2 is part of every x64
+// target, so there is no dispatch), and every control character is escaped.
+// Numbers go through std::to_chars.
+//
+//     json::Writer msg;
+//     msg.beginObject();
+//     msg.field("type", "file_saved");
+//     msg.field("filename", path);
+//     msg.endObject();
+//     output.sendJson(msg.view());
+
+namespace json {
+
+namespace detail {
+
+inline int lowestBit(unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+inline bool needsEscape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+} // namespace detail
+
+// First character in [p, end) that cannot appear unescaped in a JSON string,
+// or end.
+inline const char* findEscape(const char* p, const char* end) {
+#if JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        // Unsigned v <= 0x1f: saturating subtract leaves zero.
+        __m128i low = _mm_cmpeq_epi8(_mm_subs_epu8(v, control), _mm_setzero_si128());
+        __m128i hit = _mm_or_si128(low, _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) return p + detail::lowestBit(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && !detail::needsEscape((unsigned char)*p)) ++p;
+    return p;
+}
+
+// Appends s escaped (without quotes) to any sink with append(const char*,
+// size_t), such as std::string or Writer.
+template <typename Sink>
+void appendEscaped(Sink& out, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    const char* p = s.data();
+    const char* end = p + s.size();
+    while (p < end) {
+        const char* stop = findEscape(p, end);
+        if (stop > p) out.append(p, (size_t)(stop - p));
+        if (stop == end) break;
+        unsigned char c = (unsigned char)*stop;
+        char esc[6] = { '\\', 0, 0, 0, 0, 0 };
+        size_t n = 2;
+        switch (c) {
+        case '"': esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        default:
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 15];
+            n = 6;
+            break;
+        }
+        out.append(esc, n);
+        p = stop + 1;
+    }
+}
+
+template <typename Sink, typename T>
+void appendInteger(Sink& out, T v) {
+    char tmp[24];
+    auto r = std::to_chars(tmp, tmp + sizeof(tmp), v);
+    out.append(tmp, (size_t)(r.ptr - tmp));
+}
+
+// Shortest text that reads back as v, or v to the given number of
+// significant digits as printf's %g would. JSON has no NaN or infinity, so
+// those become null.
+template <typename Sink>
+void appendReal(Sink& out, double v, int precision = 0) {
+    if (!std::isfinite(v)) {
+        out.append("null", 4);
+        return;
+    }
+    char tmp[32];
+    auto r = precision > 0 ? std::to_chars(tmp, tmp + sizeof(tmp), v, std::chars_format::general, precision)
+                           : std::to_chars(tmp, tmp + sizeof(tmp), v);
+    out.append(tmp, (size_t)(r.ptr - tmp));
+}
+
+// Lowercase hex digits, zero-padded to minDigits.
+template <typename Sink>
+void appendHex(Sink& out, uint64_t v, int minDigits = 1) {
+    char tmp[16];
+    auto r = std::to_chars(tmp, tmp + sizeof(tmp), v, 16);
+    for (int pad = minDigits - (int)(r.ptr - tmp); pad > 0; --pad) out.append("0", 1);
+    out.append(tmp, (size_t)(r.ptr - tmp));
+}
+
+class Writer {
+public:
+    static constexpr size_t kInline = 1024;
+
+    Writer() = default;
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    // Starts a new message; the buffer is kept.
+    void clear() {
+        len = 0;
+        depth = 0;
+        hasItems = 0;
+        afterKey = false;
+    }
+
+    std::string_view view() const { return std::string_view(data, len); }
+    size_t size() const { return len; }
+
+    Writer& beginObject() { return open('{'); }
+    Writer& endObject() { return close('}'); }
+    Writer& beginArray() { return open('['); }
+    Writer& endArray() { return close(']'); }
+
+    Writer& key(std::string_view k) {
+        separator();
+        quoted(k);
+        push_back(':');
+        afterKey = true;
+        return *this;
+    }
+
+    Writer& value(std::string_view v) {
+        separator();
+        quoted(v);
+        return *this;
+    }
+    Writer& value(const char* v) { return value(std::string_view(v)); }
+    Writer& value(const std::string& v) { return value(std::string_view(v)); }
+    Writer& value(bool v) {
+        separator();
+        if (v) append("true", 4);
+        else append("false", 5);
+        return *this;
+    }
+    template <typename T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                                  !std::is_same<T, char>::value, int>::type = 0>
+    Writer& value(T v) {
+        separator();
+        appendInteger(*this, v);
+        return *this;
+    }
+    Writer& value(double v, int precision = 0) {
+        separator();
+        appendReal(*this, v, precision);
+        return *this;
+    }
+    Writer& null() {
+        separator();
+        append("null", 4);
+        return *this;
+    }
+
+    template <typename T>
+    Writer& field(std::string_view k, const T& v) {
+        key(k);
+        return value(v);
+    }
+    Writer& field(std::string_view k, double v, int precision) {
+        key(k);
+        return value(v, precision);
+    }
+
+    // A string value written in pieces, for text mixed with numbers:
+    //     msg.key("message").beginString().text("Error (Code: ").hex(hr).text(")").endString();
+    Writer& beginString() {
+        separator();
+        push_back('"');
+        return *this;
+    }
+    Writer& text(std::string_view s) {
+        appendEscaped(*this, s);
+        return *this;
+    }
+    template <typename T>
+    Writer& number(T v) {
+        appendInteger(*this, v);
+        return *this;
+    }
+    Writer& hex(uint64_t v, int minDigits = 1) {
+        appendHex(*this, v, minDigits);
+        return *this;
+    }
+    Writer& endString() {
+        push_back('"');
+        return *this;
+    }
+
+    // Raw output; the caller keeps the JSON well formed.
+    void append(const char* s, size_t n) {
+        if (cap - len < n) grow(n);
+        memcpy(data + len, s, n);
+        len += n;
+    }
+    void push_back(char c) {
+        if (len == cap) grow(1);
+        data[len++] = c;
+    }
+
+private:
+    // A comma before every item but the first in its container, and none
+    // between a key and its value. Nesting deeper than 64 levels shares bits,
+    // which no helper message comes near.
+    void separator() {
+        if (afterKey) {
+            afterKey = false;
+            return;
+        }
+        if (!depth) return;
+        uint64_t bit = 1ull << ((depth - 1) & 63);
+        if (hasItems & bit) push_back(',');
+        hasItems |= bit;
+    }
+
+    Writer& open(char c) {
+        separator();
+        push_back(c);
+        ++depth;
+        hasItems &= ~(1ull << ((depth - 1) & 63));
+        return *this;
+    }
+
+    Writer& close(char c) {
+        push_back(c);
+        if (depth) --depth;
+        return *this;
+    }
+
+    void quoted(std::string_view s) {
+        push_back('"');
+        appendEscaped(*this, s);
+        push_back('"');
+    }
+
+    void grow(size_t extra) {
+        size_t want = cap * 2;
+        if (want < len + extra) want = len + extra;
+        std::unique_ptr<char[]> bigger(new char[want]);
+        memcpy(bigger.get(), data, len);
+        heap = std::move(bigger);
+        data = heap.get();
+        cap = want;
+    }
+
+    char small[kInline];
+    std::unique_ptr<char[]> heap;
+    char* data = small;
+    size_t len = 0;
+    size_t cap = kInline;
+    int depth = 0;
+    uint64_t hasItems = 0;
+    bool afterKey = false;
+};
+
+} // namespace json
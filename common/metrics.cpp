@@ -0,0 +1,411 @@
+#include "metrics.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace metrics {
+
+namespace {
+
+#if defined(_WIN32)
+using Socket = SOCKET;
+const Socket kNoSocket = INVALID_SOCKET;
+void closeSocket(Socket s) { closesocket(s); }
+constexpr int kSendFlags = 0;
+#else
+using Socket = int;
+const Socket kNoSocket = -1;
+void closeSocket(Socket s) { close(s); }
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#endif
+
+// Prometheus reads Go's float syntax; integers print without an exponent up
+// to 2^53.
+void appendNumber(std::string& out, double v) {
+    if (std::isnan(v)) {
+        out += "NaN";
+    } else if (std::isinf(v)) {
+        out += v > 0 ? "+Inf" : "-Inf";
+    } else {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.15g", v);
+        out += buf;
+    }
+}
+
+void appendNumber(std::string& out, uint64_t v) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v);
+    out += buf;
+}
+
+// Escapes for a label value (quote) or help text (no quote).
+void appendEscaped(std::string& out, std::string_view text, bool quote) {
+    for (char c : text) {
+        if (c == '\\') out += "\\\\";
+        else if (c == '\n') out += "\\n";
+        else if (c == '"' && quote) out += "\\\"";
+        else out.push_back(c);
+    }
+}
+
+const char* typeText(int type) {
+    switch (type) {
+    case 0: return "counter";
+    case 1: return "gauge";
+    default: return "histogram";
+    }
+}
+
+// Resident set size, or -1 where it cannot be read.
+double residentBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return (double)pmc.WorkingSetSize;
+    return -1;
+#elif defined(__linux__)
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return -1;
+    unsigned long long size = 0, resident = 0;
+    int n = fscanf(f, "%llu %llu", &size, &resident);
+    fclose(f);
+    return n == 2 ? (double)resident * (double)sysconf(_SC_PAGESIZE) : -1;
+#else
+    return -1;
+#endif
+}
+
+} // namespace
+
+// ---- series ----
+
+void Gauge::add(double delta) {
+    double old = v.load(std::memory_order_relaxed);
+    while (!v.compare_exchange_weak(old, old + delta, std::memory_order_relaxed)) {
+    }
+}
+
+Histogram::Histogram(std::vector<double> upperBounds)
+    : upper(std::move(upperBounds)), counts(new std::atomic<uint64_t>[upper.size() + 1]) {
+    for (size_t i = 0; i <= upper.size(); ++i) counts[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::observe(double value) {
+    size_t i = 0;
+    while (i < upper.size() && value > upper[i]) ++i;
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    double old = sumOf.load(std::memory_order_relaxed);
+    while (!sumOf.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {
+    }
+}
+
+const std::vector<double>& latencyBuckets() {
+    static const std::vector<double> bounds = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                                0.025,  0.05,    0.1,    0.25,  0.5,    1,     2.5, 5, 10 };
+    return bounds;
+}
+
+std::string label(std::string_view key, std::string_view value) {
+    std::string out(key);
+    out += "=\"";
+    appendEscaped(out, value, true);
+    out += '"';
+    return out;
+}
+
+// ---- exposition ----
+
+void Exposition::family(std::string_view name, std::string_view help, const char* type) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    appendEscaped(out, help, false);
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void Exposition::name(std::string_view name, std::string_view labels) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+}
+
+void Exposition::sample(std::string_view name, std::string_view labels, double value) {
+    this->name(name, labels);
+    appendNumber(out, value);
+    out += '\n';
+}
+
+void Exposition::sample(std::string_view name, std::string_view labels, uint64_t value) {
+    this->name(name, labels);
+    appendNumber(out, value);
+    out += '\n';
+}
+
+void Exposition::histogram(std::string_view name, std::string_view labels, const std::vector<double>& bounds,
+                           const std::vector<uint64_t>& buckets, double sum) {
+    // _count is the buckets as read rather than a separate total, so a
+    // concurrent observation cannot make it disagree with +Inf.
+    std::string series(name);
+    std::string bucketLabels;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= bounds.size() && i < buckets.size(); ++i) {
+        cumulative += buckets[i];
+        bucketLabels = labels;
+        if (!bucketLabels.empty()) bucketLabels += ',';
+        bucketLabels += "le=\"";
+        if (i < bounds.size()) appendNumber(bucketLabels, bounds[i]);
+        else bucketLabels += "+Inf";
+        bucketLabels += '"';
+        sample(series + "_bucket", bucketLabels, cumulative);
+    }
+    sample(series + "_sum", labels, sum);
+    sample(series + "_count", labels, cumulative);
+}
+
+// ---- registry ----
+
+Registry::Registry() {
+    addCollector([](Exposition& out) {
+        double rss = residentBytes();
+        if (rss < 0) return;
+        out.family("process_resident_memory_bytes", "Resident memory size in bytes.", "gauge");
+        out.sample("process_resident_memory_bytes", {}, rss);
+    });
+}
+
+Registry::Series* Registry::find(std::string_view name, std::string_view help, std::string_view labels, Type type) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = families.find(name);
+    if (it == families.end()) {
+        it = families.emplace(std::string(name), Family{ type, std::string(help), {} }).first;
+    } else if (it->second.type != type) {
+        detached.push_back(std::make_unique<Series>());
+        return detached.back().get();
+    }
+    for (const std::unique_ptr<Series>& s : it->second.series) {
+        if (s->labels == labels) return s.get();
+    }
+    it->second.series.push_back(std::make_unique<Series>());
+    Series* s = it->second.series.back().get();
+    s->labels = std::string(labels);
+    return s;
+}
+
+Counter& Registry::counter(std::string_view name, std::string_view help, std::string_view labels) {
+    Series* s = find(name, help, labels, Type::Counter);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!s->counter) s->counter = std::make_unique<Counter>();
+    return *s->counter;
+}
+
+Gauge& Registry::gauge(std::string_view name, std::string_view help, std::string_view labels) {
+    Series* s = find(name, help, labels, Type::Gauge);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!s->gauge) s->gauge = std::make_unique<Gauge>();
+    return *s->gauge;
+}
+
+Histogram& Registry::histogram(std::string_view name, std::string_view help, const std::vector<double>& bounds,
+                               std::string_view labels) {
+    Series* s = find(name, help, labels, Type::Histogram);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!s->histogram) s->histogram = std::make_unique<Histogram>(bounds);
+    return *s->histogram;
+}
+
+int Registry::addCollector(std::function<void(Exposition&)> collect) {
+    std::lock_guard<std::mutex> lock(collectMutex);
+    int handle = nextCollector++;
+    collectors[handle] = std::move(collect);
+    return handle;
+}
+
+void Registry::removeCollector(int handle) {
+    std::lock_guard<std::mutex> lock(collectMutex);
+    collectors.erase(handle);
+}
+
+void Registry::render(std::string& out) {
+    Exposition text(out);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint64_t> buckets;
+        for (const auto& entry : families) {
+            const std::string& name = entry.first;
+            const Family& family = entry.second;
+            text.family(name, family.help, typeText((int)family.type));
+            for (const std::unique_ptr<Series>& s : family.series) {
+                if (s->counter) {
+                    text.sample(name, s->labels, s->counter->value());
+                } else if (s->gauge) {
+                    text.sample(name, s->labels, s->gauge->value());
+                } else if (s->histogram) {
+                    const Histogram& h = *s->histogram;
+                    buckets.resize(h.bounds().size() + 1);
+                    for (size_t i = 0; i < buckets.size(); ++i) buckets[i] = h.bucket(i);
+                    text.histogram(name, s->labels, h.bounds(), buckets, h.sum());
+                }
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(collectMutex);
+    for (auto& entry : collectors) entry.second(text);
+}
+
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+// ---- server ----
+
+std::unique_ptr<Server> Server::listen(uint16_t port) {
+#if defined(_WIN32)
+    static bool started = [] {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    if (!started) {
+        fprintf(stderr, "metrics: Winsock is not available\n");
+        return nullptr;
+    }
+#endif
+    Socket s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == kNoSocket) {
+        fprintf(stderr, "metrics: cannot create a socket\n");
+        return nullptr;
+    }
+#if !defined(_WIN32)
+    // Windows lets a second process take a port with SO_REUSEADDR; elsewhere
+    // it only skips TIME_WAIT after a restart.
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+#endif
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(s, 4) != 0 ||
+        getsockname(s, (sockaddr*)&addr, &len) != 0) {
+        fprintf(stderr, "metrics: cannot listen on 127.0.0.1:%u\n", (unsigned)port);
+        closeSocket(s);
+        return nullptr;
+    }
+    return std::unique_ptr<Server>(new Server((intptr_t)s, ntohs(addr.sin_port)));
+}
+
+Server::Server(intptr_t socket, uint16_t port) : listener(socket), boundPort(port) {
+    thread = std::thread(&Server::acceptLoop, this);
+}
+
+Server::~Server() {
+    stopping = true;
+    thread.join();
+    closeSocket((Socket)listener);
+}
+
+// Wakes up every 200 ms to notice the destructor.
+void Server::acceptLoop() {
+    Socket s = (Socket)listener;
+    while (!stopping) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(s, &readable);
+        timeval wait = { 0, 200000 };
+        if (select((int)s + 1, &readable, nullptr, nullptr, &wait) <= 0) continue;
+        Socket client = accept(s, nullptr, nullptr);
+        if (client == kNoSocket) continue;
+        serve((intptr_t)client);
+        closeSocket(client);
+    }
+}
+
+// Reads the request head (up to 8 KB, for up to a second) and answers GET
+// /metrics; anything else gets a 404.
+void Server::serve(intptr_t client) {
+    Socket c = (Socket)client;
+    char request[8192];
+    size_t got = 0;
+    while (got < sizeof(request) - 1) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(c, &readable);
+        timeval wait = { 1, 0 };
+        if (select((int)c + 1, &readable, nullptr, nullptr, &wait) <= 0) return;
+        int n = (int)recv(c, request + got, (int)(sizeof(request) - 1 - got), 0);
+        if (n <= 0) return;
+        got += (size_t)n;
+        request[got] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[got] = 0;
+
+    bool found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+    body.clear();
+    const char* status = "404 Not Found";
+    const char* type = "text/plain; charset=utf-8";
+    if (found) {
+        registry().render(body);
+        status = "200 OK";
+        type = "text/plain; version=0.0.4; charset=utf-8";
+    } else {
+        body = "Not found; the metrics are at /metrics.\n";
+    }
+    char head[256];
+    int headLen = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                           status, type, body.size());
+    body.insert(0, head, (size_t)headLen);
+    const char* data = body.data();
+    size_t left = body.size();
+    while (left) {
+        int n = (int)send(c, data, (int)left, kSendFlags);
+        if (n <= 0) return;
+        data += n;
+        left -= (size_t)n;
+    }
+}
+
+std::unique_ptr<Server> serveFromArgs(int argc, char** argv) {
+    const char* port = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--metrics=", 10) == 0) port = argv[i] + 10;
+    }
+    if (!port) port = getenv("HELPER_METRICS");
+    if (!port || !*port) return nullptr;
+    char* end = nullptr;
+    unsigned long n = strtoul(port, &end, 10);
+    if (*end || n > 65535) {
+        fprintf(stderr, "metrics: bad port '%s'\n", port);
+        return nullptr;
+    }
+    std::unique_ptr<Server> server = Server::listen((uint16_t)n);
+    if (server) fprintf(stderr, "metrics: http://127.0.0.1:%u/metrics\n", (unsigned)server->port());
+    return server;
+}
+
+} // namespace metrics
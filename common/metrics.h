@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Runtime metrics of a helper, scraped in the Prometheus text format (0.0.4).
+//
+// Code that reports looks its series up once, by name and label set, and
+// keeps the reference; a series lives as long as the process. Updating one
+// is a relaxed atomic add or store, with no lock, so the hot paths (every
+// output write, every power read) can afford it. Values that already exist
+// elsewhere (capture sessions, latency histograms) are not copied on every
+// change but read by a collector at scrape time.
+//
+//   static metrics::Counter& scans = metrics::registry().counter("helper_pci_scans_total", "PCI bus scans.");
+//   scans.add();
+//
+// A helper started with --metrics=<port> (or HELPER_METRICS=<port>) serves
+// the registry at http://127.0.0.1:<port>/metrics.
+
+namespace metrics {
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { v.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return v.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> v{ 0 };
+};
+
+class Gauge {
+public:
+    void set(double value) { v.store(value, std::memory_order_relaxed); }
+    void add(double delta);
+    double value() const { return v.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> v{ 0 };
+};
+
+// Cumulative buckets with fixed upper bounds, as Prometheus has them.
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> upperBounds);
+    void observe(double value);
+    void observeNs(int64_t ns) { observe(ns / 1e9); }
+
+    const std::vector<double>& bounds() const { return upper; }
+    // Observations at or below bounds()[i], not cumulative; the last entry
+    // counts everything above the largest bound.
+    uint64_t bucket(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    double sum() const { return sumOf.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<double> upper;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> total{ 0 };
+    std::atomic<double> sumOf{ 0 };
+};
+
+// Seconds, 100 us to 10 s.
+const std::vector<double>& latencyBuckets();
+
+// key="value" with the value escaped, for label sets built at run time.
+std::string label(std::string_view key, std::string_view value);
+
+// Text for metric families a collector produces itself.
+class Exposition {
+public:
+    explicit Exposition(std::string& text) : out(text) {}
+    // "# HELP" and "# TYPE"; type is counter, gauge, histogram or summary.
+    void family(std::string_view name, std::string_view help, const char* type);
+    // labels without the braces, or empty.
+    void sample(std::string_view name, std::string_view labels, double value);
+    void sample(std::string_view name, std::string_view labels, uint64_t value);
+    // The _bucket, _sum and _count lines of one histogram series. buckets are
+    // not cumulative, one per bound and a last one above them all.
+    void histogram(std::string_view name, std::string_view labels, const std::vector<double>& bounds,
+                   const std::vector<uint64_t>& buckets, double sum);
+
+private:
+    void name(std::string_view name, std::string_view labels);
+
+    std::string& out;
+};
+
+class Registry {
+public:
+    Registry();
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    // The series of a family with these labels, created on first use. A name
+    // keeps the type and help it was first registered with; asking for it as
+    // another type is a programming error and returns a detached series.
+    Counter& counter(std::string_view name, std::string_view help, std::string_view labels = {});
+    Gauge& gauge(std::string_view name, std::string_view help, std::string_view labels = {});
+    Histogram& histogram(std::string_view name, std::string_view help, const std::vector<double>& bounds = latencyBuckets(),
+                         std::string_view labels = {});
+
+    // Runs at every scrape, after the registry's own families. Returns a
+    // handle for removeCollector(), which waits out a scrape in progress, so
+    // whatever the collector reads may go away right after.
+    int addCollector(std::function<void(Exposition&)> collect);
+    void removeCollector(int handle);
+
+    // Every family, sorted by name, then the collectors'.
+    void render(std::string& out);
+
+private:
+    enum class Type { Counter, Gauge, Histogram };
+
+    struct Series {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    struct Family {
+        Type type;
+        std::string help;
+        std::vector<std::unique_ptr<Series>> series;
+    };
+
+    Series* find(std::string_view name, std::string_view help, std::string_view labels, Type type);
+
+    std::mutex mutex;
+    std::map<std::string, Family, std::less<>> families;
+    // Held while collectors run, so removeCollector() can wait for them.
+    std::mutex collectMutex;
+    std::map<int, std::function<void(Exposition&)>> collectors;
+    int nextCollector = 1;
+    // For a series asked for as the wrong type.
+    std::vector<std::unique_ptr<Series>> detached;
+};
+
+// The process-wide registry every helper reports into. It starts with
+// process_resident_memory_bytes.
+Registry& registry();
+
+// Serves registry() over HTTP on 127.0.0.1 from a thread of its own, one
+// request per connection.
+class Server {
+public:
+    // Null, with the reason on stderr, if the port cannot be bound.
+    static std::unique_ptr<Server> listen(uint16_t port);
+    ~Server();
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    uint16_t port() const { return boundPort; }
+
+private:
+    Server(intptr_t socket, uint16_t port);
+    void acceptLoop();
+    void serve(intptr_t client);
+
+    intptr_t listener;
+    uint16_t boundPort;
+    std::atomic<bool> stopping{ false };
+    std::string body;
+    std::thread thread;
+};
+
+// --metrics=<port> on the command line or HELPER_METRICS=<port> in the
+// environment starts a Server; null without either. Port 0 picks a free one.
+std::unique_ptr<Server> serveFromArgs(int argc, char** argv);
+
+} // namespace metrics
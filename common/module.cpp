@@ -0,0 +1,71 @@
+#include "module.h"
+#include "metrics.h"
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace helper {
+
+// Shared with the reader thread, which may outlive the CommandReader.
+struct CommandReader::Shared {
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::deque<std::string> lines;
+    bool eof = false;
+};
+
+CommandReader::CommandReader() : shared(std::make_shared<Shared>()) {
+    std::thread([state = shared] {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            size_t first = line.find_first_not_of(" \t\r\n");
+            if (first == std::string::npos) continue;
+            size_t last = line.find_last_not_of(" \t\r\n");
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->lines.push_back(line.substr(first, last - first + 1));
+            state->arrived.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->eof = true;
+        state->arrived.notify_one();
+    }).detach();
+}
+
+bool CommandReader::next(std::string& line, std::chrono::milliseconds wait) {
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->arrived.wait_for(lock, wait, [this] { return !shared->lines.empty() || shared->eof; });
+    if (shared->lines.empty()) return false;
+    line = std::move(shared->lines.front());
+    shared->lines.pop_front();
+    return true;
+}
+
+bool CommandReader::ended() const {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    return shared->eof && shared->lines.empty();
+}
+
+int runStandalone(int argc, char** argv, ModuleFactory factory) {
+    protocol::Output output(protocol::modeFromArgs(argc, argv));
+    std::unique_ptr<metrics::Server> metricsServer = metrics::serveFromArgs(argc, argv);
+    std::unique_ptr<Module> module = factory(output, hal::traceOptionsFromArgs(argc, argv));
+    if (!module->start()) return 1;
+    module->setSubscribed(true);
+
+    CommandReader commands;
+    std::string line;
+    while (!module->finished()) {
+        if (commands.next(line, std::chrono::milliseconds(200))) {
+            if (line == "exit" || line == "quit") break;
+            module->command(line);
+        } else if (commands.ended()) {
+            break;
+        }
+    }
+    return 0;
+}
+
+} // namespace helper
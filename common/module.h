@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "hal/trace.h"
+#include "protocol.h"
+
+// A helper as a module: the battery monitor, the PCI scan, the USB monitor
+// and the webcam each implement Module, and run either as a process of their
+// own (runStandalone) or side by side in helperd, which starts a module the
+// first time the host uses it and keeps it running after, so switching labs
+// neither restarts a process nor loses device state.
+//
+// start() and command() are only ever called from one thread, the one that
+// reads the commands; a module that needs COM or a message queue for them
+// gets it there. Whatever a module reports from its own threads goes through
+// the Output it was created with, on its channel.
+
+namespace helper {
+
+class Module {
+public:
+    virtual ~Module() = default;
+    // Opens the backend and starts the module's threads. False if it cannot
+    // run here; the module has said why on its channel or stderr.
+    virtual bool start() = 0;
+    // One command line as the helper always took it ("lock|<id>", ...),
+    // trimmed and not empty.
+    virtual void command(const std::string& line) = 0;
+    // Sends the module's current state again, for a host that just
+    // subscribed to it.
+    virtual void refresh() {}
+    // Whether a host is listening on the module's channel: false until it
+    // subscribes (in helperd), true throughout when the module runs on its
+    // own. For what should only be active while someone uses the module,
+    // such as global hotkeys.
+    virtual void setSubscribed(bool) {}
+    // Nothing more will happen (a replayed trace ran out).
+    virtual bool finished() const { return false; }
+};
+
+using ModuleFactory = std::unique_ptr<Module> (*)(protocol::Output& output, const hal::TraceOptions& trace);
+
+// Lines from stdin, read on a thread of their own so the thread acting on
+// them can also notice a module finishing. The reader thread is left blocked
+// on stdin when the process exits.
+class CommandReader {
+public:
+    CommandReader();
+    // The next line, trimmed; empty lines are skipped. False if none arrived
+    // within the wait, or stdin has ended and every line was taken.
+    bool next(std::string& line, std::chrono::milliseconds wait);
+    bool ended() const;
+
+private:
+    struct Shared;
+    std::shared_ptr<Shared> shared;
+};
+
+// main() of a helper that is one module: stdout in the mode the command line
+// asks for, --record/--replay, --metrics, and commands from stdin until it
+// ends, "exit" or "quit", or the module finishes. 1 if the module cannot start.
+int runStandalone(int argc, char** argv, ModuleFactory factory);
+
+} // namespace helper
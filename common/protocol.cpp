@@ -0,0 +1,942 @@
+#include "protocol.h"
+#include "json.h"
+#include "metrics.h"
+
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace protocol {
+
+namespace {
+
+const char* const kTypeNames[] = {
+    "",
+    "log",
+    "status",
+    "power_status",
+    "device_list",
+    "camera_info",
+    "file_saved",
+    "preview_started",
+    "preview_frame",
+    "preview_stopped",
+    "session_opened",
+    "session_closed",
+    "session_stats",
+    "stats",
+    "motion_armed",
+    "motion_disarmed",
+    "motion_started",
+    "motion_stopped",
+    "continuous_started",
+    "continuous_stopped",
+    "segment_closed",
+    "segment_deleted",
+};
+
+constexpr size_t kTypeCount = sizeof(kTypeNames) / sizeof(kTypeNames[0]);
+static_assert(kTypeCount == kMessageTypes, "kTypeNames must name every MessageType");
+
+const char* const kChannelNames[] = {
+    "",
+    "battery",
+    "pci",
+    "usb",
+    "webcam",
+};
+
+static_assert(sizeof(kChannelNames) / sizeof(kChannelNames[0]) == kChannels, "kChannelNames must name every Channel");
+
+inline void putBE16(std::string& b, uint16_t v) {
+    b.push_back((char)(v >> 8));
+    b.push_back((char)v);
+}
+
+inline void putBE32(std::string& b, uint32_t v) {
+    putBE16(b, (uint16_t)(v >> 16));
+    putBE16(b, (uint16_t)v);
+}
+
+inline void putBE64(std::string& b, uint64_t v) {
+    putBE32(b, (uint32_t)(v >> 32));
+    putBE32(b, (uint32_t)v);
+}
+
+inline uint32_t readLE32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint64_t readBE(const uint8_t* p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+// ---- MessagePack -> JSON ----
+
+void jsonString(const char* s, size_t n, std::string& out) {
+    out.push_back('"');
+    json::appendEscaped(out, std::string_view(s, n));
+    out.push_back('"');
+}
+
+struct MsgpackReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    std::string& out;
+
+    bool need(size_t n) const { return (size_t)(end - p) >= n; }
+
+    bool str(size_t n) {
+        if (!need(n)) return false;
+        jsonString((const char*)p, n, out);
+        p += n;
+        return true;
+    }
+
+    bool items(size_t n, bool map, int depth) {
+        out.push_back(map ? '{' : '[');
+        for (size_t i = 0; i < n; ++i) {
+            if (i) out.push_back(',');
+            if (map) {
+                if (!value(depth + 1)) return false;
+                out.push_back(':');
+            }
+            if (!value(depth + 1)) return false;
+        }
+        out.push_back(map ? '}' : ']');
+        return true;
+    }
+
+    bool number(double d) {
+        json::appendReal(out, d);
+        return true;
+    }
+
+    bool value(int depth) {
+        if (depth > 64 || !need(1)) return false;
+        uint8_t t = *p++;
+        if (t <= 0x7f) { json::appendInteger(out, (int)t); return true; }
+        if (t >= 0xe0) { json::appendInteger(out, (int)(int8_t)t); return true; }
+        if ((t & 0xe0) == 0xa0) return str(t & 0x1f);
+        if ((t & 0xf0) == 0x90) return items(t & 0x0f, false, depth);
+        if ((t & 0xf0) == 0x80) return items(t & 0x0f, true, depth);
+        switch (t) {
+        case 0xc0: out += "null"; return true;
+        case 0xc2: out += "false"; return true;
+        case 0xc3: out += "true"; return true;
+        case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+            int n = 1 << (t - 0xcc);
+            if (!need(n)) return false;
+            json::appendInteger(out, readBE(p, n));
+            p += n;
+            return true;
+        }
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+            int n = 1 << (t - 0xd0);
+            if (!need(n)) return false;
+            uint64_t raw = readBE(p, n);
+            int shift = 64 - 8 * n;
+            int64_t v = (int64_t)(raw << shift) >> shift;
+            json::appendInteger(out, v);
+            p += n;
+            return true;
+        }
+        case 0xca: {
+            if (!need(4)) return false;
+            uint32_t raw = (uint32_t)readBE(p, 4);
+            float f;
+            memcpy(&f, &raw, 4);
+            p += 4;
+            return number(f);
+        }
+        case 0xcb: {
+            if (!need(8)) return false;
+            uint64_t raw = readBE(p, 8);
+            double d;
+            memcpy(&d, &raw, 8);
+            p += 8;
+            return number(d);
+        }
+        case 0xd9: case 0xda: case 0xdb: {
+            int n = 1 << (t - 0xd9);
+            if (!need(n)) return false;
+            size_t len = (size_t)readBE(p, n);
+            p += n;
+            return str(len);
+        }
+        case 0xc4: case 0xc5: case 0xc6: {
+            // Binary has no JSON form; it becomes an array of byte values.
+            int n = 1 << (t - 0xc4);
+            if (!need(n)) return false;
+            size_t len = (size_t)readBE(p, n);
+            p += n;
+            if (!need(len)) return false;
+            out.push_back('[');
+            for (size_t i = 0; i < len; ++i) {
+                if (i) out.push_back(',');
+                json::appendInteger(out, (int)p[i]);
+            }
+            out.push_back(']');
+            p += len;
+            return true;
+        }
+        case 0xdc: case 0xdd: case 0xde: case 0xdf: {
+            int n = (t & 1) ? 4 : 2;
+            if (!need(n)) return false;
+            size_t count = (size_t)readBE(p, n);
+            p += n;
+            return items(count, t >= 0xde, depth);
+        }
+        default:
+            return false;
+        }
+    }
+};
+
+// ---- JSON -> MessagePack ----
+
+struct JsonReader {
+    const char* p;
+    const char* end;
+    Encoder& enc;
+    MessageType* type;
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+    }
+
+    bool literal(const char* word) {
+        size_t n = strlen(word);
+        if ((size_t)(end - p) < n || memcmp(p, word, n) != 0) return false;
+        p += n;
+        return true;
+    }
+
+    static void appendUtf8(std::string& s, uint32_t cp) {
+        if (cp < 0x80) {
+            s.push_back((char)cp);
+        } else if (cp < 0x800) {
+            s.push_back((char)(0xc0 | (cp >> 6)));
+            s.push_back((char)(0x80 | (cp & 0x3f)));
+        } else if (cp < 0x10000) {
+            s.push_back((char)(0xe0 | (cp >> 12)));
+            s.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+            s.push_back((char)(0x80 | (cp & 0x3f)));
+        } else {
+            s.push_back((char)(0xf0 | (cp >> 18)));
+            s.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+            s.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+            s.push_back((char)(0x80 | (cp & 0x3f)));
+        }
+    }
+
+    bool hex4(uint32_t& v) {
+        if (end - p < 4) return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *p++;
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= (uint32_t)(c - '0');
+            else if (c >= 'a' && c <= 'f') v |= (uint32_t)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') v |= (uint32_t)(c - 'A' + 10);
+            else return false;
+        }
+        return true;
+    }
+
+    bool string(std::string& s) {
+        ++p; // opening quote
+        const char* run = p;
+        while (p < end) {
+            char c = *p;
+            if (c == '"') {
+                s.append(run, p);
+                ++p;
+                return true;
+            }
+            if (c != '\\') {
+                ++p;
+                continue;
+            }
+            s.append(run, p);
+            if (++p >= end) return false;
+            switch (*p++) {
+            case '"': s.push_back('"'); break;
+            case '\\': s.push_back('\\'); break;
+            case '/': s.push_back('/'); break;
+            case 'b': s.push_back('\b'); break;
+            case 'f': s.push_back('\f'); break;
+            case 'n': s.push_back('\n'); break;
+            case 'r': s.push_back('\r'); break;
+            case 't': s.push_back('\t'); break;
+            case 'u': {
+                uint32_t cp;
+                if (!hex4(cp)) return false;
+                // A surrogate only stands as the first half of a pair; alone
+                // it has no UTF-8 encoding.
+                if (cp >= 0xdc00 && cp < 0xe000) return false;
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    uint32_t low;
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u') return false;
+                    p += 2;
+                    if (!hex4(low) || low < 0xdc00 || low >= 0xe000) return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                appendUtf8(s, cp);
+                break;
+            }
+            default:
+                return false;
+            }
+            run = p;
+        }
+        return false;
+    }
+
+    // Parsed where it stands: from_chars needs neither a copy nor a
+    // terminator, and is locale-independent.
+    bool number() {
+        const char* start = p;
+        bool integral = true;
+        if (p < end && *p == '-') ++p;
+        while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) {
+            if (*p == '.' || *p == 'e' || *p == 'E') integral = false;
+            ++p;
+        }
+        if (p == start || (p - start == 1 && *start == '-')) return false;
+        if (integral) {
+            if (*start == '-') {
+                long long v;
+                std::from_chars_result r = std::from_chars(start, p, v);
+                if (r.ec == std::errc() && r.ptr == p) { enc.integer(v); return true; }
+            } else {
+                unsigned long long v;
+                std::from_chars_result r = std::from_chars(start, p, v);
+                if (r.ec == std::errc() && r.ptr == p) { enc.uinteger(v); return true; }
+            }
+        }
+        double d;
+        std::from_chars_result r = std::from_chars(start, p, d);
+        if (r.ptr != p) return false;
+        if (r.ec == std::errc::result_out_of_range) {
+            // Rare enough for a copy: strtod saturates to infinity or zero.
+            d = strtod(std::string(start, p).c_str(), nullptr);
+        }
+        enc.real(d);
+        return true;
+    }
+
+    bool value(int depth) {
+        if (depth > 64) return false;
+        skipSpace();
+        if (p >= end) return false;
+        switch (*p) {
+        case '{': {
+            ++p;
+            enc.beginMap();
+            skipSpace();
+            if (p < end && *p == '}') { ++p; enc.endMap(); return true; }
+            while (true) {
+                skipSpace();
+                if (p >= end || *p != '"') return false;
+                std::string k;
+                if (!string(k)) return false;
+                enc.key(k);
+                skipSpace();
+                if (p >= end || *p++ != ':') return false;
+                if (depth == 0 && type && k == "type") {
+                    skipSpace();
+                    std::string name;
+                    if (p >= end || *p != '"' || !string(name)) return false;
+                    enc.string(name);
+                    *type = typeFor(name);
+                } else if (!value(depth + 1)) {
+                    return false;
+                }
+                skipSpace();
+                if (p < end && *p == ',') { ++p; continue; }
+                if (p < end && *p == '}') { ++p; enc.endMap(); return true; }
+                return false;
+            }
+        }
+        case '[': {
+            ++p;
+            enc.beginArray();
+            skipSpace();
+            if (p < end && *p == ']') { ++p; enc.endArray(); return true; }
+            while (true) {
+                if (!value(depth + 1)) return false;
+                skipSpace();
+                if (p < end && *p == ',') { ++p; continue; }
+                if (p < end && *p == ']') { ++p; enc.endArray(); return true; }
+                return false;
+            }
+        }
+        case '"': {
+            std::string s;
+            if (!string(s)) return false;
+            enc.string(s);
+            return true;
+        }
+        case 't': if (!literal("true")) return false; enc.boolean(true); return true;
+        case 'f': if (!literal("false")) return false; enc.boolean(false); return true;
+        case 'n': if (!literal("null")) return false; enc.nil(); return true;
+        default: return number();
+        }
+    }
+};
+
+} // namespace
+
+const char* typeName(MessageType type) {
+    size_t i = (size_t)type;
+    return i < kTypeCount ? kTypeNames[i] : "";
+}
+
+MessageType typeFor(std::string_view name) {
+    for (size_t i = 1; i < kTypeCount; ++i) {
+        if (name == kTypeNames[i]) return (MessageType)i;
+    }
+    return MessageType::Generic;
+}
+
+const char* channelName(Channel channel) {
+    size_t i = (size_t)channel;
+    return i < kChannels ? kChannelNames[i] : "";
+}
+
+Channel channelFor(std::string_view name) {
+    for (size_t i = 1; i < kChannels; ++i) {
+        if (name == kChannelNames[i]) return (Channel)i;
+    }
+    return Channel::None;
+}
+
+bool supersedes(MessageType type) {
+    switch (type) {
+    case MessageType::PowerStatus:
+    case MessageType::DeviceList:
+    case MessageType::CameraInfo:
+    case MessageType::PreviewFrame:
+    case MessageType::SessionStats:
+        return true;
+    default:
+        return false;
+    }
+}
+
+Mode modeFromArgs(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--protocol=binary") == 0) return Mode::Binary;
+        if (strcmp(argv[i], "--protocol=json") == 0) return Mode::JsonLines;
+    }
+    const char* env = getenv("HELPER_PROTOCOL");
+    return env && strcmp(env, "binary") == 0 ? Mode::Binary : Mode::JsonLines;
+}
+
+// ---- Encoder ----
+
+void Encoder::clear() {
+    buf.clear();
+    open.clear();
+}
+
+void Encoder::counted() {
+    if (!open.empty()) ++open.back().count;
+}
+
+void Encoder::nil() {
+    counted();
+    buf.push_back((char)0xc0);
+}
+
+void Encoder::boolean(bool v) {
+    counted();
+    buf.push_back((char)(v ? 0xc3 : 0xc2));
+}
+
+void Encoder::integer(int64_t v) {
+    if (v >= 0) {
+        uinteger((uint64_t)v);
+        return;
+    }
+    counted();
+    if (v >= -32) {
+        buf.push_back((char)(int8_t)v);
+    } else if (v >= INT8_MIN) {
+        buf.push_back((char)0xd0);
+        buf.push_back((char)(int8_t)v);
+    } else if (v >= INT16_MIN) {
+        buf.push_back((char)0xd1);
+        putBE16(buf, (uint16_t)(int16_t)v);
+    } else if (v >= INT32_MIN) {
+        buf.push_back((char)0xd2);
+        putBE32(buf, (uint32_t)(int32_t)v);
+    } else {
+        buf.push_back((char)0xd3);
+        putBE64(buf, (uint64_t)v);
+    }
+}
+
+void Encoder::uinteger(uint64_t v) {
+    counted();
+    if (v <= 0x7f) {
+        buf.push_back((char)v);
+    } else if (v <= 0xff) {
+        buf.push_back((char)0xcc);
+        buf.push_back((char)v);
+    } else if (v <= 0xffff) {
+        buf.push_back((char)0xcd);
+        putBE16(buf, (uint16_t)v);
+    } else if (v <= 0xffffffffu) {
+        buf.push_back((char)0xce);
+        putBE32(buf, (uint32_t)v);
+    } else {
+        buf.push_back((char)0xcf);
+        putBE64(buf, v);
+    }
+}
+
+void Encoder::real(double v) {
+    counted();
+    uint64_t raw;
+    memcpy(&raw, &v, 8);
+    buf.push_back((char)0xcb);
+    putBE64(buf, raw);
+}
+
+void Encoder::string(std::string_view v) {
+    counted();
+    size_t n = v.size();
+    if (n < 32) {
+        buf.push_back((char)(0xa0 | n));
+    } else if (n <= 0xff) {
+        buf.push_back((char)0xd9);
+        buf.push_back((char)n);
+    } else if (n <= 0xffff) {
+        buf.push_back((char)0xda);
+        putBE16(buf, (uint16_t)n);
+    } else {
+        buf.push_back((char)0xdb);
+        putBE32(buf, (uint32_t)n);
+    }
+    buf.append(v.data(), n);
+}
+
+void Encoder::binary(const void* data, size_t n) {
+    counted();
+    if (n <= 0xff) {
+        buf.push_back((char)0xc4);
+        buf.push_back((char)n);
+    } else if (n <= 0xffff) {
+        buf.push_back((char)0xc5);
+        putBE16(buf, (uint16_t)n);
+    } else {
+        buf.push_back((char)0xc6);
+        putBE32(buf, (uint32_t)n);
+    }
+    buf.append((const char*)data, n);
+}
+
+// A container starts with a 5-byte map32/array32 header; endMap/endArray
+// shrink it to the smallest form once the count is known.
+void Encoder::beginMap() {
+    counted();
+    open.push_back({ buf.size(), 0, true });
+    buf.append(5, '\0');
+}
+
+void Encoder::beginArray() {
+    counted();
+    open.push_back({ buf.size(), 0, false });
+    buf.append(5, '\0');
+}
+
+void Encoder::endMap() {
+    endArray();
+}
+
+void Encoder::endArray() {
+    if (open.empty()) return;
+    Open o = open.back();
+    open.pop_back();
+    uint32_t n = o.map ? o.count / 2 : o.count;
+    std::string header;
+    if (n < 16) {
+        header.push_back((char)((o.map ? 0x80 : 0x90) | n));
+    } else if (n <= 0xffff) {
+        header.push_back((char)(o.map ? 0xde : 0xdc));
+        putBE16(header, (uint16_t)n);
+    } else {
+        header.push_back((char)(o.map ? 0xdf : 0xdd));
+        putBE32(header, n);
+    }
+    buf.replace(o.offset, 5, header);
+}
+
+bool toJson(const uint8_t* data, size_t size, std::string& out) {
+    MsgpackReader r{ data, data + size, out };
+    return r.value(0) && r.p == r.end;
+}
+
+bool fromJson(std::string_view json, Encoder& enc, MessageType* type) {
+    enc.clear();
+    if (type) *type = MessageType::Generic;
+    JsonReader r{ json.data(), json.data() + json.size(), enc, type };
+    if (!r.value(0)) return false;
+    r.skipSpace();
+    return r.p == r.end;
+}
+
+bool fromJson(std::string_view json, std::string& out, MessageType* type) {
+    Encoder enc;
+    if (!fromJson(json, enc, type)) return false;
+    out = enc.bytes();
+    return true;
+}
+
+void appendFrame(std::string& out, MessageType type, std::string_view payload) {
+    uint32_t body = (uint32_t)(payload.size() + 2);
+    char header[kFrameHeader] = {
+        (char)body, (char)(body >> 8), (char)(body >> 16), (char)(body >> 24),
+        (char)(uint16_t)type, (char)((uint16_t)type >> 8),
+    };
+    out.append(header, kFrameHeader);
+    out.append(payload.data(), payload.size());
+}
+
+void appendFrame(std::string& out, MessageType type, Channel channel, std::string_view payload) {
+    uint32_t body = (uint32_t)(payload.size() + 4);
+    char header[kChannelFrameHeader] = {
+        (char)body, (char)(body >> 8), (char)(body >> 16), (char)(body >> 24),
+        (char)(uint16_t)type, (char)((uint16_t)type >> 8),
+        (char)(uint16_t)channel, (char)((uint16_t)channel >> 8),
+    };
+    out.append(header, kChannelFrameHeader);
+    out.append(payload.data(), payload.size());
+}
+
+// ---- decoders ----
+
+void FrameDecoder::feed(const void* data, size_t size) {
+    compact();
+    const uint8_t* bytes = (const uint8_t*)data;
+    buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+void FrameDecoder::compact() {
+    if (readPos && readPos >= buffer.size() - readPos) {
+        buffer.erase(buffer.begin(), buffer.begin() + (ptrdiff_t)readPos);
+        readPos = 0;
+    }
+}
+
+bool FrameDecoder::next(Frame& frame) {
+    if (broken) return false;
+    size_t avail = buffer.size() - readPos;
+    if (preamblePending) {
+        if (avail < sizeof(kPreamble)) return false;
+        if (memcmp(buffer.data() + readPos, kChannelPreamble, sizeof(kChannelPreamble)) == 0) {
+            channels = true;
+        } else if (memcmp(buffer.data() + readPos, kPreamble, sizeof(kPreamble)) != 0) {
+            broken = true;
+            return false;
+        }
+        readPos += sizeof(kPreamble);
+        avail -= sizeof(kPreamble);
+        preamblePending = false;
+    }
+    if (avail < 4) return false;
+    uint32_t body = readLE32(buffer.data() + readPos);
+    uint32_t header = channels ? 4 : 2;
+    if (body < header || body > kMaxFrameBytes) {
+        broken = true;
+        return false;
+    }
+    if (avail < 4 + (size_t)body) return false;
+    const uint8_t* p = buffer.data() + readPos;
+    frame.type = (MessageType)(p[4] | (p[5] << 8));
+    frame.channel = channels ? (Channel)(p[6] | (p[7] << 8)) : Channel::None;
+    frame.payload = p + 4 + header;
+    frame.size = body - header;
+    readPos += 4 + (size_t)body;
+    return true;
+}
+
+void LineDecoder::feed(const void* data, size_t size) {
+    if (readPos && readPos >= buffer.size() - readPos) {
+        buffer.erase(0, readPos);
+        scanPos -= readPos;
+        readPos = 0;
+    }
+    buffer.append((const char*)data, size);
+}
+
+bool LineDecoder::next(std::string_view& line) {
+    size_t nl = buffer.find('\n', scanPos);
+    if (nl == std::string::npos) {
+        scanPos = buffer.size();
+        return false;
+    }
+    size_t end = nl;
+    if (end > readPos && buffer[end - 1] == '\r') --end;
+    line = std::string_view(buffer.data() + readPos, end - readPos);
+    readPos = scanPos = nl + 1;
+    return true;
+}
+
+// ---- Output ----
+
+namespace {
+
+// Loops only if the pipe takes less than everything at once.
+void writeAll(int fd, const char* data, size_t size) {
+    while (size) {
+#if defined(_WIN32)
+        int n = _write(fd, data, (unsigned)(size < 0x40000000 ? size : 0x40000000));
+#else
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n <= 0) return;
+        data += n;
+        size -= (size_t)n;
+    }
+}
+
+// A JSON message is tagged by opening its object with the channel field;
+// closeTag() then removes the message's own '{' that follows.
+void openTag(std::string& out, Channel channel) {
+    out += "{\"channel\":\"";
+    out += channelName(channel);
+    out += "\",";
+}
+
+void closeTag(std::string& out, size_t message) {
+    out.erase(message, 1);
+    if (message < out.size() && out[message] == '}') out.erase(message - 1, 1);
+}
+
+// Every Output of the process reports into the same series.
+struct OutputMetrics {
+    metrics::Counter& queued = counter("queued");
+    metrics::Counter& written = counter("written");
+    metrics::Counter& coalesced = counter("coalesced");
+    metrics::Counter& dropped = counter("dropped");
+    metrics::Counter& filtered = counter("filtered");
+    metrics::Counter& writes = metrics::registry().counter("helper_output_writes_total", "Writes to the pipe.");
+    metrics::Counter& bytes = metrics::registry().counter("helper_output_bytes_total", "Bytes written to the pipe.");
+    metrics::Gauge& depth = metrics::registry().gauge("helper_output_queue_depth", "Messages queued and not yet written.");
+    metrics::Histogram& stall = metrics::registry().histogram(
+        "helper_output_write_seconds", "Time one write to the pipe took; long ones mean the host is not reading.");
+
+    static metrics::Counter& counter(const char* outcome) {
+        return metrics::registry().counter("helper_output_messages_total", "Messages sent, by what became of them.",
+                                           metrics::label("outcome", outcome));
+    }
+};
+
+OutputMetrics& outputMetrics() {
+    static OutputMetrics m;
+    return m;
+}
+
+} // namespace
+
+Output::Output(Mode mode, FILE* stream, size_t capacity, bool multiplexed)
+    : wireMode(mode), tagged(multiplexed), capacity(capacity ? capacity : 1) {
+    for (bool& on : listening) on = !tagged;
+    listening[(size_t)Channel::None] = true;
+    // Anything already buffered in stdio goes first; from here on messages
+    // bypass it.
+    fflush(stream);
+    fd = fileno(stream);
+    if (wireMode == Mode::Binary) {
+#if defined(_WIN32)
+        _setmode(fd, _O_BINARY);
+#endif
+        writeAll(fd, tagged ? kChannelPreamble : kPreamble, sizeof(kPreamble));
+    }
+    writer = std::thread(&Output::writerLoop, this);
+}
+
+Output::~Output() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+}
+
+Output::Queued* Output::snapshot(MessageType type, Channel channel) {
+    size_t t = (size_t)type;
+    if (t >= kMessageTypes || (size_t)channel >= kChannels || !supersedes(type)) return nullptr;
+    return &latest[t][(size_t)channel];
+}
+
+bool Output::admit(MessageType type, Channel channel) {
+    if ((size_t)channel >= kChannels || !listening[(size_t)channel]) {
+        ++counters.filtered;
+        outputMetrics().filtered.add();
+        return false;
+    }
+    if (count < capacity) return true;
+    Queued* q = snapshot(type, channel);
+    if (q && q->offset != SIZE_MAX) return true;
+    ++counters.dropped;
+    outputMetrics().dropped.add();
+    return false;
+}
+
+void Output::commit(MessageType type, Channel channel, size_t offset) {
+    OutputMetrics& m = outputMetrics();
+    ++counters.queued;
+    m.queued.add();
+    size_t size = pending.size() - offset;
+    Queued* q = snapshot(type, channel);
+    if (q && q->offset != SIZE_MAX) {
+        // The newer snapshot takes the older one's place in the queue, so
+        // it goes out where the older one would have.
+        scratch.assign(pending, offset, size);
+        pending.resize(offset);
+        pending.replace(q->offset, q->size, scratch);
+        for (Queued* other = &latest[0][0]; other != &latest[0][0] + kMessageTypes * kChannels; ++other) {
+            if (other->offset != SIZE_MAX && other->offset > q->offset) other->offset = other->offset - q->size + size;
+        }
+        q->size = size;
+        ++counters.coalesced;
+        m.coalesced.add();
+        return;
+    }
+    if (q) *q = Queued{ offset, size };
+    ++count;
+    if (count > counters.maxDepth) counters.maxDepth = count;
+    m.depth.add(1);
+    wake.notify_one();
+}
+
+// A message that cannot be encoded is cut off again, leaving what was queued
+// before it untouched.
+void Output::send(MessageType type, const Encoder& payload, Channel channel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!admit(type, channel)) return;
+    size_t offset = pending.size();
+    bool tag = tagged && channel != Channel::None;
+    if (wireMode == Mode::Binary) {
+        if (tagged) appendFrame(pending, type, channel, payload.bytes());
+        else appendFrame(pending, type, payload.bytes());
+    } else {
+        if (tag) openTag(pending, channel);
+        size_t message = pending.size();
+        if (!toJson((const uint8_t*)payload.bytes().data(), payload.bytes().size(), pending)) {
+            pending.resize(offset);
+            return;
+        }
+        if (tag) closeTag(pending, message);
+        pending.push_back('\n');
+    }
+    commit(type, channel, offset);
+}
+
+void Output::sendJson(std::string_view json, MessageType type, Channel channel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (wireMode == Mode::Binary && !fromJson(json, transcoded, &type)) return;
+    if (!admit(type, channel)) return;
+    size_t offset = pending.size();
+    bool tag = tagged && channel != Channel::None && !json.empty() && json[0] == '{';
+    if (wireMode == Mode::Binary) {
+        if (tagged) appendFrame(pending, type, channel, transcoded.bytes());
+        else appendFrame(pending, type, transcoded.bytes());
+    } else {
+        if (tag) openTag(pending, channel);
+        size_t message = pending.size();
+        pending.append(json.data(), json.size());
+        if (tag) closeTag(pending, message);
+        pending.push_back('\n');
+    }
+    commit(type, channel, offset);
+}
+
+void Output::subscribe(Channel channel, bool on) {
+    if (!tagged || channel == Channel::None || (size_t)channel >= kChannels) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    listening[(size_t)channel] = on;
+}
+
+bool Output::subscribed(Channel channel) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (size_t)channel < kChannels && listening[(size_t)channel];
+}
+
+void Output::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (batchDepth) return;
+    idle.wait(lock, [this] { return !count && !writing; });
+}
+
+OutputStats Output::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    OutputStats st = counters;
+    st.depth = count;
+    return st;
+}
+
+void Output::beginBatch() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++batchDepth;
+}
+
+void Output::endBatch() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (batchDepth > 0) --batchDepth;
+    if (!batchDepth) wake.notify_one();
+}
+
+// Takes everything queued at once, so a consumer that fell behind gets one
+// large write instead of one per message. The two buffers trade places, so
+// neither is reallocated once both have grown to the largest backlog.
+void Output::writerLoop() {
+    OutputMetrics& m = outputMetrics();
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this] { return stopping || (count && !batchDepth); });
+        if (!count) {
+            if (stopping) break;
+            continue;
+        }
+        chunk.swap(pending);
+        pending.clear();
+        size_t messages = count;
+        count = 0;
+        for (Queued* q = &latest[0][0]; q != &latest[0][0] + kMessageTypes * kChannels; ++q) q->offset = SIZE_MAX;
+        writing = true;
+        lock.unlock();
+        m.depth.add(-(double)messages);
+        auto t0 = std::chrono::steady_clock::now();
+        writeAll(fd, chunk.data(), chunk.size());
+        m.stall.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        m.written.add(messages);
+        m.writes.add();
+        m.bytes.add(chunk.size());
+        lock.lock();
+        writing = false;
+        counters.written += messages;
+        ++counters.writes;
+        idle.notify_all();
+    }
+}
+
+} // namespace protocol
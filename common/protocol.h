@@ -0,0 +1,305 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <string_view>
+#include <vector>
+
+// Message framing between the helpers and the Electron host.
+//
+// Two wire modes carry the same messages:
+//
+//   JsonLines  one JSON object per line, as the helpers always wrote.
+//   Binary     the preamble "HPB1", then frames of
+//                u32 LE  body length
+//                u16 LE  message type (MessageType)
+//                ...     payload, one MessagePack map
+//              The host can route on the type without decoding the payload,
+//              and finding the end of a message costs one length read instead
+//              of a scan for the newline.
+//
+// The host picks the mode by starting a helper with --protocol=binary. An
+// older helper ignores the flag and writes JSON lines, which the host tells
+// apart by the missing preamble.
+//
+// helperd, which hosts several helpers as modules of one process, tags every
+// message with the module it came from (Channel). Its binary stream starts
+// with "HPB2" and each frame header gains a u16 LE channel after the type;
+// its JSON lines carry a leading "channel" field. Messages of a module the
+// host has not subscribed to are dropped before they are queued.
+//
+// Output never makes the thread that produced a message wait for the pipe.
+// Messages go into a bounded queue and a single writer thread drains it,
+// writing everything that has piled up with one write straight to the
+// descriptor. When the host falls behind, a queued snapshot (device_list,
+// camera_info, power status, ...) is overwritten in place by the newer one of
+// the same type and channel, so snapshots never take more than one slot each;
+// once the queue is full other messages are dropped and counted rather than
+// blocking the producer. While a Batch is open the writer holds off, so
+// everything sent meanwhile goes out in one write. Messages are encoded into
+// one buffer that the writer swaps for its own, so once warm a message costs
+// no allocation in JSON-lines mode.
+
+namespace protocol {
+
+enum class Mode { JsonLines, Binary };
+
+enum class MessageType : uint16_t {
+    Generic = 0, // payload carries its own "type" string
+    Log,
+    Status,
+    PowerStatus,
+    DeviceList,
+    CameraInfo,
+    FileSaved,
+    PreviewStarted,
+    PreviewFrame,
+    PreviewStopped,
+    SessionOpened,
+    SessionClosed,
+    SessionStats,
+    Stats,
+    MotionArmed,
+    MotionDisarmed,
+    MotionStarted,
+    MotionStopped,
+    ContinuousStarted,
+    ContinuousStopped,
+    SegmentClosed,
+    SegmentDeleted,
+};
+
+constexpr size_t kMessageTypes = (size_t)MessageType::SegmentDeleted + 1;
+
+// The module a message belongs to. None is helperd itself, and every message
+// of a helper running on its own.
+enum class Channel : uint16_t {
+    None = 0,
+    Battery,
+    Pci,
+    Usb,
+    Webcam,
+};
+
+constexpr size_t kChannels = (size_t)Channel::Webcam + 1;
+
+constexpr char kPreamble[4] = { 'H', 'P', 'B', '1' };
+constexpr char kChannelPreamble[4] = { 'H', 'P', 'B', '2' };
+constexpr size_t kFrameHeader = 6;
+constexpr size_t kChannelFrameHeader = 8;
+constexpr uint32_t kMaxFrameBytes = 16u << 20;
+
+// The "type" string of a message and back; unknown names map to Generic.
+const char* typeName(MessageType type);
+MessageType typeFor(std::string_view name);
+
+// The name of a channel as the host addresses it ("battery", ...) and back;
+// unknown names map to None.
+const char* channelName(Channel channel);
+Channel channelFor(std::string_view name);
+
+// A newer message of this type makes a queued one pointless.
+bool supersedes(MessageType type);
+
+// --protocol=binary on the command line or HELPER_PROTOCOL=binary in the
+// environment selects Binary.
+Mode modeFromArgs(int argc, char** argv);
+
+// MessagePack writer. Containers are closed explicitly and their element
+// counts filled in at the end, so callers never count fields.
+class Encoder {
+public:
+    void clear();
+    const std::string& bytes() const { return buf; }
+
+    void nil();
+    void boolean(bool v);
+    void integer(int64_t v);
+    void uinteger(uint64_t v);
+    void real(double v);
+    void string(std::string_view v);
+    void binary(const void* data, size_t size);
+
+    void beginMap();
+    void endMap();
+    void beginArray();
+    void endArray();
+
+    // Map entries.
+    void key(std::string_view k) { string(k); }
+    void field(std::string_view k, std::string_view v) { key(k); string(v); }
+    void field(std::string_view k, const char* v) { key(k); string(v); }
+    void field(std::string_view k, bool v) { key(k); boolean(v); }
+    void field(std::string_view k, int v) { key(k); integer(v); }
+    void field(std::string_view k, int64_t v) { key(k); integer(v); }
+    void field(std::string_view k, uint64_t v) { key(k); uinteger(v); }
+    void field(std::string_view k, double v) { key(k); real(v); }
+
+private:
+    void counted();
+
+    struct Open {
+        size_t offset;
+        uint32_t count;
+        bool map;
+    };
+    std::string buf;
+    std::vector<Open> open;
+};
+
+// MessagePack value -> JSON text, appended to out. False on malformed or
+// truncated input.
+bool toJson(const uint8_t* data, size_t size, std::string& out);
+// JSON text -> MessagePack. Integers stay integers. If type is given, it gets
+// the top-level "type" field. False on malformed input.
+bool fromJson(std::string_view json, std::string& out, MessageType* type = nullptr);
+// The same into an Encoder, which keeps its buffer between calls.
+bool fromJson(std::string_view json, Encoder& enc, MessageType* type = nullptr);
+
+void appendFrame(std::string& out, MessageType type, std::string_view payload);
+// A frame of a multiplexed ("HPB2") stream.
+void appendFrame(std::string& out, MessageType type, Channel channel, std::string_view payload);
+
+struct Frame {
+    MessageType type;
+    Channel channel; // None in an "HPB1" stream
+    const uint8_t* payload;
+    size_t size;
+};
+
+// Splits a binary stream into frames as bytes arrive. Each byte is looked at
+// once: consumed input is dropped by moving the unread tail to the front only
+// when it is smaller than what was consumed. The preamble decides whether
+// frames carry a channel; without one they do not.
+class FrameDecoder {
+public:
+    explicit FrameDecoder(bool expectPreamble = true) : preamblePending(expectPreamble) {}
+    void feed(const void* data, size_t size);
+    // The next complete frame; its payload stays valid until the next feed().
+    bool next(Frame& frame);
+    // The stream is not a valid frame stream; nothing more will be decoded.
+    bool failed() const { return broken; }
+
+private:
+    void compact();
+
+    std::vector<uint8_t> buffer;
+    size_t readPos = 0;
+    bool preamblePending;
+    bool channels = false;
+    bool broken = false;
+};
+
+// Splits JSON lines, scanning every byte once however the input is chunked.
+class LineDecoder {
+public:
+    void feed(const void* data, size_t size);
+    // The next complete line without its terminator; valid until the next feed().
+    bool next(std::string_view& line);
+
+private:
+    std::string buffer;
+    size_t readPos = 0;
+    size_t scanPos = 0;
+};
+
+// Counters of an Output since it was created.
+struct OutputStats {
+    uint64_t queued = 0;    // accepted from producers
+    uint64_t written = 0;   // handed to the pipe
+    uint64_t coalesced = 0; // replaced by a newer message of the same type and channel while queued
+    uint64_t dropped = 0;   // refused because the queue was full
+    uint64_t filtered = 0;  // of a channel nobody is subscribed to
+    uint64_t writes = 0;    // write calls, each carrying one or more messages
+    size_t depth = 0;       // queued and not yet written
+    size_t maxDepth = 0;
+};
+
+// A helper's stdout. Thread-safe; sending never blocks on the pipe.
+class Output {
+public:
+    static constexpr size_t kDefaultCapacity = 1024;
+
+    // A multiplexed output tags messages with their channel, and starts with
+    // no channel but None subscribed.
+    explicit Output(Mode mode = Mode::JsonLines, FILE* stream = stdout, size_t capacity = kDefaultCapacity,
+                    bool multiplexed = false);
+    // Writes whatever is still queued.
+    ~Output();
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    Mode mode() const { return wireMode; }
+    bool multiplexed() const { return tagged; }
+
+    void send(MessageType type, const Encoder& payload, Channel channel = Channel::None);
+    // An existing JSON message; converted to MessagePack in Binary mode. The
+    // type only matters for coalescing in JSON-lines mode, since Binary mode
+    // reads it from the message.
+    void sendJson(std::string_view json, MessageType type = MessageType::Generic, Channel channel = Channel::None);
+    // Whether messages of a channel are written or dropped. Ignored unless
+    // multiplexed. Messages of the channel already queued still go out.
+    void subscribe(Channel channel, bool on);
+    bool subscribed(Channel channel) const;
+    // Waits until everything sent so far has been written.
+    void flush();
+    OutputStats stats() const;
+
+    // Holds everything sent through the output until it goes out of scope.
+    class Batch {
+    public:
+        explicit Batch(Output& out) : output(out) { output.beginBatch(); }
+        ~Batch() { output.endBatch(); }
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+    private:
+        Output& output;
+    };
+
+private:
+    // Where a queued snapshot sits in pending.
+    struct Queued {
+        size_t offset = SIZE_MAX;
+        size_t size = 0;
+    };
+
+    void beginBatch();
+    void endBatch();
+    // With the mutex held: whether a message may be queued. A snapshot whose
+    // predecessor is still queued is always taken, since it replaces that one.
+    bool admit(MessageType type, Channel channel);
+    // With the mutex held, once the message is encoded at the end of pending
+    // from offset on: moves a snapshot over its queued predecessor and hands
+    // the message to the writer.
+    void commit(MessageType type, Channel channel, size_t offset);
+    Queued* snapshot(MessageType type, Channel channel);
+    void writerLoop();
+
+    Mode wireMode;
+    bool tagged;
+    bool listening[kChannels];
+    int fd;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t capacity;
+    size_t count = 0;
+    std::string pending; // encoded messages, in order, not yet taken by the writer
+    Queued latest[kMessageTypes][kChannels]; // queued snapshot per type and channel
+    int batchDepth = 0;
+    bool writing = false;
+    bool stopping = false;
+    OutputStats counters;
+    Encoder transcoded;
+    std::string scratch;
+    std::string chunk;
+    std::thread writer;
+};
+
+} // namespace protocol
@@ -0,0 +1,140 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../common/json.h"
+#include "../common/metrics.h"
+#include "../common/module.h"
+#include "../lab1/battery.h"
+#include "../lab2/pci_scan.h"
+#if defined(_WIN32)
+#include "../ui/src/lab4/webcam.h"
+#include "../ui/src/lab5/usb.h"
+#endif
+
+// Every helper in one process, for the host to keep running across lab
+// switches. Its stdout is a multiplexed Output (see common/protocol.h); its
+// stdin takes
+//
+//   subscribe|<module>      start the module if it is not running, and pass
+//                           its messages on; one already running sends its
+//                           current state again
+//   unsubscribe|<module>    drop its messages; the module keeps running, but
+//                           turns off what only a user of it needs (the
+//                           webcam's hotkeys)
+//   <module>|<command>      a command as the helper on its own takes it
+//   modules                 which modules exist, run and are subscribed
+//   exit, quit
+//
+// where <module> is battery, pci, usb or webcam. A module starts the first
+// time it is addressed and then stays up, so its devices, locks, sessions
+// and camera cache are as the host left them when it comes back. With
+// --metrics=<port> every module's metrics are served from one endpoint.
+
+namespace {
+
+struct Hosted {
+    protocol::Channel channel;
+    helper::ModuleFactory factory;
+    std::unique_ptr<helper::Module> module;
+};
+
+void sendStatus(protocol::Output& output, protocol::Channel channel, const char* text) {
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("type", "status");
+    msg.key("message").beginString().text(text).text(" ").text(protocol::channelName(channel)).text(".").endString();
+    msg.field("module", protocol::channelName(channel));
+    msg.field("error", true);
+    msg.endObject();
+    output.sendJson(msg.view(), protocol::MessageType::Status);
+}
+
+void sendModules(protocol::Output& output, const std::vector<Hosted>& hosted) {
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("type", "modules");
+    msg.key("modules").beginArray();
+    for (const Hosted& h : hosted) {
+        msg.beginObject();
+        msg.field("name", protocol::channelName(h.channel));
+        msg.field("running", h.module != nullptr);
+        msg.field("subscribed", output.subscribed(h.channel));
+        msg.endObject();
+    }
+    msg.endArray();
+    msg.endObject();
+    output.sendJson(msg.view());
+}
+
+// Starts the module on first use. One that cannot start is dropped, so the
+// next use tries again (a driver started, a camera plugged in).
+helper::Module* ensureStarted(protocol::Output& output, const hal::TraceOptions& trace, Hosted& h) {
+    if (h.module) return h.module.get();
+    std::unique_ptr<helper::Module> module = h.factory(output, trace);
+    if (!module->start()) {
+        sendStatus(output, h.channel, "Cannot start module");
+        return nullptr;
+    }
+    h.module = std::move(module);
+    return h.module.get();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    protocol::Output output(protocol::modeFromArgs(argc, argv), stdout, protocol::Output::kDefaultCapacity, true);
+    hal::TraceOptions trace = hal::traceOptionsFromArgs(argc, argv);
+    std::unique_ptr<metrics::Server> metricsServer = metrics::serveFromArgs(argc, argv);
+
+    std::vector<Hosted> hosted;
+    hosted.push_back({ protocol::Channel::Battery, batteryModule, nullptr });
+    hosted.push_back({ protocol::Channel::Pci, pciModule, nullptr });
+#if defined(_WIN32)
+    hosted.push_back({ protocol::Channel::Usb, usbModule, nullptr });
+    hosted.push_back({ protocol::Channel::Webcam, webcamModule, nullptr });
+#endif
+    auto find = [&](std::string_view name) -> Hosted* {
+        protocol::Channel channel = protocol::channelFor(name);
+        for (Hosted& h : hosted) {
+            if (h.channel == channel) return &h;
+        }
+        return nullptr;
+    };
+
+    helper::CommandReader commands;
+    std::string line;
+    while (!commands.ended()) {
+        if (!commands.next(line, std::chrono::milliseconds(200))) continue;
+        if (line == "exit" || line == "quit") break;
+        if (line == "modules") {
+            sendModules(output, hosted);
+            continue;
+        }
+
+        size_t bar = line.find('|');
+        if (bar == std::string::npos) continue;
+        std::string_view head(line.data(), bar);
+        std::string_view rest(line.data() + bar + 1, line.size() - bar - 1);
+
+        if (head == "subscribe" || head == "unsubscribe") {
+            Hosted* h = find(rest);
+            if (!h) continue;
+            if (head == "unsubscribe") {
+                output.subscribe(h->channel, false);
+                if (h->module) h->module->setSubscribed(false);
+                continue;
+            }
+            // Subscribed first, so what a starting module sends gets through.
+            output.subscribe(h->channel, true);
+            bool running = h->module != nullptr;
+            helper::Module* module = ensureStarted(output, trace, *h);
+            if (!module) continue;
+            if (running) module->refresh();
+            module->setSubscribed(true);
+        } else if (Hosted* h = find(head)) {
+            if (helper::Module* module = ensureStarted(output, trace, *h)) module->command(std::string(rest));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "battery.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../common/hal/power.h"
+#include "../common/metrics.h"
+
+namespace {
+
+std::string getACLineStatusString(uint8_t status) {
+    switch (status) {
+        case 0: return "Offline";
+        case 1: return "Online";
+        default: return "Unknown";
+    }
+}
+
+class BatteryModule : public helper::Module {
+public:
+    BatteryModule(protocol::Output& out, const hal::TraceOptions& options) : output(out), trace(options) {}
+
+    ~BatteryModule() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (poller.joinable()) poller.join();
+    }
+
+    bool start() override {
+        power = hal::openPower(trace);
+        if (!power) {
+            std::cerr << "No power backend." << std::endl;
+            return false;
+        }
+        poller = std::thread(&BatteryModule::pollLoop, this);
+        return true;
+    }
+
+    void command(const std::string& line) override {
+        if (line == "sleep") {
+            power->suspend(false);
+        } else if (line == "hibernate") {
+            power->suspend(true);
+        }
+    }
+
+    // The next status goes out now rather than at the end of the wait.
+    void refresh() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            refreshNow = true;
+        }
+        wake.notify_one();
+    }
+
+    bool finished() const override { return done; }
+
+private:
+    // A replay is paced by the trace, and over when it runs out.
+    void pollLoop() {
+        metrics::Registry& r = metrics::registry();
+        metrics::Counter& reads = r.counter("helper_power_reads_total", "Power status reads.",
+                                             metrics::label("result", "ok"));
+        metrics::Counter& failed = r.counter("helper_power_reads_total", "Power status reads.",
+                                              metrics::label("result", "failed"));
+        metrics::Histogram& took = r.histogram("helper_power_read_seconds", "Time one power status read took.");
+        metrics::Gauge& level = r.gauge("helper_battery_percent", "Battery charge, 0 to 100.");
+        metrics::Gauge& online = r.gauge("helper_power_ac_online", "1 on mains power, 0 on battery.");
+
+        while (!power->ended()) {
+            hal::PowerStatus sps;
+            auto t0 = std::chrono::steady_clock::now();
+            bool ok = power->read(sps);
+            // A replayed read waits for its time in the trace.
+            if (!trace.replaying()) took.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            (ok ? reads : failed).add();
+            if (ok) {
+                int batteryLifePercent = static_cast<int>(sps.batteryPercent);
+                if (batteryLifePercent > 100) {
+                    batteryLifePercent = 100;
+                }
+                level.set(batteryLifePercent);
+                online.set(sps.acLine == 1 ? 1 : 0);
+
+                protocol::Encoder status;
+                status.beginMap();
+                status.field("powerSource", getACLineStatusString(sps.acLine));
+                status.field("batteryType", sps.chemistry.empty() ? "N/A" : sps.chemistry.c_str());
+                status.field("batteryLevel", batteryLifePercent);
+                status.field("batteryLifeTime", (uint64_t)sps.lifeTime);
+                status.field("batteryFullLifeTime", (uint64_t)sps.fullLifeTime);
+                status.endMap();
+                output.send(protocol::MessageType::PowerStatus, status, protocol::Channel::Battery);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!trace.replaying()) {
+                wake.wait_for(lock, std::chrono::seconds(2), [this] { return stopping || refreshNow; });
+            }
+            refreshNow = false;
+            if (stopping) break;
+        }
+        done = true;
+    }
+
+    protocol::Output& output;
+    hal::TraceOptions trace;
+    std::unique_ptr<hal::Power> power;
+    std::thread poller;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    bool refreshNow = false;
+    std::atomic<bool> done{ false };
+};
+
+} // namespace
+
+std::unique_ptr<helper::Module> batteryModule(protocol::Output& output, const hal::TraceOptions& trace) {
+    return std::unique_ptr<helper::Module>(new BatteryModule(output, trace));
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "../common/module.h"
+
+// The battery monitor: a power_status message every 2 seconds (or at the
+// trace's pace when replaying), and the "sleep" and "hibernate" commands.
+std::unique_ptr<helper::Module> batteryModule(protocol::Output& output, const hal::TraceOptions& trace);
@@ -0,0 +1,65 @@
+#include "pci_scan.h"
+
+void writePciList(const std::vector<hal::PciFunction>& found, json::Writer& out) {
+    out.beginObject();
+    out.key("devices").beginArray();
+    for (const hal::PciFunction& f : found) {
+        out.beginObject();
+        out.key("DeviceID").beginString().text("0x").hex(f.deviceId, 4).endString();
+        out.key("VendorID").beginString().text("0x").hex(f.vendorId, 4).endString();
+        out.endObject();
+    }
+    out.endArray();
+    out.endObject();
+}
+
+namespace {
+
+class PciModule : public helper::Module {
+public:
+    PciModule(protocol::Output& out, const hal::TraceOptions& options) : output(out), trace(options) {}
+
+    bool start() override {
+        pci = hal::openPci(trace);
+        if (!pci) {
+            output.sendJson(trace.replaying()
+                                ? "{\"type\":\"status\",\"message\":\"Could not read the PCI trace.\",\"error\":true}"
+                                : "{\"type\":\"status\",\"message\":\"Could not open the GiveIO driver.\",\"error\":true}",
+                            protocol::MessageType::Status, protocol::Channel::Pci);
+            return false;
+        }
+        scan();
+        return true;
+    }
+
+    void command(const std::string& line) override {
+        if (line == "scan") scan();
+    }
+
+    void refresh() override { scan(); }
+
+private:
+    // {"type":"pci_devices","devices":[...]}: the file's object with the
+    // type in front.
+    void scan() {
+        std::vector<hal::PciFunction> found = hal::enumeratePci(*pci);
+        list.clear();
+        writePciList(found, list);
+        message.clear();
+        message.append("{\"type\":\"pci_devices\",");
+        message.append(list.view().substr(1));
+        output.sendJson(message, protocol::MessageType::Generic, protocol::Channel::Pci);
+    }
+
+    protocol::Output& output;
+    hal::TraceOptions trace;
+    std::unique_ptr<hal::PciConfig> pci;
+    json::Writer list;
+    std::string message;
+};
+
+} // namespace
+
+std::unique_ptr<helper::Module> pciModule(protocol::Output& output, const hal::TraceOptions& trace) {
+    return std::unique_ptr<helper::Module>(new PciModule(output, trace));
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <vector>
+
+#include "../common/hal/pci.h"
+#include "../common/json.h"
+#include "../common/module.h"
+
+// {"devices":[{"DeviceID":"0x1234","VendorID":"0x8086"},...]}, the list lab2
+// writes to Z:\pci_devices.txt.
+void writePciList(const std::vector<hal::PciFunction>& found, json::Writer& out);
+
+// The scan as a module: a pci_devices message carrying the same list when it
+// starts and on every "scan" command.
+std::unique_ptr<helper::Module> pciModule(protocol::Output& output, const hal::TraceOptions& trace);
@@ -1,11 +1,31 @@
 const { app, BrowserWindow, ipcMain } = require('electron');
+const fs = require('fs');
 const path = require('path');
 const { spawn } = require('child_process');
+const { HelperStream } = require('./protocol');
 
 app.commandLine.appendSwitch('autoplay-policy', 'no-user-gesture-required');
 
 let cppProcess = null;
 
+// helperd hosts every helper as a module of one process that outlives lab
+// switches (see helperd/main.cpp). Without it each lab gets its own helper
+// process, killed when the next lab starts.
+let daemon = null;
+let activeModule = null;
+
+const DAEMON = {
+  dev: path.join(__dirname, 'src', 'helperd', 'helperd.exe'),
+  prod: path.join(process.resourcesPath, 'helperd.exe')
+};
+
+const MODULES = {
+  default: 'battery',
+  lab1: 'battery',
+  lab4: 'webcam',
+  lab5: 'usb'
+};
+
 const EXECUTABLES = {
   default: {
     dev: path.join(__dirname, 'src', 'lab1', 'main.exe'),
@@ -52,7 +72,68 @@ const createWindow = () => {
     }
   };
 
+  const attachOutput = (child, onMessage) => {
+    const stream = new HelperStream(onMessage);
+
+    child.on('error', (error) => {
+      console.error(`C++ process error: ${error.message}`);
+      sendProcessError(`Helper error: ${error.message}`);
+    });
+
+    child.stdout.on('data', (data) => {
+      try {
+        stream.push(data);
+      } catch (error) {
+        console.error(`Helper output error: ${error.message}`);
+        sendProcessError(`Helper output error: ${error.message}`);
+        child.kill();
+      }
+    });
+
+    child.stderr.on('data', (data) => {
+      console.error(`C++ STDERR: ${data}`);
+    });
+  };
+
+  // Started once; a module's messages reach the page only while its lab is
+  // the active one, and helperd's own (no channel) always.
+  const startDaemon = () => {
+    const exePath = app.isPackaged ? DAEMON.prod : DAEMON.dev;
+    if (!fs.existsSync(exePath)) return null;
+    let child;
+    try {
+      child = spawn(exePath, ['--protocol=binary']);
+    } catch (error) {
+      console.error(`Failed to launch helperd: ${error.message}`);
+      return null;
+    }
+    attachOutput(child, (jsonString, channel) => {
+      if (!channel || channel === activeModule) win.webContents.send('cpp-data', jsonString);
+    });
+    const forget = () => {
+      if (daemon === child) {
+        daemon = null;
+        activeModule = null;
+      }
+    };
+    child.on('error', forget);
+    child.on('close', (code) => {
+      console.log(`helperd exited with code ${code}`);
+      forget();
+    });
+    return child;
+  };
+
   ipcMain.on('start-cpp', (_event, labNumber) => {
+    if (!daemon && !cppProcess) daemon = startDaemon();
+    if (daemon) {
+      const module = MODULES[labNumber] || MODULES.default;
+      if (activeModule && activeModule !== module) daemon.stdin.write(`unsubscribe|${activeModule}\n`);
+      activeModule = module;
+      daemon.stdin.write(`subscribe|${module}\n`);
+      return;
+    }
+
     if (cppProcess) {
       cppProcess.kill();
       cppProcess = null;
@@ -61,7 +142,8 @@ const createWindow = () => {
     const exePath = resolveExecutable(labNumber);
 
     try {
-      cppProcess = spawn(exePath);
+      // Helpers that predate the flag ignore it and keep writing JSON lines.
+      cppProcess = spawn(exePath, ['--protocol=binary']);
     } catch (error) {
       cppProcess = null;
       const logMessage = `Failed to launch helper (${labNumber || 'lab1'}): ${error.message}`;
@@ -69,29 +151,11 @@ const createWindow = () => {
       sendProcessError(logMessage);
       return;
     }
-    let buffer = '';
-
-    cppProcess.on('error', (error) => {
-      console.error(`C++ process error: ${error.message}`);
-      sendProcessError(`Helper error: ${error.message}`);
-      cppProcess = null;
-    });
-
-    cppProcess.stdout.on('data', (data) => {
-      buffer += data.toString();
-      let boundary = buffer.indexOf('\n');
-      while (boundary !== -1) {
-        const jsonString = buffer.substring(0, boundary);
-        buffer = buffer.substring(boundary + 1);
-        if (jsonString) {
-            win.webContents.send('cpp-data', jsonString);
-        }
-        boundary = buffer.indexOf('\n');
-      }
+    attachOutput(cppProcess, (jsonString) => {
+      win.webContents.send('cpp-data', jsonString);
     });
-
-    cppProcess.stderr.on('data', (data) => {
-      console.error(`C++ STDERR: ${data}`);
+    cppProcess.on('error', () => {
+      cppProcess = null;
     });
 
     cppProcess.on('close', (code) => {
@@ -101,7 +165,9 @@ const createWindow = () => {
   });
 
   ipcMain.on('send-command-to-cpp', (event, command) => {
-    if (cppProcess) {
+    if (daemon && activeModule) {
+      daemon.stdin.write(`${activeModule}|${command}\n`);
+    } else if (cppProcess) {
       cppProcess.stdin.write(`${command}\n`);
     }
   });
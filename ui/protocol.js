@@ -0,0 +1,209 @@
+const { StringDecoder } = require('string_decoder');
+
+// Incremental decoding of helper output. The wire format is described in
+// common/protocol.h: either JSON lines, or the "HPB1" preamble followed by
+// length-prefixed frames carrying a MessagePack map. helperd starts with
+// "HPB2" instead, and its frames carry the channel (module) after the type.
+// Both decoders look at every byte once, however the output is chunked.
+
+const PREAMBLE = Buffer.from('HPB1');
+const CHANNEL_PREAMBLE = Buffer.from('HPB2');
+const FRAME_HEADER = 6;
+const CHANNEL_FRAME_HEADER = 8;
+const MAX_FRAME_BYTES = 16 * 1024 * 1024;
+
+// protocol::Channel, by value.
+const CHANNELS = [null, 'battery', 'pci', 'usb', 'webcam'];
+
+class LineDecoder {
+  constructor() {
+    this.text = new StringDecoder('utf8');
+    this.pending = '';
+  }
+
+  push(chunk, onMessage) {
+    const text = this.text.write(chunk);
+    let start = 0;
+    let newline = text.indexOf('\n');
+    while (newline !== -1) {
+      let line = start === 0 ? this.pending + text.slice(0, newline) : text.slice(start, newline);
+      if (start === 0) this.pending = '';
+      if (line.endsWith('\r')) line = line.slice(0, -1);
+      if (line) onMessage(line);
+      start = newline + 1;
+      newline = text.indexOf('\n', start);
+    }
+    this.pending = start === 0 ? this.pending + text : text.slice(start);
+  }
+}
+
+// MessagePack -> JS value. 64-bit integers become Numbers and lose precision
+// past 2^53, the same as JSON.parse does with the JSON-lines stream.
+const decodeValue = (buf, state) => {
+  const t = buf[state.pos++];
+  const str = (n) => {
+    const s = buf.toString('utf8', state.pos, state.pos + n);
+    state.pos += n;
+    return s;
+  };
+  const items = (n, isMap) => {
+    if (isMap) {
+      const obj = {};
+      for (let i = 0; i < n; i++) {
+        const key = decodeValue(buf, state);
+        obj[key] = decodeValue(buf, state);
+      }
+      return obj;
+    }
+    const arr = new Array(n);
+    for (let i = 0; i < n; i++) arr[i] = decodeValue(buf, state);
+    return arr;
+  };
+  const take = (n, read) => {
+    const v = read(state.pos);
+    state.pos += n;
+    return v;
+  };
+
+  if (t <= 0x7f) return t;
+  if (t >= 0xe0) return t - 0x100;
+  if ((t & 0xe0) === 0xa0) return str(t & 0x1f);
+  if ((t & 0xf0) === 0x90) return items(t & 0x0f, false);
+  if ((t & 0xf0) === 0x80) return items(t & 0x0f, true);
+  switch (t) {
+    case 0xc0: return null;
+    case 0xc2: return false;
+    case 0xc3: return true;
+    case 0xcc: return take(1, (p) => buf.readUInt8(p));
+    case 0xcd: return take(2, (p) => buf.readUInt16BE(p));
+    case 0xce: return take(4, (p) => buf.readUInt32BE(p));
+    case 0xcf: return take(8, (p) => Number(buf.readBigUInt64BE(p)));
+    case 0xd0: return take(1, (p) => buf.readInt8(p));
+    case 0xd1: return take(2, (p) => buf.readInt16BE(p));
+    case 0xd2: return take(4, (p) => buf.readInt32BE(p));
+    case 0xd3: return take(8, (p) => Number(buf.readBigInt64BE(p)));
+    case 0xca: return take(4, (p) => buf.readFloatBE(p));
+    case 0xcb: return take(8, (p) => buf.readDoubleBE(p));
+    case 0xd9: return str(take(1, (p) => buf.readUInt8(p)));
+    case 0xda: return str(take(2, (p) => buf.readUInt16BE(p)));
+    case 0xdb: return str(take(4, (p) => buf.readUInt32BE(p)));
+    case 0xc4:
+    case 0xc5:
+    case 0xc6: {
+      const width = 1 << (t - 0xc4);
+      const n = take(width, (p) => buf.readUIntBE(p, width));
+      const bytes = buf.subarray(state.pos, state.pos + n);
+      state.pos += n;
+      return Array.from(bytes);
+    }
+    case 0xdc: return items(take(2, (p) => buf.readUInt16BE(p)), false);
+    case 0xdd: return items(take(4, (p) => buf.readUInt32BE(p)), false);
+    case 0xde: return items(take(2, (p) => buf.readUInt16BE(p)), true);
+    case 0xdf: return items(take(4, (p) => buf.readUInt32BE(p)), true);
+    default:
+      throw new Error(`Unsupported MessagePack byte 0x${t.toString(16)}`);
+  }
+};
+
+const decodeMessagePack = (buf) => decodeValue(buf, { pos: 0 });
+
+class FrameDecoder {
+  constructor() {
+    this.chunks = [];
+    this.available = 0;
+    this.preamblePending = true;
+    this.header = FRAME_HEADER;
+  }
+
+  // Removes n bytes from the front of the queue, copying only when they span
+  // chunks.
+  take(n) {
+    const first = this.chunks[0];
+    if (first.length >= n) {
+      const out = first.subarray(0, n);
+      if (first.length === n) this.chunks.shift();
+      else this.chunks[0] = first.subarray(n);
+      this.available -= n;
+      return out;
+    }
+    const out = Buffer.allocUnsafe(n);
+    let filled = 0;
+    while (filled < n) {
+      const chunk = this.chunks[0];
+      const part = Math.min(chunk.length, n - filled);
+      chunk.copy(out, filled, 0, part);
+      filled += part;
+      if (part === chunk.length) this.chunks.shift();
+      else this.chunks[0] = chunk.subarray(part);
+    }
+    this.available -= n;
+    return out;
+  }
+
+  peekUInt32LE() {
+    const first = this.chunks[0];
+    if (first.length >= 4) return first.readUInt32LE(0);
+    const head = this.take(4);
+    this.chunks.unshift(head);
+    this.available += 4;
+    return head.readUInt32LE(0);
+  }
+
+  // Calls onFrame(type, payload, channel) per complete frame, channel being
+  // null in an "HPB1" stream; throws on a stream that is not a frame stream.
+  push(chunk, onFrame) {
+    this.chunks.push(chunk);
+    this.available += chunk.length;
+    if (this.preamblePending) {
+      if (this.available < PREAMBLE.length) return;
+      const preamble = this.take(PREAMBLE.length);
+      if (preamble.equals(CHANNEL_PREAMBLE)) this.header = CHANNEL_FRAME_HEADER;
+      else if (!preamble.equals(PREAMBLE)) throw new Error('Missing protocol preamble');
+      this.preamblePending = false;
+    }
+    while (this.available >= 4) {
+      const body = this.peekUInt32LE();
+      if (body < this.header - 4 || body > MAX_FRAME_BYTES) throw new Error(`Bad frame length ${body}`);
+      if (this.available < 4 + body) return;
+      const frame = this.take(4 + body);
+      const channel = this.header === CHANNEL_FRAME_HEADER ? CHANNELS[frame.readUInt16LE(6)] || null : null;
+      onFrame(frame.readUInt16LE(4), frame.subarray(this.header), channel);
+    }
+  }
+}
+
+// Decodes a helper's stdout in whichever mode it turns out to use, and hands
+// every message on as a JSON string, as the renderer pages expect, along with
+// its channel when the binary stream carries one. helperd's JSON lines keep
+// theirs inside the message.
+class HelperStream {
+  constructor(onMessage) {
+    this.onMessage = onMessage;
+    this.decoder = null;
+    this.head = Buffer.alloc(0);
+  }
+
+  push(chunk) {
+    if (!this.decoder) {
+      // The first bytes tell the modes apart: a JSON line never starts with
+      // the preamble.
+      this.head = Buffer.concat([this.head, chunk]);
+      const n = Math.min(this.head.length, PREAMBLE.length);
+      const head = this.head.subarray(0, n);
+      const binary = head.equals(PREAMBLE.subarray(0, n)) || head.equals(CHANNEL_PREAMBLE.subarray(0, n));
+      if (binary && this.head.length < PREAMBLE.length) return;
+      this.decoder = binary ? new FrameDecoder() : new LineDecoder();
+      chunk = this.head;
+      this.head = null;
+    }
+    if (this.decoder instanceof LineDecoder) {
+      this.decoder.push(chunk, this.onMessage);
+    } else {
+      this.decoder.push(chunk, (_type, payload, channel) => {
+        this.onMessage(JSON.stringify(decodeMessagePack(payload)), channel);
+      });
+    }
+  }
+}
+
+module.exports = { LineDecoder, FrameDecoder, HelperStream, decodeMessagePack, CHANNELS };
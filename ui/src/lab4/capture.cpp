@@ -0,0 +1,218 @@
+#include "capture.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace capture {
+
+namespace {
+
+// A source that keeps failing is treated as gone (unplugged camera).
+constexpr int kMaxConsecutiveErrors = 10;
+
+} // namespace
+
+int64_t clockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t ClockSync::map(int64_t deviceNs, int64_t arrivalNs) {
+    int64_t offset = arrivalNs - deviceNs;
+    if (!valid) {
+        valid = true;
+        windowStart = arrivalNs;
+        currentMin = previousMin = offset;
+    } else if (arrivalNs - windowStart >= window) {
+        previousMin = currentMin;
+        currentMin = offset;
+        windowStart = arrivalNs;
+    } else if (offset < currentMin) {
+        currentMin = offset;
+    }
+    return deviceNs + std::min(currentMin, previousMin);
+}
+
+Session::Session(std::string id, std::unique_ptr<FrameSource> src, int slotCount)
+    : sessionId(std::move(id)), source(std::move(src)), slots((size_t)std::max(slotCount, 2)) {}
+
+Session::~Session() {
+    stop();
+}
+
+bool Session::start() {
+    if (running || captureThread.joinable()) return false;
+    running = true;
+    captureDone = false;
+
+    std::promise<bool> opened;
+    std::future<bool> result = opened.get_future();
+    captureThread = std::thread(&Session::captureLoop, this, &opened);
+    if (!result.get()) {
+        running = false;
+        captureThread.join();
+        return false;
+    }
+    deliverThread = std::thread(&Session::deliverLoop, this);
+    return true;
+}
+
+bool Session::stop(int timeoutMs) {
+    running = false;
+    frameReady.notify_all();
+    if (deliverThread.joinable()) deliverThread.join();
+    if (!captureThread.joinable()) return true;
+
+    source->cancel();
+    if (timeoutMs >= 0) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!captureExited.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return captureDone; })) {
+            return false;
+        }
+    }
+    captureThread.join();
+    return true;
+}
+
+void Session::addSink(std::shared_ptr<FrameSink> sink) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sinks.push_back(std::move(sink));
+}
+
+SessionStats Session::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    SessionStats s;
+    s.captured = captured;
+    s.delivered = delivered;
+    s.dropped = dropped;
+    s.readErrors = readErrors;
+    s.elapsedSeconds = startNs ? (clockNs() - startNs) / 1e9 : 0;
+    if (s.elapsedSeconds > 0) {
+        s.captureFps = captured / s.elapsedSeconds;
+        s.deliverFps = delivered / s.elapsedSeconds;
+    }
+    s.maxDeliverMs = maxDeliverNs / 1e6;
+    s.lastTimestampNs = lastTimestampNs;
+    return s;
+}
+
+void Session::captureLoop(std::promise<bool>* opened) {
+    source->attachThread();
+    if (!source->open(streamFormat) || streamFormat.width <= 0 || streamFormat.height <= 0) {
+        source->detachThread();
+        opened->set_value(false);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t bytes = pixelconv::imageSize(pixelconv::PixelFormat::NV12, streamFormat.width, streamFormat.height);
+        freeSlots.clear();
+        readySlots.clear();
+        for (size_t i = 0; i < slots.size(); ++i) {
+            slots[i].storage.assign(bytes, 0);
+            slots[i].frame.image = pixelconv::wrap(pixelconv::PixelFormat::NV12, streamFormat.width,
+                                                   streamFormat.height, slots[i].storage.data());
+            freeSlots.push_back((int)i);
+        }
+        startNs = clockNs();
+    }
+    opened->set_value(true);
+
+    int consecutiveErrors = 0;
+    while (running) {
+        int index;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!freeSlots.empty()) {
+                index = freeSlots.front();
+                freeSlots.pop_front();
+            } else {
+                // The sinks are behind: the oldest undelivered frame is dropped.
+                index = readySlots.front();
+                readySlots.pop_front();
+                ++dropped;
+            }
+        }
+
+        int64_t deviceNs = 0;
+        bool ok = source->read(slots[index].frame.image, deviceNs);
+        int64_t arrivalNs = clockNs();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) {
+                ++readErrors;
+                freeSlots.push_back(index);
+            } else {
+                Frame& frame = slots[index].frame;
+                frame.sequence = captured++;
+                frame.timestampNs = clock.map(deviceNs ? deviceNs : arrivalNs, arrivalNs);
+                lastTimestampNs = frame.timestampNs;
+                readySlots.push_back(index);
+            }
+        }
+        if (ok) {
+            consecutiveErrors = 0;
+            frameReady.notify_one();
+        } else if (++consecutiveErrors >= kMaxConsecutiveErrors) {
+            running = false;
+            frameReady.notify_all();
+        } else if (running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    source->close();
+    source->detachThread();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        captureDone = true;
+    }
+    captureExited.notify_all();
+}
+
+void Session::deliverLoop() {
+    source->attachThread();
+    std::vector<std::shared_ptr<FrameSink>> current;
+    std::vector<FrameSink*> finished;
+
+    while (true) {
+        int index;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            frameReady.wait(lock, [this] { return !readySlots.empty() || !running; });
+            if (!running) break;
+            index = readySlots.front();
+            readySlots.pop_front();
+            current = sinks;
+        }
+
+        int64_t t0 = clockNs();
+        finished.clear();
+        for (const std::shared_ptr<FrameSink>& sink : current) {
+            if (!sink->onFrame(slots[index].frame)) finished.push_back(sink.get());
+        }
+        int64_t spent = clockNs() - t0;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!finished.empty()) {
+            sinks.erase(std::remove_if(sinks.begin(), sinks.end(), [&](const std::shared_ptr<FrameSink>& s) {
+                return std::find(finished.begin(), finished.end(), s.get()) != finished.end();
+            }), sinks.end());
+        }
+        ++delivered;
+        maxDeliverNs = std::max(maxDeliverNs, spent);
+        freeSlots.push_back(index);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.swap(sinks);
+        sinks.clear();
+    }
+    for (const std::shared_ptr<FrameSink>& sink : current) sink->onStop();
+    source->detachThread();
+}
+
+} // namespace capture
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pixelconv.h"
+
+// Per-camera capture sessions.
+//
+// A Session owns one FrameSource and two threads. The capture thread only
+// pulls frames from the source into a small ring of preallocated NV12 slots.
+// The delivery thread hands them to the registered sinks (recorder, snapshot,
+// preview). When the sinks fall behind, the capture thread overwrites the
+// oldest undelivered frame and counts a drop. It never waits on a consumer, so
+// a slow disk or encoder on one camera cannot stall its device or any other
+// session.
+//
+// Every frame is stamped on the shared steady clock (see ClockSync), so frames
+// from different cameras can be lined up by timestamp.
+
+namespace capture {
+
+int64_t clockNs();
+
+// Maps a device's own frame clock onto clockNs(). The offset is the smallest
+// (arrival - device) seen over a sliding window: the minimum drops delivery
+// jitter, and the window lets the estimate follow slow drift between clocks.
+class ClockSync {
+public:
+    explicit ClockSync(int64_t windowNs = 2000000000) : window(windowNs) {}
+    int64_t map(int64_t deviceNs, int64_t arrivalNs);
+    void reset() { valid = false; }
+
+private:
+    int64_t window;
+    bool valid = false;
+    int64_t windowStart = 0;
+    int64_t currentMin = 0;
+    int64_t previousMin = 0;
+};
+
+struct StreamFormat {
+    int width = 0;
+    int height = 0;
+    double fps = 0;
+};
+
+struct Frame {
+    pixelconv::Image image; // NV12, valid only for the duration of the sink call
+    uint64_t sequence = 0;
+    int64_t timestampNs = 0; // on clockNs()
+};
+
+// A camera or synthetic generator. open/read/close run on the capture thread.
+class FrameSource {
+public:
+    virtual ~FrameSource() = default;
+    virtual bool open(StreamFormat& format) = 0;
+    // Blocks until the next frame and writes it as NV12 into dst. deviceNs is
+    // the source's own timestamp, or 0 if it has none.
+    virtual bool read(const pixelconv::Image& dst, int64_t& deviceNs) = 0;
+    virtual void close() = 0;
+    // Called from another thread when the session stops, to make a read()
+    // that is blocked on the device return (with false) instead of waiting for
+    // a frame that may never come. Must be safe at any point of the capture
+    // thread, including after close().
+    virtual void cancel() {}
+    // Called first and last on each session thread (COM initialization).
+    virtual void attachThread() {}
+    virtual void detachThread() {}
+};
+
+class FrameSink {
+public:
+    virtual ~FrameSink() = default;
+    // Returns false to be removed after this frame.
+    virtual bool onFrame(const Frame& frame) = 0;
+    // The session stopped while the sink was still attached.
+    virtual void onStop() {}
+};
+
+struct SessionStats {
+    uint64_t captured = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t readErrors = 0;
+    double elapsedSeconds = 0;
+    double captureFps = 0;
+    double deliverFps = 0;
+    double maxDeliverMs = 0; // slowest single pass through the sinks
+    int64_t lastTimestampNs = 0;
+};
+
+class Session {
+public:
+    Session(std::string id, std::unique_ptr<FrameSource> source, int slots = 4);
+    ~Session();
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // Opens the source on the capture thread and starts delivering.
+    bool start();
+    // Cancels the source's read and joins both threads. With timeoutMs >= 0 a
+    // source that still has not returned by then is left to its capture
+    // thread and stop() returns false; stop() can be called again to join it
+    // later, and the destructor waits for it.
+    bool stop(int timeoutMs = -1);
+    bool isRunning() const { return running; }
+
+    const std::string& id() const { return sessionId; }
+    const StreamFormat& format() const { return streamFormat; }
+
+    void addSink(std::shared_ptr<FrameSink> sink);
+    SessionStats stats() const;
+
+private:
+    struct Slot {
+        std::vector<uint8_t> storage;
+        Frame frame;
+    };
+
+    void captureLoop(std::promise<bool>* opened);
+    void deliverLoop();
+
+    std::string sessionId;
+    std::unique_ptr<FrameSource> source;
+    StreamFormat streamFormat;
+    std::vector<Slot> slots;
+    ClockSync clock;
+
+    mutable std::mutex mutex;
+    std::condition_variable frameReady;
+    std::condition_variable captureExited;
+    bool captureDone = false;
+    std::deque<int> freeSlots;
+    std::deque<int> readySlots;
+    std::vector<std::shared_ptr<FrameSink>> sinks;
+    std::atomic<bool> running{ false };
+    std::thread captureThread;
+    std::thread deliverThread;
+
+    int64_t startNs = 0;
+    uint64_t captured = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t readErrors = 0;
+    int64_t maxDeliverNs = 0;
+    int64_t lastTimestampNs = 0;
+};
+
+} // namespace capture
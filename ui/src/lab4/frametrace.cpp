@@ -0,0 +1,155 @@
+#include "frametrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace frametrace {
+
+namespace {
+
+enum Kind : uint8_t {
+    kOpen = 1,   // uvar stream, str camera, uvar width, uvar height, f64 fps
+    kFrame = 2,  // uvar stream, svar deviceNs, NV12 planes packed tight
+    kFailed = 3, // uvar stream: a read that failed
+    kClose = 4,  // uvar stream
+};
+
+std::atomic<uint64_t> nextStream{ 1 };
+
+class RecordingSource : public capture::FrameSource {
+public:
+    RecordingSource(std::unique_ptr<capture::FrameSource> camera, const std::string& id, std::shared_ptr<hal::TraceWriter> writer)
+        : inner(std::move(camera)), cameraId(id), trace(std::move(writer)), stream(nextStream++) {}
+
+    bool open(capture::StreamFormat& format) override {
+        if (!inner->open(format)) return false;
+        width = format.width;
+        height = format.height;
+        payload.clear();
+        payload.uvar(stream).str(cameraId).uvar((uint64_t)format.width).uvar((uint64_t)format.height).f64(format.fps);
+        trace->write(hal::Channel::Frames, kOpen, payload);
+        return true;
+    }
+
+    bool read(const pixelconv::Image& dst, int64_t& deviceNs) override {
+        bool ok = inner->read(dst, deviceNs);
+        payload.clear();
+        payload.uvar(stream);
+        if (!ok) {
+            trace->write(hal::Channel::Frames, kFailed, payload);
+            return false;
+        }
+        payload.svar(deviceNs);
+        for (int y = 0; y < height; ++y) payload.raw(dst.planes[0].data + (size_t)y * dst.planes[0].stride, (size_t)width);
+        for (int y = 0; y < height / 2; ++y) payload.raw(dst.planes[1].data + (size_t)y * dst.planes[1].stride, (size_t)width);
+        trace->write(hal::Channel::Frames, kFrame, payload);
+        return true;
+    }
+
+    void close() override {
+        inner->close();
+        payload.clear();
+        payload.uvar(stream);
+        trace->write(hal::Channel::Frames, kClose, payload);
+    }
+
+    void cancel() override { inner->cancel(); }
+    void attachThread() override { inner->attachThread(); }
+    void detachThread() override { inner->detachThread(); }
+
+private:
+    std::unique_ptr<capture::FrameSource> inner;
+    std::string cameraId;
+    std::shared_ptr<hal::TraceWriter> trace;
+    uint64_t stream;
+    int width = 0;
+    int height = 0;
+    hal::Packer payload;
+};
+
+class ReplaySource : public capture::FrameSource {
+public:
+    ReplaySource(const std::string& camera, hal::Speed speed) : cameraId(camera), clock(speed) {}
+
+    bool openTrace(const std::string& path) { return reader.open(path); }
+
+    // Finds the stream's Open record; the frames follow it in the file.
+    bool open(capture::StreamFormat& format) override {
+        while (reader.next(hal::Channel::Frames, rec)) {
+            if (rec.kind != kOpen) continue;
+            hal::Unpacker in(rec.payload);
+            uint64_t id = in.uvar();
+            if (in.str() != cameraId) continue;
+            stream = id;
+            format.width = width = (int)in.uvar();
+            format.height = height = (int)in.uvar();
+            format.fps = in.f64();
+            return in.ok();
+        }
+        return false;
+    }
+
+    bool read(const pixelconv::Image& dst, int64_t& deviceNs) override {
+        while (!over && reader.next(hal::Channel::Frames, rec)) {
+            hal::Unpacker in(rec.payload);
+            if (in.uvar() != stream) continue;
+            if (rec.kind == kClose) break;
+            if (!clock.waitUntil(rec.timeNs) || rec.kind != kFrame) return false;
+            deviceNs = in.svar();
+            size_t size = pixelconv::imageSize(pixelconv::PixelFormat::NV12, width, height);
+            const uint8_t* frame = in.raw(size);
+            if (!frame || dst.width != width || dst.height != height) return false;
+            for (int y = 0; y < height; ++y, frame += width) memcpy(dst.planes[0].data + (size_t)y * dst.planes[0].stride, frame, (size_t)width);
+            for (int y = 0; y < height / 2; ++y, frame += width) memcpy(dst.planes[1].data + (size_t)y * dst.planes[1].stride, frame, (size_t)width);
+            return true;
+        }
+        over = true;
+        return false;
+    }
+
+    void close() override { reader.close(); }
+    // Ends the wait for the next frame's time at Original speed.
+    void cancel() override { clock.cancel(); }
+
+private:
+    std::string cameraId;
+    hal::ReplayClock clock;
+    hal::TraceReader reader;
+    hal::Record rec;
+    uint64_t stream = 0;
+    int width = 0;
+    int height = 0;
+    bool over = false;
+};
+
+} // namespace
+
+std::unique_ptr<capture::FrameSource> record(std::unique_ptr<capture::FrameSource> inner, const std::string& camera,
+                                             std::shared_ptr<hal::TraceWriter> trace) {
+    if (!trace) return inner;
+    return std::unique_ptr<capture::FrameSource>(new RecordingSource(std::move(inner), camera, std::move(trace)));
+}
+
+std::unique_ptr<capture::FrameSource> replay(const std::string& path, const std::string& camera, hal::Speed speed) {
+    std::unique_ptr<ReplaySource> source(new ReplaySource(camera, speed));
+    if (!source->openTrace(path)) return nullptr;
+    return std::unique_ptr<capture::FrameSource>(source.release());
+}
+
+std::vector<std::string> cameras(const std::string& path) {
+    std::vector<std::string> found;
+    hal::TraceReader reader;
+    if (!reader.open(path)) return found;
+    hal::Record rec;
+    while (reader.next(hal::Channel::Frames, rec)) {
+        if (rec.kind != kOpen) continue;
+        hal::Unpacker in(rec.payload);
+        in.uvar();
+        std::string camera = in.str();
+        if (in.ok() && std::find(found.begin(), found.end(), camera) == found.end()) found.push_back(camera);
+    }
+    return found;
+}
+
+} // namespace frametrace
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../../../common/hal/trace.h"
+#include "capture.h"
+
+// Camera frames in a hardware trace (common/hal/trace.h, Frames channel).
+//
+// A recorded session is a stream: the format its source opened with, then
+// every read, with the device timestamp and the NV12 frame packed tight.
+// Replaying a stream hands back the same frames with the same timestamps,
+// so capture sessions and everything hanging off them (preview, motion,
+// segments) run on a machine without the camera.
+
+namespace frametrace {
+
+// Wraps a camera so everything it delivers is written to trace.
+std::unique_ptr<capture::FrameSource> record(std::unique_ptr<capture::FrameSource> inner, const std::string& camera,
+                                             std::shared_ptr<hal::TraceWriter> trace);
+
+// The first stream recorded for camera; reads fail once it is over. Null if
+// the trace cannot be read.
+std::unique_ptr<capture::FrameSource> replay(const std::string& path, const std::string& camera, hal::Speed speed);
+
+// The cameras with a stream in the trace, in the order they were opened.
+std::vector<std::string> cameras(const std::string& path);
+
+} // namespace frametrace
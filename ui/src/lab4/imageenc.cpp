@@ -0,0 +1,755 @@
+#include "imageenc.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace imageenc {
+
+namespace {
+
+void put16le(uint8_t* p, uint32_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+void put32le(uint8_t* p, uint32_t v) { put16le(p, v); put16le(p + 2, v >> 16); }
+void put32be(uint8_t* p, uint32_t v) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+
+const uint8_t* row(const pixelconv::Image& img, int y) {
+    return img.planes[0].data + (ptrdiff_t)y * img.planes[0].stride;
+}
+
+inline int ctz64(uint64_t v) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward64(&i, v);
+    return (int)i;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+// ---- deflate (RFC 1951) ----
+
+const uint16_t kLenBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t kLenExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t kDistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t kDistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+                                 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+const uint8_t kClenOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+struct SymbolTables {
+    uint8_t len[259];
+    uint8_t distLow[256];
+    uint8_t distHigh[256];
+    SymbolTables() {
+        for (int s = 0; s < 29; ++s) {
+            int end = s == 28 ? 259 : kLenBase[s + 1];
+            for (int l = kLenBase[s]; l < end && l < 259; ++l) len[l] = (uint8_t)s;
+        }
+        len[258] = 28;
+        for (int s = 0; s < 30; ++s) {
+            int end = s == 29 ? 32769 : kDistBase[s + 1];
+            for (int d = kDistBase[s]; d < end; ++d) {
+                if (d <= 256) distLow[d - 1] = (uint8_t)s;
+                else distHigh[(d - 1) >> 7] = (uint8_t)s;
+            }
+        }
+    }
+    int distSymbol(int d) const { return d <= 256 ? distLow[d - 1] : distHigh[(d - 1) >> 7]; }
+};
+
+const SymbolTables& symbols() {
+    static const SymbolTables t;
+    return t;
+}
+
+struct BitWriter {
+    std::vector<uint8_t>& out;
+    uint64_t buf = 0;
+    int bits = 0;
+
+    explicit BitWriter(std::vector<uint8_t>& o) : out(o) {}
+
+    void put(uint32_t value, int count) {
+        buf |= (uint64_t)value << bits;
+        bits += count;
+        if (bits >= 32) {
+            uint8_t b[4];
+            put32le(b, (uint32_t)buf);
+            out.insert(out.end(), b, b + 4);
+            buf >>= 32;
+            bits -= 32;
+        }
+    }
+
+    void align() {
+        while (bits > 0) {
+            out.push_back((uint8_t)buf);
+            buf >>= 8;
+            bits -= 8;
+        }
+        buf = 0;
+        bits = 0;
+    }
+};
+
+// Optimal code lengths limited to maxBits (the over-long tail is folded back
+// with the usual Kraft-sum repair). Always yields a complete code: a lone
+// symbol gets a dummy partner so strict inflaters accept the tree.
+void buildLengths(const uint32_t* freq, int n, int maxBits, uint8_t* lengths) {
+    memset(lengths, 0, n);
+    std::vector<int> syms;
+    for (int i = 0; i < n; ++i) {
+        if (freq[i]) syms.push_back(i);
+    }
+    if (syms.size() < 2) {
+        int a = syms.empty() ? 0 : syms[0];
+        lengths[a] = 1;
+        lengths[a == 0 ? 1 : 0] = 1;
+        return;
+    }
+    std::stable_sort(syms.begin(), syms.end(), [&](int a, int b) { return freq[a] < freq[b]; });
+
+    const int m = (int)syms.size();
+    std::vector<uint64_t> weight(2 * m);
+    std::vector<int> parent(2 * m, -1);
+    for (int i = 0; i < m; ++i) weight[i] = freq[syms[i]];
+
+    // Two-queue Huffman: leaves are sorted, internal nodes are created in order.
+    int leaf = 0, node = m;
+    for (int next = m; next < 2 * m - 1; ++next) {
+        int pick[2];
+        for (int& p : pick) {
+            if (leaf < m && (node >= next || weight[leaf] <= weight[node])) p = leaf++;
+            else p = node++;
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = next;
+    }
+
+    std::vector<int> depth(2 * m, 0);
+    int count[64] = { 0 };
+    for (int i = 2 * m - 3; i >= 0; --i) depth[i] = depth[parent[i]] + 1;
+    for (int i = 0; i < m; ++i) count[std::min(depth[i], 63)]++;
+
+    for (int i = maxBits + 1; i < 64; ++i) {
+        count[maxBits] += count[i];
+        count[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int i = maxBits; i > 0; --i) total += (uint32_t)count[i] << (maxBits - i);
+    while (total != (1u << maxBits)) {
+        count[maxBits]--;
+        for (int i = maxBits - 1; i > 0; --i) {
+            if (count[i]) {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    int s = 0;
+    for (int len = maxBits; len > 0; --len) {
+        for (int k = 0; k < count[len]; ++k) lengths[syms[s++]] = (uint8_t)len;
+    }
+}
+
+void buildCodes(const uint8_t* lengths, int n, uint16_t* codes) {
+    int blCount[16] = { 0 };
+    for (int i = 0; i < n; ++i) blCount[lengths[i]]++;
+    blCount[0] = 0;
+    int next[16] = { 0 };
+    int code = 0;
+    for (int bits = 1; bits < 16; ++bits) {
+        code = (code + blCount[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int i = 0; i < n; ++i) {
+        int len = lengths[i];
+        if (!len) continue;
+        uint32_t c = next[len]++, r = 0;
+        for (int b = 0; b < len; ++b) r |= ((c >> b) & 1) << (len - 1 - b);
+        codes[i] = (uint16_t)r;
+    }
+}
+
+struct Token {
+    uint16_t litlen; // literal byte, or match length when dist != 0
+    uint16_t dist;
+};
+
+void writeDynamicBlock(BitWriter& bw, const std::vector<Token>& tokens) {
+    const SymbolTables& st = symbols();
+    uint32_t lf[286] = { 0 }, df[30] = { 0 };
+    for (const Token& t : tokens) {
+        if (t.dist == 0) {
+            lf[t.litlen]++;
+        } else {
+            lf[257 + st.len[t.litlen]]++;
+            df[st.distSymbol(t.dist)]++;
+        }
+    }
+    lf[256] = 1;
+
+    uint8_t ll[286], dl[30];
+    uint16_t lc[286], dc[30];
+    buildLengths(lf, 286, 15, ll);
+    buildLengths(df, 30, 15, dl);
+    buildCodes(ll, 286, lc);
+    buildCodes(dl, 30, dc);
+
+    int hlit = 286, hdist = 30;
+    while (hlit > 257 && ll[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && dl[hdist - 1] == 0) hdist--;
+
+    uint8_t lens[316];
+    memcpy(lens, ll, hlit);
+    memcpy(lens + hlit, dl, hdist);
+    const int total = hlit + hdist;
+
+    uint8_t rleSym[316], rleExtra[316];
+    int nr = 0;
+    uint32_t cf[19] = { 0 };
+    auto emit = [&](int sym, int extra) {
+        rleSym[nr] = (uint8_t)sym;
+        rleExtra[nr++] = (uint8_t)extra;
+        cf[sym]++;
+    };
+    for (int i = 0; i < total;) {
+        int l = lens[i], run = 1;
+        while (i + run < total && lens[i + run] == l) ++run;
+        if (l == 0 && run >= 11) {
+            int r = std::min(run, 138);
+            emit(18, r - 11);
+            i += r;
+        } else if (l == 0 && run >= 3) {
+            emit(17, run - 3);
+            i += run;
+        } else {
+            emit(l, 0);
+            ++i;
+            --run;
+            while (l != 0 && run >= 3) {
+                int r = std::min(run, 6);
+                emit(16, r - 3);
+                i += r;
+                run -= r;
+            }
+        }
+    }
+
+    uint8_t cl[19];
+    uint16_t cc[19];
+    buildLengths(cf, 19, 7, cl);
+    buildCodes(cl, 19, cc);
+    int hclen = 19;
+    while (hclen > 4 && cl[kClenOrder[hclen - 1]] == 0) hclen--;
+
+    bw.put(0, 1);
+    bw.put(2, 2);
+    bw.put(hlit - 257, 5);
+    bw.put(hdist - 1, 5);
+    bw.put(hclen - 4, 4);
+    for (int i = 0; i < hclen; ++i) bw.put(cl[kClenOrder[i]], 3);
+    for (int i = 0; i < nr; ++i) {
+        int s = rleSym[i];
+        bw.put(cc[s], cl[s]);
+        if (s == 16) bw.put(rleExtra[i], 2);
+        else if (s == 17) bw.put(rleExtra[i], 3);
+        else if (s == 18) bw.put(rleExtra[i], 7);
+    }
+
+    for (const Token& t : tokens) {
+        if (t.dist == 0) {
+            bw.put(lc[t.litlen], ll[t.litlen]);
+            continue;
+        }
+        int ls = st.len[t.litlen];
+        bw.put(lc[257 + ls], ll[257 + ls]);
+        if (kLenExtra[ls]) bw.put(t.litlen - kLenBase[ls], kLenExtra[ls]);
+        int ds = st.distSymbol(t.dist);
+        bw.put(dc[ds], dl[ds]);
+        if (kDistExtra[ds]) bw.put(t.dist - kDistBase[ds], kDistExtra[ds]);
+    }
+    bw.put(lc[256], ll[256]);
+}
+
+struct LevelParams {
+    int maxChain;
+    int niceLength;
+    int insertLimit;
+};
+
+const LevelParams kLevels[10] = {
+    { 0, 0, 0 }, { 4, 16, 8 }, { 8, 16, 8 }, { 16, 32, 8 }, { 32, 64, 258 }, { 48, 128, 258 },
+    { 64, 128, 258 }, { 128, 258, 258 }, { 512, 258, 258 }, { 2048, 258, 258 },
+};
+
+// Compresses one band into a raw deflate stream that ends byte-aligned, so
+// independently produced bands can be concatenated. Only the last band
+// carries the final block.
+void deflateBand(const uint8_t* data, size_t n, int level, bool last, std::vector<uint8_t>& out) {
+    BitWriter bw(out);
+
+    if (level <= 0) {
+        size_t pos = 0;
+        do {
+            size_t len = std::min<size_t>(n - pos, 65535);
+            bw.put(0, 1);
+            bw.put(0, 2);
+            bw.align();
+            uint8_t hdr[4];
+            put16le(hdr, (uint32_t)len);
+            put16le(hdr + 2, (uint32_t)~len & 0xFFFF);
+            out.insert(out.end(), hdr, hdr + 4);
+            out.insert(out.end(), data + pos, data + pos + len);
+            pos += len;
+        } while (pos < n);
+    } else {
+        const LevelParams& lp = kLevels[std::min(level, 9)];
+        const int kWindow = 32768, kHashBits = 15;
+        std::vector<int32_t> head(1 << kHashBits, -1), prev(kWindow, -1);
+        std::vector<Token> tokens;
+        tokens.reserve(1 << 15);
+
+        auto hash = [&](size_t i) {
+            uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+            return (v * 2654435761u) >> (32 - kHashBits);
+        };
+        auto insert = [&](size_t i) {
+            uint32_t h = hash(i);
+            prev[i & (kWindow - 1)] = head[h];
+            head[h] = (int32_t)i;
+        };
+
+        size_t i = 0;
+        while (i < n) {
+            int bestLen = 0, bestDist = 0;
+            if (i + 3 <= n) {
+                uint32_t h = hash(i);
+                int32_t cand = head[h];
+                int chain = lp.maxChain;
+                int maxLen = (int)std::min<size_t>(258, n - i);
+                while (cand >= 0 && (int64_t)i - cand <= kWindow && chain-- > 0) {
+                    const uint8_t* a = data + cand;
+                    const uint8_t* b = data + i;
+                    if (a[bestLen] == b[bestLen]) {
+                        int l = 0;
+                        while (l + 8 <= maxLen) {
+                            uint64_t x, y;
+                            memcpy(&x, a + l, 8);
+                            memcpy(&y, b + l, 8);
+                            if (x != y) {
+                                l += ctz64(x ^ y) >> 3;
+                                goto matched;
+                            }
+                            l += 8;
+                        }
+                        while (l < maxLen && a[l] == b[l]) ++l;
+                    matched:
+                        if (l > bestLen) {
+                            bestLen = l;
+                            bestDist = (int)(i - cand);
+                            if (l >= lp.niceLength || l >= maxLen) break;
+                        }
+                    }
+                    cand = prev[cand & (kWindow - 1)];
+                }
+                prev[i & (kWindow - 1)] = head[h];
+                head[h] = (int32_t)i;
+            }
+
+            if (bestLen >= 3) {
+                tokens.push_back({ (uint16_t)bestLen, (uint16_t)bestDist });
+                if (bestLen <= lp.insertLimit) {
+                    for (size_t k = i + 1; k < i + bestLen && k + 3 <= n; ++k) insert(k);
+                }
+                i += bestLen;
+            } else {
+                tokens.push_back({ data[i], 0 });
+                ++i;
+            }
+
+            if (tokens.size() >= (1 << 15)) {
+                writeDynamicBlock(bw, tokens);
+                tokens.clear();
+            }
+        }
+        if (!tokens.empty()) writeDynamicBlock(bw, tokens);
+    }
+
+    if (last) {
+        // Empty final block with fixed codes: just the 7-bit end-of-block code.
+        bw.put(1, 1);
+        bw.put(1, 2);
+        bw.put(0, 7);
+        bw.align();
+    } else {
+        // Sync flush: empty stored block, leaves the stream byte-aligned.
+        bw.put(0, 1);
+        bw.put(0, 2);
+        bw.align();
+        const uint8_t marker[4] = { 0x00, 0x00, 0xFF, 0xFF };
+        out.insert(out.end(), marker, marker + 4);
+    }
+}
+
+uint32_t adler32(const uint8_t* p, size_t n) {
+    uint32_t a = 1, b = 0;
+    while (n > 0) {
+        size_t chunk = std::min<size_t>(n, 5552);
+        n -= chunk;
+        while (chunk--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+uint32_t adler32Combine(uint32_t a1, uint32_t a2, size_t len2) {
+    const uint32_t base = 65521;
+    uint32_t rem = (uint32_t)(len2 % base);
+    uint32_t sum1 = a1 & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+    sum1 += (a2 & 0xFFFF) + base - 1;
+    sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= (base << 1)) sum2 -= (base << 1);
+    if (sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+// Slicing-by-4 CRC-32 (PNG chunk checksums cover the whole IDAT).
+uint32_t crc32(const uint8_t* p, size_t n, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(4 * 256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int s = 1; s < 4; ++s) t[s * 256 + i] = (t[(s - 1) * 256 + i] >> 8) ^ t[t[(s - 1) * 256 + i] & 0xFF];
+        }
+        return t;
+    }();
+    const uint32_t* t = table.data();
+    crc = ~crc;
+    for (; n >= 4; n -= 4, p += 4) {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = t[768 + (crc & 0xFF)] ^ t[512 + ((crc >> 8) & 0xFF)] ^ t[256 + ((crc >> 16) & 0xFF)] ^ t[crc >> 24];
+    }
+    while (n--) crc = t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// ---- PNG ----
+
+inline uint8_t paeth(int a, int b, int c) {
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - c - c);
+    int bc = pb <= pc ? b : c;
+    return (uint8_t)(pa <= pb && pa <= pc ? a : bc);
+}
+
+void bgraRowToRgb(const uint8_t* src, uint8_t* dst, int width) {
+    for (int x = 0; x < width; ++x) {
+        dst[x * 3 + 0] = src[x * 4 + 2];
+        dst[x * 3 + 1] = src[x * 4 + 1];
+        dst[x * 3 + 2] = src[x * 4 + 0];
+    }
+}
+
+// Sum of |residual| with residuals read as int8: min(u, 256 - u) per byte.
+uint64_t residualCost(const uint8_t* v, size_t len) {
+    uint64_t cost = 0;
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+    }
+    cost = (uint64_t)_mm_cvtsi128_si64(acc) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+    for (; i < len; ++i) cost += (uint64_t)abs((int)(int8_t)v[i]);
+    return cost;
+}
+
+// Writes the filter byte plus filtered scanline to out. With adaptive
+// filtering every PNG filter is tried and the one with the smallest sum of
+// signed residuals wins. `up` is the previous raw row (zeros for row 0),
+// `scratch` holds 4 * len bytes.
+void filterRow(const uint8_t* cur, const uint8_t* up, size_t len, bool adaptive, uint8_t* out, uint8_t* scratch) {
+    const size_t bpp = 3;
+    if (!adaptive) {
+        out[0] = 0;
+        memcpy(out + 1, cur, len);
+        return;
+    }
+    uint8_t* sub = scratch;
+    uint8_t* upf = scratch + len;
+    uint8_t* avg = scratch + len * 2;
+    uint8_t* pae = scratch + len * 3;
+    for (size_t i = 0; i < bpp; ++i) {
+        sub[i] = cur[i];
+        upf[i] = (uint8_t)(cur[i] - up[i]);
+        avg[i] = (uint8_t)(cur[i] - (up[i] >> 1));
+        pae[i] = (uint8_t)(cur[i] - up[i]);
+    }
+    for (size_t i = bpp; i < len; ++i) sub[i] = (uint8_t)(cur[i] - cur[i - bpp]);
+    for (size_t i = bpp; i < len; ++i) upf[i] = (uint8_t)(cur[i] - up[i]);
+    for (size_t i = bpp; i < len; ++i) avg[i] = (uint8_t)(cur[i] - ((cur[i - bpp] + up[i]) >> 1));
+    for (size_t i = bpp; i < len; ++i) pae[i] = (uint8_t)(cur[i] - paeth(cur[i - bpp], up[i], up[i - bpp]));
+
+    const uint8_t* candidates[5] = { cur, sub, upf, avg, pae };
+    uint64_t best = UINT64_MAX;
+    int choice = 0;
+    for (int f = 0; f < 5; ++f) {
+        uint64_t cost = residualCost(candidates[f], len);
+        if (cost < best) {
+            best = cost;
+            choice = f;
+        }
+    }
+    out[0] = (uint8_t)choice;
+    memcpy(out + 1, candidates[choice], len);
+}
+
+struct Band {
+    int y0 = 0, y1 = 0;
+    std::vector<uint8_t> filtered;
+    std::vector<uint8_t> deflated;
+    uint32_t adler = 1;
+};
+
+void encodeBand(const pixelconv::Image& img, int level, bool last, Band& band) {
+    const size_t rowBytes = (size_t)img.width * 3;
+    std::vector<uint8_t> cur(rowBytes), up(rowBytes, 0), scratch(rowBytes * 4);
+    band.filtered.resize((rowBytes + 1) * (band.y1 - band.y0));
+
+    if (band.y0 > 0) bgraRowToRgb(row(img, band.y0 - 1), up.data(), img.width);
+    uint8_t* out = band.filtered.data();
+    for (int y = band.y0; y < band.y1; ++y) {
+        bgraRowToRgb(row(img, y), cur.data(), img.width);
+        filterRow(cur.data(), up.data(), rowBytes, level > 0, out, scratch.data());
+        out += rowBytes + 1;
+        cur.swap(up);
+    }
+
+    band.adler = adler32(band.filtered.data(), band.filtered.size());
+    band.deflated.clear();
+    band.deflated.reserve(band.filtered.size() / 2 + 64);
+    deflateBand(band.filtered.data(), band.filtered.size(), level, last, band.deflated);
+}
+
+void appendChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t len) {
+    uint8_t hdr[8];
+    put32be(hdr, (uint32_t)len);
+    memcpy(hdr + 4, type, 4);
+    out.insert(out.end(), hdr, hdr + 8);
+    size_t start = out.size() - 4;
+    if (len) out.insert(out.end(), data, data + len);
+    uint8_t crc[4];
+    put32be(crc, crc32(out.data() + start, len + 4));
+    out.insert(out.end(), crc, crc + 4);
+}
+
+} // namespace
+
+bool parseFormat(const std::string& name, Format& format) {
+    if (name == "bmp") format = Format::Bmp;
+    else if (name == "qoi") format = Format::Qoi;
+    else if (name == "png") format = Format::Png;
+    else return false;
+    return true;
+}
+
+const char* extension(Format format) {
+    switch (format) {
+    case Format::Qoi: return "qoi";
+    case Format::Png: return "png";
+    default: return "bmp";
+    }
+}
+
+bool encodeBmp(const pixelconv::Image& bgra, std::vector<uint8_t>& out) {
+    if (bgra.format != pixelconv::PixelFormat::BGRA) return false;
+    const int w = bgra.width, h = bgra.height;
+    const int stride = (w * 3 + 3) & ~3;
+    const uint32_t pixelBytes = (uint32_t)stride * h;
+    const uint32_t offBits = 14 + 40;
+
+    out.assign(offBits + pixelBytes, 0);
+    uint8_t* p = out.data();
+    p[0] = 'B';
+    p[1] = 'M';
+    put32le(p + 2, offBits + pixelBytes);
+    put32le(p + 10, offBits);
+    put32le(p + 14, 40);
+    put32le(p + 18, (uint32_t)w);
+    put32le(p + 22, (uint32_t)-h);
+    put16le(p + 26, 1);
+    put16le(p + 28, 24);
+    put32le(p + 34, pixelBytes);
+
+    pixelconv::Image dst = pixelconv::wrap(pixelconv::PixelFormat::RGB24, w, h, p + offBits);
+    dst.planes[0].stride = stride;
+    return pixelconv::convert(bgra, dst);
+}
+
+bool encodeQoi(const pixelconv::Image& bgra, std::vector<uint8_t>& out) {
+    if (bgra.format != pixelconv::PixelFormat::BGRA) return false;
+    const int w = bgra.width, h = bgra.height;
+    out.resize(14 + (size_t)w * h * 4 + 8);
+    uint8_t* p = out.data();
+    memcpy(p, "qoif", 4);
+    put32be(p + 4, (uint32_t)w);
+    put32be(p + 8, (uint32_t)h);
+    p[12] = 3;
+    p[13] = 0;
+    p += 14;
+
+    struct Px { uint8_t r, g, b, a; };
+    Px index[64];
+    memset(index, 0, sizeof(index));
+    Px prev = { 0, 0, 0, 255 };
+    int run = 0;
+    const size_t total = (size_t)w * h;
+    size_t n = 0;
+
+    for (int y = 0; y < h; ++y) {
+        const uint8_t* s = row(bgra, y);
+        for (int x = 0; x < w; ++x, ++n) {
+            Px px = { s[x * 4 + 2], s[x * 4 + 1], s[x * 4 + 0], 255 };
+            if (px.r == prev.r && px.g == prev.g && px.b == prev.b) {
+                if (++run == 62 || n + 1 == total) {
+                    *p++ = (uint8_t)(0xC0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *p++ = (uint8_t)(0xC0 | (run - 1));
+                run = 0;
+            }
+            int h6 = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+            Px& slot = index[h6];
+            if (slot.r == px.r && slot.g == px.g && slot.b == px.b && slot.a == px.a) {
+                *p++ = (uint8_t)h6;
+            } else {
+                slot = px;
+                int8_t vr = (int8_t)(px.r - prev.r);
+                int8_t vg = (int8_t)(px.g - prev.g);
+                int8_t vb = (int8_t)(px.b - prev.b);
+                int8_t vgr = (int8_t)(vr - vg);
+                int8_t vgb = (int8_t)(vb - vg);
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *p++ = (uint8_t)(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                } else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+                    *p++ = (uint8_t)(0x80 | (vg + 32));
+                    *p++ = (uint8_t)((vgr + 8) << 4 | (vgb + 8));
+                } else {
+                    *p++ = 0xFE;
+                    *p++ = px.r;
+                    *p++ = px.g;
+                    *p++ = px.b;
+                }
+            }
+            prev = px;
+        }
+    }
+
+    static const uint8_t kEnd[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    memcpy(p, kEnd, 8);
+    p += 8;
+    out.resize(p - out.data());
+    return true;
+}
+
+bool encodePng(const pixelconv::Image& bgra, int level, std::vector<uint8_t>& out, int threads) {
+    if (bgra.format != pixelconv::PixelFormat::BGRA || bgra.width <= 0 || bgra.height <= 0) return false;
+    level = std::max(0, std::min(level, 9));
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    // Bands below ~32 rows cost more in lost matches and block headers than they save.
+    const int bandCount = std::max(1, std::min(threads, bgra.height / 32));
+    std::vector<Band> bands(bandCount);
+    for (int i = 0; i < bandCount; ++i) {
+        bands[i].y0 = (int)((int64_t)bgra.height * i / bandCount);
+        bands[i].y1 = (int)((int64_t)bgra.height * (i + 1) / bandCount);
+    }
+
+    if (bandCount == 1) {
+        encodeBand(bgra, level, true, bands[0]);
+    } else {
+        std::vector<std::thread> workers;
+        for (int i = 1; i < bandCount; ++i) {
+            workers.emplace_back(encodeBand, std::cref(bgra), level, i == bandCount - 1, std::ref(bands[i]));
+        }
+        encodeBand(bgra, level, false, bands[0]);
+        for (auto& t : workers) t.join();
+    }
+
+    size_t idatLen = 2 + 4;
+    uint32_t adler = bands[0].adler;
+    for (int i = 0; i < bandCount; ++i) {
+        idatLen += bands[i].deflated.size();
+        if (i > 0) adler = adler32Combine(adler, bands[i].adler, bands[i].filtered.size());
+    }
+
+    out.clear();
+    out.reserve(8 + 25 + 12 + idatLen + 12);
+    static const uint8_t kSig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.insert(out.end(), kSig, kSig + 8);
+
+    uint8_t ihdr[13];
+    put32be(ihdr, (uint32_t)bgra.width);
+    put32be(ihdr + 4, (uint32_t)bgra.height);
+    ihdr[8] = 8;
+    ihdr[9] = 2;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    appendChunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+    // IDAT is assembled in place so the bands are copied exactly once.
+    uint8_t hdr[8];
+    put32be(hdr, (uint32_t)idatLen);
+    memcpy(hdr + 4, "IDAT", 4);
+    out.insert(out.end(), hdr, hdr + 8);
+    size_t start = out.size() - 4;
+    out.push_back(0x78);
+    out.push_back(0x9C);
+    for (const Band& b : bands) out.insert(out.end(), b.deflated.begin(), b.deflated.end());
+    uint8_t tail[4];
+    put32be(tail, adler);
+    out.insert(out.end(), tail, tail + 4);
+    put32be(tail, crc32(out.data() + start, idatLen + 4));
+    out.insert(out.end(), tail, tail + 4);
+
+    appendChunk(out, "IEND", nullptr, 0);
+    return true;
+}
+
+bool encode(const pixelconv::Image& bgra, Format format, int level, std::vector<uint8_t>& out) {
+    switch (format) {
+    case Format::Qoi: return encodeQoi(bgra, out);
+    case Format::Png: return encodePng(bgra, std::min(level, kMaxPhotoLevel), out);
+    default: return encodeBmp(bgra, out);
+    }
+}
+
+} // namespace imageenc
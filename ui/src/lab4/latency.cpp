@@ -0,0 +1,219 @@
+#include "latency.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace latency {
+
+namespace {
+
+const char* const kStageNames[kStageCount] = {
+    "photo_device_open",
+    "photo_warmup_read",
+    "photo_contiguous_buffer",
+    "photo_convert",
+    "photo_encode",
+    "photo_file_write",
+    "photo_total",
+    "video_device_open",
+    "video_writer_setup",
+    "video_read_sample",
+    "video_convert",
+    "video_write_sample",
+    "video_finalize",
+    "video_total",
+    "preview_publish",
+};
+
+struct StageCounts {
+    std::atomic<uint64_t> buckets[Histogram::kBuckets];
+    std::atomic<uint64_t> sumNs;
+};
+
+struct Shard {
+    std::atomic<StageCounts*> stages[kStageCount];
+};
+
+// Shards outlive their threads: counts from a finished capture must still
+// show up in the next report. A shard freed by an exiting thread is handed to
+// the next new thread instead of allocating another.
+struct Registry {
+    std::mutex mutex;
+    std::vector<Shard*> all;
+    std::vector<Shard*> idle;
+    Histogram baseline[kStageCount];
+    uint64_t baselineSum[kStageCount] = {};
+};
+
+Registry& registry() {
+    static Registry* r = new Registry();
+    return *r;
+}
+
+struct LocalShard {
+    Shard* shard = nullptr;
+
+    Shard* get() {
+        if (!shard) {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (!r.idle.empty()) {
+                shard = r.idle.back();
+                r.idle.pop_back();
+            } else {
+                shard = new Shard();
+                r.all.push_back(shard);
+            }
+        }
+        return shard;
+    }
+
+    ~LocalShard() {
+        if (!shard) return;
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.idle.push_back(shard);
+    }
+};
+
+thread_local LocalShard localShard;
+// Plain pointer for the hot path; it needs no TLS init guard, unlike
+// localShard, which is only touched once per thread.
+thread_local Shard* cachedShard = nullptr;
+
+inline void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    // Single writer per shard, so a load and a store are enough.
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// With the registry mutex held.
+Histogram sumShards(const Registry& r, int s, uint64_t& sumNs) {
+    Histogram current;
+    sumNs = 0;
+    for (Shard* shard : r.all) {
+        StageCounts* counts = shard->stages[s].load(std::memory_order_acquire);
+        if (!counts) continue;
+        for (int b = 0; b < Histogram::kBuckets; ++b) {
+            uint64_t n = counts->buckets[b].load(std::memory_order_relaxed);
+            if (n) current.add(b, n);
+        }
+        sumNs += counts->sumNs.load(std::memory_order_relaxed);
+    }
+    return current;
+}
+
+double toUs(uint64_t ns) {
+    return ns / 1e3;
+}
+
+} // namespace
+
+const char* stageName(Stage stage) {
+    int i = (int)stage;
+    return i >= 0 && i < kStageCount ? kStageNames[i] : "unknown";
+}
+
+int Histogram::bucketFor(uint64_t value) {
+    if (value < (uint64_t)kSubBuckets) return (int)value;
+#if defined(__GNUC__)
+    int exponent = 63 - __builtin_clzll(value);
+#else
+    int exponent = 63;
+    while (!(value >> exponent)) --exponent;
+#endif
+    int shift = exponent - kSubBits;
+    if (shift > kMaxShift) return kBuckets - 1;
+    int sub = (int)(value >> shift) - kSubBuckets;
+    return (shift + 1) * kSubBuckets + sub;
+}
+
+uint64_t Histogram::bucketLow(int bucket) {
+    if (bucket < kSubBuckets) return (uint64_t)bucket;
+    int shift = bucket / kSubBuckets - 1;
+    return (uint64_t)(kSubBuckets + bucket % kSubBuckets) << shift;
+}
+
+uint64_t Histogram::bucketHigh(int bucket) {
+    if (bucket < kSubBuckets) return (uint64_t)bucket;
+    int shift = bucket / kSubBuckets - 1;
+    return bucketLow(bucket) + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t Histogram::percentile(double q) const {
+    if (!total) return 0;
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+        seen += counts[b];
+        if (seen >= rank) return bucketHigh(b);
+    }
+    return bucketHigh(kBuckets - 1);
+}
+
+uint64_t Histogram::max() const {
+    for (int b = kBuckets - 1; b >= 0; --b) {
+        if (counts[b]) return bucketHigh(b);
+    }
+    return 0;
+}
+
+void record(Stage stage, int64_t ns) {
+    Shard* shard = cachedShard;
+    if (!shard) shard = cachedShard = localShard.get();
+    int s = (int)stage;
+    StageCounts* counts = shard->stages[s].load(std::memory_order_relaxed);
+    if (!counts) {
+        counts = new StageCounts();
+        shard->stages[s].store(counts, std::memory_order_release);
+    }
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    bump(counts->buckets[Histogram::bucketFor(value)], 1);
+    bump(counts->sumNs, value);
+}
+
+std::vector<Summary> collect(bool reset) {
+    std::vector<Summary> out;
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    for (int s = 0; s < kStageCount; ++s) {
+        uint64_t sum = 0;
+        Histogram current = sumShards(r, s, sum);
+
+        Histogram delta;
+        for (int b = 0; b < Histogram::kBuckets; ++b) {
+            uint64_t n = current.counts[b] - r.baseline[s].counts[b];
+            if (n) delta.add(b, n);
+        }
+        if (delta.count()) {
+            Summary summary;
+            summary.stage = (Stage)s;
+            summary.count = delta.count();
+            summary.meanUs = toUs(sum - r.baselineSum[s]) / delta.count();
+            summary.p50Us = toUs(delta.percentile(0.50));
+            summary.p90Us = toUs(delta.percentile(0.90));
+            summary.p99Us = toUs(delta.percentile(0.99));
+            summary.maxUs = toUs(delta.max());
+            out.push_back(summary);
+        }
+        if (reset) {
+            r.baseline[s] = current;
+            r.baselineSum[s] = sum;
+        }
+    }
+    return out;
+}
+
+Histogram total(Stage stage, uint64_t& sumNs) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    int s = (int)stage;
+    if (s < 0 || s >= kStageCount) {
+        sumNs = 0;
+        return Histogram();
+    }
+    return sumShards(r, s, sumNs);
+}
+
+} // namespace latency
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Per-stage latency histograms for the webcam helper.
+//
+// Buckets are log-linear in the style of HdrHistogram: values below 32 ns get
+// one bucket each, and every power of two above that is split into 32 equal
+// sub-buckets. Any recorded value is therefore within 1/32 (about 3%) of its
+// bucket's bounds, from nanoseconds up to about two minutes, in 1056 buckets.
+//
+// Each thread records into its own shard. Only the owning thread writes a
+// shard, with plain relaxed stores and no read-modify-write, so recording
+// costs a clock read and a few instructions. collect() sums all shards.
+// Resetting stores a baseline instead of zeroing the shards, so it never
+// races with a recording thread.
+//
+// Configure with -DWEBCAM_LATENCY_STATS=OFF (which defines it to 0) to compile
+// the instrumentation out: the LATENCY_* macros then expand to nothing.
+
+#ifndef WEBCAM_LATENCY_STATS
+#define WEBCAM_LATENCY_STATS 1
+#endif
+
+namespace latency {
+
+enum class Stage {
+    PhotoDeviceOpen,
+    PhotoWarmupRead,
+    PhotoContiguousBuffer,
+    PhotoConvert,
+    PhotoEncode,
+    PhotoFileWrite,
+    PhotoTotal,
+    VideoDeviceOpen,
+    VideoWriterSetup,
+    VideoReadSample,
+    VideoConvert,
+    VideoWriteSample,
+    VideoFinalize,
+    VideoTotal,
+    PreviewPublish,
+    Count
+};
+
+constexpr int kStageCount = (int)Stage::Count;
+
+const char* stageName(Stage stage);
+
+class Histogram {
+public:
+    static constexpr int kSubBits = 5;
+    static constexpr int kSubBuckets = 1 << kSubBits;
+    static constexpr int kMaxShift = 31; // values up to 2^37 ns, about two minutes
+    static constexpr int kBuckets = (kMaxShift + 2) * kSubBuckets;
+
+    static int bucketFor(uint64_t value);
+    static uint64_t bucketLow(int bucket);
+    static uint64_t bucketHigh(int bucket);
+
+    Histogram() : counts(kBuckets, 0) {}
+    void add(int bucket, uint64_t n) { counts[bucket] += n; total += n; }
+    void record(uint64_t value) { add(bucketFor(value), 1); }
+    uint64_t count() const { return total; }
+    // Upper bound of the bucket holding the q-quantile (0 < q <= 1).
+    uint64_t percentile(double q) const;
+    uint64_t max() const;
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+};
+
+struct Summary {
+    Stage stage;
+    uint64_t count;
+    double meanUs;
+    double p50Us;
+    double p90Us;
+    double p99Us;
+    double maxUs;
+};
+
+void record(Stage stage, int64_t ns);
+
+// Summaries of every stage recorded since the last reset.
+std::vector<Summary> collect(bool reset);
+
+// Everything ever recorded for a stage, and the sum of it, however often
+// collect() reset; for counters that must only go up.
+Histogram total(Stage stage, uint64_t& sumNs);
+
+inline int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Times consecutive stages: lap() records the time since the previous lap
+// (or construction / restart) against a stage.
+class Stopwatch {
+public:
+    Stopwatch() : last(nowNs()) {}
+    void restart() { last = nowNs(); }
+    void lap(Stage stage) {
+        int64_t t = nowNs();
+        record(stage, t - last);
+        last = t;
+    }
+    // Records the time since the last lap or restart without starting a new lap.
+    void mark(Stage stage) const { record(stage, nowNs() - last); }
+
+private:
+    int64_t last;
+};
+
+} // namespace latency
+
+#if WEBCAM_LATENCY_STATS
+#define LATENCY_STOPWATCH(name) latency::Stopwatch name
+#define LATENCY_RESTART(name) name.restart()
+#define LATENCY_LAP(name, stage) name.lap(latency::Stage::stage)
+#define LATENCY_MARK(name, stage) name.mark(latency::Stage::stage)
+#else
+#define LATENCY_STOPWATCH(name)
+#define LATENCY_RESTART(name) ((void)0)
+#define LATENCY_LAP(name, stage) ((void)0)
+#define LATENCY_MARK(name, stage) ((void)0)
+#endif
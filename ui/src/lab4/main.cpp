@@ -0,0 +1,5 @@
+#include "webcam.h"
+
+int main(int argc, char** argv) {
+    return helper::runStandalone(argc, argv, webcamModule);
+}
@@ -0,0 +1,276 @@
+#include "motion.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MOTION_X86 1
+#include <immintrin.h>
+#else
+#define MOTION_X86 0
+#endif
+
+#if MOTION_X86 && (defined(__GNUC__) || defined(__clang__))
+#define MD_SSE41 __attribute__((target("sse4.1")))
+#define MD_AVX2 __attribute__((target("avx2")))
+#else
+#define MD_SSE41
+#define MD_AVX2
+#endif
+
+namespace motion {
+
+namespace {
+
+using pixelconv::Isa;
+
+inline uint8_t cellMean(const uint8_t* p, int stride) {
+    int sum = 0;
+    for (int r = 0; r < kCell; ++r, p += stride) {
+        for (int c = 0; c < kCell; ++c) sum += p[c];
+    }
+    return (uint8_t)((sum + kCell * kCell / 2) / (kCell * kCell));
+}
+
+// The kernels compare bytes, so every one of them, and the scalar tail the
+// SIMD ones hand over to, sees the threshold in 0..255.
+inline int clampThreshold(int threshold) {
+    return std::min(std::max(threshold, 0), 255);
+}
+
+inline int bitCount(uint32_t v) {
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    return (int)((((v + (v >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+}
+
+// ---- scalar (cells start at column cx so SIMD loops can hand over their tail) ----
+
+void cellRowScalar(const uint8_t* row, int stride, uint8_t* out, int cx, int cellsX) {
+    for (; cx < cellsX; ++cx) out[cx] = cellMean(row + cx * kCell, stride);
+}
+
+uint32_t changedTailScalar(const uint8_t* cur, uint8_t* ref, const uint8_t* mask, int i, int count, int threshold) {
+    uint32_t n = 0;
+    for (; i < count; ++i) {
+        int d = std::abs(cur[i] - ref[i]);
+        if (mask[i] && d > threshold) ++n;
+        ref[i] = (uint8_t)((cur[i] + ref[i] + 1) >> 1);
+    }
+    return n;
+}
+
+void cellMeansScalar(const uint8_t* luma, int stride, int cellsX, int cellsY, uint8_t* out) {
+    for (int cy = 0; cy < cellsY; ++cy) {
+        cellRowScalar(luma + (ptrdiff_t)cy * kCell * stride, stride, out + (ptrdiff_t)cy * cellsX, 0, cellsX);
+    }
+}
+
+uint32_t changedCellsScalar(const uint8_t* cur, uint8_t* ref, const uint8_t* mask, int count, int threshold) {
+    return changedTailScalar(cur, ref, mask, 0, count, clampThreshold(threshold));
+}
+
+const Kernels kScalar = { Isa::Scalar, cellMeansScalar, changedCellsScalar };
+
+#if MOTION_X86
+
+// ---- SSE4.1 ----
+// psadbw against zero sums 8 bytes into a 64-bit lane, which is one row of a
+// cell; eight of them give the cell sum without widening anything.
+
+MD_SSE41 void cellMeansSse41(const uint8_t* luma, int stride, int cellsX, int cellsY, uint8_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi64x(kCell * kCell / 2);
+    for (int cy = 0; cy < cellsY; ++cy) {
+        const uint8_t* row = luma + (ptrdiff_t)cy * kCell * stride;
+        uint8_t* o = out + (ptrdiff_t)cy * cellsX;
+        int cx = 0;
+        for (; cx + 2 <= cellsX; cx += 2) {
+            const uint8_t* p = row + cx * kCell;
+            __m128i acc = zero;
+            for (int r = 0; r < kCell; ++r, p += stride) {
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), zero));
+            }
+            acc = _mm_srli_epi64(_mm_add_epi64(acc, half), 6);
+            o[cx] = (uint8_t)_mm_cvtsi128_si32(acc);
+            o[cx + 1] = (uint8_t)_mm_extract_epi16(acc, 4);
+        }
+        cellRowScalar(row, stride, o, cx, cellsX);
+    }
+}
+
+MD_SSE41 uint32_t changedCellsSse41(const uint8_t* cur, uint8_t* ref, const uint8_t* mask, int count, int threshold) {
+    const __m128i zero = _mm_setzero_si128();
+    threshold = clampThreshold(threshold);
+    const __m128i t = _mm_set1_epi8((char)threshold);
+    uint32_t n = 0;
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + i));
+        __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ref + i));
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(c, r), _mm_subs_epu8(r, c));
+        __m128i within = _mm_cmpeq_epi8(_mm_subs_epu8(diff, t), zero);
+        n += bitCount((uint32_t)_mm_movemask_epi8(_mm_andnot_si128(within, m)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(ref + i), _mm_avg_epu8(c, r));
+    }
+    return n + changedTailScalar(cur, ref, mask, i, count, threshold);
+}
+
+const Kernels kSse41 = { Isa::SSE41, cellMeansSse41, changedCellsSse41 };
+
+// ---- AVX2 ----
+
+MD_AVX2 void cellMeansAvx2(const uint8_t* luma, int stride, int cellsX, int cellsY, uint8_t* out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi64x(kCell * kCell / 2);
+    for (int cy = 0; cy < cellsY; ++cy) {
+        const uint8_t* row = luma + (ptrdiff_t)cy * kCell * stride;
+        uint8_t* o = out + (ptrdiff_t)cy * cellsX;
+        int cx = 0;
+        for (; cx + 4 <= cellsX; cx += 4) {
+            const uint8_t* p = row + cx * kCell;
+            __m256i acc = zero;
+            for (int r = 0; r < kCell; ++r, p += stride) {
+                acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), zero));
+            }
+            acc = _mm256_srli_epi64(_mm256_add_epi64(acc, half), 6);
+            __m128i lo = _mm256_castsi256_si128(acc);
+            __m128i hi = _mm256_extracti128_si256(acc, 1);
+            o[cx] = (uint8_t)_mm_cvtsi128_si32(lo);
+            o[cx + 1] = (uint8_t)_mm_extract_epi16(lo, 4);
+            o[cx + 2] = (uint8_t)_mm_cvtsi128_si32(hi);
+            o[cx + 3] = (uint8_t)_mm_extract_epi16(hi, 4);
+        }
+        cellRowScalar(row, stride, o, cx, cellsX);
+    }
+}
+
+MD_AVX2 uint32_t changedCellsAvx2(const uint8_t* cur, uint8_t* ref, const uint8_t* mask, int count, int threshold) {
+    const __m256i zero = _mm256_setzero_si256();
+    threshold = clampThreshold(threshold);
+    const __m256i t = _mm256_set1_epi8((char)threshold);
+    uint32_t n = 0;
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cur + i));
+        __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ref + i));
+        __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask + i));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(c, r), _mm256_subs_epu8(r, c));
+        __m256i within = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, t), zero);
+        n += bitCount((uint32_t)_mm256_movemask_epi8(_mm256_andnot_si256(within, m)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(ref + i), _mm256_avg_epu8(c, r));
+    }
+    return n + changedTailScalar(cur, ref, mask, i, count, threshold);
+}
+
+const Kernels kAvx2 = { Isa::AVX2, cellMeansAvx2, changedCellsAvx2 };
+
+#endif // MOTION_X86
+
+} // namespace
+
+const Kernels& kernelsFor(Isa isa) {
+#if MOTION_X86
+    // pixelconv already knows what the CPU supports.
+    Isa supported = pixelconv::kernelsFor(isa).isa;
+    if (supported == Isa::AVX2) return kAvx2;
+    if (supported == Isa::SSE41) return kSse41;
+#endif
+    (void)isa;
+    return kScalar;
+}
+
+const Kernels& kernels() {
+    static const Kernels& k = motion::kernelsFor(pixelconv::detectIsa());
+    return k;
+}
+
+Detector::Detector(const Config& config) : k(kernels()) {
+    setConfig(config);
+}
+
+void Detector::setConfig(const Config& config) {
+    cfg = config;
+    cfg.threshold = clampThreshold(cfg.threshold);
+}
+
+void Detector::setMask(const std::vector<Rect>& r) {
+    regions = r;
+    buildMask();
+}
+
+void Detector::reset() {
+    hasReference = false;
+    inEvent = false;
+    movingFrames = 0;
+}
+
+void Detector::resize(int width, int height) {
+    frameWidth = width;
+    frameHeight = height;
+    cellsX = width / kCell;
+    cellsY = height / kCell;
+    cells.assign((size_t)cellsX * cellsY, 0);
+    reference.assign(cells.size(), 0);
+    buildMask();
+    reset();
+}
+
+// A cell is watched when its centre lies inside one of the regions.
+void Detector::buildMask() {
+    mask.assign((size_t)cellsX * cellsY, regions.empty() ? 0xFF : 0);
+    watched = regions.empty() ? (uint32_t)mask.size() : 0;
+    if (regions.empty()) return;
+    for (int cy = 0; cy < cellsY; ++cy) {
+        int py = cy * kCell + kCell / 2;
+        for (int cx = 0; cx < cellsX; ++cx) {
+            int px = cx * kCell + kCell / 2;
+            for (const Rect& rc : regions) {
+                if (px >= rc.x && px < rc.x + rc.width && py >= rc.y && py < rc.y + rc.height) {
+                    mask[(size_t)cy * cellsX + cx] = 0xFF;
+                    ++watched;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+Result Detector::process(const pixelconv::Image& frame, int64_t timestampNs) {
+    Result res;
+    if (frame.width != frameWidth || frame.height != frameHeight) resize(frame.width, frame.height);
+    if (!watched || !frame.planes[0].data) {
+        res.active = inEvent;
+        return res;
+    }
+
+    k.cellMeans(frame.planes[0].data, frame.planes[0].stride, cellsX, cellsY, cells.data());
+    if (!hasReference) {
+        reference = cells;
+        hasReference = true;
+        res.active = inEvent;
+        return res;
+    }
+
+    uint32_t n = k.changedCells(cells.data(), reference.data(), mask.data(), (int)cells.size(), cfg.threshold);
+    res.changed = (double)n / watched;
+    if (n && res.changed >= cfg.minArea) {
+        ++movingFrames;
+        lastMotionNs = timestampNs;
+    } else {
+        movingFrames = 0;
+    }
+
+    if (!inEvent && movingFrames >= std::max(cfg.startFrames, 1)) {
+        inEvent = true;
+        res.transition = Transition::Started;
+    } else if (inEvent && timestampNs - lastMotionNs >= cfg.stopAfterNs) {
+        inEvent = false;
+        res.transition = Transition::Stopped;
+    }
+    res.active = inEvent;
+    return res;
+}
+
+} // namespace motion
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "pixelconv.h"
+
+// Motion detection on the luma plane of a camera stream.
+//
+// Each frame is reduced to the mean of every 8x8 luma block (a 1920x1080
+// frame becomes 240x135 cells), read straight from the frame buffer with no
+// copy. A cell has changed when its mean differs from a slowly following
+// reference by more than the threshold; averaging 64 pixels removes most
+// sensor noise before the comparison. A frame is "moving" when the changed
+// share of the watched cells reaches minArea.
+//
+// Hysteresis keeps one event from turning into many: an event starts after
+// startFrames moving frames in a row and ends only when no frame has moved for
+// stopAfterNs.
+
+namespace motion {
+
+constexpr int kCell = 8;
+
+struct Config {
+    int threshold = 10;         // change of a cell mean, in luma steps (0-255)
+    double minArea = 0.005;     // share of watched cells that must change
+    int startFrames = 3;        // consecutive moving frames that start an event
+    int64_t stopAfterNs = 2000000000; // quiet time that ends it
+};
+
+// A watched region, in frame pixels.
+struct Rect {
+    int x = 0, y = 0, width = 0, height = 0;
+};
+
+enum class Transition { None, Started, Stopped };
+
+struct Result {
+    double changed = 0;  // share of watched cells that changed in this frame
+    bool active = false; // inside an event after this frame
+    Transition transition = Transition::None;
+};
+
+struct Kernels {
+    pixelconv::Isa isa;
+    // Rounded mean of every full kCell x kCell block of a luma plane.
+    void (*cellMeans)(const uint8_t* luma, int stride, int cellsX, int cellsY, uint8_t* out);
+    // Counts cells with |cur - ref| > threshold where mask is 0xFF, then moves
+    // ref halfway towards cur. A threshold outside 0..255 is clamped to it.
+    uint32_t (*changedCells)(const uint8_t* cur, uint8_t* ref, const uint8_t* mask, int count, int threshold);
+};
+
+// Same selection rules as pixelconv::kernelsFor().
+const Kernels& kernelsFor(pixelconv::Isa isa);
+const Kernels& kernels();
+
+class Detector {
+public:
+    explicit Detector(const Config& config = Config());
+
+    void setConfig(const Config& config);
+    const Config& config() const { return cfg; }
+    // Regions to watch; empty watches the whole frame.
+    void setMask(const std::vector<Rect>& regions);
+
+    // frame must have luma in plane 0 (NV12, I420 or GRAY8). A size change
+    // restarts detection.
+    Result process(const pixelconv::Image& frame, int64_t timestampNs);
+    bool active() const { return inEvent; }
+    void reset();
+
+private:
+    void resize(int width, int height);
+    void buildMask();
+
+    Config cfg;
+    std::vector<Rect> regions;
+    const Kernels& k;
+
+    int frameWidth = 0, frameHeight = 0;
+    int cellsX = 0, cellsY = 0;
+    uint32_t watched = 0;
+    std::vector<uint8_t> cells;
+    std::vector<uint8_t> reference;
+    std::vector<uint8_t> mask;
+    bool hasReference = false;
+
+    bool inEvent = false;
+    int movingFrames = 0;
+    int64_t lastMotionNs = 0;
+};
+
+} // namespace motion
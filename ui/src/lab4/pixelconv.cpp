@@ -0,0 +1,815 @@
+#include "pixelconv.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXELCONV_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define PIXELCONV_X86 0
+#endif
+
+#if PIXELCONV_X86 && (defined(__GNUC__) || defined(__clang__))
+#define PC_SSE41 __attribute__((target("sse4.1")))
+#define PC_AVX2 __attribute__((target("avx2")))
+#else
+#define PC_SSE41
+#define PC_AVX2
+#endif
+
+namespace pixelconv {
+
+namespace {
+
+// BT.601 limited range, 6 fractional bits. Every intermediate fits in int16
+// (saturating only where the clamped result is 255 either way), which keeps
+// the SIMD paths bit-exact with the scalar reference.
+constexpr int kY = 75, kUB = 129, kUG = 25, kVG = 52, kVR = 102;
+
+inline uint8_t clamp8(int v) {
+    return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+inline uint8_t avg8(int a, int b) {
+    return static_cast<uint8_t>((a + b + 1) >> 1);
+}
+
+inline void yuvPixel(int y, int u, int v, uint8_t* dst) {
+    int yy = (y - 16) * kY + 32;
+    u -= 128;
+    v -= 128;
+    dst[0] = clamp8((yy + kUB * u) >> 6);
+    dst[1] = clamp8((yy - (kUG * u + kVG * v)) >> 6);
+    dst[2] = clamp8((yy + kVR * v) >> 6);
+    dst[3] = 255;
+}
+
+// ---- scalar rows (start at column x so SIMD loops can hand over their tail) ----
+
+void yuy2RowScalar(const uint8_t* src, uint8_t* dst, int x, int width) {
+    for (; x < width; x += 2) {
+        const uint8_t* p = src + x * 2;
+        yuvPixel(p[0], p[1], p[3], dst + x * 4);
+        yuvPixel(p[2], p[1], p[3], dst + x * 4 + 4);
+    }
+}
+
+void nv12RowScalar(const uint8_t* y, const uint8_t* uv, uint8_t* dst, int x, int width) {
+    for (; x < width; x += 2) {
+        yuvPixel(y[x], uv[x], uv[x + 1], dst + x * 4);
+        yuvPixel(y[x + 1], uv[x], uv[x + 1], dst + x * 4 + 4);
+    }
+}
+
+void i420RowScalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int x, int width) {
+    for (; x < width; x += 2) {
+        yuvPixel(y[x], u[x / 2], v[x / 2], dst + x * 4);
+        yuvPixel(y[x + 1], u[x / 2], v[x / 2], dst + x * 4 + 4);
+    }
+}
+
+void rgb24RowScalar(const uint8_t* src, uint8_t* dst, int x, int width) {
+    for (; x < width; ++x) {
+        dst[x * 3 + 0] = src[x * 4 + 0];
+        dst[x * 3 + 1] = src[x * 4 + 1];
+        dst[x * 3 + 2] = src[x * 4 + 2];
+    }
+}
+
+void yuy2Nv12RowScalar(const uint8_t* s0, const uint8_t* s1, uint8_t* y0, uint8_t* y1, uint8_t* uv,
+                       int x, int width) {
+    for (; x < width; x += 2) {
+        y0[x] = s0[x * 2];
+        y0[x + 1] = s0[x * 2 + 2];
+        y1[x] = s1[x * 2];
+        y1[x + 1] = s1[x * 2 + 2];
+        uv[x] = avg8(s0[x * 2 + 1], s1[x * 2 + 1]);
+        uv[x + 1] = avg8(s0[x * 2 + 3], s1[x * 2 + 3]);
+    }
+}
+
+void interleaveRowScalar(const uint8_t* u, const uint8_t* v, uint8_t* uv, int x, int chromaWidth) {
+    for (; x < chromaWidth; ++x) {
+        uv[x * 2] = u[x];
+        uv[x * 2 + 1] = v[x];
+    }
+}
+
+void bgraDown2xRowScalar(const uint8_t* r0, const uint8_t* r1, uint8_t* dst, int x, int outWidth) {
+    for (; x < outWidth; ++x) {
+        for (int c = 0; c < 4; ++c) {
+            int i = x * 8 + c;
+            dst[x * 4 + c] = avg8(avg8(r0[i], r1[i]), avg8(r0[i + 4], r1[i + 4]));
+        }
+    }
+}
+
+void bgraDown4xRowScalar(const uint8_t* const r[4], uint8_t* dst, int x, int outWidth) {
+    for (; x < outWidth; ++x) {
+        for (int c = 0; c < 4; ++c) {
+            uint8_t v[4];
+            for (int k = 0; k < 4; ++k) {
+                int i = x * 16 + k * 4 + c;
+                v[k] = avg8(avg8(r[0][i], r[1][i]), avg8(r[2][i], r[3][i]));
+            }
+            dst[x * 4 + c] = avg8(avg8(v[0], v[1]), avg8(v[2], v[3]));
+        }
+    }
+}
+
+void planeDown2xRowScalar(const uint8_t* r0, const uint8_t* r1, uint8_t* dst, int x, int outWidth) {
+    for (; x < outWidth; ++x) {
+        dst[x] = avg8(avg8(r0[x * 2], r1[x * 2]), avg8(r0[x * 2 + 1], r1[x * 2 + 1]));
+    }
+}
+
+void planeDown4xRowScalar(const uint8_t* const r[4], uint8_t* dst, int x, int outWidth) {
+    for (; x < outWidth; ++x) {
+        uint8_t v[4];
+        for (int k = 0; k < 4; ++k) {
+            int i = x * 4 + k;
+            v[k] = avg8(avg8(r[0][i], r[1][i]), avg8(r[2][i], r[3][i]));
+        }
+        dst[x] = avg8(avg8(v[0], v[1]), avg8(v[2], v[3]));
+    }
+}
+
+// ---- scalar images ----
+
+void yuy2ToBgraScalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height; ++r) {
+        yuy2RowScalar(src + (ptrdiff_t)r * srcStride, dst + (ptrdiff_t)r * dstStride, 0, width);
+    }
+}
+
+void nv12ToBgraScalar(const uint8_t* y, int yStride, const uint8_t* uv, int uvStride,
+                      uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height; ++r) {
+        nv12RowScalar(y + (ptrdiff_t)r * yStride, uv + (ptrdiff_t)(r / 2) * uvStride,
+                      dst + (ptrdiff_t)r * dstStride, 0, width);
+    }
+}
+
+void i420ToBgraScalar(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                      uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height; ++r) {
+        i420RowScalar(y + (ptrdiff_t)r * yStride, u + (ptrdiff_t)(r / 2) * uStride, v + (ptrdiff_t)(r / 2) * vStride,
+                      dst + (ptrdiff_t)r * dstStride, 0, width);
+    }
+}
+
+void bgraToRgb24Scalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height; ++r) {
+        rgb24RowScalar(src + (ptrdiff_t)r * srcStride, dst + (ptrdiff_t)r * dstStride, 0, width);
+    }
+}
+
+void yuy2ToNv12Scalar(const uint8_t* src, int srcStride, uint8_t* y, int yStride, uint8_t* uv, int uvStride,
+                      int width, int height) {
+    for (int r = 0; r < height; r += 2) {
+        yuy2Nv12RowScalar(src + (ptrdiff_t)r * srcStride, src + (ptrdiff_t)(r + 1) * srcStride,
+                          y + (ptrdiff_t)r * yStride, y + (ptrdiff_t)(r + 1) * yStride,
+                          uv + (ptrdiff_t)(r / 2) * uvStride, 0, width);
+    }
+}
+
+void i420ToNv12Scalar(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                      uint8_t* dstY, int dstYStride, uint8_t* uv, int uvStride, int width, int height) {
+    for (int r = 0; r < height; ++r) {
+        memcpy(dstY + (ptrdiff_t)r * dstYStride, y + (ptrdiff_t)r * yStride, width);
+    }
+    for (int r = 0; r < height / 2; ++r) {
+        interleaveRowScalar(u + (ptrdiff_t)r * uStride, v + (ptrdiff_t)r * vStride, uv + (ptrdiff_t)r * uvStride,
+                            0, width / 2);
+    }
+}
+
+void bgraDown2xScalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height / 2; ++r) {
+        const uint8_t* r0 = src + (ptrdiff_t)(r * 2) * srcStride;
+        bgraDown2xRowScalar(r0, r0 + srcStride, dst + (ptrdiff_t)r * dstStride, 0, width / 2);
+    }
+}
+
+void bgraDown4xScalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height / 4; ++r) {
+        const uint8_t* rows[4];
+        for (int k = 0; k < 4; ++k) rows[k] = src + (ptrdiff_t)(r * 4 + k) * srcStride;
+        bgraDown4xRowScalar(rows, dst + (ptrdiff_t)r * dstStride, 0, width / 4);
+    }
+}
+
+void planeDown2xScalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height / 2; ++r) {
+        const uint8_t* r0 = src + (ptrdiff_t)(r * 2) * srcStride;
+        planeDown2xRowScalar(r0, r0 + srcStride, dst + (ptrdiff_t)r * dstStride, 0, width / 2);
+    }
+}
+
+void planeDown4xScalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    for (int r = 0; r < height / 4; ++r) {
+        const uint8_t* rows[4];
+        for (int k = 0; k < 4; ++k) rows[k] = src + (ptrdiff_t)(r * 4 + k) * srcStride;
+        planeDown4xRowScalar(rows, dst + (ptrdiff_t)r * dstStride, 0, width / 4);
+    }
+}
+
+const Kernels kScalar = {
+    Isa::Scalar,
+    yuy2ToBgraScalar, nv12ToBgraScalar, i420ToBgraScalar, bgraToRgb24Scalar,
+    yuy2ToNv12Scalar, i420ToNv12Scalar,
+    bgraDown2xScalar, bgraDown4xScalar, planeDown2xScalar, planeDown4xScalar,
+};
+
+#if PIXELCONV_X86
+
+// ---- SSE4.1 ----
+
+PC_SSE41 inline void yuvToBgra8(__m128i y, __m128i u, __m128i v, uint8_t* dst) {
+    const __m128i c128 = _mm_set1_epi16(128);
+    __m128i yy = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(kY)),
+                               _mm_set1_epi16(32));
+    u = _mm_sub_epi16(u, c128);
+    v = _mm_sub_epi16(v, c128);
+    __m128i b = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(u, _mm_set1_epi16(kUB))), 6);
+    __m128i g = _mm_srai_epi16(_mm_subs_epi16(yy, _mm_add_epi16(_mm_mullo_epi16(u, _mm_set1_epi16(kUG)),
+                                                                _mm_mullo_epi16(v, _mm_set1_epi16(kVG)))), 6);
+    __m128i r = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(v, _mm_set1_epi16(kVR))), 6);
+    __m128i br = _mm_packus_epi16(b, r);
+    __m128i ga = _mm_packus_epi16(g, _mm_set1_epi16(255));
+    __m128i bg = _mm_unpacklo_epi8(br, ga);
+    __m128i ra = _mm_unpackhi_epi8(br, ga);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+PC_SSE41 void yuy2ToBgraSse41(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    const __m128i my = _mm_setr_epi8(0, -1, 2, -1, 4, -1, 6, -1, 8, -1, 10, -1, 12, -1, 14, -1);
+    const __m128i mu = _mm_setr_epi8(1, -1, 1, -1, 5, -1, 5, -1, 9, -1, 9, -1, 13, -1, 13, -1);
+    const __m128i mv = _mm_setr_epi8(3, -1, 3, -1, 7, -1, 7, -1, 11, -1, 11, -1, 15, -1, 15, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* s = src + (ptrdiff_t)r * srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x * 2));
+            yuvToBgra8(_mm_shuffle_epi8(raw, my), _mm_shuffle_epi8(raw, mu), _mm_shuffle_epi8(raw, mv), d + x * 4);
+        }
+        yuy2RowScalar(s, d, x, width);
+    }
+}
+
+PC_SSE41 void nv12ToBgraSse41(const uint8_t* y, int yStride, const uint8_t* uv, int uvStride,
+                              uint8_t* dst, int dstStride, int width, int height) {
+    const __m128i mu = _mm_setr_epi8(0, -1, 0, -1, 2, -1, 2, -1, 4, -1, 4, -1, 6, -1, 6, -1);
+    const __m128i mv = _mm_setr_epi8(1, -1, 1, -1, 3, -1, 3, -1, 5, -1, 5, -1, 7, -1, 7, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* yr = y + (ptrdiff_t)r * yStride;
+        const uint8_t* uvr = uv + (ptrdiff_t)(r / 2) * uvStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i yv = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(yr + x)));
+            __m128i raw = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(uvr + x));
+            yuvToBgra8(yv, _mm_shuffle_epi8(raw, mu), _mm_shuffle_epi8(raw, mv), d + x * 4);
+        }
+        nv12RowScalar(yr, uvr, d, x, width);
+    }
+}
+
+PC_SSE41 inline __m128i load4(const uint8_t* p) {
+    int32_t t;
+    memcpy(&t, p, 4);
+    return _mm_cvtsi32_si128(t);
+}
+
+PC_SSE41 void i420ToBgraSse41(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                              uint8_t* dst, int dstStride, int width, int height) {
+    const __m128i dup = _mm_setr_epi8(0, -1, 0, -1, 1, -1, 1, -1, 2, -1, 2, -1, 3, -1, 3, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* yr = y + (ptrdiff_t)r * yStride;
+        const uint8_t* ur = u + (ptrdiff_t)(r / 2) * uStride;
+        const uint8_t* vr = v + (ptrdiff_t)(r / 2) * vStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i yv = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(yr + x)));
+            yuvToBgra8(yv, _mm_shuffle_epi8(load4(ur + x / 2), dup), _mm_shuffle_epi8(load4(vr + x / 2), dup), d + x * 4);
+        }
+        i420RowScalar(yr, ur, vr, d, x, width);
+    }
+}
+
+PC_SSE41 void bgraToRgb24Sse41(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    const __m128i m = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* s = src + (ptrdiff_t)r * srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        // Each store writes 16 bytes of which 12 are pixels; stop while the spill still lands inside the row.
+        for (; x + 6 <= width; x += 4) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x * 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x * 3), _mm_shuffle_epi8(p, m));
+        }
+        rgb24RowScalar(s, d, x, width);
+    }
+}
+
+PC_SSE41 void yuy2ToNv12Sse41(const uint8_t* src, int srcStride, uint8_t* y, int yStride, uint8_t* uv, int uvStride,
+                              int width, int height) {
+    const __m128i even = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i odd = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    for (int r = 0; r < height; r += 2) {
+        const uint8_t* s0 = src + (ptrdiff_t)r * srcStride;
+        const uint8_t* s1 = s0 + srcStride;
+        uint8_t* y0 = y + (ptrdiff_t)r * yStride;
+        uint8_t* y1 = y0 + yStride;
+        uint8_t* c = uv + (ptrdiff_t)(r / 2) * uvStride;
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s0 + x * 2));
+            __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s0 + x * 2 + 16));
+            __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s1 + x * 2));
+            __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s1 + x * 2 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + x),
+                             _mm_unpacklo_epi64(_mm_shuffle_epi8(a0, even), _mm_shuffle_epi8(a1, even)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + x),
+                             _mm_unpacklo_epi64(_mm_shuffle_epi8(b0, even), _mm_shuffle_epi8(b1, even)));
+            __m128i c0 = _mm_shuffle_epi8(_mm_avg_epu8(a0, b0), odd);
+            __m128i c1 = _mm_shuffle_epi8(_mm_avg_epu8(a1, b1), odd);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(c + x), _mm_unpacklo_epi64(c0, c1));
+        }
+        yuy2Nv12RowScalar(s0, s1, y0, y1, c, x, width);
+    }
+}
+
+PC_SSE41 void i420ToNv12Sse41(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                              uint8_t* dstY, int dstYStride, uint8_t* uv, int uvStride, int width, int height) {
+    for (int r = 0; r < height; ++r) {
+        memcpy(dstY + (ptrdiff_t)r * dstYStride, y + (ptrdiff_t)r * yStride, width);
+    }
+    int cw = width / 2;
+    for (int r = 0; r < height / 2; ++r) {
+        const uint8_t* ur = u + (ptrdiff_t)r * uStride;
+        const uint8_t* vr = v + (ptrdiff_t)r * vStride;
+        uint8_t* d = uv + (ptrdiff_t)r * uvStride;
+        int x = 0;
+        for (; x + 8 <= cw; x += 8) {
+            __m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(ur + x));
+            __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(vr + x));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x * 2), _mm_unpacklo_epi8(a, b));
+        }
+        interleaveRowScalar(ur, vr, d, x, cw);
+    }
+}
+
+// Averages adjacent BGRA pixels: 4 from a, 4 from b -> 4 outputs.
+PC_SSE41 inline __m128i pairAvgBgra(__m128i a, __m128i b) {
+    __m128i e = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i o = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_avg_epu8(e, o);
+}
+
+PC_SSE41 inline __m128i load16(const uint8_t* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+PC_SSE41 void bgraDown2xSse41(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    int ow = width / 2;
+    for (int r = 0; r < height / 2; ++r) {
+        const uint8_t* r0 = src + (ptrdiff_t)(r * 2) * srcStride;
+        const uint8_t* r1 = r0 + srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 4 <= ow; x += 4) {
+            __m128i v0 = _mm_avg_epu8(load16(r0 + x * 8), load16(r1 + x * 8));
+            __m128i v1 = _mm_avg_epu8(load16(r0 + x * 8 + 16), load16(r1 + x * 8 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x * 4), pairAvgBgra(v0, v1));
+        }
+        bgraDown2xRowScalar(r0, r1, d, x, ow);
+    }
+}
+
+PC_SSE41 void bgraDown4xSse41(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    int ow = width / 4;
+    for (int r = 0; r < height / 4; ++r) {
+        const uint8_t* rows[4];
+        for (int k = 0; k < 4; ++k) rows[k] = src + (ptrdiff_t)(r * 4 + k) * srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 4 <= ow; x += 4) {
+            __m128i v[4];
+            for (int k = 0; k < 4; ++k) {
+                int o = x * 16 + k * 16;
+                v[k] = _mm_avg_epu8(_mm_avg_epu8(load16(rows[0] + o), load16(rows[1] + o)),
+                                    _mm_avg_epu8(load16(rows[2] + o), load16(rows[3] + o)));
+            }
+            __m128i h = pairAvgBgra(pairAvgBgra(v[0], v[1]), pairAvgBgra(v[2], v[3]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x * 4), h);
+        }
+        bgraDown4xRowScalar(rows, d, x, ow);
+    }
+}
+
+// Averages adjacent bytes of v into 16-bit lanes.
+PC_SSE41 inline __m128i pairAvgBytes(__m128i v) {
+    return _mm_avg_epu16(_mm_and_si128(v, _mm_set1_epi16(0x00FF)), _mm_srli_epi16(v, 8));
+}
+
+PC_SSE41 void planeDown2xSse41(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    int ow = width / 2;
+    for (int r = 0; r < height / 2; ++r) {
+        const uint8_t* r0 = src + (ptrdiff_t)(r * 2) * srcStride;
+        const uint8_t* r1 = r0 + srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 16 <= ow; x += 16) {
+            __m128i v0 = _mm_avg_epu8(load16(r0 + x * 2), load16(r1 + x * 2));
+            __m128i v1 = _mm_avg_epu8(load16(r0 + x * 2 + 16), load16(r1 + x * 2 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_packus_epi16(pairAvgBytes(v0), pairAvgBytes(v1)));
+        }
+        planeDown2xRowScalar(r0, r1, d, x, ow);
+    }
+}
+
+PC_SSE41 void planeDown4xSse41(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    int ow = width / 4;
+    for (int r = 0; r < height / 4; ++r) {
+        const uint8_t* rows[4];
+        for (int k = 0; k < 4; ++k) rows[k] = src + (ptrdiff_t)(r * 4 + k) * srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 16 <= ow; x += 16) {
+            __m128i h[4];
+            for (int k = 0; k < 4; ++k) {
+                int o = x * 4 + k * 16;
+                __m128i v = _mm_avg_epu8(_mm_avg_epu8(load16(rows[0] + o), load16(rows[1] + o)),
+                                         _mm_avg_epu8(load16(rows[2] + o), load16(rows[3] + o)));
+                __m128i w = pairAvgBytes(v);
+                h[k] = _mm_avg_epu16(_mm_and_si128(w, _mm_set1_epi32(0xFFFF)), _mm_srli_epi32(w, 16));
+            }
+            __m128i lo = _mm_packus_epi32(h[0], h[1]);
+            __m128i hi = _mm_packus_epi32(h[2], h[3]);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_packus_epi16(lo, hi));
+        }
+        planeDown4xRowScalar(rows, d, x, ow);
+    }
+}
+
+const Kernels kSse41 = {
+    Isa::SSE41,
+    yuy2ToBgraSse41, nv12ToBgraSse41, i420ToBgraSse41, bgraToRgb24Sse41,
+    yuy2ToNv12Sse41, i420ToNv12Sse41,
+    bgraDown2xSse41, bgraDown4xSse41, planeDown2xSse41, planeDown4xSse41,
+};
+
+// ---- AVX2: the YUV -> BGRA kernels are arithmetic bound and gain from the
+// wider registers; the rest are load/store bound and share the SSE4.1 code. ----
+
+PC_AVX2 inline void yuvToBgra16(__m256i y, __m256i u, __m256i v, uint8_t* dst) {
+    const __m256i c128 = _mm256_set1_epi16(128);
+    __m256i yy = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(16)), _mm256_set1_epi16(kY)), _mm256_set1_epi16(32));
+    u = _mm256_sub_epi16(u, c128);
+    v = _mm256_sub_epi16(v, c128);
+    __m256i b = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(u, _mm256_set1_epi16(kUB))), 6);
+    __m256i g = _mm256_srai_epi16(
+        _mm256_subs_epi16(yy, _mm256_add_epi16(_mm256_mullo_epi16(u, _mm256_set1_epi16(kUG)),
+                                               _mm256_mullo_epi16(v, _mm256_set1_epi16(kVG)))), 6);
+    __m256i r = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(v, _mm256_set1_epi16(kVR))), 6);
+    __m256i br = _mm256_packus_epi16(b, r);
+    __m256i ga = _mm256_packus_epi16(g, _mm256_set1_epi16(255));
+    __m256i bg = _mm256_unpacklo_epi8(br, ga);
+    __m256i ra = _mm256_unpackhi_epi8(br, ga);
+    __m256i lo = _mm256_unpacklo_epi16(bg, ra);
+    __m256i hi = _mm256_unpackhi_epi16(bg, ra);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+PC_AVX2 void yuy2ToBgraAvx2(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) {
+    const __m256i my = _mm256_setr_epi8(0, -1, 2, -1, 4, -1, 6, -1, 8, -1, 10, -1, 12, -1, 14, -1,
+                                        0, -1, 2, -1, 4, -1, 6, -1, 8, -1, 10, -1, 12, -1, 14, -1);
+    const __m256i mu = _mm256_setr_epi8(1, -1, 1, -1, 5, -1, 5, -1, 9, -1, 9, -1, 13, -1, 13, -1,
+                                        1, -1, 1, -1, 5, -1, 5, -1, 9, -1, 9, -1, 13, -1, 13, -1);
+    const __m256i mv = _mm256_setr_epi8(3, -1, 3, -1, 7, -1, 7, -1, 11, -1, 11, -1, 15, -1, 15, -1,
+                                        3, -1, 3, -1, 7, -1, 7, -1, 11, -1, 11, -1, 15, -1, 15, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* s = src + (ptrdiff_t)r * srcStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + x * 2));
+            yuvToBgra16(_mm256_shuffle_epi8(raw, my), _mm256_shuffle_epi8(raw, mu), _mm256_shuffle_epi8(raw, mv),
+                        d + x * 4);
+        }
+        yuy2RowScalar(s, d, x, width);
+    }
+}
+
+PC_AVX2 void nv12ToBgraAvx2(const uint8_t* y, int yStride, const uint8_t* uv, int uvStride,
+                            uint8_t* dst, int dstStride, int width, int height) {
+    const __m256i mu = _mm256_setr_epi8(0, -1, 0, -1, 2, -1, 2, -1, 4, -1, 4, -1, 6, -1, 6, -1,
+                                        8, -1, 8, -1, 10, -1, 10, -1, 12, -1, 12, -1, 14, -1, 14, -1);
+    const __m256i mv = _mm256_setr_epi8(1, -1, 1, -1, 3, -1, 3, -1, 5, -1, 5, -1, 7, -1, 7, -1,
+                                        9, -1, 9, -1, 11, -1, 11, -1, 13, -1, 13, -1, 15, -1, 15, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* yr = y + (ptrdiff_t)r * yStride;
+        const uint8_t* uvr = uv + (ptrdiff_t)(r / 2) * uvStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m256i yv = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(yr + x)));
+            __m256i raw = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(uvr + x)));
+            yuvToBgra16(yv, _mm256_shuffle_epi8(raw, mu), _mm256_shuffle_epi8(raw, mv), d + x * 4);
+        }
+        nv12RowScalar(yr, uvr, d, x, width);
+    }
+}
+
+PC_AVX2 void i420ToBgraAvx2(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                            uint8_t* dst, int dstStride, int width, int height) {
+    const __m256i dup = _mm256_setr_epi8(0, -1, 0, -1, 1, -1, 1, -1, 2, -1, 2, -1, 3, -1, 3, -1,
+                                         4, -1, 4, -1, 5, -1, 5, -1, 6, -1, 6, -1, 7, -1, 7, -1);
+    for (int r = 0; r < height; ++r) {
+        const uint8_t* yr = y + (ptrdiff_t)r * yStride;
+        const uint8_t* ur = u + (ptrdiff_t)(r / 2) * uStride;
+        const uint8_t* vr = v + (ptrdiff_t)(r / 2) * vStride;
+        uint8_t* d = dst + (ptrdiff_t)r * dstStride;
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m256i yv = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(yr + x)));
+            __m256i ru = _mm256_broadcastsi128_si256(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(ur + x / 2)));
+            __m256i rv = _mm256_broadcastsi128_si256(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(vr + x / 2)));
+            yuvToBgra16(yv, _mm256_shuffle_epi8(ru, dup), _mm256_shuffle_epi8(rv, dup), d + x * 4);
+        }
+        i420RowScalar(yr, ur, vr, d, x, width);
+    }
+}
+
+const Kernels kAvx2 = {
+    Isa::AVX2,
+    yuy2ToBgraAvx2, nv12ToBgraAvx2, i420ToBgraAvx2, bgraToRgb24Sse41,
+    yuy2ToNv12Sse41, i420ToNv12Sse41,
+    bgraDown2xSse41, bgraDown4xSse41, planeDown2xSse41, planeDown4xSse41,
+};
+
+bool cpuHas(Isa isa) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    if (isa == Isa::SSE41) return sse41;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!sse41 || !osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    if (isa == Isa::SSE41) return __builtin_cpu_supports("sse4.1");
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#endif // PIXELCONV_X86
+
+const Kernels& selectKernels() {
+    return kernelsFor(detectIsa());
+}
+
+// ---- plane geometry for the packed layouts used by wrap()/convert() ----
+
+int planeCount(PixelFormat f) {
+    switch (f) {
+    case PixelFormat::NV12: return 2;
+    case PixelFormat::I420: return 3;
+    default: return 1;
+    }
+}
+
+int planeRowBytes(PixelFormat f, int plane, int width) {
+    switch (f) {
+    case PixelFormat::YUY2: return width * 2;
+    case PixelFormat::NV12: return width;
+    case PixelFormat::I420: return plane == 0 ? width : width / 2;
+    case PixelFormat::BGRA: return width * 4;
+    case PixelFormat::RGB24: return width * 3;
+    case PixelFormat::GRAY8: return width;
+    }
+    return 0;
+}
+
+int planeRows(int plane, int height) {
+    return plane == 0 ? height : height / 2;
+}
+
+bool isYuv(PixelFormat f) {
+    return f == PixelFormat::YUY2 || f == PixelFormat::NV12 || f == PixelFormat::I420;
+}
+
+void copyPlane(const Plane& src, const Plane& dst, int rowBytes, int rows) {
+    for (int r = 0; r < rows; ++r) {
+        memcpy(dst.data + (ptrdiff_t)r * dst.stride, src.data + (ptrdiff_t)r * src.stride, rowBytes);
+    }
+}
+
+void toBgra(const Image& s, uint8_t* dst, int dstStride, int row, int rows, const Kernels& k) {
+    switch (s.format) {
+    case PixelFormat::YUY2:
+        k.yuy2ToBgra(s.planes[0].data + (ptrdiff_t)row * s.planes[0].stride, s.planes[0].stride,
+                     dst, dstStride, s.width, rows);
+        break;
+    case PixelFormat::NV12:
+        k.nv12ToBgra(s.planes[0].data + (ptrdiff_t)row * s.planes[0].stride, s.planes[0].stride,
+                     s.planes[1].data + (ptrdiff_t)(row / 2) * s.planes[1].stride, s.planes[1].stride,
+                     dst, dstStride, s.width, rows);
+        break;
+    case PixelFormat::I420:
+        k.i420ToBgra(s.planes[0].data + (ptrdiff_t)row * s.planes[0].stride, s.planes[0].stride,
+                     s.planes[1].data + (ptrdiff_t)(row / 2) * s.planes[1].stride, s.planes[1].stride,
+                     s.planes[2].data + (ptrdiff_t)(row / 2) * s.planes[2].stride, s.planes[2].stride,
+                     dst, dstStride, s.width, rows);
+        break;
+    default:
+        break;
+    }
+}
+
+} // namespace
+
+Isa detectIsa() {
+    static const Isa isa = [] {
+        Isa best = Isa::Scalar;
+#if PIXELCONV_X86
+        if (cpuHas(Isa::AVX2)) best = Isa::AVX2;
+        else if (cpuHas(Isa::SSE41)) best = Isa::SSE41;
+#endif
+        // PIXELCONV_ISA=scalar|sse41 caps the selection, e.g. for A/B timing.
+        if (const char* env = getenv("PIXELCONV_ISA")) {
+            if (strcmp(env, "scalar") == 0) best = Isa::Scalar;
+            else if (strcmp(env, "sse41") == 0 && best == Isa::AVX2) best = Isa::SSE41;
+        }
+        return best;
+    }();
+    return isa;
+}
+
+const char* isaName(Isa isa) {
+    switch (isa) {
+    case Isa::AVX2: return "avx2";
+    case Isa::SSE41: return "sse41";
+    default: return "scalar";
+    }
+}
+
+const Kernels& kernelsFor(Isa isa) {
+#if PIXELCONV_X86
+    if (isa == Isa::AVX2 && cpuHas(Isa::AVX2)) return kAvx2;
+    if (isa != Isa::Scalar && cpuHas(Isa::SSE41)) return kSse41;
+#endif
+    (void)isa;
+    return kScalar;
+}
+
+const Kernels& kernels() {
+    static const Kernels& k = selectKernels();
+    return k;
+}
+
+size_t imageSize(PixelFormat format, int width, int height) {
+    size_t total = 0;
+    for (int p = 0; p < planeCount(format); ++p) {
+        total += (size_t)planeRowBytes(format, p, width) * planeRows(p, height);
+    }
+    return total;
+}
+
+Image wrap(PixelFormat format, int width, int height, uint8_t* buffer) {
+    Image img;
+    img.format = format;
+    img.width = width;
+    img.height = height;
+    for (int p = 0; p < planeCount(format); ++p) {
+        img.planes[p].data = buffer;
+        img.planes[p].stride = planeRowBytes(format, p, width);
+        buffer += (size_t)img.planes[p].stride * planeRows(p, height);
+    }
+    return img;
+}
+
+bool convert(const Image& src, const Image& dst) {
+    return convert(src, dst, kernels());
+}
+
+bool convert(const Image& src, const Image& dst, const Kernels& k) {
+    if (src.width != dst.width || src.height != dst.height) return false;
+    const int w = src.width, h = src.height;
+    const Plane* s = src.planes;
+    const Plane* d = dst.planes;
+
+    if (src.format == dst.format) {
+        for (int p = 0; p < planeCount(src.format); ++p) {
+            copyPlane(s[p], d[p], planeRowBytes(src.format, p, w), planeRows(p, h));
+        }
+        return true;
+    }
+
+    if (src.format == PixelFormat::BGRA && dst.format == PixelFormat::RGB24) {
+        k.bgraToRgb24(s[0].data, s[0].stride, d[0].data, d[0].stride, w, h);
+        return true;
+    }
+
+    if (!isYuv(src.format) || (w & 1) || (h & 1)) return false;
+
+    switch (dst.format) {
+    case PixelFormat::BGRA:
+        toBgra(src, d[0].data, d[0].stride, 0, h, k);
+        return true;
+
+    case PixelFormat::RGB24: {
+        // Two rows at a time through a scratch strip so chroma rows stay paired.
+        thread_local std::vector<uint8_t> strip;
+        strip.resize((size_t)w * 8);
+        for (int r = 0; r < h; r += 2) {
+            toBgra(src, strip.data(), w * 4, r, 2, k);
+            k.bgraToRgb24(strip.data(), w * 4, d[0].data + (ptrdiff_t)r * d[0].stride, d[0].stride, w, 2);
+        }
+        return true;
+    }
+
+    case PixelFormat::NV12:
+        if (src.format == PixelFormat::YUY2) {
+            k.yuy2ToNv12(s[0].data, s[0].stride, d[0].data, d[0].stride, d[1].data, d[1].stride, w, h);
+        } else {
+            k.i420ToNv12(s[0].data, s[0].stride, s[1].data, s[1].stride, s[2].data, s[2].stride,
+                         d[0].data, d[0].stride, d[1].data, d[1].stride, w, h);
+        }
+        return true;
+
+    case PixelFormat::GRAY8:
+        if (src.format == PixelFormat::YUY2) {
+            for (int r = 0; r < h; ++r) {
+                const uint8_t* sr = s[0].data + (ptrdiff_t)r * s[0].stride;
+                uint8_t* dr = d[0].data + (ptrdiff_t)r * d[0].stride;
+                for (int x = 0; x < w; ++x) dr[x] = sr[x * 2];
+            }
+        } else {
+            copyPlane(s[0], d[0], w, h);
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool downscale(const Image& src, const Image& dst, int factor) {
+    return downscale(src, dst, factor, kernels());
+}
+
+bool downscale(const Image& src, const Image& dst, int factor, const Kernels& k) {
+    if (src.format != dst.format) return false;
+    if (src.format != PixelFormat::BGRA && src.format != PixelFormat::GRAY8) return false;
+    if (factor != 1 && factor != 2 && factor != 4) return false;
+    if (src.width % factor || src.height % factor) return false;
+    if (dst.width != src.width / factor || dst.height != src.height / factor) return false;
+
+    const Plane& s = src.planes[0];
+    const Plane& d = dst.planes[0];
+    bool bgra = src.format == PixelFormat::BGRA;
+    if (factor == 1) {
+        copyPlane(s, d, planeRowBytes(src.format, 0, src.width), src.height);
+    } else if (factor == 2) {
+        (bgra ? k.bgraDown2x : k.planeDown2x)(s.data, s.stride, d.data, d.stride, src.width, src.height);
+    } else {
+        (bgra ? k.bgraDown4x : k.planeDown4x)(s.data, s.stride, d.data, d.stride, src.width, src.height);
+    }
+    return true;
+}
+
+bool convertScaled(const Image& src, const Image& dst, int factor) {
+    if (factor == 1) return convert(src, dst);
+    if (!isYuv(src.format) || dst.format != PixelFormat::BGRA) return false;
+    if (factor != 2 && factor != 4) return false;
+    if (src.width % factor || src.height % factor) return false;
+    if (dst.width != src.width / factor || dst.height != src.height / factor) return false;
+
+    const Kernels& k = kernels();
+    const int stripStride = src.width * 4;
+    thread_local std::vector<uint8_t> strip;
+    strip.resize((size_t)stripStride * factor);
+    for (int r = 0; r < src.height; r += factor) {
+        toBgra(src, strip.data(), stripStride, r, factor, k);
+        uint8_t* d = dst.planes[0].data + (ptrdiff_t)(r / factor) * dst.planes[0].stride;
+        (factor == 2 ? k.bgraDown2x : k.bgraDown4x)(strip.data(), stripStride, d, dst.planes[0].stride, src.width, factor);
+    }
+    return true;
+}
+
+} // namespace pixelconv
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Pixel-format conversion for the webcam helper.
+//
+// YUV input is BT.601 limited range. Widths and heights of YUV images must be
+// even. BGRA is 4 bytes per pixel with alpha forced to 255, RGB24 is the
+// Windows/BMP byte order (B, G, R). Every kernel has a scalar reference and
+// SIMD variants that produce bit-identical output; the fastest one supported
+// by the running CPU is picked on first use.
+
+namespace pixelconv {
+
+enum class PixelFormat { YUY2, NV12, I420, BGRA, RGB24, GRAY8 };
+
+enum class Isa { Scalar, SSE41, AVX2 };
+
+struct Plane {
+    uint8_t* data = nullptr;
+    int stride = 0;
+};
+
+struct Image {
+    PixelFormat format = PixelFormat::BGRA;
+    int width = 0;
+    int height = 0;
+    Plane planes[3];
+};
+
+struct Kernels {
+    Isa isa;
+    void (*yuy2ToBgra)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height);
+    void (*nv12ToBgra)(const uint8_t* y, int yStride, const uint8_t* uv, int uvStride,
+                       uint8_t* dst, int dstStride, int width, int height);
+    void (*i420ToBgra)(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                       uint8_t* dst, int dstStride, int width, int height);
+    void (*bgraToRgb24)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height);
+    void (*yuy2ToNv12)(const uint8_t* src, int srcStride, uint8_t* y, int yStride, uint8_t* uv, int uvStride,
+                       int width, int height);
+    void (*i420ToNv12)(const uint8_t* y, int yStride, const uint8_t* u, int uStride, const uint8_t* v, int vStride,
+                       uint8_t* dstY, int dstYStride, uint8_t* uv, int uvStride, int width, int height);
+    // Box-filter downscale; width and height must be multiples of the factor.
+    void (*bgraDown2x)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height);
+    void (*bgraDown4x)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height);
+    void (*planeDown2x)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height);
+    void (*planeDown4x)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height);
+};
+
+Isa detectIsa();
+const char* isaName(Isa isa);
+
+// Kernel table for a specific ISA; falls back to the best supported one below it.
+const Kernels& kernelsFor(Isa isa);
+const Kernels& kernels();
+
+// Bytes needed for a tightly packed image, and a view over such a buffer.
+size_t imageSize(PixelFormat format, int width, int height);
+Image wrap(PixelFormat format, int width, int height, uint8_t* buffer);
+
+// Supported: YUY2/NV12/I420 -> BGRA/RGB24/NV12/GRAY8, BGRA -> RGB24, same-format copy.
+// Returns false for unsupported pairs or mismatched sizes.
+bool convert(const Image& src, const Image& dst);
+bool convert(const Image& src, const Image& dst, const Kernels& k);
+
+// factor is 1, 2 or 4; BGRA and GRAY8 only. dst must be src size / factor.
+bool downscale(const Image& src, const Image& dst, int factor);
+bool downscale(const Image& src, const Image& dst, int factor, const Kernels& k);
+
+// YUV -> BGRA at 1/factor size in one pass, through a strip of `factor` rows
+// instead of a full-size intermediate frame.
+bool convertScaled(const Image& src, const Image& dst, int factor);
+
+} // namespace pixelconv
@@ -0,0 +1,296 @@
+#include "preview.h"
+
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace preview {
+
+namespace {
+
+size_t align64(size_t v) {
+    return (v + 63) & ~(size_t)63;
+}
+
+SlotHeader* slotAt(uint8_t* base, const RingHeader* header, uint32_t index) {
+    return reinterpret_cast<SlotHeader*>(base + sizeof(RingHeader) + (size_t)index * header->slotStride);
+}
+
+} // namespace
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Four independent multiply-xor lanes so the check keeps up with the converter.
+uint64_t checksum(const uint8_t* data, size_t len) {
+    const uint64_t prime = 0x100000001B3ull;
+    uint64_t h[4] = { 0x9E3779B97F4A7C15ull ^ len, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int k = 0; k < 4; ++k) {
+            uint64_t w;
+            memcpy(&w, data + i + k * 8, 8);
+            h[k] = (h[k] ^ w) * prime;
+            h[k] ^= h[k] >> 29;
+        }
+    }
+    for (; i < len; ++i) h[0] = (h[0] ^ data[i]) * prime;
+    return h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7);
+}
+
+// ---- SharedRegion ----
+
+SharedRegion::~SharedRegion() {
+    close();
+}
+
+#if defined(_WIN32)
+
+bool SharedRegion::create(const std::string& name, size_t size) {
+    close();
+    HANDLE h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                  (DWORD)((uint64_t)size >> 32), (DWORD)size, name.c_str());
+    if (!h) return false;
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(h);
+        return false;
+    }
+    void* view = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!view) {
+        CloseHandle(h);
+        return false;
+    }
+    mapping = h;
+    base = static_cast<uint8_t*>(view);
+    length = size;
+    owner = true;
+    regionName = name;
+    return true;
+}
+
+bool SharedRegion::open(const std::string& name) {
+    close();
+    HANDLE h = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+    if (!h) return false;
+    void* view = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION info = {};
+    if (!view || !VirtualQuery(view, &info, sizeof(info))) {
+        if (view) UnmapViewOfFile(view);
+        CloseHandle(h);
+        return false;
+    }
+    mapping = h;
+    base = static_cast<uint8_t*>(view);
+    length = info.RegionSize;
+    owner = false;
+    regionName = name;
+    return true;
+}
+
+void SharedRegion::close() {
+    if (base) UnmapViewOfFile(base);
+    if (mapping) CloseHandle(mapping);
+    base = nullptr;
+    mapping = nullptr;
+    length = 0;
+    owner = false;
+}
+
+#else
+
+bool SharedRegion::create(const std::string& name, size_t size) {
+    close();
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    if (ftruncate(fd, (off_t)size) != 0) {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    base = static_cast<uint8_t*>(view);
+    length = size;
+    owner = true;
+    regionName = name;
+    return true;
+}
+
+bool SharedRegion::open(const std::string& name) {
+    close();
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED) return false;
+    base = static_cast<uint8_t*>(view);
+    length = (size_t)st.st_size;
+    owner = false;
+    regionName = name;
+    return true;
+}
+
+void SharedRegion::close() {
+    if (base) munmap(base, length);
+    if (owner) shm_unlink(regionName.c_str());
+    base = nullptr;
+    length = 0;
+    owner = false;
+}
+
+#endif
+
+// ---- Publisher ----
+
+bool Publisher::open(const std::string& name, uint32_t slots, uint32_t maxPayload) {
+    close();
+    if (slots < 2) slots = 2;
+    size_t slotStride = sizeof(SlotHeader) + align64(maxPayload);
+    if (!region.create(name, sizeof(RingHeader) + slotStride * slots)) return false;
+
+    header = new (region.data()) RingHeader();
+    header->magic = kMagic;
+    header->version = kVersion;
+    header->slotCount = slots;
+    header->slotStride = (uint32_t)slotStride;
+    header->maxPayload = maxPayload;
+    for (uint32_t i = 0; i < slots; ++i) new (slotAt(region.data(), header, i)) SlotHeader();
+    header->published.store(0, std::memory_order_release);
+    return true;
+}
+
+void Publisher::close() {
+    region.close();
+    header = nullptr;
+    current = nullptr;
+}
+
+pixelconv::Image Publisher::begin(int width, int height, int64_t captureNs) {
+    pixelconv::Image img;
+    if (!header || (size_t)width * height * 4 > header->maxPayload) return img;
+
+    uint64_t frame = header->published.load(std::memory_order_relaxed);
+    slot = (uint32_t)(frame % header->slotCount);
+    current = slotAt(region.data(), header, slot);
+
+    uint64_t seq = current->seq.load(std::memory_order_relaxed);
+    current->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    current->frame = frame;
+    current->captureNs = captureNs;
+    current->width = (uint32_t)width;
+    current->height = (uint32_t)height;
+    current->stride = (uint32_t)width * 4;
+    current->payloadBytes = (uint32_t)width * height * 4;
+    return pixelconv::wrap(pixelconv::PixelFormat::BGRA, width, height,
+                           reinterpret_cast<uint8_t*>(current) + sizeof(SlotHeader));
+}
+
+uint64_t Publisher::commit() {
+    if (!current) return 0;
+    const uint8_t* payload = reinterpret_cast<const uint8_t*>(current) + sizeof(SlotHeader);
+    current->checksum = checksum(payload, current->payloadBytes);
+    current->publishNs = nowNs();
+    uint64_t frame = current->frame;
+    current->seq.store(current->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    header->published.store(frame + 1, std::memory_order_release);
+    current = nullptr;
+    return frame;
+}
+
+// The slot is not the one readers look at, so ending the write is enough;
+// the next begin() takes it again.
+void Publisher::cancel() {
+    if (!current) return;
+    current->seq.store(current->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    current = nullptr;
+}
+
+// ---- Subscriber ----
+
+bool Subscriber::open(const std::string& name) {
+    close();
+    if (!region.open(name) || region.size() < sizeof(RingHeader)) return false;
+    header = reinterpret_cast<const RingHeader*>(region.data());
+    if (header->magic != kMagic || header->version != kVersion ||
+        sizeof(RingHeader) + (size_t)header->slotStride * header->slotCount > region.size()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void Subscriber::close() {
+    region.close();
+    header = nullptr;
+}
+
+bool Subscriber::readLatest(uint64_t next, std::vector<uint8_t>& pixels, FrameInfo& info) {
+    if (!header) return false;
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        uint64_t published = header->published.load(std::memory_order_acquire);
+        if (published == 0 || published - 1 < next) return false;
+
+        const SlotHeader* s = slotAt(region.data(), header, (uint32_t)((published - 1) % header->slotCount));
+        uint64_t before = s->seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            ++torn;
+            continue;
+        }
+
+        FrameInfo copy;
+        copy.frame = s->frame;
+        copy.captureNs = s->captureNs;
+        copy.publishNs = s->publishNs;
+        copy.width = s->width;
+        copy.height = s->height;
+        copy.stride = s->stride;
+        uint32_t bytes = s->payloadBytes;
+        uint64_t sum = s->checksum;
+        if (bytes > header->maxPayload) {
+            ++torn;
+            continue;
+        }
+        pixels.resize(bytes);
+        memcpy(pixels.data(), reinterpret_cast<const uint8_t*>(s) + sizeof(SlotHeader), bytes);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s->seq.load(std::memory_order_relaxed) != before) {
+            ++torn;
+            continue;
+        }
+        copy.checksumOk = checksum(pixels.data(), bytes) == sum;
+        info = copy;
+        return true;
+    }
+    return false;
+}
+
+} // namespace preview
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "pixelconv.h"
+
+// Live preview frames shared with other processes through a named
+// shared-memory ring. The control pipe only carries a small notice per frame;
+// pixels never go through it.
+//
+// Layout: RingHeader, then slotCount slots of slotStride bytes, each a
+// SlotHeader followed by the BGRA payload. Slots are guarded by a seqlock:
+// the writer makes seq odd, fills the slot, then makes it even again. A
+// reader copies the slot and keeps the copy only if seq was the same even
+// value before and after.
+
+namespace preview {
+
+constexpr uint32_t kMagic = 0x57505256; // "VRPW"
+constexpr uint32_t kVersion = 1;
+
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotStride;
+    uint32_t maxPayload;
+    uint32_t reserved;
+    std::atomic<uint64_t> published; // frames committed so far; newest is published - 1
+    uint8_t pad[32];
+};
+
+struct SlotHeader {
+    std::atomic<uint64_t> seq;
+    uint64_t frame;
+    int64_t captureNs; // steady clock, comparable across processes on the same machine
+    int64_t publishNs;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t payloadBytes;
+    uint64_t checksum;
+    uint8_t pad[8];
+};
+
+static_assert(sizeof(RingHeader) == 64, "RingHeader must stay 64 bytes");
+static_assert(sizeof(SlotHeader) == 64, "SlotHeader must stay 64 bytes");
+
+int64_t nowNs();
+uint64_t checksum(const uint8_t* data, size_t len);
+
+class SharedRegion {
+public:
+    SharedRegion() = default;
+    ~SharedRegion();
+    SharedRegion(const SharedRegion&) = delete;
+    SharedRegion& operator=(const SharedRegion&) = delete;
+
+    bool create(const std::string& name, size_t size);
+    bool open(const std::string& name);
+    void close();
+
+    uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    uint8_t* base = nullptr;
+    size_t length = 0;
+    bool owner = false;
+    std::string regionName;
+#if defined(_WIN32)
+    void* mapping = nullptr;
+#endif
+};
+
+class Publisher {
+public:
+    bool open(const std::string& name, uint32_t slots, uint32_t maxPayload);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+    uint32_t maxPayload() const { return header ? header->maxPayload : 0; }
+
+    // BGRA view straight into the next slot; the conversion stage writes there
+    // and commit() publishes it. No frame is copied on the way.
+    // Empty if the frame is larger than a slot.
+    pixelconv::Image begin(int width, int height, int64_t captureNs);
+    uint64_t commit();
+    // Hands the slot from begin() back unpublished, when the conversion
+    // stage wrote nothing usable into it.
+    void cancel();
+    uint32_t lastSlot() const { return slot; }
+
+private:
+    SharedRegion region;
+    RingHeader* header = nullptr;
+    SlotHeader* current = nullptr;
+    uint32_t slot = 0;
+};
+
+struct FrameInfo {
+    uint64_t frame = 0;
+    int64_t captureNs = 0;
+    int64_t publishNs = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t stride = 0;
+    bool checksumOk = false;
+};
+
+class Subscriber {
+public:
+    bool open(const std::string& name);
+    void close();
+
+    // Copies the newest frame if its number is at least `next`. Returns false
+    // when nothing new is available; torn reads are retried and counted.
+    bool readLatest(uint64_t next, std::vector<uint8_t>& pixels, FrameInfo& info);
+    uint64_t tornReads() const { return torn; }
+
+private:
+    SharedRegion region;
+    const RingHeader* header = nullptr;
+    uint64_t torn = 0;
+};
+
+} // namespace preview
@@ -0,0 +1,104 @@
+// Standalone consumer for the webcam preview ring.
+//
+//   preview_probe <shm-name> [seconds]   attach to a running helper
+//   preview_probe --self [seconds]       publish synthetic frames in-process
+//
+// Prints one JSON line with frame counts, torn reads, checksum failures and
+// capture-to-read latency percentiles.
+
+#include "preview.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int64_t percentile(std::vector<int64_t>& v, double p) {
+    if (v.empty()) return 0;
+    size_t i = (size_t)(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+void syntheticPublisher(preview::Publisher& pub, int w, int h, std::atomic<bool>& running) {
+    uint8_t shade = 0;
+    while (running) {
+        pixelconv::Image img = pub.begin(w, h, preview::nowNs());
+        for (int y = 0; y < h; ++y) memset(img.planes[0].data + (size_t)y * img.planes[0].stride, shade + y, (size_t)w * 4);
+        pub.commit();
+        ++shade;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: preview_probe <shm-name>|--self [seconds]\n");
+        return 2;
+    }
+    double seconds = argc > 2 ? atof(argv[2]) : 5.0;
+    bool self = strcmp(argv[1], "--self") == 0;
+
+    preview::Publisher pub;
+    std::atomic<bool> running(true);
+    std::thread producer;
+    std::string name = argv[1];
+    if (self) {
+#if defined(_WIN32)
+        name = "Local\\webcam_preview_probe";
+#else
+        name = "/webcam_preview_probe";
+#endif
+        if (!pub.open(name, 4, 640 * 480 * 4)) {
+            fprintf(stderr, "cannot create %s\n", name.c_str());
+            return 1;
+        }
+        producer = std::thread(syntheticPublisher, std::ref(pub), 640, 480, std::ref(running));
+    }
+
+    preview::Subscriber sub;
+    if (!sub.open(name)) {
+        fprintf(stderr, "cannot open %s\n", name.c_str());
+        running = false;
+        if (producer.joinable()) producer.join();
+        return 1;
+    }
+
+    std::vector<uint8_t> pixels;
+    std::vector<int64_t> latency;
+    preview::FrameInfo info;
+    uint64_t next = 0, frames = 0, skipped = 0, badChecksum = 0;
+    bool first = true;
+    int64_t end = preview::nowNs() + (int64_t)(seconds * 1e9);
+    while (preview::nowNs() < end) {
+        if (!sub.readLatest(next, pixels, info)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+        if (!first) skipped += info.frame - next;
+        first = false;
+        next = info.frame + 1;
+        ++frames;
+        if (!info.checksumOk) ++badChecksum;
+        latency.push_back(preview::nowNs() - info.captureNs);
+    }
+
+    running = false;
+    if (producer.joinable()) producer.join();
+
+    printf("{\"frames\": %llu, \"skipped\": %llu, \"torn_reads\": %llu, \"checksum_failures\": %llu, "
+           "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+           (unsigned long long)frames, (unsigned long long)skipped, (unsigned long long)sub.tornReads(),
+           (unsigned long long)badChecksum, percentile(latency, 0.5) / 1e3, percentile(latency, 0.99) / 1e3,
+           percentile(latency, 1.0) / 1e3);
+    return badChecksum == 0 ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+#include "segments.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+namespace segments {
+
+void Store::setQuota(uint64_t quotaBytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (attached) return;
+    limit = quotaBytes;
+    if (!limit) {
+        closed.clear();
+        total = 0;
+    }
+}
+
+bool Store::attach(uint64_t quotaBytes, bool& adopt) {
+    std::lock_guard<std::mutex> lock(mutex);
+    adopt = false;
+    if (attached) {
+        if (quotaBytes && quotaBytes != limit) return false;
+    } else {
+        // What was tracked under an earlier quota may since have been
+        // deleted by hand or joined by other files; scan() starts afresh.
+        adopt = quotaBytes != 0;
+        limit = quotaBytes;
+        closed.clear();
+        total = 0;
+    }
+    ++attached;
+    return true;
+}
+
+void Store::detach() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (attached) --attached;
+}
+
+int Store::recordings() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return attached;
+}
+
+uint64_t Store::quota() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return limit;
+}
+
+std::vector<Segment> Store::scan(const std::string& directory, const std::string& prefix, const std::string& extension) {
+    std::vector<std::pair<fs::file_time_type, Segment>> found;
+    std::error_code ec;
+    for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file(ec)) continue;
+        std::string name = it->path().filename().string();
+        if (name.size() < prefix.size() + extension.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - extension.size(), extension.size(), extension) != 0) {
+            continue;
+        }
+        Segment s;
+        s.path = it->path().string();
+        s.bytes = it->file_size(ec);
+        fs::file_time_type written = it->last_write_time(ec);
+        if (!ec) found.emplace_back(written, s);
+        ec.clear();
+    }
+    std::sort(found.begin(), found.end(), [](const std::pair<fs::file_time_type, Segment>& a,
+                                             const std::pair<fs::file_time_type, Segment>& b) { return a.first < b.first; });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!limit) return {};
+    closed.clear();
+    total = 0;
+    for (const auto& f : found) {
+        closed.push_back(f.second);
+        total += f.second.bytes;
+    }
+    return evict();
+}
+
+std::vector<Segment> Store::add(const Segment& segment) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!limit) return {};
+    // A scan can adopt a segment that was still being written; count it once.
+    for (auto it = closed.begin(); it != closed.end(); ++it) {
+        if (it->path == segment.path) {
+            total -= it->bytes;
+            closed.erase(it);
+            break;
+        }
+    }
+    closed.push_back(segment);
+    total += segment.bytes;
+    return evict();
+}
+
+// Called with the mutex held.
+std::vector<Segment> Store::evict() {
+    std::vector<Segment> removed;
+    size_t i = 0;
+    while (total > limit && i + 1 < closed.size()) {
+        if (std::remove(closed[i].path.c_str()) == 0 || !fs::exists(closed[i].path)) {
+            total -= closed[i].bytes;
+            removed.push_back(closed[i]);
+            closed.erase(closed.begin() + (ptrdiff_t)i);
+        } else {
+            ++i;
+        }
+    }
+    return removed;
+}
+
+uint64_t Store::totalBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+size_t Store::count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return closed.size();
+}
+
+uint64_t fileSize(const std::string& path) {
+    std::error_code ec;
+    uintmax_t size = fs::file_size(path, ec);
+    return ec ? 0 : (uint64_t)size;
+}
+
+} // namespace segments
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Disk quota for continuous recording.
+//
+// A continuous recording is a chain of segment files. The store keeps the
+// closed ones, oldest first, and deletes from the front whenever a new one
+// would take the total over the quota. It holds one small entry per file on
+// disk, so with a quota its size is bounded however long the recording runs;
+// without one nothing is tracked at all.
+
+namespace segments {
+
+struct Segment {
+    std::string path;
+    uint64_t bytes = 0;
+};
+
+// Thread-safe: every recording on every camera shares one store, and so one
+// quota for all the segment files.
+class Store {
+public:
+    explicit Store(uint64_t quotaBytes = 0) : limit(quotaBytes) {}
+
+    // 0 disables the quota. Only while no recording is attached; a store
+    // without a quota forgets what it tracked.
+    void setQuota(uint64_t quotaBytes);
+    uint64_t quota() const;
+
+    // A recording starting on the store. The first one sets the quota; later
+    // ones run under it, and are refused (false, nothing attached) if they
+    // ask for a different one. 0 asks for none in particular. adopt is set
+    // when this turned the quota on, so the caller should scan() the files
+    // already on disk.
+    bool attach(uint64_t quotaBytes, bool& adopt);
+    // The recording has closed its last segment.
+    void detach();
+    int recordings() const;
+
+    // Adopts files left by earlier runs: regular files in directory whose
+    // names start with prefix and end with extension, oldest first by
+    // modification time. Evicts straight away if they exceed the quota.
+    std::vector<Segment> scan(const std::string& directory, const std::string& prefix, const std::string& extension);
+
+    // Records a closed segment, then deletes the oldest segments until the
+    // total fits the quota again. The segment just added is never deleted,
+    // nor is a file that cannot be removed (still open in a player); both stay
+    // counted. Returns what was deleted.
+    std::vector<Segment> add(const Segment& segment);
+
+    uint64_t totalBytes() const;
+    size_t count() const;
+
+private:
+    std::vector<Segment> evict();
+
+    mutable std::mutex mutex;
+    uint64_t limit;
+    int attached = 0;
+    uint64_t total = 0;
+    std::deque<Segment> closed;
+};
+
+// Size of a file in bytes, or 0 if it cannot be read.
+uint64_t fileSize(const std::string& path);
+
+} // namespace segments
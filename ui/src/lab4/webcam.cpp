@@ -1,18 +1,40 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <dbt.h>
 #include <mfapi.h>
 #include <mfidl.h>
 #include <mfreadwrite.h>
+#include <mferror.h>
 #include <shlwapi.h>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <string>
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+#include "../../../common/json.h"
+#include "../../../common/metrics.h"
+#include "../../../common/protocol.h"
+#include "capture.h"
+#include "frametrace.h"
+#include "imageenc.h"
+#include "latency.h"
+#include "motion.h"
+#include "pixelconv.h"
+#include "preview.h"
+#include "segments.h"
+#include "webcam.h"
+
 #pragma comment(lib, "mfplat.lib")
 #pragma comment(lib, "mfreadwrite.lib")
 #pragma comment(lib, "mfuuid.lib")
@@ -20,177 +42,591 @@
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "user32.lib")
 
-std::atomic<bool> isRunning(true);
+const GUID GUID_KSCATEGORY_VIDEO_CAMERA = { 0xe5323777, 0xf976, 0x4f5b, { 0x9b, 0x55, 0xb9, 0x46, 0x99, 0xc4, 0x6e, 0x44 } };
+const GUID GUID_KSCATEGORY_CAPTURE = { 0x65e8773d, 0x8f56, 0x11d0, { 0xa3, 0xb9, 0x00, 0xa0, 0xc9, 0x22, 0x31, 0x96 } };
+
 std::atomic<bool> isHidden(false);
 
+void generateFilename(char* buffer, size_t size, const char* prefix, const char* ext);
+class MotionSink;
+class SegmentSink;
+
+// Significant digits for reported doubles, as the stream-built messages had.
+constexpr int kDigits = 6;
+
+// How long closing a session waits for a camera's read to return once its
+// source is shut down, before the session is given up on.
+constexpr int kSessionStopMs = 2000;
+
+// One native media type of a camera, as the driver reports it.
+struct CameraMode {
+    DWORD index = 0;
+    std::string format;
+    UINT32 width = 0;
+    UINT32 height = 0;
+    UINT32 fpsNum = 0;
+    UINT32 fpsDen = 1;
+    double fpsMin = 0;
+    double fpsMax = 0;
+
+    double fps() const { return fpsDen ? (double)fpsNum / fpsDen : 0; }
+};
+
+struct CameraDevice {
+    std::string id;
+    std::string name;
+    std::vector<CameraMode> modes;
+};
+
 class WebcamCapture {
 public:
-    WebcamCapture() {
+    WebcamCapture(protocol::Output& out, protocol::Channel messages, hal::TraceOptions traceOptions = hal::TraceOptions())
+        : output(out), channel(messages), trace(std::move(traceOptions)) {
+        if (trace.replaying()) tracedCameras = frametrace::cameras(trace.replay);
         HRESULT hr = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
         if (SUCCEEDED(hr)) {
             MFStartup(MF_VERSION);
         }
+        metricsCollector = metrics::registry().addCollector([this](metrics::Exposition& out) { collectMetrics(out); });
     }
 
     ~WebcamCapture() {
+        metrics::registry().removeCollector(metricsCollector);
+        stopPreview();
+        closeAllSessions();
+        joinBackground();
         MFShutdown();
         CoUninitialize();
     }
 
-    void outputJSON(const std::string& json) {
-        std::cout << json << std::endl;
-        std::cout.flush();
+    // Sessions and the preview thread report from their own threads. Output
+    // queues the message for its writer thread and never blocks on the pipe;
+    // a type that supersedes (camera_info, session_stats) replaces a queued
+    // one when the host lags.
+    void outputJSON(std::string_view json, protocol::MessageType type = protocol::MessageType::Generic) {
+        output.sendJson(json, type, channel);
+    }
+
+    protocol::Output& out() { return output; }
+
+    void outputError(const char* context, HRESULT hr) {
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "status");
+        msg.key("message").beginString().text("Error in ").text(context);
+        msg.text(" (Code: ").hex((uint32_t)hr).text(")").endString();
+        msg.field("error", true);
+        msg.endObject();
+        outputJSON(msg.view());
+    }
+
+    void reportSegmentDeleted(const segments::Segment& gone) {
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "segment_deleted");
+        msg.field("filename", gone.path);
+        msg.field("bytes", gone.bytes);
+        msg.endObject();
+        outputJSON(msg.view());
     }
 
-    void outputError(const std::string& context, HRESULT hr) {
-        std::ostringstream ss;
-        ss << "{\"type\":\"status\",\"message\":\"Error in " << context 
-           << " (Code: " << std::hex << hr << ")\",\"error\":true}";
-        outputJSON(ss.str());
+    // {"type":<type>,<key>:<value>}, the shape of most notices.
+    void outputEvent(const char* type, const char* key, std::string_view value) {
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", type);
+        msg.field(key, value);
+        msg.endObject();
+        outputJSON(msg.view());
     }
 
-    static std::string escapeJSON(const std::string& s) {
-        std::ostringstream o;
-        for (char c : s) {
-            switch (c) {
-            case '\"': o << "\\\""; break;
-            case '\\': o << "\\\\"; break;
-            case '\b': o << "\\b"; break;
-            case '\f': o << "\\f"; break;
-            case '\n': o << "\\n"; break;
-            case '\r': o << "\\r"; break;
-            case '\t': o << "\\t"; break;
-            default:   o << c; break;
+    // Work that must not hold up a session's delivery thread, such as a
+    // session photo's encode and write. The destructor joins it once the
+    // sessions are closed, so it may use the capture.
+    void runInBackground(std::function<void()> work) {
+        std::lock_guard<std::mutex> lock(backgroundMutex);
+        for (auto it = background.begin(); it != background.end();) {
+            if (*it->done) {
+                it->thread.join();
+                it = background.erase(it);
+            } else {
+                ++it;
             }
         }
-        return o.str();
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        std::thread thread([work = std::move(work), done] {
+            work();
+            *done = true;
+        });
+        background.push_back({ std::move(thread), done });
     }
 
-    std::string getCameraInfo() {
-        IMFAttributes* pConfig = nullptr;
-        IMFActivate** ppDevices = nullptr;
-        UINT32 count = 0;
-        std::string name = "No camera found";
-        std::string status = "Not Available";
-        std::string resolution = "Checking...";
-        std::string fps = "Checking...";
-
-        if (SUCCEEDED(MFCreateAttributes(&pConfig, 1))) {
-            pConfig->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE, MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID);
-            if (SUCCEEDED(MFEnumDeviceSources(pConfig, &ppDevices, &count)) && count > 0) {
-                WCHAR* szFriendlyName = nullptr;
-                UINT32 cchName;
-                if (SUCCEEDED(ppDevices[0]->GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME, &szFriendlyName, &cchName))) {
-                    char buffer[512] = {0};
-                    WideCharToMultiByte(CP_UTF8, 0, szFriendlyName, -1, buffer, sizeof(buffer) - 1, NULL, NULL);
-                    name = buffer;
-                    CoTaskMemFree(szFriendlyName);
-                    status = "Available";
-                    
-                    IMFMediaSource* pSrc = nullptr;
-                    IMFSourceReader* pRdr = nullptr;
-                    if (SUCCEEDED(ppDevices[0]->ActivateObject(IID_PPV_ARGS(&pSrc)))) {
-                        if (SUCCEEDED(MFCreateSourceReaderFromMediaSource(pSrc, NULL, &pRdr))) {
-                            IMFMediaType* pMT = nullptr;
-                            if (SUCCEEDED(pRdr->GetCurrentMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, &pMT))) {
-                                UINT32 w=0, h=0;
-                                MFGetAttributeSize(pMT, MF_MT_FRAME_SIZE, &w, &h);
-                                resolution = std::to_string(w) + "x" + std::to_string(h);
-
-                                UINT32 num=0, den=1;
-                                MFGetAttributeRatio(pMT, MF_MT_FRAME_RATE, &num, &den);
-                                if (den != 0) fps = std::to_string(num / den);
-
-                                pMT->Release();
-                            }
-                            pRdr->Release();
-                        }
-                        pSrc->Release();
+    static bool toPixelFormat(const GUID& subtype, pixelconv::PixelFormat& fmt) {
+        if (subtype == MFVideoFormat_YUY2) { fmt = pixelconv::PixelFormat::YUY2; return true; }
+        if (subtype == MFVideoFormat_NV12) { fmt = pixelconv::PixelFormat::NV12; return true; }
+        if (subtype == MFVideoFormat_I420 || subtype == MFVideoFormat_IYUV) { fmt = pixelconv::PixelFormat::I420; return true; }
+        return false;
+    }
+
+    // Keeps the reader on the mode applyMode() put the camera in if it is YUV,
+    // or on a YUV layout the MJPEG decoder emits, so Media Foundation never
+    // inserts its video processor.
+    static HRESULT selectYuvOutput(IMFSourceReader* pReader, UINT32& width, UINT32& height, UINT32& num, UINT32& den,
+                                   pixelconv::PixelFormat& fmt) {
+        IMFMediaType* pNative = nullptr;
+        HRESULT hr = pReader->GetCurrentMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, &pNative);
+        if (FAILED(hr)) return hr;
+
+        GUID subtype = GUID_NULL;
+        pNative->GetGUID(MF_MT_SUBTYPE, &subtype);
+        MFGetAttributeSize(pNative, MF_MT_FRAME_SIZE, &width, &height);
+        MFGetAttributeRatio(pNative, MF_MT_FRAME_RATE, &num, &den);
+
+        if (toPixelFormat(subtype, fmt)) {
+            hr = pReader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, NULL, pNative);
+            SAFE_RELEASE(pNative);
+            return hr;
+        }
+        SAFE_RELEASE(pNative);
+
+        const GUID* decoded[] = { &MFVideoFormat_NV12, &MFVideoFormat_I420, &MFVideoFormat_YUY2 };
+        hr = MF_E_INVALIDMEDIATYPE;
+        for (const GUID* candidate : decoded) {
+            IMFMediaType* pType = nullptr;
+            if (FAILED(MFCreateMediaType(&pType))) break;
+            pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+            pType->SetGUID(MF_MT_SUBTYPE, *candidate);
+            MFSetAttributeSize(pType, MF_MT_FRAME_SIZE, width, height);
+            MFSetAttributeRatio(pType, MF_MT_FRAME_RATE, num, den);
+            hr = pReader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, NULL, pType);
+            SAFE_RELEASE(pType);
+            if (SUCCEEDED(hr)) {
+                toPixelFormat(*candidate, fmt);
+                break;
+            }
+        }
+        return hr;
+    }
+
+    // Locks a buffer and describes it as a pixelconv image, honouring the
+    // driver's pitch when the buffer exposes IMF2DBuffer.
+    static HRESULT lockFrame(IMFMediaBuffer* pBuffer, pixelconv::PixelFormat fmt, UINT32 width, UINT32 height,
+                             pixelconv::Image& img, bool& locked2D) {
+        IMF2DBuffer* p2D = nullptr;
+        locked2D = false;
+        if (SUCCEEDED(pBuffer->QueryInterface(IID_PPV_ARGS(&p2D)))) {
+            BYTE* pScan0 = nullptr;
+            LONG pitch = 0;
+            if (SUCCEEDED(p2D->Lock2D(&pScan0, &pitch))) {
+                if (pitch > 0) {
+                    img = pixelconv::wrap(fmt, (int)width, (int)height, pScan0);
+                    img.planes[0].stride = (int)pitch;
+                    if (fmt == pixelconv::PixelFormat::NV12) {
+                        img.planes[1] = { pScan0 + (size_t)pitch * height, (int)pitch };
+                    } else if (fmt == pixelconv::PixelFormat::I420) {
+                        img.planes[1] = { pScan0 + (size_t)pitch * height, (int)pitch / 2 };
+                        img.planes[2] = { img.planes[1].data + (size_t)(pitch / 2) * (height / 2), (int)pitch / 2 };
                     }
+                    locked2D = true;
+                    SAFE_RELEASE(p2D);
+                    return S_OK;
                 }
+                p2D->Unlock2D();
+            }
+            SAFE_RELEASE(p2D);
+        }
+
+        BYTE* pData = nullptr;
+        DWORD maxLen = 0, curLen = 0;
+        HRESULT hr = pBuffer->Lock(&pData, &maxLen, &curLen);
+        if (FAILED(hr)) return hr;
+        if (curLen < pixelconv::imageSize(fmt, (int)width, (int)height)) {
+            pBuffer->Unlock();
+            return MF_E_BUFFERTOOSMALL;
+        }
+        img = pixelconv::wrap(fmt, (int)width, (int)height, pData);
+        return S_OK;
+    }
+
+    static void unlockFrame(IMFMediaBuffer* pBuffer, bool locked2D) {
+        if (locked2D) {
+            IMF2DBuffer* p2D = nullptr;
+            if (SUCCEEDED(pBuffer->QueryInterface(IID_PPV_ARGS(&p2D)))) {
+                p2D->Unlock2D();
+                p2D->Release();
             }
+        } else {
+            pBuffer->Unlock();
+        }
+    }
+
+    // Converts a YUY2/I420 sample into a fresh NV12 sample for the H.264 encoder.
+    // A new buffer per frame, since the sink writer may still hold the previous one.
+    static IMFSample* toNV12Sample(IMFSample* pSrc, pixelconv::PixelFormat format, UINT32 width, UINT32 height) {
+        IMFMediaBuffer* pIn = nullptr;
+        IMFMediaBuffer* pOut = nullptr;
+        IMFSample* pOutSample = nullptr;
+        BYTE* pDst = nullptr;
+        pixelconv::Image frame;
+        bool locked2D = false;
+        DWORD size = (DWORD)pixelconv::imageSize(pixelconv::PixelFormat::NV12, (int)width, (int)height);
+
+        if (FAILED(pSrc->ConvertToContiguousBuffer(&pIn))) goto done;
+        if (FAILED(MFCreateMemoryBuffer(size, &pOut))) goto done;
+        if (FAILED(lockFrame(pIn, format, width, height, frame, locked2D))) goto done;
+        if (SUCCEEDED(pOut->Lock(&pDst, NULL, NULL))) {
+            pixelconv::convert(frame, pixelconv::wrap(pixelconv::PixelFormat::NV12, (int)width, (int)height, pDst));
+            pOut->Unlock();
+            pOut->SetCurrentLength(size);
+            if (SUCCEEDED(MFCreateSample(&pOutSample))) pOutSample->AddBuffer(pOut);
         }
+        unlockFrame(pIn, locked2D);
+
+    done:
+        SAFE_RELEASE(pOut);
+        SAFE_RELEASE(pIn);
+        return pOutSample;
+    }
 
+    static std::string subtypeName(const GUID& subtype) {
+        if (subtype == MFVideoFormat_RGB24) return "RGB24";
+        if (subtype == MFVideoFormat_RGB32) return "RGB32";
+        if (subtype == MFVideoFormat_IYUV) return "I420";
+        // Other video subtypes are FOURCC GUIDs.
+        char fourcc[5] = { (char)(subtype.Data1 & 0xFF), (char)((subtype.Data1 >> 8) & 0xFF),
+                           (char)((subtype.Data1 >> 16) & 0xFF), (char)((subtype.Data1 >> 24) & 0xFF), 0 };
+        for (int i = 0; i < 4; ++i) {
+            if (fourcc[i] < 32 || fourcc[i] > 126) return "unknown";
+        }
+        return fourcc;
+    }
+
+    // Cameras are addressed by their symbolic link, which stays the same across
+    // replugs and reboots. An empty id means the first camera.
+    static HRESULT activateCamera(const std::string& id, IMFMediaSource** ppSource) {
+        IMFAttributes* pConfig = nullptr;
+        IMFActivate** ppDevices = nullptr;
+        UINT32 count = 0;
+        HRESULT hr = MFCreateAttributes(&pConfig, 2);
+        if (SUCCEEDED(hr)) hr = pConfig->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE, MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID);
+        if (SUCCEEDED(hr) && !id.empty()) {
+            std::wstring link(id.size(), L'\0');
+            link.resize(MultiByteToWideChar(CP_UTF8, 0, id.c_str(), (int)id.size(), &link[0], (int)link.size()));
+            hr = pConfig->SetString(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK, link.c_str());
+            if (SUCCEEDED(hr)) hr = MFCreateDeviceSource(pConfig, ppSource);
+        } else if (SUCCEEDED(hr)) {
+            hr = MFEnumDeviceSources(pConfig, &ppDevices, &count);
+            if (SUCCEEDED(hr) && count == 0) hr = MF_E_NOT_FOUND;
+            if (SUCCEEDED(hr)) hr = ppDevices[0]->ActivateObject(IID_PPV_ARGS(ppSource));
+        }
         SAFE_RELEASE_ARRAY(ppDevices, count);
         SAFE_RELEASE(pConfig);
+        return hr;
+    }
 
-        std::ostringstream json;
-        json << "{\"type\":\"camera_info\",\"name\":\"" << escapeJSON(name)
-             << "\",\"status\":\"" << status
-             << "\",\"resolution\":\"" << resolution
-             << "\",\"fps\":\"" << fps << "\"}";
-        return json.str();
+    // Shutting the source down releases the device for other sessions.
+    static void releaseSource(IMFMediaSource*& pSource) {
+        if (pSource) {
+            pSource->Shutdown();
+            pSource->Release();
+            pSource = nullptr;
+        }
     }
 
-    bool capturePhotoBMP(const std::string& filename) {
+    // Calls fn with the media type handler of the source's first stream.
+    template <typename Fn>
+    static HRESULT withTypeHandler(IMFMediaSource* pSource, Fn fn) {
+        IMFPresentationDescriptor* pPD = nullptr;
+        IMFStreamDescriptor* pSD = nullptr;
+        IMFMediaTypeHandler* pHandler = nullptr;
+        BOOL selected = FALSE;
+        HRESULT hr = pSource->CreatePresentationDescriptor(&pPD);
+        if (SUCCEEDED(hr)) hr = pPD->GetStreamDescriptorByIndex(0, &selected, &pSD);
+        if (SUCCEEDED(hr)) hr = pSD->GetMediaTypeHandler(&pHandler);
+        if (SUCCEEDED(hr)) hr = fn(pHandler);
+        SAFE_RELEASE(pHandler);
+        SAFE_RELEASE(pSD);
+        SAFE_RELEASE(pPD);
+        return hr;
+    }
+
+    static void enumerateModes(IMFMediaSource* pSource, std::vector<CameraMode>& modes) {
+        withTypeHandler(pSource, [&](IMFMediaTypeHandler* pHandler) {
+            DWORD typeCount = 0;
+            HRESULT hr = pHandler->GetMediaTypeCount(&typeCount);
+            for (DWORD i = 0; SUCCEEDED(hr) && i < typeCount; ++i) {
+                IMFMediaType* pType = nullptr;
+                if (FAILED(pHandler->GetMediaTypeByIndex(i, &pType))) continue;
+                CameraMode mode;
+                GUID subtype = GUID_NULL;
+                UINT32 num = 0, den = 1;
+                mode.index = i;
+                pType->GetGUID(MF_MT_SUBTYPE, &subtype);
+                mode.format = subtypeName(subtype);
+                MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &mode.width, &mode.height);
+                MFGetAttributeRatio(pType, MF_MT_FRAME_RATE, &mode.fpsNum, &mode.fpsDen);
+                mode.fpsMin = mode.fpsMax = mode.fps();
+                if (SUCCEEDED(MFGetAttributeRatio(pType, MF_MT_FRAME_RATE_RANGE_MIN, &num, &den)) && den) mode.fpsMin = (double)num / den;
+                if (SUCCEEDED(MFGetAttributeRatio(pType, MF_MT_FRAME_RATE_RANGE_MAX, &num, &den)) && den) mode.fpsMax = (double)num / den;
+                modes.push_back(mode);
+                pType->Release();
+            }
+            return hr;
+        });
+    }
+
+    // Activates every camera once and records its native media types. Runs only
+    // when the cache was invalidated by a device change.
+    static std::vector<CameraDevice> enumerateCameras() {
+        std::vector<CameraDevice> found;
         IMFAttributes* pConfig = nullptr;
-        IMFAttributes* pReaderConfig = nullptr;
         IMFActivate** ppDevices = nullptr;
         UINT32 count = 0;
+
+        if (SUCCEEDED(MFCreateAttributes(&pConfig, 1)) &&
+            SUCCEEDED(pConfig->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE, MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID)) &&
+            SUCCEEDED(MFEnumDeviceSources(pConfig, &ppDevices, &count))) {
+            for (UINT32 i = 0; i < count; ++i) {
+                CameraDevice dev;
+                WCHAR* szValue = nullptr;
+                UINT32 cch = 0;
+                char buffer[512] = {0};
+                if (SUCCEEDED(ppDevices[i]->GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME, &szValue, &cch))) {
+                    WideCharToMultiByte(CP_UTF8, 0, szValue, -1, buffer, sizeof(buffer) - 1, NULL, NULL);
+                    dev.name = buffer;
+                    CoTaskMemFree(szValue);
+                }
+                if (SUCCEEDED(ppDevices[i]->GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK, &szValue, &cch))) {
+                    memset(buffer, 0, sizeof(buffer));
+                    WideCharToMultiByte(CP_UTF8, 0, szValue, -1, buffer, sizeof(buffer) - 1, NULL, NULL);
+                    dev.id = buffer;
+                    CoTaskMemFree(szValue);
+                }
+
+                IMFMediaSource* pSrc = nullptr;
+                if (SUCCEEDED(ppDevices[i]->ActivateObject(IID_PPV_ARGS(&pSrc)))) {
+                    enumerateModes(pSrc, dev.modes);
+                    pSrc->Shutdown();
+                    pSrc->Release();
+                    ppDevices[i]->ShutdownObject();
+                }
+                found.push_back(dev);
+            }
+        }
+
+        SAFE_RELEASE_ARRAY(ppDevices, count);
+        SAFE_RELEASE(pConfig);
+        return found;
+    }
+
+    void invalidateCameras() {
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        camerasValid = false;
+    }
+
+    // The cameras are only activated again after a device change. Called with
+    // camerasMutex held.
+    void refreshCamerasLocked() {
+        if (!camerasValid) {
+            static metrics::Counter& enumerations =
+                metrics::registry().counter("helper_webcam_enumerations_total", "Camera enumerations, each activating every camera.");
+            static metrics::Histogram& took =
+                metrics::registry().histogram("helper_webcam_enumeration_seconds", "Time one camera enumeration took.");
+            static metrics::Gauge& present = metrics::registry().gauge("helper_webcam_cameras", "Cameras found by the last enumeration.");
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<CameraDevice> found = enumerateCameras();
+            took.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            enumerations.add();
+            present.set((double)found.size());
+            // A camera we are streaming from may refuse a second activation;
+            // keep what was learned about it before.
+            for (CameraDevice& dev : found) {
+                if (!dev.modes.empty()) continue;
+                for (const CameraDevice& old : cameras) {
+                    if (old.id == dev.id) dev.modes = old.modes;
+                }
+            }
+            cameras = found;
+            camerasValid = true;
+            if (hasSelectedMode && !rematchSelectedMode()) {
+                hasSelectedMode = false;
+            }
+        }
+    }
+
+    void refreshCameras() {
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        refreshCamerasLocked();
+    }
+
+    // camera_info, served from the cache.
+    void reportCameraInfo() {
+        json::Writer msg;
+        {
+            std::lock_guard<std::mutex> lock(camerasMutex);
+            refreshCamerasLocked();
+            writeCameraInfo(msg);
+        }
+        outputJSON(msg.view(), protocol::MessageType::CameraInfo);
+    }
+
+    // set_mode|w|h|fps|format on the current camera. An exact nominal frame rate
+    // wins over a mode whose range merely contains it; without a format,
+    // uncompressed modes are preferred over ones that need a decoder.
+    bool setMode(UINT32 width, UINT32 height, double fps, std::string format) {
+        std::transform(format.begin(), format.end(), format.begin(), [](unsigned char c) { return (char)toupper(c); });
+        if (format == "MJPEG") format = "MJPG";
+        if (format == "ANY") format.clear();
+
+        refreshCameras();
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        int current = currentIndex();
+        if (current < 0) return false;
+
+        const CameraMode* best = nullptr;
+        int bestScore = -1;
+        for (const CameraMode& mode : cameras[current].modes) {
+            if (mode.width != width || mode.height != height) continue;
+            if (!format.empty() && mode.format != format) continue;
+            bool exact = fps <= 0 || (mode.fps() > fps - 0.5 && mode.fps() < fps + 0.5);
+            bool inRange = fps >= mode.fpsMin - 0.01 && fps <= mode.fpsMax + 0.01;
+            if (!exact && !inRange) continue;
+            int score = (exact ? 2 : 0) + (mode.format != "MJPG" ? 1 : 0);
+            if (score > bestScore) {
+                best = &mode;
+                bestScore = score;
+            }
+        }
+        if (!best) return false;
+
+        selectedMode = *best;
+        if (fps > 0 && !(best->fps() > fps - 0.5 && best->fps() < fps + 0.5)) {
+            selectedMode.fpsNum = (UINT32)(fps * 1000 + 0.5);
+            selectedMode.fpsDen = 1000;
+        }
+        hasSelectedMode = true;
+        return true;
+    }
+
+    void clearMode() {
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        hasSelectedMode = false;
+    }
+
+    // Accepts a camera id or its index in camera_info's "cameras" list.
+    bool resolveCamera(const std::string& idOrIndex, std::string& id) {
+        refreshCameras();
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        for (const CameraDevice& cam : cameras) {
+            if (cam.id == idOrIndex) {
+                id = cam.id;
+                return true;
+            }
+        }
+        // A replay can open the cameras in its trace, present or not.
+        if (trace.replaying()) {
+            for (const std::string& recorded : tracedCameras) {
+                if (recorded == idOrIndex) {
+                    id = recorded;
+                    return true;
+                }
+            }
+        }
+        if (idOrIndex.empty() || idOrIndex.find_first_not_of("0123456789") != std::string::npos) return false;
+        size_t index = (size_t)atoi(idOrIndex.c_str());
+        if (index >= cameras.size()) return false;
+        id = cameras[index].id;
+        return true;
+    }
+
+    // select_camera: the camera used by photo, video, preview and set_mode.
+    bool selectCamera(const std::string& idOrIndex) {
+        std::string id;
+        if (!resolveCamera(idOrIndex, id)) return false;
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        if (id != cameraId) hasSelectedMode = false;
+        cameraId = id;
+        return true;
+    }
+
+    std::string currentCamera() {
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        return cameraId;
+    }
+
+    // The mode a session on this camera should use: the set_mode choice for
+    // the current camera, the driver default for the others.
+    bool modeFor(const std::string& id, CameraMode& mode) {
+        std::lock_guard<std::mutex> lock(camerasMutex);
+        int current = currentIndex();
+        if (!hasSelectedMode || current < 0 || cameras[current].id != id) return false;
+        mode = selectedMode;
+        return true;
+    }
+
+    // Capture sessions (capture.h): any number of cameras streaming at once,
+    // each with its own threads. Defined after the session sinks below.
+    void openSession(const std::string& camera);
+    void closeSession(const std::string& camera);
+    void sessionPhoto(const std::string& camera, imageenc::Format format, int level);
+    void sessionRecord(const std::string& camera, int seconds);
+    void reportSessions();
+    void collectMetrics(metrics::Exposition& out);
+    void closeAllSessions();
+
+    // Motion-triggered recording on an open session (motion.h).
+    void startMotion(const std::string& camera, const motion::Config& config, const std::vector<motion::Rect>& regions);
+    void stopMotion(const std::string& camera);
+
+    // Continuous recording of a session as a chain of segments under a disk
+    // quota shared by all cameras (0 = no quota).
+    void startContinuous(const std::string& camera, int segmentSeconds, uint64_t quotaBytes);
+    void stopContinuous(const std::string& camera);
+
+    // Restarts a running preview so it picks up a new mode.
+    void restartPreview() {
+        if (suspendPreview()) startPreview(previewFps, previewMaxWidth);
+    }
+
+    bool capturePhoto(const std::string& filename, imageenc::Format format = imageenc::Format::Bmp, int level = 1) {
         IMFMediaSource* pSource = nullptr;
         IMFSourceReader* pReader = nullptr;
-        IMFMediaType* pType = nullptr;
-        IMFMediaType* pNativeType = nullptr;
         IMFSample* pSample = nullptr;
         IMFMediaBuffer* pBuffer = nullptr;
-        BYTE* pData = nullptr;
         
         DWORD flags = 0;
         LONGLONG llTimeStamp = 0;
-        DWORD maxLen = 0, curLen = 0;
         UINT32 width = 640, height = 480;
-        DWORD imageSize = 0;
-        
-        BITMAPFILEHEADER bf = {0};
-        BITMAPINFOHEADER bi = {0};
+        UINT32 num = 30, den = 1;
+        pixelconv::PixelFormat pixelFormat = pixelconv::PixelFormat::NV12;
+        pixelconv::Image frame;
+        pixelconv::Image bgra;
+        bool locked2D = false;
+        bool converted = false;
         
         bool ok = false;
+        bool resumePreview = suspendPreview();
         HRESULT hr = S_OK;
+        LATENCY_STOPWATCH(total);
+        LATENCY_STOPWATCH(stage);
 
-        hr = MFCreateAttributes(&pConfig, 1);
-        if (FAILED(hr)) { outputError("MFCreateAttributes", hr); goto done; }
-        
-        hr = pConfig->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE, MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID);
-        if (FAILED(hr)) { outputError("SetGUID", hr); goto done; }
-
-        hr = MFEnumDeviceSources(pConfig, &ppDevices, &count);
-        if (FAILED(hr) || count == 0) { outputError("MFEnumDeviceSources", hr); goto done; }
-
-        hr = ppDevices[0]->ActivateObject(IID_PPV_ARGS(&pSource));
+        hr = activateCamera(currentCamera(), &pSource);
         if (FAILED(hr)) { outputError("ActivateObject", hr); goto done; }
+        hr = applyMode(pSource);
+        if (FAILED(hr)) { outputError("SetCurrentMediaType", hr); goto done; }
 
-        hr = MFCreateAttributes(&pReaderConfig, 1);
-        if (FAILED(hr)) { outputError("CreateAttributes(Reader)", hr); goto done; }
-        
-        hr = pReaderConfig->SetUINT32(MF_SOURCE_READER_ENABLE_VIDEO_PROCESSING, TRUE);
-        if (FAILED(hr)) { outputError("Set EnableVideoProcessing", hr); goto done; }
-
-        hr = MFCreateSourceReaderFromMediaSource(pSource, pReaderConfig, &pReader);
+        hr = MFCreateSourceReaderFromMediaSource(pSource, NULL, &pReader);
         if (FAILED(hr)) { outputError("CreateSourceReader", hr); goto done; }
 
-        hr = pReader->GetNativeMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, &pNativeType);
-        if (SUCCEEDED(hr)) {
-            MFGetAttributeSize(pNativeType, MF_MT_FRAME_SIZE, &width, &height);
-            SAFE_RELEASE(pNativeType);
-        }
-
-        hr = MFCreateMediaType(&pType);
-        if (FAILED(hr)) goto done;
-        hr = pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
-        if (FAILED(hr)) goto done;
-        hr = pType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_RGB32);
-        if (FAILED(hr)) goto done;
-        
-        hr = MFSetAttributeSize(pType, MF_MT_FRAME_SIZE, width, height);
-        if (FAILED(hr)) goto done;
-
-        hr = pReader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, NULL, pType);
+        hr = selectYuvOutput(pReader, width, height, num, den, pixelFormat);
         if (FAILED(hr)) { outputError("SetCurrentMediaType", hr); goto done; }
+        LATENCY_LAP(stage, PhotoDeviceOpen);
 
         for (int i = 0; i < 20; ++i) {
             if (pSample) { pSample->Release(); pSample = nullptr; }
             
             hr = pReader->ReadSample(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, NULL, &flags, &llTimeStamp, &pSample);
+            LATENCY_LAP(stage, PhotoWarmupRead);
             
             if (FAILED(hr)) { outputError("ReadSample", hr); goto done; }
             
@@ -200,6 +636,7 @@ public:
             if (i > 5) break; 
             
             std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            LATENCY_RESTART(stage);
         }
 
         if (!pSample) {
@@ -209,64 +646,55 @@ public:
 
         hr = pSample->ConvertToContiguousBuffer(&pBuffer);
         if (FAILED(hr)) { outputError("ConvertToContiguousBuffer", hr); goto done; }
+        LATENCY_LAP(stage, PhotoContiguousBuffer);
 
-        hr = pBuffer->Lock(&pData, &maxLen, &curLen);
+        hr = lockFrame(pBuffer, pixelFormat, width, height, frame, locked2D);
         if (FAILED(hr)) { outputError("Buffer Lock", hr); goto done; }
 
-        bi.biSize = sizeof(BITMAPINFOHEADER);
-        bi.biWidth = (LONG)width;
-        bi.biHeight = (LONG)height * -1;
-        bi.biPlanes = 1;
-        bi.biBitCount = 32;
-        bi.biCompression = BI_RGB;
+        photoPixels.resize(pixelconv::imageSize(pixelconv::PixelFormat::BGRA, (int)width, (int)height));
+        bgra = pixelconv::wrap(pixelconv::PixelFormat::BGRA, (int)width, (int)height, photoPixels.data());
+        converted = pixelconv::convert(frame, bgra);
+        unlockFrame(pBuffer, locked2D);
+        if (!converted) {
+            outputJSON("{\"type\":\"status\",\"message\":\"Cannot convert the camera frame.\",\"error\":true}");
+            goto done;
+        }
+        LATENCY_LAP(stage, PhotoConvert);
 
-        imageSize = curLen;
-        bf.bfType = 0x4D42;
-        bf.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-        bf.bfSize = bf.bfOffBits + imageSize;
+        if (!imageenc::encode(bgra, format, level, photoEncoded)) {
+            outputJSON("{\"type\":\"status\",\"message\":\"Image encoding failed.\",\"error\":true}");
+            goto done;
+        }
+        LATENCY_LAP(stage, PhotoEncode);
 
         {
             std::ofstream file(filename, std::ios::binary);
             if (file.is_open()) {
-                file.write(reinterpret_cast<const char*>(&bf), sizeof(bf));
-                file.write(reinterpret_cast<const char*>(&bi), sizeof(bi));
-                file.write(reinterpret_cast<const char*>(pData), imageSize);
+                file.write(reinterpret_cast<const char*>(photoEncoded.data()), photoEncoded.size());
                 file.close();
+                LATENCY_LAP(stage, PhotoFileWrite);
+                LATENCY_MARK(total, PhotoTotal);
                 ok = true;
             } else {
                 outputJSON("{\"type\":\"status\",\"message\":\"Cannot open file for writing.\",\"error\":true}");
             }
         }
 
-        pBuffer->Unlock();
-
     done:
         SAFE_RELEASE(pBuffer);
         SAFE_RELEASE(pSample);
-        SAFE_RELEASE(pType);
         SAFE_RELEASE(pReader);
-        SAFE_RELEASE(pReaderConfig);
-        SAFE_RELEASE(pSource);
-        SAFE_RELEASE_ARRAY(ppDevices, count);
-        SAFE_RELEASE(pConfig);
+        releaseSource(pSource);
+        if (resumePreview) startPreview(previewFps, previewMaxWidth);
 
-        if (ok) {
-            std::ostringstream json;
-            json << "{\"type\":\"file_saved\",\"filename\":\"" << escapeJSON(filename) << "\"}";
-            outputJSON(json.str());
-        }
+        if (ok) outputEvent("file_saved", "filename", filename);
         return ok;
     }
 
     bool captureVideoMP4(const std::string& filename, int durationSeconds = 5) {
-        IMFAttributes* pConfig = nullptr;
-        IMFActivate** ppDevices = nullptr;
-        UINT32 count = 0;
         IMFMediaSource* pSource = nullptr;
         IMFSourceReader* pReader = nullptr;
         IMFSinkWriter* pWriter = nullptr;
-        IMFMediaType* pNativeType = nullptr;
-        IMFMediaType* pReaderType = nullptr;
         IMFMediaType* pOutType = nullptr;
         IMFMediaType* pInType = nullptr;
         IMFSample* pSample = nullptr;
@@ -277,27 +705,20 @@ public:
         DWORD flags = 0;
         LONGLONG ts = 0;
         LONGLONG startTs = -1;
+        pixelconv::PixelFormat format = pixelconv::PixelFormat::NV12;
         std::chrono::steady_clock::time_point deadline;
         
         bool ok = false;
+        bool resumePreview = suspendPreview();
+        LATENCY_STOPWATCH(total);
+        LATENCY_STOPWATCH(stage);
 
-        if (FAILED(MFCreateAttributes(&pConfig, 1))) goto done;
-        if (FAILED(pConfig->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE, MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID))) goto done;
-        if (FAILED(MFEnumDeviceSources(pConfig, &ppDevices, &count)) || count == 0) goto done;
-        if (FAILED(ppDevices[0]->ActivateObject(IID_PPV_ARGS(&pSource)))) goto done;
+        if (FAILED(activateCamera(currentCamera(), &pSource))) goto done;
+        if (FAILED(applyMode(pSource))) goto done;
         if (FAILED(MFCreateSourceReaderFromMediaSource(pSource, NULL, &pReader))) goto done;
 
-        if (FAILED(pReader->GetNativeMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, &pNativeType))) goto done;
-
-        MFGetAttributeSize(pNativeType, MF_MT_FRAME_SIZE, &width, &height);
-        MFGetAttributeRatio(pNativeType, MF_MT_FRAME_RATE, &num, &den);
-        SAFE_RELEASE(pNativeType);
-
-        if (FAILED(MFCreateMediaType(&pReaderType))) goto done;
-        pReaderType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
-        pReaderType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
-        pReader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_VIDEO_STREAM, NULL, pReaderType);
-        SAFE_RELEASE(pReaderType);
+        if (FAILED(selectYuvOutput(pReader, width, height, num, den, format))) goto done;
+        LATENCY_LAP(stage, VideoDeviceOpen);
 
         if (FAILED(MFCreateSinkWriterFromURL(std::wstring(filename.begin(), filename.end()).c_str(), NULL, NULL, &pWriter))) goto done;
 
@@ -322,6 +743,7 @@ public:
         SAFE_RELEASE(pInType);
 
         if (FAILED(pWriter->BeginWriting())) goto done;
+        LATENCY_LAP(stage, VideoWriterSetup);
 
         deadline = std::chrono::steady_clock::now() + std::chrono::seconds(durationSeconds);
 
@@ -331,38 +753,395 @@ public:
             ts = 0;
             
             if (FAILED(pReader->ReadSample(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, NULL, &flags, &ts, &pSample))) break;
+            LATENCY_LAP(stage, VideoReadSample);
             if (flags & MF_SOURCE_READERF_STREAMTICK) continue;
             if (!pSample) continue;
 
             if (startTs == -1) startTs = ts;
 
+            if (format != pixelconv::PixelFormat::NV12) {
+                IMFSample* pNV12 = toNV12Sample(pSample, format, width, height);
+                SAFE_RELEASE(pSample);
+                if (!pNV12) break;
+                pSample = pNV12;
+                LATENCY_LAP(stage, VideoConvert);
+            }
+
             pSample->SetSampleTime(ts - startTs);
 
             if (FAILED(pWriter->WriteSample(streamIndex, pSample))) { SAFE_RELEASE(pSample); break; }
             SAFE_RELEASE(pSample);
+            LATENCY_LAP(stage, VideoWriteSample);
         }
 
         if (FAILED(pWriter->Finalize())) goto done;
+        LATENCY_LAP(stage, VideoFinalize);
+        LATENCY_MARK(total, VideoTotal);
         ok = true;
 
     done:
         SAFE_RELEASE(pWriter);
         SAFE_RELEASE(pReader);
-        SAFE_RELEASE(pSource);
-        SAFE_RELEASE_ARRAY(ppDevices, count);
-        SAFE_RELEASE(pConfig);
+        releaseSource(pSource);
+        if (resumePreview) startPreview(previewFps, previewMaxWidth);
 
         if (ok) {
-            std::ostringstream json;
-            json << "{\"type\":\"file_saved\",\"filename\":\"" << escapeJSON(filename) << "\"}";
-            outputJSON(json.str());
+            outputEvent("file_saved", "filename", filename);
         } else {
             outputJSON("{\"type\":\"status\",\"message\":\"Failed to capture video\",\"error\":true}");
         }
         return ok;
     }
 
+    // stats: per-stage latency since the previous stats command, and the
+    // output queue's counters since startup.
+    void reportStats() {
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "stats");
+        protocol::OutputStats out = output.stats();
+        msg.key("output").beginObject();
+        msg.field("queued", out.queued);
+        msg.field("written", out.written);
+        msg.field("coalesced", out.coalesced);
+        msg.field("dropped", out.dropped);
+        msg.field("writes", out.writes);
+        msg.field("depth", out.depth);
+        msg.field("max_depth", out.maxDepth);
+        msg.endObject();
+#if WEBCAM_LATENCY_STATS
+        msg.field("enabled", true);
+        msg.key("stages").beginArray();
+        for (const latency::Summary& st : latency::collect(true)) {
+            msg.beginObject();
+            msg.field("stage", latency::stageName(st.stage));
+            msg.field("count", st.count);
+            msg.field("mean_us", st.meanUs, kDigits);
+            msg.field("p50_us", st.p50Us, kDigits);
+            msg.field("p90_us", st.p90Us, kDigits);
+            msg.field("p99_us", st.p99Us, kDigits);
+            msg.field("max_us", st.maxUs, kDigits);
+            msg.endObject();
+        }
+        msg.endArray();
+#else
+        msg.field("enabled", false);
+        msg.key("stages").beginArray().endArray();
+#endif
+        msg.endObject();
+        outputJSON(msg.view(), protocol::MessageType::Stats);
+    }
+
+    // Live preview: frames go into a shared-memory ring (see preview.h) and
+    // only a small preview_frame notice is written to stdout.
+    void startPreview(int fps, int maxWidth) {
+        stopPreview();
+        previewFps = fps > 0 ? fps : 15;
+        previewMaxWidth = maxWidth > 0 ? maxWidth : 640;
+        previewRunning = true;
+        previewThread = std::thread(&WebcamCapture::previewLoop, this);
+    }
+
+    void stopPreview() {
+        previewRunning = false;
+        if (previewThread.joinable()) previewThread.join();
+    }
+
 private:
+    // Called with camerasMutex held.
+    void writeCameraInfo(json::Writer& msg) {
+        const CameraMode* mode = nullptr;
+        int current = currentIndex();
+        if (current >= 0) {
+            const CameraDevice& cam = cameras[current];
+            mode = hasSelectedMode ? &selectedMode : (cam.modes.empty() ? nullptr : &cam.modes[0]);
+        }
+
+        msg.beginObject();
+        msg.field("type", "camera_info");
+        msg.field("name", current >= 0 ? cameras[current].name : std::string("No camera found"));
+        msg.field("status", current >= 0 ? "Available" : "Not Available");
+        if (mode) {
+            msg.key("resolution").beginString().number(mode->width).text("x").number(mode->height).endString();
+            msg.key("fps").beginString();
+            json::appendReal(msg, mode->fps(), kDigits);
+            msg.endString();
+            msg.field("format", mode->format);
+        } else {
+            msg.field("resolution", "Checking...");
+            msg.field("fps", "Checking...");
+            msg.field("format", "");
+        }
+        msg.field("camera", current >= 0 ? cameras[current].id : std::string());
+        msg.key("cameras").beginArray();
+        for (const CameraDevice& cam : cameras) {
+            msg.beginObject();
+            msg.field("id", cam.id);
+            msg.field("name", cam.name);
+            msg.key("modes").beginArray();
+            for (const CameraMode& m : cam.modes) {
+                msg.beginObject();
+                msg.field("format", m.format);
+                msg.field("width", m.width);
+                msg.field("height", m.height);
+                msg.field("fps", m.fps(), kDigits);
+                msg.field("fps_min", m.fpsMin, kDigits);
+                msg.field("fps_max", m.fpsMax, kDigits);
+                msg.endObject();
+            }
+            msg.endArray();
+            msg.endObject();
+        }
+        msg.endArray();
+        msg.endObject();
+    }
+
+    // Reused between shots so a photo doesn't reallocate two full frames.
+    std::vector<uint8_t> photoPixels;
+    std::vector<uint8_t> photoEncoded;
+
+    protocol::Output& output;
+    protocol::Channel channel;
+    // --record / --replay: session frames go into, or come from, a trace.
+    hal::TraceOptions trace;
+    std::vector<std::string> tracedCameras;
+    int metricsCollector = 0;
+
+    struct Background {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::mutex backgroundMutex;
+    std::vector<Background> background;
+
+    void joinBackground() {
+        std::vector<Background> running;
+        {
+            std::lock_guard<std::mutex> lock(backgroundMutex);
+            running.swap(background);
+        }
+        for (Background& b : running) b.thread.join();
+    }
+
+    // Capability cache, rebuilt after a device change. cameraId is the
+    // select_camera choice (the first camera when empty or gone), and
+    // selectedMode its set_mode choice, dropped when another camera is
+    // selected. Photo, video, preview and a session on that camera use the
+    // mode; sessions on the other cameras (modeFor) and a camera without a
+    // choice get native type 0.
+    std::mutex camerasMutex;
+    std::vector<CameraDevice> cameras;
+    bool camerasValid = false;
+    CameraMode selectedMode;
+    bool hasSelectedMode = false;
+    std::string cameraId;
+
+    std::mutex sessionsMutex;
+    std::map<std::string, std::unique_ptr<capture::Session>> sessions;
+    std::vector<std::unique_ptr<capture::Session>> stuckSessions; // closed, capture thread not yet returned
+    std::map<std::string, std::shared_ptr<MotionSink>> motionSinks;
+    std::map<std::string, std::shared_ptr<SegmentSink>> segmentSinks;
+    segments::Store segmentStore;
+    int sessionFiles = 0;
+
+    friend class MediaFoundationSource;
+    friend class RecorderSink;
+
+    // Index of the current camera in the cache; the first one when none was
+    // selected or the selected one is gone. Called with camerasMutex held.
+    int currentIndex() const {
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            if (cameras[i].id == cameraId) return (int)i;
+        }
+        return cameras.empty() ? -1 : 0;
+    }
+    std::thread previewThread;
+    std::atomic<bool> previewRunning{ false };
+    int previewFps = 15;
+    int previewMaxWidth = 640;
+    int previewCount = 0;
+
+    // Native type indices can change when the camera is replugged, so the
+    // selection is looked up again by format, size and frame rate.
+    bool rematchSelectedMode() {
+        int current = currentIndex();
+        if (current < 0) return false;
+        for (const CameraMode& mode : cameras[current].modes) {
+            if (mode.format == selectedMode.format && mode.width == selectedMode.width &&
+                mode.height == selectedMode.height && selectedMode.fps() >= mode.fpsMin - 0.01 &&
+                selectedMode.fps() <= mode.fpsMax + 0.01) {
+                selectedMode.index = mode.index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    HRESULT applyMode(IMFMediaSource* pSource) {
+        CameraMode mode;
+        bool selected;
+        {
+            std::lock_guard<std::mutex> lock(camerasMutex);
+            mode = selectedMode;
+            selected = hasSelectedMode;
+        }
+        return applyNativeMode(pSource, selected ? &mode : nullptr);
+    }
+
+    // Puts the device into the given native mode (type 0 when null) before a
+    // reader is created on it, so the reader and any MJPEG decoder start from
+    // that type.
+    static HRESULT applyNativeMode(IMFMediaSource* pSource, const CameraMode* selected) {
+        return withTypeHandler(pSource, [&](IMFMediaTypeHandler* pHandler) {
+            IMFMediaType* pType = nullptr;
+            HRESULT hr = pHandler->GetMediaTypeByIndex(selected ? selected->index : 0, &pType);
+            if (FAILED(hr)) return hr;
+            if (selected) {
+                const CameraMode& mode = *selected;
+                UINT32 w = 0, h = 0;
+                MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &w, &h);
+                if (w != mode.width || h != mode.height) {
+                    pType->Release();
+                    return MF_E_INVALIDMEDIATYPE;
+                }
+                MFSetAttributeRatio(pType, MF_MT_FRAME_RATE, mode.fpsNum, mode.fpsDen);
+            }
+            hr = pHandler->SetCurrentMediaType(pType);
+            pType->Release();
+            return hr;
+        });
+    }
+
+    // The camera is opened exclusively, so photo and video capture stop the
+    // preview and restart it when they are done.
+    bool suspendPreview() {
+        bool running = previewThread.joinable();
+        stopPreview();
+        return running;
+    }
+
+    void previewLoop() {
+        HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+        IMFMediaSource* pSource = nullptr;
+        IMFSourceReader* pReader = nullptr;
+        IMFSample* pSample = nullptr;
+        IMFMediaBuffer* pBuffer = nullptr;
+
+        UINT32 width = 640, height = 480;
+        UINT32 num = 30, den = 1;
+        pixelconv::PixelFormat format = pixelconv::PixelFormat::NV12;
+        preview::Publisher ring;
+        std::string ringName;
+        int factor = 0;
+        int outWidth = 0, outHeight = 0;
+        std::chrono::steady_clock::duration interval = std::chrono::microseconds(1000000 / previewFps);
+        std::chrono::steady_clock::time_point nextDue = std::chrono::steady_clock::now();
+        HRESULT hr = S_OK;
+        LATENCY_STOPWATCH(stage);
+
+        hr = activateCamera(currentCamera(), &pSource);
+        if (FAILED(hr)) { outputError("ActivateObject", hr); goto done; }
+        hr = applyMode(pSource);
+        if (FAILED(hr)) { outputError("SetCurrentMediaType", hr); goto done; }
+        hr = MFCreateSourceReaderFromMediaSource(pSource, NULL, &pReader);
+        if (FAILED(hr)) { outputError("CreateSourceReader", hr); goto done; }
+        hr = selectYuvOutput(pReader, width, height, num, den, format);
+        if (FAILED(hr)) { outputError("SetCurrentMediaType", hr); goto done; }
+
+        // Smallest box factor that fits the requested width and divides the
+        // frame; without one the preview would break the limit, so it fails.
+        for (int f : { 1, 2, 4 }) {
+            if ((int)width / f <= previewMaxWidth && width % (2 * f) == 0 && height % (2 * f) == 0) {
+                factor = f;
+                break;
+            }
+        }
+        if (!factor) {
+            json::Writer msg;
+            msg.beginObject();
+            msg.field("type", "status");
+            msg.key("message").beginString().text("Cannot scale a ").number((int)width).text("x").number((int)height);
+            msg.text(" preview to a width of ").number(previewMaxWidth).text(".").endString();
+            msg.field("error", true);
+            msg.endObject();
+            outputJSON(msg.view());
+            goto done;
+        }
+        outWidth = (int)width / factor;
+        outHeight = (int)height / factor;
+
+        ringName = "Local\\webcam_preview_" + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(++previewCount);
+        if (!ring.open(ringName, 4, (uint32_t)outWidth * outHeight * 4)) {
+            outputError("CreateFileMapping", HRESULT_FROM_WIN32(GetLastError()));
+            goto done;
+        }
+
+        {
+            json::Writer msg;
+            msg.beginObject();
+            msg.field("type", "preview_started");
+            msg.field("shm", ringName);
+            msg.field("width", outWidth);
+            msg.field("height", outHeight);
+            msg.field("fps", previewFps);
+            msg.field("slots", 4);
+            msg.endObject();
+            outputJSON(msg.view());
+        }
+
+        while (previewRunning) {
+            DWORD flags = 0;
+            LONGLONG ts = 0;
+            hr = pReader->ReadSample(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, NULL, &flags, &ts, &pSample);
+            if (FAILED(hr)) { outputError("ReadSample", hr); break; }
+            int64_t captureNs = preview::nowNs();
+            if (!pSample || (flags & MF_SOURCE_READERF_STREAMTICK)) { SAFE_RELEASE(pSample); continue; }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now < nextDue) { SAFE_RELEASE(pSample); continue; }
+            nextDue = (now - nextDue > interval) ? now + interval : nextDue + interval;
+
+            pixelconv::Image frame;
+            bool locked2D = false;
+            LATENCY_RESTART(stage);
+            if (SUCCEEDED(pSample->ConvertToContiguousBuffer(&pBuffer)) &&
+                SUCCEEDED(lockFrame(pBuffer, format, width, height, frame, locked2D))) {
+                // Converted and downscaled straight into the shared slot; a
+                // frame that did not convert is neither published nor announced.
+                pixelconv::Image slot = ring.begin(outWidth, outHeight, captureNs);
+                bool converted = slot.planes[0].data && pixelconv::convertScaled(frame, slot, factor);
+                unlockFrame(pBuffer, locked2D);
+                if (converted) {
+                    uint64_t frameNo = ring.commit();
+                    LATENCY_LAP(stage, PreviewPublish);
+
+                    // The most frequent message, so it skips the JSON round trip.
+                    protocol::Encoder msg;
+                    msg.beginMap();
+                    msg.field("type", "preview_frame");
+                    msg.field("frame", (uint64_t)frameNo);
+                    msg.field("slot", (int)ring.lastSlot());
+                    msg.endMap();
+                    output.send(protocol::MessageType::PreviewFrame, msg, channel);
+                } else {
+                    ring.cancel();
+                }
+            }
+            SAFE_RELEASE(pBuffer);
+            SAFE_RELEASE(pSample);
+        }
+
+        outputJSON("{\"type\":\"preview_stopped\"}");
+
+    done:
+        ring.close();
+        SAFE_RELEASE(pBuffer);
+        SAFE_RELEASE(pSample);
+        SAFE_RELEASE(pReader);
+        releaseSource(pSource);
+        if (SUCCEEDED(hrCom)) CoUninitialize();
+    }
+
     template <typename T>
     static void SAFE_RELEASE(T*& p) {
         if (p) { p->Release(); p = nullptr; }
@@ -380,6 +1159,904 @@ private:
     }
 };
 
+// A camera feeding a capture session. Every frame is converted to NV12 as it
+// is copied out of the Media Foundation buffer, so sinks see a single layout.
+class MediaFoundationSource : public capture::FrameSource {
+public:
+    MediaFoundationSource(const std::string& id, const CameraMode* mode) : cameraId(id), hasMode(mode != nullptr) {
+        if (mode) this->mode = *mode;
+    }
+
+    void attachThread() override {
+        comInitialized = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    }
+
+    void detachThread() override {
+        if (comInitialized) CoUninitialize();
+        comInitialized = false;
+    }
+
+    bool open(capture::StreamFormat& format) override {
+        UINT32 num = 30, den = 1;
+        {
+            std::lock_guard<std::mutex> lock(sourceMutex);
+            if (FAILED(WebcamCapture::activateCamera(cameraId, &pSource))) return false;
+        }
+        if (FAILED(WebcamCapture::applyNativeMode(pSource, hasMode ? &mode : nullptr))) return false;
+        if (FAILED(MFCreateSourceReaderFromMediaSource(pSource, NULL, &pReader))) return false;
+        if (FAILED(WebcamCapture::selectYuvOutput(pReader, width, height, num, den, pixelFormat))) return false;
+        format.width = (int)width;
+        format.height = (int)height;
+        format.fps = den ? (double)num / den : 30;
+        return true;
+    }
+
+    bool read(const pixelconv::Image& dst, int64_t& deviceNs) override {
+        IMFSample* pSample = nullptr;
+        IMFMediaBuffer* pBuffer = nullptr;
+        pixelconv::Image frame;
+        bool locked2D = false;
+        bool ok = false;
+        DWORD flags = 0;
+        LONGLONG ts = 0;
+
+        while (!pSample) {
+            if (FAILED(pReader->ReadSample(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, NULL, &flags, &ts, &pSample))) return false;
+            if (flags & (MF_SOURCE_READERF_ENDOFSTREAM | MF_SOURCE_READERF_ERROR)) {
+                WebcamCapture::SAFE_RELEASE(pSample);
+                return false;
+            }
+        }
+        if (SUCCEEDED(pSample->ConvertToContiguousBuffer(&pBuffer)) &&
+            SUCCEEDED(WebcamCapture::lockFrame(pBuffer, pixelFormat, width, height, frame, locked2D))) {
+            ok = pixelconv::convert(frame, dst);
+            WebcamCapture::unlockFrame(pBuffer, locked2D);
+        }
+        deviceNs = ts * 100;
+        WebcamCapture::SAFE_RELEASE(pBuffer);
+        WebcamCapture::SAFE_RELEASE(pSample);
+        return ok;
+    }
+
+    void close() override {
+        WebcamCapture::SAFE_RELEASE(pReader);
+        std::lock_guard<std::mutex> lock(sourceMutex);
+        WebcamCapture::releaseSource(pSource);
+    }
+
+    // Shuts the media source down under a ReadSample that is waiting on it,
+    // which then fails with MF_E_SHUTDOWN. Flushing the reader would not do:
+    // in synchronous mode Flush itself waits on the stream that is stuck.
+    void cancel() override {
+        std::lock_guard<std::mutex> lock(sourceMutex);
+        if (pSource) pSource->Shutdown();
+    }
+
+private:
+    std::string cameraId;
+    CameraMode mode;
+    bool hasMode;
+    std::mutex sourceMutex; // pSource against cancel() from the command thread
+    IMFMediaSource* pSource = nullptr;
+    IMFSourceReader* pReader = nullptr;
+    UINT32 width = 0, height = 0;
+    pixelconv::PixelFormat pixelFormat = pixelconv::PixelFormat::NV12;
+    static thread_local bool comInitialized;
+};
+
+thread_local bool MediaFoundationSource::comInitialized = false;
+
+// Takes the next frame of a session as a photo. The frame is converted on the
+// delivery thread; encoding and the file write happen in the background of
+// the capture so a PNG does not cost a recording on the same camera its
+// frames.
+class SnapshotSink : public capture::FrameSink, public std::enable_shared_from_this<SnapshotSink> {
+public:
+    SnapshotSink(WebcamCapture* cam, std::string file, imageenc::Format fmt, int lvl)
+        : webcam(cam), filename(std::move(file)), format(fmt), level(lvl) {}
+
+    bool onFrame(const capture::Frame& frame) override {
+        pixels.resize(pixelconv::imageSize(pixelconv::PixelFormat::BGRA, frame.image.width, frame.image.height));
+        bgra = pixelconv::wrap(pixelconv::PixelFormat::BGRA, frame.image.width, frame.image.height, pixels.data());
+        if (!pixelconv::convert(frame.image, bgra)) {
+            webcam->outputJSON("{\"type\":\"status\",\"message\":\"Cannot convert the camera frame.\",\"error\":true}");
+            return false;
+        }
+        std::shared_ptr<SnapshotSink> self = shared_from_this();
+        webcam->runInBackground([self] { self->save(); });
+        return false;
+    }
+
+private:
+    void save() {
+        std::vector<uint8_t> encoded;
+        bool ok = imageenc::encode(bgra, format, level, encoded);
+        if (ok) {
+            std::ofstream file(filename, std::ios::binary);
+            ok = file.is_open();
+            if (ok) file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        }
+        if (ok) {
+            webcam->outputEvent("file_saved", "filename", filename);
+        } else {
+            webcam->outputJSON("{\"type\":\"status\",\"message\":\"Cannot save session photo.\",\"error\":true}");
+        }
+    }
+
+    WebcamCapture* webcam;
+    std::string filename;
+    imageenc::Format format;
+    int level;
+    std::vector<uint8_t> pixels;
+    pixelconv::Image bgra;
+};
+
+// Records a session's NV12 frames to H.264 for a fixed duration. Sample times
+// come from the session's shared clock, so clips from different cameras line
+// up. A fragmented MP4 is playable up to its last fragment even if the helper
+// dies before finalizing; systems without the fMP4 sink get a plain MP4.
+class RecorderSink : public capture::FrameSink {
+public:
+    RecorderSink(WebcamCapture* cam, std::string file, int seconds, bool fragmentedMp4 = false)
+        : webcam(cam), filename(std::move(file)), durationNs((int64_t)seconds * 1000000000LL), fragmented(fragmentedMp4) {}
+
+    ~RecorderSink() {
+        finish();
+    }
+
+    bool open(const capture::StreamFormat& format) {
+        IMFMediaType* pType = nullptr;
+        IMFAttributes* pAttributes = nullptr;
+        UINT32 fpsNum = (UINT32)(format.fps * 1000 + 0.5), fpsDen = 1000;
+        bool ok = false;
+        std::wstring url(filename.begin(), filename.end());
+        width = format.width;
+        height = format.height;
+
+        if (fragmented && SUCCEEDED(MFCreateAttributes(&pAttributes, 1))) {
+            pAttributes->SetGUID(MF_TRANSCODE_CONTAINERTYPE, MFTranscodeContainerType_FMPEG4);
+            if (FAILED(MFCreateSinkWriterFromURL(url.c_str(), NULL, pAttributes, &pWriter))) pWriter = nullptr;
+            WebcamCapture::SAFE_RELEASE(pAttributes);
+        }
+        if (!pWriter && FAILED(MFCreateSinkWriterFromURL(url.c_str(), NULL, NULL, &pWriter))) return false;
+
+        if (FAILED(MFCreateMediaType(&pType))) return false;
+        pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        pType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264);
+        pType->SetUINT32(MF_MT_AVG_BITRATE, 4000000);
+        pType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+        MFSetAttributeSize(pType, MF_MT_FRAME_SIZE, width, height);
+        MFSetAttributeRatio(pType, MF_MT_FRAME_RATE, fpsNum, fpsDen);
+        MFSetAttributeRatio(pType, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+        ok = SUCCEEDED(pWriter->AddStream(pType, &streamIndex));
+        WebcamCapture::SAFE_RELEASE(pType);
+        if (!ok) return false;
+
+        if (FAILED(MFCreateMediaType(&pType))) return false;
+        pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        pType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
+        MFSetAttributeSize(pType, MF_MT_FRAME_SIZE, width, height);
+        MFSetAttributeRatio(pType, MF_MT_FRAME_RATE, fpsNum, fpsDen);
+        MFSetAttributeRatio(pType, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+        ok = SUCCEEDED(pWriter->SetInputMediaType(streamIndex, pType, NULL));
+        WebcamCapture::SAFE_RELEASE(pType);
+        return ok && SUCCEEDED(pWriter->BeginWriting());
+    }
+
+    bool onFrame(const capture::Frame& frame) override {
+        if (!pWriter) return false;
+        if (startNs < 0) startNs = frame.timestampNs;
+        if (frame.timestampNs - startNs >= durationNs) {
+            finish();
+            return false;
+        }
+
+        IMFMediaBuffer* pBuffer = nullptr;
+        IMFSample* pSample = nullptr;
+        BYTE* pDst = nullptr;
+        DWORD size = (DWORD)pixelconv::imageSize(pixelconv::PixelFormat::NV12, width, height);
+        bool ok = false;
+        if (SUCCEEDED(MFCreateMemoryBuffer(size, &pBuffer)) && SUCCEEDED(pBuffer->Lock(&pDst, NULL, NULL))) {
+            pixelconv::convert(frame.image, pixelconv::wrap(pixelconv::PixelFormat::NV12, width, height, pDst));
+            pBuffer->Unlock();
+            pBuffer->SetCurrentLength(size);
+            if (SUCCEEDED(MFCreateSample(&pSample)) && SUCCEEDED(pSample->AddBuffer(pBuffer))) {
+                pSample->SetSampleTime((frame.timestampNs - startNs) / 100);
+                ok = SUCCEEDED(pWriter->WriteSample(streamIndex, pSample));
+            }
+        }
+        WebcamCapture::SAFE_RELEASE(pSample);
+        WebcamCapture::SAFE_RELEASE(pBuffer);
+        if (!ok) {
+            finish();
+            return false;
+        }
+        return true;
+    }
+
+    void onStop() override {
+        finish();
+    }
+
+    // Finalizes without reporting; false if nothing was written or it failed.
+    bool finalize() {
+        if (!pWriter) return false;
+        bool ok = startNs >= 0 && SUCCEEDED(pWriter->Finalize());
+        WebcamCapture::SAFE_RELEASE(pWriter);
+        return ok;
+    }
+
+    const std::string& path() const { return filename; }
+
+private:
+    void finish() {
+        if (!pWriter) return;
+        bool ok = finalize();
+        if (ok) {
+            webcam->outputEvent("file_saved", "filename", filename);
+        } else {
+            webcam->outputJSON("{\"type\":\"status\",\"message\":\"Failed to record session video\",\"error\":true}");
+        }
+    }
+
+    WebcamCapture* webcam;
+    std::string filename;
+    int64_t durationNs;
+    bool fragmented;
+    int64_t startNs = -1;
+    int width = 0, height = 0;
+    IMFSinkWriter* pWriter = nullptr;
+    DWORD streamIndex = 0;
+};
+
+// Records a session while there is motion in front of it. The detector reads
+// the luma plane of the session's NV12 slot in place; frames are only copied
+// once an event is being recorded. An event longer than the clip limit
+// continues in a new file.
+class MotionSink : public capture::FrameSink {
+public:
+    static const int kMaxClipSeconds = 600;
+
+    MotionSink(WebcamCapture* cam, std::string id, std::string prefix, const capture::StreamFormat& fmt,
+               const motion::Config& config, const std::vector<motion::Rect>& regions)
+        : webcam(cam), camera(std::move(id)), filePrefix(std::move(prefix)), format(fmt), detector(config) {
+        detector.setMask(regions);
+    }
+
+    // Detaches on the next frame; called from the command thread.
+    void stop() { stopRequested = true; }
+
+    bool onFrame(const capture::Frame& frame) override {
+        lastTimestampNs = frame.timestampNs;
+        if (stopRequested) {
+            endEvent();
+            webcam->outputEvent("motion_disarmed", "camera", camera);
+            return false;
+        }
+
+        motion::Result r = detector.process(frame.image, frame.timestampNs);
+        if (r.transition == motion::Transition::Started) beginEvent(r.changed);
+        if (detector.active() && r.changed > peakChanged) peakChanged = r.changed;
+        if (recorder && !recorder->onFrame(frame)) {
+            recorder.reset();
+            if (detector.active() && openClip()) recorder->onFrame(frame);
+        }
+        if (r.transition == motion::Transition::Stopped) endEvent();
+        return true;
+    }
+
+    void onStop() override {
+        endEvent();
+        webcam->outputEvent("motion_disarmed", "camera", camera);
+    }
+
+private:
+    bool openClip() {
+        char filename[256];
+        generateFilename(filename, sizeof(filename), (filePrefix + "_" + std::to_string(++clips)).c_str(), "mp4");
+        recorder.reset(new RecorderSink(webcam, filename, kMaxClipSeconds));
+        if (!recorder->open(format)) {
+            recorder.reset();
+            webcam->outputJSON("{\"type\":\"status\",\"message\":\"Failed to start motion recording\",\"error\":true}");
+            return false;
+        }
+        return true;
+    }
+
+    void beginEvent(double changed) {
+        inEvent = true;
+        eventStartNs = lastTimestampNs;
+        peakChanged = changed;
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "motion_started");
+        msg.field("camera", camera);
+        msg.field("timestamp_ns", lastTimestampNs);
+        msg.field("changed", changed, kDigits);
+        msg.endObject();
+        webcam->outputJSON(msg.view());
+        openClip();
+    }
+
+    // The recorder reports file_saved as it finalizes.
+    void endEvent() {
+        if (!inEvent) return;
+        inEvent = false;
+        recorder.reset();
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "motion_stopped");
+        msg.field("camera", camera);
+        msg.field("timestamp_ns", lastTimestampNs);
+        msg.field("duration_ms", (lastTimestampNs - eventStartNs) / 1000000);
+        msg.field("peak_changed", peakChanged, kDigits);
+        msg.endObject();
+        webcam->outputJSON(msg.view());
+    }
+
+    WebcamCapture* webcam;
+    std::string camera;
+    std::string filePrefix;
+    capture::StreamFormat format;
+    motion::Detector detector;
+    std::unique_ptr<RecorderSink> recorder;
+    std::atomic<bool> stopRequested{ false };
+    bool inEvent = false;
+    int64_t eventStartNs = 0;
+    int64_t lastTimestampNs = 0;
+    double peakChanged = 0;
+    int clips = 0;
+};
+
+// Records a session continuously as a chain of segments, each its own
+// fragmented MP4 that is finalized as the next one starts: a crash costs at
+// most the open segment, and a closed one can be played at once. The first
+// writer is opened by start(), before the sink joins the session; after that
+// the next writer is opened ahead of time and the previous one finalized on a
+// worker thread. The delivery thread never waits for either: a rotation that
+// finds the next writer not yet open keeps writing the current segment and
+// tries again on the following frame. Memory is the same after a day as after
+// a minute: two writers, one worker and the shared quota store.
+class SegmentSink : public capture::FrameSink {
+public:
+    SegmentSink(WebcamCapture* cam, std::string id, std::string prefix, const capture::StreamFormat& fmt,
+                int seconds, segments::Store* quotaStore)
+        : webcam(cam), camera(std::move(id)), filePrefix(std::move(prefix)), format(fmt),
+          segmentNs((int64_t)seconds * 1000000000LL), store(quotaStore) {}
+
+    ~SegmentSink() {
+        shutdown();
+    }
+
+    // Opens the first segment on the calling thread and starts the worker.
+    // The sink is attached to the store already; on failure it detaches.
+    bool start() {
+        current = openSegment();
+        if (!current) {
+            store->detach();
+            done = true;
+            return false;
+        }
+        worker = std::thread(&SegmentSink::workerLoop, this);
+        prepareNext();
+        return true;
+    }
+
+    // Detaches on the next frame; called from the command thread.
+    void stop() { stopRequested = true; }
+
+    // The sink has shut down, asked to or after a failure.
+    bool finished() const { return done; }
+
+    bool onFrame(const capture::Frame& frame) override {
+        if (stopRequested || !current) {
+            shutdown();
+            return false;
+        }
+        if (current->frames && frame.timestampNs - current->startNs >= segmentNs && !rotate()) {
+            webcam->outputJSON("{\"type\":\"status\",\"message\":\"Failed to open recording segment\",\"error\":true}");
+            shutdown();
+            return false;
+        }
+        if (!current->frames) current->startNs = frame.timestampNs;
+        if (!current->writer->onFrame(frame)) {
+            webcam->outputJSON("{\"type\":\"status\",\"message\":\"Failed to write recording segment\",\"error\":true}");
+            shutdown();
+            return false;
+        }
+        current->endNs = frame.timestampNs;
+        ++current->frames;
+        return true;
+    }
+
+    void onStop() override {
+        shutdown();
+    }
+
+private:
+    struct Segment {
+        std::unique_ptr<RecorderSink> writer;
+        int64_t startNs = 0;
+        int64_t endNs = 0;
+        uint64_t frames = 0;
+    };
+
+    void post(std::function<void()> job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+        wake.notify_all();
+    }
+
+    void workerLoop() {
+        HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return !jobs.empty() || quitting; });
+                if (jobs.empty()) break;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+        if (SUCCEEDED(hr)) CoUninitialize();
+    }
+
+    void prepareNext() {
+        nextPending = true;
+        post([this] {
+            std::shared_ptr<Segment> seg = openSegment();
+            std::lock_guard<std::mutex> lock(mutex);
+            next = seg;
+            nextReady = true;
+        });
+    }
+
+    // The writer for a new segment, or null if it cannot be opened. On the
+    // command thread for the first segment, on the worker after that.
+    std::shared_ptr<Segment> openSegment() {
+        char filename[256];
+        generateFilename(filename, sizeof(filename), (filePrefix + "_" + std::to_string(++opened)).c_str(), "mp4");
+        std::shared_ptr<Segment> seg = std::make_shared<Segment>();
+        // Rotation happens long before this; the margin only stops the
+        // writer from ending a segment on its own.
+        seg->writer.reset(new RecorderSink(webcam, filename, (int)(segmentNs / 1000000000LL) + 60, true));
+        if (!seg->writer->open(format)) {
+            seg->writer.reset();
+            std::remove(filename);
+            seg.reset();
+        }
+        return seg;
+    }
+
+    // Delivery thread: moves on to the prepared writer if the worker has it
+    // ready, and otherwise leaves the current segment running a frame longer.
+    // False only if the prepared writer failed to open.
+    bool rotate() {
+        std::shared_ptr<Segment> upcoming;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!nextReady) return true;
+            nextReady = false;
+            upcoming = std::move(next);
+        }
+        nextPending = false;
+        if (!upcoming) return false;
+        closeSegment(current);
+        current = upcoming;
+        prepareNext();
+        return true;
+    }
+
+    void closeSegment(std::shared_ptr<Segment> seg) {
+        post([this, seg] { finalize(*seg); });
+    }
+
+    // Worker: finalizes a segment, reports it and enforces the quota.
+    void finalize(Segment& seg) {
+        std::string path = seg.writer->path();
+        bool ok = seg.writer->finalize();
+        seg.writer.reset();
+        if (!ok) {
+            std::remove(path.c_str());
+            return;
+        }
+        segments::Segment closed;
+        closed.path = path;
+        closed.bytes = segments::fileSize(path);
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "segment_closed");
+        msg.field("camera", camera);
+        msg.field("filename", path);
+        msg.field("start_ns", seg.startNs);
+        msg.field("end_ns", seg.endNs);
+        msg.field("frames", seg.frames);
+        msg.field("bytes", closed.bytes);
+        msg.endObject();
+        // The close and the evictions it causes go out together.
+        protocol::Output::Batch batch(webcam->out());
+        webcam->outputJSON(msg.view());
+        for (const segments::Segment& gone : store->add(closed)) webcam->reportSegmentDeleted(gone);
+    }
+
+    // Closes the open segment, discards the prepared one and waits for the
+    // worker to finish both, then leaves the quota store. Safe to call more
+    // than once.
+    void shutdown() {
+        if (!worker.joinable()) return;
+        if (current) closeSegment(current);
+        current.reset();
+        if (nextPending) {
+            // Queued behind the job that opens it, so it is ready by then.
+            post([this] {
+                std::shared_ptr<Segment> unused;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    unused = std::move(next);
+                    nextReady = false;
+                }
+                if (unused) finalize(*unused);
+            });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+            wake.notify_all();
+        }
+        worker.join();
+        store->detach();
+        done = true;
+        webcam->outputEvent("continuous_stopped", "camera", camera);
+    }
+
+    WebcamCapture* webcam;
+    std::string camera;
+    std::string filePrefix;
+    capture::StreamFormat format;
+    int64_t segmentNs;
+    segments::Store* store;
+    std::atomic<bool> stopRequested{ false };
+    std::atomic<bool> done{ false };
+    std::shared_ptr<Segment> current;
+    bool nextPending = false;
+    int opened = 0; // the command thread in start(), then the worker
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> jobs;
+    bool quitting = false;
+    std::shared_ptr<Segment> next;
+    bool nextReady = false;
+    std::thread worker;
+};
+
+void WebcamCapture::openSession(const std::string& camera) {
+    std::string id;
+    if (!resolveCamera(camera, id)) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Unknown camera.\",\"error\":true}");
+        return;
+    }
+    std::unique_ptr<capture::FrameSource> source;
+    if (trace.replaying()) {
+        source = frametrace::replay(trace.replay, id, trace.speed);
+    } else {
+        CameraMode mode;
+        bool hasMode = modeFor(id, mode);
+        source.reset(new MediaFoundationSource(id, hasMode ? &mode : nullptr));
+        source = frametrace::record(std::move(source), id, trace.recorder);
+    }
+    if (!source) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Cannot read the trace.\",\"error\":true}");
+        return;
+    }
+    std::unique_ptr<capture::Session> session(new capture::Session(id, std::move(source)));
+
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    if (sessions.count(id)) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Session already open.\",\"error\":true}");
+        return;
+    }
+    if (!session->start()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Cannot open camera session.\",\"error\":true}");
+        return;
+    }
+    const capture::StreamFormat& format = session->format();
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("type", "session_opened");
+    msg.field("camera", id);
+    msg.field("width", format.width);
+    msg.field("height", format.height);
+    msg.field("fps", format.fps, kDigits);
+    msg.endObject();
+    sessions[id] = std::move(session);
+    outputJSON(msg.view());
+}
+
+void WebcamCapture::closeSession(const std::string& camera) {
+    std::string id;
+    std::unique_ptr<capture::Session> session;
+    if (resolveCamera(camera, id)) {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        auto it = sessions.find(id);
+        if (it != sessions.end()) {
+            session = std::move(it->second);
+            sessions.erase(it);
+        }
+        motionSinks.erase(id);
+        segmentSinks.erase(id);
+    }
+    if (!session) {
+        outputJSON("{\"type\":\"status\",\"message\":\"No session for this camera.\",\"error\":true}");
+        return;
+    }
+    if (!session->stop(kSessionStopMs)) {
+        // The camera is stuck in a read even after its source was shut down.
+        // The session is parked, not destroyed, so its capture thread keeps
+        // valid memory until it returns.
+        outputJSON("{\"type\":\"status\",\"message\":\"Camera did not stop; its session is abandoned.\",\"error\":true}");
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        stuckSessions.push_back(std::move(session));
+        return;
+    }
+    outputEvent("session_closed", "camera", id);
+}
+
+void WebcamCapture::sessionPhoto(const std::string& camera, imageenc::Format format, int level) {
+    std::string id;
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = resolveCamera(camera, id) ? sessions.find(id) : sessions.end();
+    if (it == sessions.end()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"No session for this camera.\",\"error\":true}");
+        return;
+    }
+    char filename[256];
+    generateFilename(filename, sizeof(filename), ("session" + std::to_string(++sessionFiles) + "_photo").c_str(),
+                     imageenc::extension(format));
+    it->second->addSink(std::make_shared<SnapshotSink>(this, filename, format, level));
+}
+
+void WebcamCapture::sessionRecord(const std::string& camera, int seconds) {
+    std::string id;
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = resolveCamera(camera, id) ? sessions.find(id) : sessions.end();
+    if (it == sessions.end()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"No session for this camera.\",\"error\":true}");
+        return;
+    }
+    char filename[256];
+    generateFilename(filename, sizeof(filename), ("session" + std::to_string(++sessionFiles) + "_video").c_str(), "mp4");
+    std::shared_ptr<RecorderSink> recorder = std::make_shared<RecorderSink>(this, filename, seconds > 0 ? seconds : 5);
+    if (!recorder->open(it->second->format())) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Failed to start session recording\",\"error\":true}");
+        return;
+    }
+    it->second->addSink(recorder);
+}
+
+void WebcamCapture::reportSessions() {
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("type", "session_stats");
+    msg.key("sessions").beginArray();
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    for (const auto& entry : sessions) {
+        capture::SessionStats st = entry.second->stats();
+        const capture::StreamFormat& format = entry.second->format();
+        msg.beginObject();
+        msg.field("camera", entry.first);
+        msg.field("running", entry.second->isRunning());
+        msg.field("width", format.width);
+        msg.field("height", format.height);
+        msg.field("captured", st.captured);
+        msg.field("delivered", st.delivered);
+        msg.field("dropped", st.dropped);
+        msg.field("read_errors", st.readErrors);
+        msg.field("capture_fps", st.captureFps, kDigits);
+        msg.field("deliver_fps", st.deliverFps, kDigits);
+        msg.field("max_deliver_ms", st.maxDeliverMs, kDigits);
+        msg.field("last_timestamp_ns", st.lastTimestampNs);
+        msg.endObject();
+    }
+    msg.endArray();
+    msg.endObject();
+    outputJSON(msg.view(), protocol::MessageType::SessionStats);
+}
+
+// At scrape time (metrics.h): the sessions' counters and the latency stages,
+// both of which are kept anyway, so nothing is counted twice on the frame
+// path.
+void WebcamCapture::collectMetrics(metrics::Exposition& out) {
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        out.family("helper_webcam_sessions", "Capture sessions open.", "gauge");
+        out.sample("helper_webcam_sessions", {}, (uint64_t)sessions.size());
+        if (!sessions.empty()) {
+            std::vector<std::pair<std::string, capture::SessionStats>> stats;
+            for (const auto& entry : sessions) stats.emplace_back(metrics::label("camera", entry.first), entry.second->stats());
+            out.family("helper_webcam_frames_total", "Session frames by what became of them.", "counter");
+            for (const auto& st : stats) {
+                const std::pair<const char*, uint64_t> outcomes[] = {
+                    { "captured", st.second.captured }, { "delivered", st.second.delivered }, { "dropped", st.second.dropped }
+                };
+                for (const auto& o : outcomes)
+                    out.sample("helper_webcam_frames_total", st.first + "," + metrics::label("outcome", o.first), o.second);
+            }
+            out.family("helper_webcam_read_errors_total", "Failed frame reads.", "counter");
+            for (const auto& st : stats) out.sample("helper_webcam_read_errors_total", st.first, st.second.readErrors);
+            out.family("helper_webcam_capture_fps", "Frames per second the camera delivers.", "gauge");
+            for (const auto& st : stats) out.sample("helper_webcam_capture_fps", st.first, st.second.captureFps);
+            out.family("helper_webcam_deliver_max_seconds", "Slowest single pass of a frame through the sinks.", "gauge");
+            for (const auto& st : stats) out.sample("helper_webcam_deliver_max_seconds", st.first, st.second.maxDeliverMs / 1e3);
+        }
+    }
+#if WEBCAM_LATENCY_STATS
+    // From the running totals rather than collect(), whose window the stats
+    // command resets. A latency bucket goes to the first bound its upper end
+    // fits under; they are a few percent wide, far finer than the bounds.
+    const std::vector<double>& bounds = metrics::latencyBuckets();
+    std::vector<uint64_t> buckets;
+    bool first = true;
+    for (int s = 0; s < latency::kStageCount; ++s) {
+        uint64_t sumNs = 0;
+        latency::Histogram h = latency::total((latency::Stage)s, sumNs);
+        if (!h.count()) continue;
+        buckets.assign(bounds.size() + 1, 0);
+        size_t i = 0;
+        for (int b = 0; b < latency::Histogram::kBuckets; ++b) {
+            if (!h.counts[b]) continue;
+            double high = latency::Histogram::bucketHigh(b) / 1e9;
+            while (i < bounds.size() && high > bounds[i]) ++i;
+            buckets[i] += h.counts[b];
+        }
+        if (first) {
+            out.family("helper_webcam_stage_seconds", "Photo, video and preview stage latencies.", "histogram");
+            first = false;
+        }
+        out.histogram("helper_webcam_stage_seconds", metrics::label("stage", latency::stageName((latency::Stage)s)),
+                      bounds, buckets, sumNs / 1e9);
+    }
+#endif
+}
+
+void WebcamCapture::closeAllSessions() {
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    for (auto& entry : sessions) {
+        if (!entry.second->stop(kSessionStopMs)) stuckSessions.push_back(std::move(entry.second));
+    }
+    sessions.clear();
+    motionSinks.clear();
+    segmentSinks.clear();
+    // A reader that never returns must not hang the helper's exit: what is
+    // still stuck is left to the process teardown.
+    for (std::unique_ptr<capture::Session>& session : stuckSessions) {
+        if (!session->stop(0)) session.release();
+    }
+    stuckSessions.clear();
+}
+
+void WebcamCapture::startMotion(const std::string& camera, const motion::Config& config,
+                                const std::vector<motion::Rect>& regions) {
+    std::string id;
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = resolveCamera(camera, id) ? sessions.find(id) : sessions.end();
+    if (it == sessions.end()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"No session for this camera.\",\"error\":true}");
+        return;
+    }
+    if (motionSinks.count(id)) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Motion detection already running.\",\"error\":true}");
+        return;
+    }
+    std::shared_ptr<MotionSink> sink = std::make_shared<MotionSink>(
+        this, id, "session" + std::to_string(++sessionFiles) + "_motion", it->second->format(), config, regions);
+    motionSinks[id] = sink;
+    it->second->addSink(sink);
+
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("type", "motion_armed");
+    msg.field("camera", id);
+    msg.field("threshold", config.threshold);
+    msg.field("min_area", config.minArea, kDigits);
+    msg.field("start_frames", config.startFrames);
+    msg.field("stop_ms", config.stopAfterNs / 1000000);
+    msg.field("regions", regions.size());
+    msg.endObject();
+    outputJSON(msg.view());
+}
+
+void WebcamCapture::startContinuous(const std::string& camera, int segmentSeconds, uint64_t quotaBytes) {
+    std::string id;
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = resolveCamera(camera, id) ? sessions.find(id) : sessions.end();
+    if (it == sessions.end()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"No session for this camera.\",\"error\":true}");
+        return;
+    }
+    auto running = segmentSinks.find(id);
+    if (running != segmentSinks.end()) {
+        // A sink that failed has shut itself down already.
+        if (!running->second->finished()) {
+            outputJSON("{\"type\":\"status\",\"message\":\"Continuous recording already running.\",\"error\":true}");
+            return;
+        }
+        segmentSinks.erase(running);
+    }
+
+    // The quota covers every camera's segments, so a recording joins the
+    // one already running rather than replacing it.
+    bool adopt = false;
+    if (!segmentStore.attach(quotaBytes, adopt)) {
+        json::Writer msg;
+        msg.beginObject();
+        msg.field("type", "status");
+        msg.key("message").beginString();
+        if (uint64_t quota = segmentStore.quota()) {
+            msg.text("Continuous recording is running under a quota of ").number(quota / (1024 * 1024)).text(" MB.");
+        } else {
+            msg.text("Continuous recording is running without a quota.");
+        }
+        msg.endString();
+        msg.field("error", true);
+        msg.endObject();
+        outputJSON(msg.view());
+        return;
+    }
+    if (adopt) {
+        // Segments from earlier runs count against the quota too.
+        protocol::Output::Batch batch(output);
+        for (const segments::Segment& gone : segmentStore.scan("captures", "segment_", ".mp4")) {
+            reportSegmentDeleted(gone);
+        }
+    }
+
+    std::shared_ptr<SegmentSink> sink = std::make_shared<SegmentSink>(
+        this, id, "segment_" + std::to_string(++sessionFiles), it->second->format(), segmentSeconds, &segmentStore);
+    if (!sink->start()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Failed to open recording segment\",\"error\":true}");
+        return;
+    }
+    segmentSinks[id] = sink;
+    it->second->addSink(sink);
+
+    json::Writer msg;
+    msg.beginObject();
+    msg.field("type", "continuous_started");
+    msg.field("camera", id);
+    msg.field("segment_seconds", segmentSeconds);
+    msg.field("quota_bytes", segmentStore.quota());
+    msg.endObject();
+    outputJSON(msg.view());
+}
+
+void WebcamCapture::stopContinuous(const std::string& camera) {
+    std::string id;
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = resolveCamera(camera, id) ? segmentSinks.find(id) : segmentSinks.end();
+    if (it == segmentSinks.end() || it->second->finished()) {
+        if (it != segmentSinks.end()) segmentSinks.erase(it);
+        outputJSON("{\"type\":\"status\",\"message\":\"Continuous recording is not running.\",\"error\":true}");
+        return;
+    }
+    it->second->stop();
+    segmentSinks.erase(it);
+}
+
+void WebcamCapture::stopMotion(const std::string& camera) {
+    std::string id;
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = resolveCamera(camera, id) ? motionSinks.find(id) : motionSinks.end();
+    if (it == motionSinks.end()) {
+        outputJSON("{\"type\":\"status\",\"message\":\"Motion detection is not running.\",\"error\":true}");
+        return;
+    }
+    it->second->stop();
+    motionSinks.erase(it);
+}
+
 void toggleStealthMode() {
     HWND hwndElectron = FindWindowA(NULL, "LAB4: WEBCAM");
     HWND hwndConsole = GetConsoleWindow();
@@ -393,6 +2070,36 @@ void toggleStealthMode() {
     isHidden = shouldHide;
 }
 
+std::vector<std::string> splitCommand(std::string line) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    while (true) {
+        size_t bar = line.find('|', start);
+        parts.push_back(line.substr(start, bar == std::string::npos ? std::string::npos : bar - start));
+        if (bar == std::string::npos) break;
+        start = bar + 1;
+    }
+    return parts;
+}
+
+// "x,y,w,h;x,y,w,h" in frame pixels.
+bool parseRegions(const std::string& text, std::vector<motion::Rect>& regions) {
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t semi = text.find(';', start);
+        std::string part = text.substr(start, semi == std::string::npos ? std::string::npos : semi - start);
+        motion::Rect rc;
+        if (sscanf_s(part.c_str(), "%d,%d,%d,%d", &rc.x, &rc.y, &rc.width, &rc.height) != 4 || rc.width <= 0 || rc.height <= 0) {
+            return false;
+        }
+        regions.push_back(rc);
+        if (semi == std::string::npos) break;
+        start = semi + 1;
+    }
+    return true;
+}
+
 void generateFilename(char* buffer, size_t size, const char* prefix, const char* ext) {
     CreateDirectoryA("captures", NULL);
     SYSTEMTIME st; GetLocalTime(&st);
@@ -400,15 +2107,72 @@ void generateFilename(char* buffer, size_t size, const char* prefix, const char*
         prefix, st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, ext);
 }
 
-void keyListenerThread(WebcamCapture* cam) {
-    while (isRunning) {
+// Camera arrivals and removals come in bursts (one per interface class), so
+// the cache is refreshed once things have been quiet for half a second.
+LRESULT CALLBACK DeviceWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    if (msg == WM_DEVICECHANGE && (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE)) {
+        SetTimer(hwnd, 1, 500, NULL);
+    } else if (msg == WM_TIMER) {
+        KillTimer(hwnd, 1);
+        WebcamCapture* cam = reinterpret_cast<WebcamCapture*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
+        if (cam) {
+            cam->invalidateCameras();
+            cam->reportCameraInfo();
+        }
+    } else if (msg == WM_DESTROY) {
+        // The module closed the window; the watcher's message loop ends.
+        PostQuitMessage(0);
+    }
+    return DefWindowProc(hwnd, msg, wParam, lParam);
+}
+
+// Hands its window over through ready once it exists (null if it could not
+// be created); closing that window ends the thread.
+void deviceWatcherThread(WebcamCapture* cam, std::promise<HWND> ready) {
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    WNDCLASSEXA wx = {};
+    wx.cbSize = sizeof(WNDCLASSEXA);
+    wx.lpfnWndProc = DeviceWndProc;
+    wx.lpszClassName = "WebcamMonitorClass";
+    RegisterClassExA(&wx);
+    HWND hwnd = CreateWindowExA(0, "WebcamMonitorClass", "Webcam Monitor", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, NULL, NULL);
+    ready.set_value(hwnd);
+    if (!hwnd) {
+        CoUninitialize();
+        return;
+    }
+    SetWindowLongPtr(hwnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(cam));
+
+    DEV_BROADCAST_DEVICEINTERFACE_A notificationFilter = {};
+    notificationFilter.dbcc_size = sizeof(notificationFilter);
+    notificationFilter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+
+    notificationFilter.dbcc_classguid = GUID_KSCATEGORY_VIDEO_CAMERA;
+    RegisterDeviceNotificationA(hwnd, &notificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE);
+
+    notificationFilter.dbcc_classguid = GUID_KSCATEGORY_CAPTURE;
+    RegisterDeviceNotificationA(hwnd, &notificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE);
+
+    MSG msg;
+    while (GetMessage(&msg, NULL, 0, 0) > 0) { TranslateMessage(&msg); DispatchMessage(&msg); }
+
+    if (IsWindow(hwnd)) DestroyWindow(hwnd);
+    CoUninitialize();
+}
+
+// The F8-F10 hotkeys, polled while listening is set. Presses from before
+// the start are read and dropped first.
+void keyListenerThread(WebcamCapture* cam, const std::atomic<bool>* listening) {
+    for (int key : { VK_F8, VK_F9, VK_F10 }) GetAsyncKeyState(key);
+    while (*listening) {
         if (GetAsyncKeyState(VK_F8) & 0x0001) toggleStealthMode();
 
         if (GetAsyncKeyState(VK_F9) & 0x0001) {
             if (!isHidden) toggleStealthMode();
             char filename[256];
             generateFilename(filename, 256, "hidden_photo", "bmp");
-            cam->capturePhotoBMP(filename);
+            cam->capturePhoto(filename);
         }
 
         if (GetAsyncKeyState(VK_F10) & 0x0001) {
@@ -422,41 +2186,167 @@ void keyListenerThread(WebcamCapture* cam) {
     }
 }
 
-int main() {
-    WebcamCapture webcam;
-    std::cout << webcam.getCameraInfo() << std::endl;
-    std::thread listener(keyListenerThread, &webcam);
+namespace {
 
-    std::string line;
-    while (std::getline(std::cin, line)) {
-        if (line == "refresh_info") {
-            std::cout << webcam.getCameraInfo() << std::endl;
-        } else if (line == "capture_photo") {
-            char filename[256];
-            generateFilename(filename, 256, "photo", "bmp");
-            webcam.capturePhotoBMP(filename);
-        } else if (line == "hidden_photo") {
-            toggleStealthMode();
+// The webcam as a module. The capture object (and with it COM and Media
+// Foundation) comes up on the thread that starts the module, which is also
+// the one all commands run on.
+class WebcamModule : public helper::Module {
+public:
+    WebcamModule(protocol::Output& out, const hal::TraceOptions& options) : output(out), trace(options) {}
+
+    ~WebcamModule() override {
+        setSubscribed(false);
+        if (watcher.joinable()) {
+            if (watcherWindow) PostMessage(watcherWindow, WM_CLOSE, 0, 0);
+            watcher.join();
+        }
+    }
+
+    bool start() override {
+        webcam = std::make_unique<WebcamCapture>(output, protocol::Channel::Webcam, trace);
+        webcam->reportCameraInfo();
+        std::promise<HWND> ready;
+        std::future<HWND> window = ready.get_future();
+        watcher = std::thread(deviceWatcherThread, webcam.get(), std::move(ready));
+        watcherWindow = window.get();
+        return true;
+    }
+
+    // The hotkeys reach across the whole desktop, so they are armed only
+    // while a host uses the webcam, as they were while webcam.exe ran.
+    void setSubscribed(bool on) override {
+        if (on == listener.joinable()) return;
+        if (on) {
+            listening = true;
+            listener = std::thread(keyListenerThread, webcam.get(), &listening);
+        } else {
+            listening = false;
+            listener.join();
+        }
+    }
+
+    void command(const std::string& line) override {
+        std::vector<std::string> args = splitCommand(line);
+        const std::string& cmd = args[0];
+
+        if (cmd == "refresh_info") {
+            webcam->reportCameraInfo();
+        } else if (cmd == "capture_photo" || cmd == "hidden_photo") {
+            // capture_photo[|bmp|qoi|png[|level]]
+            imageenc::Format format = imageenc::Format::Bmp;
+            int level = 1;
+            if (args.size() > 1 && !imageenc::parseFormat(args[1], format)) {
+                webcam->outputJSON("{\"type\":\"status\",\"message\":\"Unknown image format.\",\"error\":true}");
+                return;
+            }
+            if (args.size() > 2) level = atoi(args[2].c_str());
+
+            bool hidden = cmd == "hidden_photo";
             char filename[256];
-            generateFilename(filename, 256, "hidden_photo", "bmp");
-            webcam.capturePhotoBMP(filename);
-            toggleStealthMode();
-        } else if (line == "capture_video") {
+            generateFilename(filename, 256, hidden ? "hidden_photo" : "photo", imageenc::extension(format));
+            if (hidden) toggleStealthMode();
+            webcam->capturePhoto(filename, format, level);
+            if (hidden) toggleStealthMode();
+        } else if (cmd == "capture_video") {
             char filename[256];
             generateFilename(filename, 256, "video", "mp4");
-            webcam.captureVideoMP4(filename, 5);
-        } else if (line == "hidden_video") {
+            webcam->captureVideoMP4(filename, 5);
+        } else if (cmd == "hidden_video") {
             toggleStealthMode();
             char filename[256];
             generateFilename(filename, 256, "hidden_video", "mp4");
-            webcam.captureVideoMP4(filename, 5);
+            webcam->captureVideoMP4(filename, 5);
             toggleStealthMode();
-        } else if (line == "exit" || line == "quit") {
-            isRunning = false;
-            break;
+        } else if (cmd == "set_mode") {
+            // set_mode|w|h|fps|format, or set_mode alone for the driver default
+            if (args.size() == 1) {
+                webcam->clearMode();
+            } else if (args.size() < 3 ||
+                       !webcam->setMode((UINT32)atoi(args[1].c_str()), (UINT32)atoi(args[2].c_str()),
+                                       args.size() > 3 ? atof(args[3].c_str()) : 0,
+                                       args.size() > 4 ? args[4] : std::string())) {
+                webcam->outputJSON("{\"type\":\"status\",\"message\":\"Camera does not support this mode.\",\"error\":true}");
+                return;
+            }
+            webcam->restartPreview();
+            webcam->reportCameraInfo();
+        } else if (cmd == "select_camera" && args.size() > 1) {
+            if (!webcam->selectCamera(args[1])) {
+                webcam->outputJSON("{\"type\":\"status\",\"message\":\"Unknown camera.\",\"error\":true}");
+                return;
+            }
+            webcam->restartPreview();
+            webcam->reportCameraInfo();
+        } else if (cmd == "session_open" && args.size() > 1) {
+            // session_*|<camera id or index>[|...]
+            webcam->openSession(args[1]);
+        } else if (cmd == "session_close" && args.size() > 1) {
+            webcam->closeSession(args[1]);
+        } else if (cmd == "session_photo" && args.size() > 1) {
+            imageenc::Format format = imageenc::Format::Bmp;
+            if (args.size() > 2 && !imageenc::parseFormat(args[2], format)) {
+                webcam->outputJSON("{\"type\":\"status\",\"message\":\"Unknown image format.\",\"error\":true}");
+                return;
+            }
+            webcam->sessionPhoto(args[1], format, args.size() > 3 ? atoi(args[3].c_str()) : 1);
+        } else if (cmd == "session_record" && args.size() > 1) {
+            webcam->sessionRecord(args[1], args.size() > 2 ? atoi(args[2].c_str()) : 5);
+        } else if (cmd == "session_stats") {
+            webcam->reportSessions();
+        } else if (cmd == "motion_start" && args.size() > 1) {
+            // motion_start|camera[|threshold[|minAreaPercent[|startFrames[|stopMs[|x,y,w,h;...]]]]]
+            motion::Config config;
+            std::vector<motion::Rect> regions;
+            if (args.size() > 2 && !args[2].empty()) config.threshold = atoi(args[2].c_str());
+            if (args.size() > 3 && !args[3].empty()) config.minArea = atof(args[3].c_str()) / 100;
+            if (args.size() > 4 && !args[4].empty()) config.startFrames = atoi(args[4].c_str());
+            if (args.size() > 5 && !args[5].empty()) config.stopAfterNs = (int64_t)atoi(args[5].c_str()) * 1000000;
+            if (config.threshold < 0 || config.threshold > 255 || !(config.minArea >= 0 && config.minArea <= 1) ||
+                config.startFrames < 1 || config.stopAfterNs < 0) {
+                webcam->outputJSON("{\"type\":\"status\",\"message\":\"Invalid motion settings.\",\"error\":true}");
+                return;
+            }
+            if (args.size() > 6 && !parseRegions(args[6], regions)) {
+                webcam->outputJSON("{\"type\":\"status\",\"message\":\"Invalid motion regions.\",\"error\":true}");
+                return;
+            }
+            webcam->startMotion(args[1], config, regions);
+        } else if (cmd == "motion_stop" && args.size() > 1) {
+            webcam->stopMotion(args[1]);
+        } else if (cmd == "continuous_start" && args.size() > 1) {
+            // continuous_start|camera[|segmentSeconds[|quotaMB]]
+            int seconds = args.size() > 2 ? atoi(args[2].c_str()) : 60;
+            uint64_t quotaMb = args.size() > 3 ? (uint64_t)strtoull(args[3].c_str(), NULL, 10) : 0;
+            webcam->startContinuous(args[1], seconds > 0 ? seconds : 60, quotaMb * 1024 * 1024);
+        } else if (cmd == "continuous_stop" && args.size() > 1) {
+            webcam->stopContinuous(args[1]);
+        } else if (cmd == "stats") {
+            webcam->reportStats();
+        } else if (cmd == "preview_start") {
+            // preview_start[|fps[|maxWidth]]
+            int fps = args.size() > 1 ? atoi(args[1].c_str()) : 15;
+            int maxWidth = args.size() > 2 ? atoi(args[2].c_str()) : 640;
+            webcam->startPreview(fps, maxWidth);
+        } else if (cmd == "preview_stop") {
+            webcam->stopPreview();
         }
     }
 
-    if (listener.joinable()) listener.join();
-    return 0;
-}
\ No newline at end of file
+    void refresh() override { webcam->reportCameraInfo(); }
+
+private:
+    protocol::Output& output;
+    hal::TraceOptions trace;
+    std::unique_ptr<WebcamCapture> webcam;
+    std::atomic<bool> listening{ false };
+    std::thread listener;
+    std::thread watcher;
+    HWND watcherWindow = NULL;
+};
+
+} // namespace
+
+std::unique_ptr<helper::Module> webcamModule(protocol::Output& output, const hal::TraceOptions& trace) {
+    return std::unique_ptr<helper::Module>(new WebcamModule(output, trace));
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "../../../common/module.h"
+
+// The webcam: camera_info, photos, videos, preview, sessions, motion and
+// continuous recording, driven by the commands the lab4 page sends.
+std::unique_ptr<helper::Module> webcamModule(protocol::Output& output, const hal::TraceOptions& trace);
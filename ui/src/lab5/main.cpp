@@ -0,0 +1,5 @@
+#include "usb.h"
+
+int main(int argc, char** argv) {
+    return helper::runStandalone(argc, argv, usbModule);
+}
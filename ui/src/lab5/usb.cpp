@@ -1,314 +1,270 @@
+#include "usb.h"
+
 #include <windows.h>
-#include <dbt.h>
-#include <setupapi.h>
-#include <cfgmgr32.h>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <thread>
 #include <map>
-#include <algorithm>
-#include <chrono>
-
-const GUID GUID_DEVINTERFACE_DISK = { 0x53f56307, 0xb6bf, 0x11d0, { 0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b } };
-const GUID GUID_DEVINTERFACE_MOUSE = { 0x378de44c, 0x56ef, 0x11d1, { 0xbc, 0x8c, 0x00, 0xa0, 0xc9, 0x14, 0x05, 0xdd } };
-
-std::map<std::string, HANDLE> lockedDevices;
+#include <memory>
+#include <mutex>
 
-auto lastSafeRemovalRequestTime = std::chrono::steady_clock::time_point::min();
-auto lastLogTime = std::chrono::steady_clock::time_point::min();
-WPARAM lastLogWParam = 0;
+#include "../../../common/hal/devices.h"
+#include "../../../common/metrics.h"
 
-struct DeviceInfo {
-    std::string id;
-    std::string name;
-    std::string type;
-    std::string driveLetter;
-};
-
-std::string escapeJson(const std::string& s) {
-    std::string res;
-    for (char c : s) {
-        if (c == '\\') res += "\\\\";
-        else if (c == '"') res += "\\\"";
-        else res += c;
-    }
-    return res;
-}
+namespace {
 
-bool IdsEqual(const std::string& a, const std::string& b) {
-    if (a.size() != b.size()) return false;
-    return std::equal(a.begin(), a.end(), b.begin(), 
-        [](char c1, char c2) { return tolower(c1) == tolower(c2); });
-}
+constexpr int64_t kRepeatWindowNs = 500000000;
+constexpr int64_t kSafeRemovalNs = 3000000000;
 
-void SendLog(std::string msg, std::string level = "normal") {
-    std::cout << "{ \"type\": \"log\", \"message\": \"" << escapeJson(msg) << "\", \"level\": \"" << level << "\" }" << std::endl;
+metrics::Counter& eventCounter(const char* event) {
+    return metrics::registry().counter("helper_usb_events_total", "Device notifications, before repeats are dropped.",
+                                       metrics::label("event", event));
 }
 
-std::string GetProperty(DEVINST devInst, ULONG property) {
-    char buffer[1024];
-    ULONG len = sizeof(buffer);
-    if (CM_Get_DevNode_Registry_PropertyA(devInst, property, NULL, (PBYTE)buffer, &len, 0) == CR_SUCCESS) {
-        return std::string(buffer);
-    }
-    return "";
+metrics::Counter& ejectCounter(const char* result) {
+    return metrics::registry().counter("helper_usb_ejects_total", "Eject requests by result.", metrics::label("result", result));
 }
 
-std::string GetDetailedName(DEVINST devInst) {
-    std::string name = GetProperty(devInst, CM_DRP_FRIENDLYNAME);
-    if (!name.empty()) return name;
-    name = GetProperty(devInst, CM_DRP_DEVICEDESC);
-    
-    if (name == "USB Input Device" || name.find("HID") != std::string::npos || name == "Disk drive" || name == "USB Mass Storage Device") {
-        DEVINST parentInst;
-        if (CM_Get_Parent(&parentInst, devInst, 0) == CR_SUCCESS) {
-            std::string parentName = GetProperty(parentInst, CM_DRP_FRIENDLYNAME);
-            if (!parentName.empty() && parentName != "USB Composite Device") return parentName;
-        }
-    }
-    return name.empty() ? "Unknown Device" : name;
-}
+class UsbModule : public helper::Module {
+public:
+    UsbModule(protocol::Output& out, const hal::TraceOptions& options) : output(out), trace(options) {}
 
-std::string GetDriveLetter(const std::string& deviceId) {
-    DWORD drives = GetLogicalDrives();
-    char driveName[] = "A:";
-    for (int i = 0; i < 26; i++) {
-        if (drives & (1 << i)) {
-            driveName[0] = 'A' + i;
-            if (GetDriveTypeA(driveName) == DRIVE_REMOVABLE) return std::string(driveName);
+    // The watcher is stopped and joined before anything it uses goes away.
+    ~UsbModule() override {
+        if (watcher.joinable()) {
+            devices->stop();
+            watcher.join();
         }
+        for (auto& locked : lockedDevices) CloseHandle(locked.second);
     }
-    return "";
-}
 
-void ListDevices() {
-    std::vector<DeviceInfo> devices;
-    HDEVINFO hDevInfo;
-    SP_DEVINFO_DATA spDevInfoData;
-
-    hDevInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_DISK, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-    if (hDevInfo != INVALID_HANDLE_VALUE) {
-        spDevInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
-        for (int i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &spDevInfoData); i++) {
-            char buf[1024];
-            if (CM_Get_Device_IDA(spDevInfoData.DevInst, buf, 1024, 0) == CR_SUCCESS) {
-                std::string devId = buf;
-                if (devId.find("USB") != std::string::npos) {
-                    DeviceInfo dev;
-                    dev.id = devId;
-                    dev.name = GetDetailedName(spDevInfoData.DevInst);
-                    dev.type = "DISK";
-                    dev.driveLetter = GetDriveLetter(devId);
-                    devices.push_back(dev);
-                }
-            }
+    bool start() override {
+        devices = hal::openDevices(trace);
+        if (!devices) {
+            SendLog("Cannot open the device trace.", "error");
+            return false;
         }
-        SetupDiDestroyDeviceInfoList(hDevInfo);
+        watcher = std::thread([this] { devices->watch([this](hal::DeviceEvent event, int64_t now) { OnDeviceEvent(event, now); }); });
+        ListDevices();
+        return true;
     }
 
-    hDevInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_MOUSE, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-    if (hDevInfo != INVALID_HANDLE_VALUE) {
-        spDevInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
-        for (int i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &spDevInfoData); i++) {
-            char buf[1024];
-            if (CM_Get_Device_IDA(spDevInfoData.DevInst, buf, 1024, 0) == CR_SUCCESS) {
-                std::string devId = buf;
-                if (devId.find("USB") != std::string::npos || devId.find("HID") != std::string::npos) {
-                    DeviceInfo dev;
-                    dev.id = devId;
-                    dev.name = GetDetailedName(spDevInfoData.DevInst);
-                    dev.type = "MOUSE";
-                    devices.push_back(dev);
-                }
-            }
-        }
-        SetupDiDestroyDeviceInfoList(hDevInfo);
+    void command(const std::string& input) override {
+        if (input == "refresh") ListDevices();
+        else if (input.find("lock|") == 0) LockDevice(input.substr(5));
+        else if (input.find("unlock|") == 0) UnlockDevice(input.substr(7));
+        else if (input.find("eject|") == 0) EjectDevice(input.substr(6));
     }
 
-    std::cout << "{ \"type\": \"device_list\", \"devices\": [";
-    for (size_t i = 0; i < devices.size(); ++i) {
-        bool isLocked = lockedDevices.find(devices[i].id) != lockedDevices.end();
-        std::cout << "{ \"id\": \"" << escapeJson(devices[i].id) 
-                  << "\", \"name\": \"" << escapeJson(devices[i].name) 
-                  << "\", \"type\": \"" << escapeJson(devices[i].type)
-                  << "\", \"path\": \"" << escapeJson(devices[i].driveLetter)
-                  << "\", \"isLocked\": " << (isLocked ? "true" : "false") 
-                  << " }";
-        if (i < devices.size() - 1) std::cout << ",";
+    void refresh() override { ListDevices(); }
+
+private:
+    void SendLog(std::string msg, std::string level = "normal") {
+        protocol::Encoder log;
+        log.beginMap();
+        log.field("type", "log");
+        log.field("message", msg);
+        log.field("level", level);
+        log.endMap();
+        output.send(protocol::MessageType::Log, log, protocol::Channel::Usb);
     }
-    std::cout << "] }" << std::endl;
-}
 
-void LockDevice(const std::string& id) {
-    std::string drive = GetDriveLetter(id); 
-    if (drive.empty()) {
-        SendLog("Cannot lock: No drive letter found.", "error");
-        return;
+    void ListDevices() {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<hal::Device> present = devices->list();
+        listTime.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        enumerations.add();
+        devicesPresent.set((double)present.size());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        devicesLocked.set((double)lockedDevices.size());
+        protocol::Encoder list;
+        list.beginMap();
+        list.field("type", "device_list");
+        list.key("devices");
+        list.beginArray();
+        for (const hal::Device& dev : present) {
+            list.beginMap();
+            list.field("id", dev.id);
+            list.field("name", dev.name);
+            list.field("type", dev.type);
+            list.field("path", dev.path);
+            list.field("isLocked", lockedDevices.find(dev.id) != lockedDevices.end());
+            list.endMap();
+        }
+        list.endArray();
+        list.endMap();
+        output.send(protocol::MessageType::DeviceList, list, protocol::Channel::Usb);
     }
-    std::string path = "\\\\.\\" + drive;
-    HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
 
-    if (hFile != INVALID_HANDLE_VALUE) {
-        lockedDevices[id] = hFile;
-        SendLog("Device LOCKED. Windows Safe Eject will now fail.", "warning");
-        ListDevices();
-    } else {
-        SendLog("Lock Failed. Error: " + std::to_string(GetLastError()), "error");
+    // The drive comes from the listed device with this id, through the
+    // devices backend so a replay locks what the recording did. The backend
+    // gives each disk the letter of a volume on that disk (matched by storage
+    // device number), so with two USB disks plugged in each id locks its
+    // own; a mouse, or a disk that has gone or has no volume, locks nothing.
+    // Ids match without regard to case, as eject's do.
+    void LockDevice(const std::string& id) {
+        std::string drive, listedId;
+        for (const hal::Device& dev : devices->list()) {
+            if (hal::idsEqual(dev.id, id)) {
+                drive = dev.path;
+                listedId = dev.id;
+            }
+        }
+        if (drive.empty()) {
+            SendLog("Cannot lock: No drive letter found.", "error");
+            return;
+        }
+        std::string path = "\\\\.\\" + drive;
+        HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+
+        if (hFile != INVALID_HANDLE_VALUE) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = lockedDevices.find(listedId);
+                if (it != lockedDevices.end()) CloseHandle(it->second);
+                lockedDevices[listedId] = hFile;
+            }
+            SendLog("Device LOCKED. Windows Safe Eject will now fail.", "warning");
+            ListDevices();
+        } else {
+            SendLog("Lock Failed. Error: " + std::to_string(GetLastError()), "error");
+        }
     }
-}
 
-void UnlockDevice(const std::string& id) {
-    if (lockedDevices.find(id) != lockedDevices.end()) {
-        CloseHandle(lockedDevices[id]);
-        lockedDevices.erase(id);
+    void UnlockDevice(const std::string& id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = lockedDevices.begin();
+            while (it != lockedDevices.end() && !hal::idsEqual(it->first, id)) ++it;
+            if (it == lockedDevices.end()) return;
+            CloseHandle(it->second);
+            lockedDevices.erase(it);
+        }
         SendLog("Device UNLOCKED.");
         ListDevices();
     }
-}
-
-bool AttemptEject(DEVINST devInst) {
-    PNP_VETO_TYPE vetoType = PNP_VetoTypeUnknown; 
-    char vetoName[MAX_PATH];
-
-    CONFIGRET res = CM_Request_Device_EjectA(devInst, &vetoType, vetoName, MAX_PATH, 0);
-    if (res == CR_SUCCESS) return true;
 
-    DEVINST parentInst;
-    if (CM_Get_Parent(&parentInst, devInst, 0) == CR_SUCCESS) {
-        return AttemptEject(parentInst);
-    }
-    return false;
-}
-
-void EjectDevice(const std::string& id) {
-    if (lockedDevices.find(id) != lockedDevices.end()) {
+    // The eject itself runs without the mutex: the system asks the watcher
+    // thread's window whether the device may go before it returns.
+    void EjectDevice(const std::string& id) {
         UnlockDevice(id);
-    }
-
-    HDEVINFO hDevInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_DISK, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-    if (hDevInfo == INVALID_HANDLE_VALUE) return;
-
-    SP_DEVINFO_DATA spDevInfoData;
-    spDevInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
-    bool found = false;
 
-    for (int i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &spDevInfoData); i++) {
-        char buf[1024];
-        if (CM_Get_Device_IDA(spDevInfoData.DevInst, buf, 1024, 0) == CR_SUCCESS) {
-            if (IdsEqual(id, std::string(buf))) {
-                found = true;
+        switch (devices->eject(id)) {
+            case hal::EjectResult::Ejected:
+                ejected.add();
                 SendLog("Device found. Attempting eject...");
-                if (AttemptEject(spDevInfoData.DevInst)) {
-                    lastSafeRemovalRequestTime = std::chrono::steady_clock::now();
-                } else {
-                    SendLog("Ejection Failed. Device is busy.", "error");
-                }
+                lastSafeRemovalRequestNs = devices->nowNs();
+                break;
+            case hal::EjectResult::Busy:
+                busy.add();
+                SendLog("Device found. Attempting eject...");
+                SendLog("Ejection Failed. Device is busy.", "error");
+                break;
+            case hal::EjectResult::NotFound:
+                notFound.add();
+                SendLog("Device ID not found in list.", "error");
                 break;
-            }
         }
     }
-    SetupDiDestroyDeviceInfoList(hDevInfo);
 
-    if (!found) {
-        SendLog("Device ID not found in list.", "error");
-    }
-}
+    void OnDeviceEvent(hal::DeviceEvent event, int64_t now) {
+        switch (event) {
+            case hal::DeviceEvent::Arrival: arrivals.add(); break;
+            case hal::DeviceEvent::QueryRemove: queryRemoves.add(); break;
+            case hal::DeviceEvent::QueryRemoveFailed: queryRemovesFailed.add(); break;
+            case hal::DeviceEvent::RemoveComplete: removals.add(); break;
+        }
 
-LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
-    if (msg == WM_DEVICECHANGE) {
-        auto now = std::chrono::steady_clock::now();
-        auto timeDiff = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastLogTime).count();
-        if (wParam == lastLogWParam && timeDiff < 500) {
-            return DefWindowProc(hwnd, msg, wParam, lParam);
+        // Windows repeats a notification once per interface; one log line each.
+        if (lastLogNs && event == lastLogEvent && now - lastLogNs < kRepeatWindowNs) {
+            return;
         }
 
         bool shouldUpdateList = false;
 
-        switch (wParam) {
-            case DBT_DEVICEARRIVAL:
+        switch (event) {
+            case hal::DeviceEvent::Arrival:
                 SendLog("Event: Device Inserted.", "success");
                 shouldUpdateList = true;
                 break;
-                
-            case DBT_DEVICEQUERYREMOVE:
-                lastSafeRemovalRequestTime = now;
-                if (!lockedDevices.empty()) {
+
+            case hal::DeviceEvent::QueryRemove: {
+                lastSafeRemovalRequestNs = now;
+                bool anyLocked;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    anyLocked = !lockedDevices.empty();
+                }
+                if (anyLocked) {
                     SendLog("Windows requesting removal (Device Locked)...", "warning");
                 } else {
                     SendLog("Windows requesting removal...", "normal");
                 }
                 break;
+            }
 
-            case DBT_DEVICEQUERYREMOVEFAILED:
-                lastSafeRemovalRequestTime = std::chrono::steady_clock::time_point::min();
+            case hal::DeviceEvent::QueryRemoveFailed:
+                lastSafeRemovalRequestNs = 0;
                 SendLog("Safe Removal DENIED by System.", "error");
                 break;
 
-            case DBT_DEVICEREMOVECOMPLETE:
-                {
-                    auto removeDiff = std::chrono::duration_cast<std::chrono::seconds>(now - lastSafeRemovalRequestTime).count();
-                    
-                    if (removeDiff < 3) {
-                        SendLog("Event: Device Removed SAFELY.", "success");
-                    } else {
-                        SendLog("Event: Device Removed UNSAFELY.", "warning");
-                    }
-                    shouldUpdateList = true;
+            case hal::DeviceEvent::RemoveComplete: {
+                int64_t requested = lastSafeRemovalRequestNs;
+                if (requested && now - requested < kSafeRemovalNs) {
+                    SendLog("Event: Device Removed SAFELY.", "success");
+                } else {
+                    SendLog("Event: Device Removed UNSAFELY.", "warning");
                 }
+                shouldUpdateList = true;
                 break;
+            }
         }
 
-        if (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE || wParam == DBT_DEVICEQUERYREMOVE) {
-            lastLogTime = now;
-            lastLogWParam = wParam;
+        if (event != hal::DeviceEvent::QueryRemoveFailed) {
+            lastLogNs = now;
+            lastLogEvent = event;
         }
 
         if (shouldUpdateList) {
             ListDevices();
         }
     }
-    return DefWindowProc(hwnd, msg, wParam, lParam);
-}
 
-void WindowThread() {
-    WNDCLASSEX wx = {};
-    wx.cbSize = sizeof(WNDCLASSEX);
-    wx.lpfnWndProc = WndProc;
-    wx.lpszClassName = "USBMonitorClass";
-    RegisterClassEx(&wx);
-    HWND hwnd = CreateWindowEx(0, "USBMonitorClass", "USB Monitor", 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL);
-
-    DEV_BROADCAST_DEVICEINTERFACE notificationFilter = {};
-    notificationFilter.dbcc_size = sizeof(DEV_BROADCAST_DEVICEINTERFACE);
-    notificationFilter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
-    
-    notificationFilter.dbcc_classguid = GUID_DEVINTERFACE_MOUSE;
-    RegisterDeviceNotification(hwnd, &notificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE);
-
-    notificationFilter.dbcc_classguid = GUID_DEVINTERFACE_DISK;
-    RegisterDeviceNotification(hwnd, &notificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE);
-
-    MSG msg;
-    while (GetMessage(&msg, NULL, 0, 0)) { TranslateMessage(&msg); DispatchMessage(&msg); }
-}
-
-int main() {
-    std::thread wThread(WindowThread);
-    wThread.detach();
-    ListDevices();
+    protocol::Output& output;
+    hal::TraceOptions trace;
+    std::unique_ptr<hal::Devices> devices;
+    std::thread watcher;
+
+    // Commands and the watcher thread both lock, unlock and list.
+    std::mutex mutex;
+    std::map<std::string, HANDLE> lockedDevices;
+
+    // Times on the devices backend's clock, so a replayed trace judges safe and
+    // unsafe removals as the recording did. 0: none. The last log is only
+    // touched by the watcher thread.
+    std::atomic<int64_t> lastSafeRemovalRequestNs{ 0 };
+    int64_t lastLogNs = 0;
+    hal::DeviceEvent lastLogEvent = hal::DeviceEvent::Arrival;
+
+    metrics::Counter& enumerations = metrics::registry().counter("helper_usb_enumerations_total", "Device list enumerations.");
+    metrics::Histogram& listTime = metrics::registry().histogram("helper_usb_enumeration_seconds", "Time one device enumeration took.");
+    metrics::Gauge& devicesPresent = metrics::registry().gauge("helper_usb_devices", "USB disks and mice present at the last enumeration.");
+    metrics::Gauge& devicesLocked = metrics::registry().gauge("helper_usb_locked_devices", "Disks held open against ejection.");
+    metrics::Counter& arrivals = eventCounter("arrival");
+    metrics::Counter& queryRemoves = eventCounter("query_remove");
+    metrics::Counter& queryRemovesFailed = eventCounter("query_remove_failed");
+    metrics::Counter& removals = eventCounter("remove_complete");
+    metrics::Counter& ejected = ejectCounter("ejected");
+    metrics::Counter& busy = ejectCounter("busy");
+    metrics::Counter& notFound = ejectCounter("not_found");
+};
 
-    std::string input;
-    while (std::getline(std::cin, input)) {
-        size_t first = input.find_first_not_of(" \t\r\n");
-        if (first == std::string::npos) continue;
-        size_t last = input.find_last_not_of(" \t\r\n");
-        input = input.substr(first, (last - first + 1));
+} // namespace
 
-        if (input == "refresh") ListDevices();
-        else if (input.find("lock|") == 0) LockDevice(input.substr(5));
-        else if (input.find("unlock|") == 0) UnlockDevice(input.substr(7));
-        else if (input.find("eject|") == 0) EjectDevice(input.substr(6));
-    }
-    return 0;
-}
\ No newline at end of file
+std::unique_ptr<helper::Module> usbModule(protocol::Output& output, const hal::TraceOptions& trace) {
+    return std::unique_ptr<helper::Module>(new UsbModule(output, trace));
+}
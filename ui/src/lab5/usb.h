@@ -0,0 +1,7 @@
+#pragma once
+
+#include "../../../common/module.h"
+
+// The USB monitor: device_list and log messages as disks and mice come and
+// go, and the refresh, lock|<id>, unlock|<id> and eject|<id> commands.
+std::unique_ptr<helper::Module> usbModule(protocol::Output& output, const hal::TraceOptions& trace);